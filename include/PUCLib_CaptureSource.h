@@ -0,0 +1,136 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Device backend of PUCLib_Wrapper
+		@details CaptureSource has one method per PUCLIB function the wrapper and PUCLib_Playback call, with the same arguments and results.
+			PUCLibSource forwards them to the camera and is the default where PUCLIB exists (see PUCLib_Platform.h). Other backends, like the
+			synthetic device of PUCLib_SyntheticSource.h or the recording replay of PUCLib_Playback.h (PlaybackSource), drive the same buffering,
+			decoding, listener and subscription code without a camera.
+			Device settings that only exist on the camera (fan, LED, sync signals) return PUC_ERROR_NOTSUPPORT unless a backend overrides them.
+	@~japanese
+		@brief PUCLib_Wrapperのデバイスバックエンド
+		@details CaptureSourceは、ラッパとPUCLib_Playbackが呼び出すPUCLIBの関数ごとに、同じ引数と戻り値のメソッドを持ちます。
+			PUCLibSourceはこれらをカメラに転送し、PUCLIBがある環境ではデフォルトになります（PUCLib_Platform.h参照）。
+			PUCLib_SyntheticSource.hの疑似デバイスやPUCLib_Playback.hの記録再生（PlaybackSource）など他のバックエンドは、カメラなしで同じバッファリング、
+			デコード、リスナー、購読の処理を動かします。
+			カメラにのみ存在する設定（ファン、LED、同期信号）は、バックエンドが上書きしない限りPUC_ERROR_NOTSUPPORTを返します。
+*/
+
+#include "PUCLib_Platform.h"
+#include "PUCLIB.h"
+
+namespace photron {
+
+	class CaptureSource {
+	public:
+		virtual ~CaptureSource() {}
+
+		virtual PUCRESULT initialize() = 0;
+		virtual PUCRESULT detectDevice(PPUC_DETECT_INFO pDetectInfo) = 0;
+		virtual PUCRESULT openDevice(UINT32 nDeviceNo, PPUC_HANDLE pDeviceHandle) = 0;
+		virtual PUCRESULT resetDevice(UINT32 nDeviceNo) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT closeDevice(PUC_HANDLE hDevice) = 0;
+
+		virtual PUCRESULT getResolution(PUC_HANDLE hDevice, UINT32* pWidth, UINT32* pHeight) = 0;
+		virtual PUCRESULT getResolutionLimit(PUC_HANDLE hDevice, PPUC_RESO_LIMIT_INFO pLimitInfo) = 0;
+		virtual PUCRESULT setResolution(PUC_HANDLE hDevice, UINT32 nWidth, UINT32 nHeight) = 0;
+		virtual PUCRESULT getQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT* pVal) = 0;
+		virtual PUCRESULT setQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT nVal) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT getFramerateShutter(PUC_HANDLE hDevice, UINT32* pFramerate, UINT32* pShutterSpeedFps) = 0;
+		virtual PUCRESULT setFramerateShutter(PUC_HANDLE hDevice, UINT32 nFramerate, UINT32 nShutterSpeedFps) = 0;
+		virtual PUCRESULT getFramerateLimit(PUC_HANDLE hDevice, PPUC_FRAMERATE_LIMIT_INFO pLimitInfo) = 0;
+		virtual PUCRESULT setExposeTime(PUC_HANDLE hDevice, UINT32 nExpOnTime, UINT32 nExpOffTime) = 0;
+
+		virtual PUCRESULT setFanState(PUC_HANDLE hDevice, PUC_MODE nState) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setSyncInMode(PUC_HANDLE hDevice, PUC_SYNC_MODE nMode, PUC_SIGNAL nSignal) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setSyncOutSignal(PUC_HANDLE hDevice, PUC_SIGNAL nSignal) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setSyncOutDelay(PUC_HANDLE hDevice, UINT32 nDelay) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setSyncOutWidth(PUC_HANDLE hDevice, UINT32 nWidth) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setSyncOutMagnification(PUC_HANDLE hDevice, UINT32 nMagnification) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setLEDMode(PUC_HANDLE hDevice, PUC_MODE nMode) { return PUC_ERROR_NOTSUPPORT; }
+		virtual PUCRESULT setXferTimeOut(PUC_HANDLE hDevice, UINT32 nSingleXferTimeOut, UINT32 nContinuousXferTimeOut) { return PUC_ERROR_NOTSUPPORT; }
+
+		virtual PUCRESULT setXferDataMode(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode) = 0;
+		virtual PUCRESULT getXferDataSize(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode, UINT32* pDataSize) = 0;
+		virtual PUCRESULT getSingleXferData(PUC_HANDLE hDevice, PPUC_XFER_DATA_INFO pXferData) = 0;
+		virtual PUCRESULT beginXferData(PUC_HANDLE hDevice, RECIEVE_CALLBACK callback, void* arg) = 0;
+		virtual PUCRESULT endXferData(PUC_HANDLE hDevice) = 0;
+
+		// Payload functions, thread-safe and callable in parallel like their PUCLIB counterparts
+		virtual PUCRESULT extractSequenceNo(const PUCHAR pData, UINT32 nWidth, UINT32 nHeight, PUSHORT pSeqNo) = 0;
+		virtual PUCRESULT decodeData(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) = 0;
+		virtual PUCRESULT decodeDataMultiThread(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals, UINT32 nThreadCount) {
+			return decodeData(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals);
+		}
+		virtual PUCRESULT decodeDCTData(PINT16 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) = 0;
+		virtual PUCRESULT decodeDCData(PUINT8 pDst, UINT32 nBlockX, UINT32 nBlockY, UINT32 nBlockCountX, UINT32 nBlockCountY, const PUINT8 pSrc) = 0;
+	};
+
+#ifdef PHOTRON_HAS_PUCLIB
+
+	// Forwards every call to PUCLIB
+	class PUCLibSource : public CaptureSource {
+	public:
+		PUCRESULT initialize() { return PUC_Initialize(); }
+		PUCRESULT detectDevice(PPUC_DETECT_INFO pDetectInfo) { return PUC_DetectDevice(pDetectInfo); }
+		PUCRESULT openDevice(UINT32 nDeviceNo, PPUC_HANDLE pDeviceHandle) { return PUC_OpenDevice(nDeviceNo, pDeviceHandle); }
+		PUCRESULT resetDevice(UINT32 nDeviceNo) { return PUC_ResetDevice(nDeviceNo); }
+		PUCRESULT closeDevice(PUC_HANDLE hDevice) { return PUC_CloseDevice(hDevice); }
+
+		PUCRESULT getResolution(PUC_HANDLE hDevice, UINT32* pWidth, UINT32* pHeight) { return PUC_GetResolution(hDevice, pWidth, pHeight); }
+		PUCRESULT getResolutionLimit(PUC_HANDLE hDevice, PPUC_RESO_LIMIT_INFO pLimitInfo) { return PUC_GetResolutionLimit(hDevice, pLimitInfo); }
+		PUCRESULT setResolution(PUC_HANDLE hDevice, UINT32 nWidth, UINT32 nHeight) { return PUC_SetResolution(hDevice, nWidth, nHeight); }
+		PUCRESULT getQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT* pVal) { return PUC_GetQuantization(hDevice, nPoint, pVal); }
+		PUCRESULT setQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT nVal) { return PUC_SetQuantization(hDevice, nPoint, nVal); }
+		PUCRESULT getFramerateShutter(PUC_HANDLE hDevice, UINT32* pFramerate, UINT32* pShutterSpeedFps) { return PUC_GetFramerateShutter(hDevice, pFramerate, pShutterSpeedFps); }
+		PUCRESULT setFramerateShutter(PUC_HANDLE hDevice, UINT32 nFramerate, UINT32 nShutterSpeedFps) { return PUC_SetFramerateShutter(hDevice, nFramerate, nShutterSpeedFps); }
+		PUCRESULT getFramerateLimit(PUC_HANDLE hDevice, PPUC_FRAMERATE_LIMIT_INFO pLimitInfo) { return PUC_GetFramerateLimit(hDevice, pLimitInfo); }
+		PUCRESULT setExposeTime(PUC_HANDLE hDevice, UINT32 nExpOnTime, UINT32 nExpOffTime) { return PUC_SetExposeTime(hDevice, nExpOnTime, nExpOffTime); }
+
+		PUCRESULT setFanState(PUC_HANDLE hDevice, PUC_MODE nState) { return PUC_SetFanState(hDevice, nState); }
+		PUCRESULT setSyncInMode(PUC_HANDLE hDevice, PUC_SYNC_MODE nMode, PUC_SIGNAL nSignal) { return PUC_SetSyncInMode(hDevice, nMode, nSignal); }
+		PUCRESULT setSyncOutSignal(PUC_HANDLE hDevice, PUC_SIGNAL nSignal) { return PUC_SetSyncOutSignal(hDevice, nSignal); }
+		PUCRESULT setSyncOutDelay(PUC_HANDLE hDevice, UINT32 nDelay) { return PUC_SetSyncOutDelay(hDevice, nDelay); }
+		PUCRESULT setSyncOutWidth(PUC_HANDLE hDevice, UINT32 nWidth) { return PUC_SetSyncOutWidth(hDevice, nWidth); }
+		PUCRESULT setSyncOutMagnification(PUC_HANDLE hDevice, UINT32 nMagnification) { return PUC_SetSyncOutMagnification(hDevice, nMagnification); }
+		PUCRESULT setLEDMode(PUC_HANDLE hDevice, PUC_MODE nMode) { return PUC_SetLEDMode(hDevice, nMode); }
+		PUCRESULT setXferTimeOut(PUC_HANDLE hDevice, UINT32 nSingleXferTimeOut, UINT32 nContinuousXferTimeOut) { return PUC_SetXferTimeOut(hDevice, nSingleXferTimeOut, nContinuousXferTimeOut); }
+
+		PUCRESULT setXferDataMode(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode) { return PUC_SetXferDataMode(hDevice, nDataMode); }
+		PUCRESULT getXferDataSize(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode, UINT32* pDataSize) { return PUC_GetXferDataSize(hDevice, nDataMode, pDataSize); }
+		PUCRESULT getSingleXferData(PUC_HANDLE hDevice, PPUC_XFER_DATA_INFO pXferData) { return PUC_GetSingleXferData(hDevice, pXferData); }
+		PUCRESULT beginXferData(PUC_HANDLE hDevice, RECIEVE_CALLBACK callback, void* arg) { return PUC_BeginXferData(hDevice, callback, arg); }
+		PUCRESULT endXferData(PUC_HANDLE hDevice) { return PUC_EndXferData(hDevice); }
+
+		PUCRESULT extractSequenceNo(const PUCHAR pData, UINT32 nWidth, UINT32 nHeight, PUSHORT pSeqNo) { return PUC_ExtractSequenceNo(pData, nWidth, nHeight, pSeqNo); }
+		PUCRESULT decodeData(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			return PUC_DecodeData(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals);
+		}
+		PUCRESULT decodeDataMultiThread(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals, UINT32 nThreadCount) {
+			return PUC_DecodeDataMultiThread(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals, nThreadCount);
+		}
+		PUCRESULT decodeDCTData(PINT16 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			return PUC_DecodeDCTData(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals);
+		}
+		PUCRESULT decodeDCData(PUINT8 pDst, UINT32 nBlockX, UINT32 nBlockY, UINT32 nBlockCountX, UINT32 nBlockCountY, const PUINT8 pSrc) {
+			return PUC_DecodeDCData(pDst, nBlockX, nBlockY, nBlockCountX, nBlockCountY, pSrc);
+		}
+	};
+
+	// The PUCLIB backend shared by every wrapper that was not given another source
+	inline CaptureSource* getDefaultCaptureSource() {
+		static PUCLibSource source;
+		return &source;
+	}
+
+#else
+
+	// No default without PUCLIB, give the wrapper a source with setCaptureSource
+	inline CaptureSource* getDefaultCaptureSource() {
+		return NULL;
+	}
+
+#endif
+
+}
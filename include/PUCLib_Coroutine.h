@@ -0,0 +1,352 @@
+#pragma once
+
+/*!
+	@~english
+		@brief C++20 coroutine interface of PUCLib_Wrapper
+		@details co_await a frame, a proxy frame or a timeout without a thread per consumer: a FrameExecutor runs the coroutines,
+			the transfer callback only queues the ones whose frame arrived. The header needs C++20 (/std:c++20) and is opt-in,
+			the wrapper itself stays C++14. Define PHOTRON_ENABLE_COROUTINES to get the cv::Mat versions on photron::VideoCapture as well.
+		@code
+			photron::FrameTask pipeline(photron::PUCLib_Wrapper& wrapper, photron::FrameExecutor& executor) {
+				photron::FrameStream frames(wrapper, executor);
+				for (;;) {
+					photron::FrameLease lease = co_await frames.next(100);
+					if (!lease.isValid())
+						continue; // timeout
+					...
+					lease.release();
+				}
+			}
+			pipeline(wrapper, executor).spawn(executor);
+			executor.run();
+		@endcode
+	@~japanese
+		@brief PUCLib_WrapperのC++20コルーチンインターフェース
+		@details 利用者毎のスレッドなしでフレーム、プロキシ画像、タイムアウトをco_awaitできます。FrameExecutorがコルーチンを実行し、
+			転送コールバックはフレームが到着したコルーチンをキューに入れるだけです。本ヘッダはC++20（/std:c++20）が必要で、使用は任意です。
+			ラッパ自体はC++14のままです。PHOTRON_ENABLE_COROUTINESを定義するとphotron::VideoCaptureのcv::Mat版も使用できます。
+*/
+
+#if !defined(__cpp_impl_coroutine)
+#error "PUCLib_Coroutine.h needs C++20 coroutines, compile with /std:c++20"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <exception>
+
+#include "PUCLib_Wrapper.h"
+
+namespace photron {
+
+	/*!
+		@~english
+			@brief Single threaded executor for frame coroutines
+			@details run() resumes queued coroutines and fires timers on the calling thread until stop(). post() and stop() may be called
+				from any thread, run() from one thread only. Coroutines still suspended when the executor is destroyed are not resumed.
+		@~japanese
+			@brief フレーム用コルーチンのシングルスレッドのエグゼキュータ
+			@details run()はstop()まで、呼び出したスレッドでキューのコルーチンを再開し、タイマーを実行します。post()とstop()は任意のスレッドから、
+				run()は1つのスレッドからのみ呼び出してください。エグゼキュータの破棄時に中断中のコルーチンは再開されません。
+	*/
+	class FrameExecutor {
+		struct Timer {
+			std::chrono::steady_clock::time_point due;
+			UINT64 id = 0;
+			std::function<void()> fire;
+		};
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::deque<std::coroutine_handle<>> m_ready;
+		std::vector<Timer> m_timers; // heap, earliest first
+		UINT64 m_nextTimerId = 1;
+		bool m_stopped = false;
+
+		static bool later(const Timer& a, const Timer& b) {
+			return a.due > b.due;
+		}
+
+	public:
+		// Queues a coroutine to be resumed by run()
+		void post(std::coroutine_handle<> handle) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_ready.push_back(handle);
+			}
+			m_wake.notify_one();
+		}
+
+		// Calls fire from run() after timeoutMs, returns an id for cancel()
+		UINT64 callAfter(int timeoutMs, std::function<void()> fire) {
+			Timer timer;
+			timer.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+			timer.fire = std::move(fire);
+			UINT64 id;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				id = timer.id = m_nextTimerId++;
+				m_timers.push_back(std::move(timer));
+				std::push_heap(m_timers.begin(), m_timers.end(), later);
+			}
+			m_wake.notify_one();
+			return id;
+		}
+
+		// Removes a timer that has not fired yet
+		void cancel(UINT64 id) {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			for (size_t i = 0; i < m_timers.size(); i++) {
+				if (m_timers[i].id == id) {
+					m_timers.erase(m_timers.begin() + i);
+					std::make_heap(m_timers.begin(), m_timers.end(), later);
+					return;
+				}
+			}
+		}
+
+		// Runs until stop() is called
+		void run() {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stopped = false;
+			while (!m_stopped) {
+				if (!m_ready.empty()) {
+					std::coroutine_handle<> handle = m_ready.front();
+					m_ready.pop_front();
+					lock.unlock();
+					handle.resume();
+					lock.lock();
+				}
+				else if (!m_timers.empty() && m_timers.front().due <= std::chrono::steady_clock::now()) {
+					std::pop_heap(m_timers.begin(), m_timers.end(), later);
+					Timer timer = std::move(m_timers.back());
+					m_timers.pop_back();
+					lock.unlock();
+					timer.fire();
+					lock.lock();
+				}
+				else if (!m_timers.empty()) {
+					m_wake.wait_until(lock, m_timers.front().due);
+				}
+				else {
+					m_wake.wait(lock);
+				}
+			}
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_stopped = true;
+			}
+			m_wake.notify_all();
+		}
+
+		struct ScheduleAwaiter {
+			FrameExecutor& executor;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { executor.post(handle); }
+			void await_resume() const noexcept {}
+		};
+
+		// co_await executor.schedule() continues the coroutine on the executor thread
+		ScheduleAwaiter schedule() {
+			return ScheduleAwaiter{ *this };
+		}
+
+		struct SleepAwaiter {
+			FrameExecutor& executor;
+			int timeoutMs;
+			bool await_ready() const noexcept { return timeoutMs <= 0; }
+			void await_suspend(std::coroutine_handle<> handle) { executor.callAfter(timeoutMs, [handle] { handle.resume(); }); }
+			void await_resume() const noexcept {}
+		};
+
+		// co_await executor.sleep(ms) suspends the coroutine without blocking the executor
+		SleepAwaiter sleep(int timeoutMs) {
+			return SleepAwaiter{ *this, timeoutMs };
+		}
+	};
+
+	// Fire-and-forget coroutine started on an executor. The coroutine owns itself once spawned and ends with its body.
+	class FrameTask {
+	public:
+		struct promise_type {
+			FrameTask get_return_object() {
+				return FrameTask(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+
+		FrameTask(FrameTask&& other) noexcept : m_handle(std::exchange(other.m_handle, {})) {
+		}
+
+		~FrameTask() {
+			if (m_handle)
+				m_handle.destroy();
+		}
+
+		// Queues the first resume on the executor
+		void spawn(FrameExecutor& executor) {
+			if (m_handle)
+				executor.post(std::exchange(m_handle, {}));
+		}
+
+	private:
+		explicit FrameTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {
+		}
+		FrameTask(const FrameTask&) = delete;
+		FrameTask& operator=(const FrameTask&) = delete;
+
+		std::coroutine_handle<promise_type> m_handle;
+	};
+
+	/*!
+		@~english
+			@brief Awaits the next frame of a stream, the result of co_await is a FrameLease (invalid on timeout)
+			@details The transfer callback posts the coroutine back to the executor when a frame newer than afterFrameNo is published,
+				a timer on the executor resumes it on timeout. Await only from coroutines running on the executor.
+		@~japanese
+			@brief ストリームの次のフレームを待機します。co_awaitの結果はFrameLeaseです（タイムアウトの場合は無効）。
+			@details afterFrameNoより新しいフレームが公開されると転送コールバックがコルーチンをエグゼキュータに戻し、タイムアウトの場合は
+				エグゼキュータのタイマーが再開します。エグゼキュータ上で実行中のコルーチンからのみ待機してください。
+	*/
+	class FrameAwaiter {
+		PUCLib_Wrapper& m_wrapper;
+		FrameExecutor& m_executor;
+		FrameWaiter m_waiter;
+		int m_timeoutMs;
+		UINT64 m_timer = 0;
+		bool m_timedOut = false;
+		std::coroutine_handle<> m_handle;
+
+		static void wake(FrameWaiter* waiter) {
+			FrameAwaiter* that = (FrameAwaiter*)waiter->context;
+			that->m_executor.post(that->m_handle);
+		}
+
+	public:
+		FrameAwaiter(PUCLib_Wrapper& wrapper, FrameExecutor& executor, SubscriptionKind kind, long long afterFrameNo, int timeoutMs)
+			: m_wrapper(wrapper), m_executor(executor), m_timeoutMs(timeoutMs) {
+			m_waiter.kind = kind;
+			m_waiter.afterFrameNo = afterFrameNo;
+			m_waiter.wake = wake;
+			m_waiter.context = this;
+		}
+
+		bool await_ready() const {
+			return m_wrapper.getAvailableFrameNo(m_waiter.kind) > m_waiter.afterFrameNo;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			m_handle = handle;
+			if (!m_wrapper.addFrameWaiter(&m_waiter))
+				return false;
+			if (m_timeoutMs >= 0) {
+				// Runs on the executor thread like the resumed coroutine, so it cannot race await_resume
+				m_timer = m_executor.callAfter(m_timeoutMs, [this] {
+					if (m_wrapper.removeFrameWaiter(&m_waiter)) {
+						m_timedOut = true;
+						m_handle.resume();
+					}
+				});
+			}
+			return true;
+		}
+
+		FrameLease await_resume() {
+			if (m_timer)
+				m_executor.cancel(m_timer);
+			FrameLease lease;
+			if (m_timedOut)
+				return lease;
+			switch (m_waiter.kind) {
+			case SUBSCRIBE_PROXY:
+				m_wrapper.acquireProxy(lease);
+				break;
+			case SUBSCRIBE_DCT:
+				m_wrapper.acquireDCT(lease);
+				break;
+			default:
+				m_wrapper.acquireFrame(lease);
+				break;
+			}
+			return lease;
+		}
+	};
+
+	// co_await nextFrame(wrapper, executor, afterFrameNo, timeoutMs): full sized frame newer than afterFrameNo
+	inline FrameAwaiter nextFrame(PUCLib_Wrapper& wrapper, FrameExecutor& executor, long long afterFrameNo = -1, int timeoutMs = -1) {
+		return FrameAwaiter(wrapper, executor, SUBSCRIBE_FULL, afterFrameNo, timeoutMs);
+	}
+
+	// co_await nextProxy(wrapper, executor, afterFrameNo, timeoutMs): proxy image newer than afterFrameNo
+	inline FrameAwaiter nextProxy(PUCLib_Wrapper& wrapper, FrameExecutor& executor, long long afterFrameNo = -1, int timeoutMs = -1) {
+		return FrameAwaiter(wrapper, executor, SUBSCRIBE_PROXY, afterFrameNo, timeoutMs);
+	}
+
+	/*!
+		@~english
+			@brief Asynchronous sequence of the frames of one stream
+			@details Every co_await next() yields a frame not returned before, the coroutine counterpart of PUCLib_Wrapper::readNext.
+				Frames published while the consumer was busy are skipped and counted (getSkippedCount).
+		@~japanese
+			@brief 1つのストリームのフレームの非同期シーケンス
+			@details co_await next()は毎回まだ返していないフレームを返します。PUCLib_Wrapper::readNextのコルーチン版です。
+				利用者の処理中に公開されたフレームは読み飛ばされ、数えられます（getSkippedCount）。
+	*/
+	class FrameStream {
+		PUCLib_Wrapper& m_wrapper;
+		FrameExecutor& m_executor;
+		SubscriptionKind m_kind;
+		long long m_lastFrameNo = -1;
+		UINT64 m_skipped = 0;
+
+	public:
+		FrameStream(PUCLib_Wrapper& wrapper, FrameExecutor& executor, SubscriptionKind kind = SUBSCRIBE_FULL)
+			: m_wrapper(wrapper), m_executor(executor), m_kind(kind) {
+		}
+
+		class NextAwaiter {
+			FrameStream& m_stream;
+			FrameAwaiter m_frame;
+		public:
+			NextAwaiter(FrameStream& stream, int timeoutMs)
+				: m_stream(stream), m_frame(stream.m_wrapper, stream.m_executor, stream.m_kind, stream.m_lastFrameNo, timeoutMs) {
+			}
+			bool await_ready() const { return m_frame.await_ready(); }
+			bool await_suspend(std::coroutine_handle<> handle) { return m_frame.await_suspend(handle); }
+			FrameLease await_resume() {
+				FrameLease lease = m_frame.await_resume();
+				if (!lease.isValid() || lease.frameNo <= m_stream.m_lastFrameNo) {
+					// Timed out, or the announced frame was not decoded
+					lease.release();
+					return lease;
+				}
+				if (m_stream.m_lastFrameNo >= 0)
+					m_stream.m_skipped += lease.frameNo - m_stream.m_lastFrameNo - 1;
+				m_stream.m_lastFrameNo = lease.frameNo;
+				return lease;
+			}
+		};
+
+		// co_await next(timeoutMs): the next frame, an invalid lease on timeout
+		NextAwaiter next(int timeoutMs = -1) {
+			return NextAwaiter(*this, timeoutMs);
+		}
+
+		long long getLastFrameNo() const {
+			return m_lastFrameNo;
+		}
+
+		UINT64 getSkippedCount() const {
+			return m_skipped;
+		}
+	};
+
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Compressed-domain kernels on the DCT coefficients of PUCLib_Wrapper::acquireDCT
+		@details Coefficients are INT16, every 8x8 block keeps its 64 coefficients in place with the DC coefficient top left.
+			Nothing here runs the inverse transform, so motion and edge triggers cost a pass over the coefficients only.
+			proxyChanges works on the DC proxy of acquireProxy, one 8 bit DC value per block.
+	@~japanese
+		@brief PUCLib_Wrapper::acquireDCTのDCT係数に対する圧縮領域の処理
+		@details 係数はINT16で、各8x8ブロックの64個の係数はそのまま格納され、DC係数は左上です。
+			逆変換を行わないため、動き検出やエッジ検出のトリガーは係数を一度走査するだけで済みます。
+			proxyChangesはacquireProxyのDCプロキシ（ブロックごとに8ビットのDC値）を対象とします。
+*/
+
+#include "PUCLib_Platform.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PHOTRON_DCT_KERNELS_SSE2
+#endif
+
+namespace photron {
+
+	enum {
+		DCT_BLOCK_SIZE = 8
+	};
+
+	inline const INT16* dctBlockRow(const INT16* coeffs, int rowBytes, int blockY, int row) {
+		return (const INT16*)((const UINT8*)coeffs + size_t(blockY * DCT_BLOCK_SIZE + row) * rowBytes);
+	}
+
+	/*!
+		@~english
+			@brief AC energy of every block
+			@details Sum of the squared AC coefficients, i.e. the energy of the block around its mean. Flat blocks are close to 0.
+			@param[in] coeffs DCT coefficients
+			@param[in] rowBytes Number of bytes per row of coeffs
+			@param[in] blocksX Number of blocks per row
+			@param[in] blocksY Number of block rows
+			@param[out] energy blocksX * blocksY values, row by row
+		@~japanese
+			@brief 各ブロックのACエネルギー
+			@details AC係数の二乗和、すなわちブロック平均まわりのエネルギーです。平坦なブロックは0に近くなります。
+			@param[in] coeffs DCT係数
+			@param[in] rowBytes coeffsの１ラインあたりのバイト数
+			@param[in] blocksX 横方向のブロック数
+			@param[in] blocksY 縦方向のブロック数
+			@param[out] energy blocksX * blocksY個の値（行順）
+	*/
+	inline void dctBlockEnergy(const INT16* coeffs, int rowBytes, int blocksX, int blocksY, float* energy) {
+		for (int by = 0; by < blocksY; by++) {
+			float* out = energy + size_t(by) * blocksX;
+			for (int bx = 0; bx < blocksX; bx++)
+				out[bx] = 0.0f;
+			for (int v = 0; v < DCT_BLOCK_SIZE; v++) {
+				const INT16* row = dctBlockRow(coeffs, rowBytes, by, v);
+				for (int bx = 0; bx < blocksX; bx++) {
+					const INT16* c = row + bx * DCT_BLOCK_SIZE;
+					long long sum = 0;
+					for (int u = (v == 0 ? 1 : 0); u < DCT_BLOCK_SIZE; u++)
+						sum += (long long)c[u] * c[u];
+					out[bx] += (float)sum;
+				}
+			}
+		}
+	}
+
+	/*!
+		@~english
+			@brief Edge map from the first row and column of AC coefficients
+			@details Horizontal frequencies (first row) respond to vertical edges and vertical frequencies (first column) to horizontal ones.
+				A block is marked 255 when the square root of their energy reaches threshold, 0 otherwise.
+			@param[in] coeffs DCT coefficients
+			@param[in] rowBytes Number of bytes per row of coeffs
+			@param[in] blocksX Number of blocks per row
+			@param[in] blocksY Number of block rows
+			@param[in] threshold Edge strength, in coefficient units
+			@param[out] map blocksX x blocksY mask
+			@param[in] mapStep Number of bytes per row of map
+		@~japanese
+			@brief AC係数の先頭行と先頭列からのエッジマップ
+			@details 水平周波数（先頭行）は垂直エッジに、垂直周波数（先頭列）は水平エッジに反応します。
+				そのエネルギーの平方根がthreshold以上のブロックを255、それ以外を0にします。
+			@param[in] coeffs DCT係数
+			@param[in] rowBytes coeffsの１ラインあたりのバイト数
+			@param[in] blocksX 横方向のブロック数
+			@param[in] blocksY 縦方向のブロック数
+			@param[in] threshold エッジ強度（係数単位）
+			@param[out] map blocksX x blocksYのマスク
+			@param[in] mapStep mapの１ラインあたりのバイト数
+	*/
+	inline void dctEdgeMap(const INT16* coeffs, int rowBytes, int blocksX, int blocksY, float threshold, UINT8* map, int mapStep) {
+		float limit = threshold * threshold;
+		for (int by = 0; by < blocksY; by++) {
+			const INT16* first = dctBlockRow(coeffs, rowBytes, by, 0);
+			UINT8* out = map + size_t(by) * mapStep;
+			for (int bx = 0; bx < blocksX; bx++) {
+				const INT16* c = first + bx * DCT_BLOCK_SIZE;
+				long long sum = 0;
+				for (int u = 1; u < DCT_BLOCK_SIZE; u++)
+					sum += (long long)c[u] * c[u];
+				for (int v = 1; v < DCT_BLOCK_SIZE; v++) {
+					int vertical = dctBlockRow(coeffs, rowBytes, by, v)[bx * DCT_BLOCK_SIZE];
+					sum += (long long)vertical * vertical;
+				}
+				out[bx] = (float)sum >= limit ? 255 : 0;
+			}
+		}
+	}
+
+	/*!
+		@~english
+			@brief Block-wise difference of two frames
+			@details Sum of squared coefficient differences per block. The DCT is orthonormal, so this is the squared pixel difference
+				of the block up to the scale of the codec.
+			@param[in] previous DCT coefficients of the earlier frame
+			@param[in] current DCT coefficients of the later frame, same geometry
+			@param[in] rowBytes Number of bytes per row of both
+			@param[in] blocksX Number of blocks per row
+			@param[in] blocksY Number of block rows
+			@param[out] diff blocksX * blocksY values, row by row
+		@~japanese
+			@brief 2フレームのブロック単位の差分
+			@details ブロックごとの係数差の二乗和です。DCTは正規直交変換のため、コーデックのスケールを除いてブロックの画素差の二乗和と等しくなります。
+			@param[in] previous 前のフレームのDCT係数
+			@param[in] current 後のフレームのDCT係数（同じサイズ）
+			@param[in] rowBytes 両方の１ラインあたりのバイト数
+			@param[in] blocksX 横方向のブロック数
+			@param[in] blocksY 縦方向のブロック数
+			@param[out] diff blocksX * blocksY個の値（行順）
+	*/
+	inline void dctBlockDiff(const INT16* previous, const INT16* current, int rowBytes, int blocksX, int blocksY, float* diff) {
+		for (int by = 0; by < blocksY; by++) {
+			float* out = diff + size_t(by) * blocksX;
+			for (int bx = 0; bx < blocksX; bx++)
+				out[bx] = 0.0f;
+			for (int v = 0; v < DCT_BLOCK_SIZE; v++) {
+				const INT16* a = dctBlockRow(previous, rowBytes, by, v);
+				const INT16* b = dctBlockRow(current, rowBytes, by, v);
+				for (int bx = 0; bx < blocksX; bx++) {
+					long long sum = 0;
+					for (int u = 0; u < DCT_BLOCK_SIZE; u++) {
+						int d = b[bx * DCT_BLOCK_SIZE + u] - a[bx * DCT_BLOCK_SIZE + u];
+						sum += (long long)d * d;
+					}
+					out[bx] += (float)sum;
+				}
+			}
+		}
+	}
+
+	// Number of values at or above threshold, e.g. blocks that changed or carry an edge
+	inline int dctCountAbove(const float* values, int count, float threshold) {
+		int n = 0;
+		for (int i = 0; i < count; i++)
+			n += values[i] >= threshold ? 1 : 0;
+		return n;
+	}
+
+	// Blocks that changed between two DC proxies, see proxyChanges
+	struct ProxyChange {
+		int blocks = 0;		// number of blocks whose DC value moved by more than the threshold
+		UINT64 sad = 0;		// sum of absolute differences over all blocks
+		int left = 0, top = 0, right = 0, bottom = 0;	// bounding box of the changed blocks in blocks, right and bottom exclusive
+	};
+
+	/*!
+		@~english
+			@brief Compares two DC proxies block by block
+			@details Sum of absolute differences, number of blocks that moved by more than threshold and their bounding box, in one SIMD pass.
+				The proxy is 1/64 of the frame, so this is far cheaper than decoding the frame to find out nothing changed.
+			@param[in] previous DC proxy of the earlier frame
+			@param[in] current DC proxy of the later frame, same geometry
+			@param[in] rowBytes Number of bytes per row of both
+			@param[in] blocksX Number of blocks per row
+			@param[in] blocksY Number of block rows
+			@param[in] threshold Change of a DC value that counts as motion
+			@param[out] change Result, blocks is 0 if nothing changed
+		@~japanese
+			@brief 2つのDCプロキシをブロックごとに比較します。
+			@details 差分絶対値和、thresholdを超えて変化したブロック数とその外接矩形を1回のSIMD走査で求めます。
+				プロキシはフレームの1/64のため、フレームをデコードして変化がないことを確認するより大幅に軽量です。
+			@param[in] previous 前のフレームのDCプロキシ
+			@param[in] current 後のフレームのDCプロキシ（同じサイズ）
+			@param[in] rowBytes 両方の１ラインあたりのバイト数
+			@param[in] blocksX 横方向のブロック数
+			@param[in] blocksY 縦方向のブロック数
+			@param[in] threshold 動きとみなすDC値の変化量
+			@param[out] change 結果（変化がない場合blocksは0）
+	*/
+	inline void proxyChanges(const UINT8* previous, const UINT8* current, int rowBytes, int blocksX, int blocksY, int threshold, ProxyChange& change) {
+		change = ProxyChange();
+		change.left = blocksX;
+		change.top = blocksY;
+		int limit = threshold < 0 ? 0 : threshold > 255 ? 255 : threshold;
+		for (int by = 0; by < blocksY; by++) {
+			const UINT8* a = previous + size_t(by) * rowBytes;
+			const UINT8* b = current + size_t(by) * rowBytes;
+			int first = -1, last = -1, count = 0;
+			int bx = 0;
+#ifdef PHOTRON_DCT_KERNELS_SSE2
+			const __m128i limits = _mm_set1_epi8((char)limit);
+			__m128i sad = _mm_setzero_si128();
+			for (; bx + 16 <= blocksX; bx += 16) {
+				__m128i va = _mm_loadu_si128((const __m128i*)(a + bx));
+				__m128i vb = _mm_loadu_si128((const __m128i*)(b + bx));
+				sad = _mm_add_epi64(sad, _mm_sad_epu8(va, vb));
+				__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+				unsigned int moved = (unsigned int)_mm_movemask_epi8(cmpgtEpu8(diff, limits));
+				if (moved) {
+					unsigned long index;
+					_BitScanForward(&index, moved);
+					if (first < 0)
+						first = bx + (int)index;
+					_BitScanReverse(&index, moved);
+					last = bx + (int)index;
+					for (; moved; moved &= moved - 1)
+						count++;
+				}
+			}
+			change.sad += UINT64(_mm_cvtsi128_si32(sad)) + UINT64(_mm_cvtsi128_si32(_mm_srli_si128(sad, 8)));
+#endif
+			for (; bx < blocksX; bx++) {
+				int d = a[bx] > b[bx] ? a[bx] - b[bx] : b[bx] - a[bx];
+				change.sad += d;
+				if (d > limit) {
+					if (first < 0)
+						first = bx;
+					last = bx;
+					count++;
+				}
+			}
+			if (count == 0)
+				continue;
+			change.blocks += count;
+			if (first < change.left)
+				change.left = first;
+			if (last + 1 > change.right)
+				change.right = last + 1;
+			if (by < change.top)
+				change.top = by;
+			change.bottom = by + 1;
+		}
+		if (change.blocks == 0)
+			change.left = change.top = 0;
+	}
+
+}
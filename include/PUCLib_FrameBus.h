@@ -0,0 +1,537 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Shared memory ring that one capture process publishes decoded frames into and any number of processes read without copying
+		@details Only one process can own the camera. The capture daemon (src/captureDaemon) runs PUCLib_Wrapper and publishes the full and
+			the proxy stream with FrameBusWriter, clients map the same memory with FrameBusReader (or PhotronBusCapture.h for cv::Mat).
+			Every slot is guarded by a sequence lock: the writer makes the sequence odd while it fills the slot, so a reader knows a frame was
+			intact if the sequence is even and unchanged after it used the data (isValid). Readers never write to the mapping and never block
+			the writer. The layout only uses fixed width types, since 32 and 64 bit processes and different compilers share it.
+			The mapping is a named file mapping on Windows and a POSIX shared memory object elsewhere.
+	@~japanese
+		@brief 1つのキャプチャプロセスがデコード済みフレームを公開し、複数のプロセスがコピーせずに読み出す共有メモリのリングバッファ
+		@details カメラを所有できるのは1プロセスのみです。キャプチャデーモン（src/captureDaemon）がPUCLib_Wrapperを実行し、フル画像と
+			プロキシ画像をFrameBusWriterで公開し、クライアントはFrameBusReader（cv::Matの場合はPhotronBusCapture.h）で同じメモリを参照します。
+			各スロットはシーケンスロックで保護されます。書き込み中はシーケンスが奇数になるため、読み出し側はデータ使用後にシーケンスが偶数かつ
+			変化していなければフレームが壊れていないと判断できます（isValid）。読み出し側はマッピングに書き込まず、書き込み側を待たせません。
+			32ビットと64ビットのプロセスや異なるコンパイラ間で共有するため、レイアウトは固定長の型のみを使用します。
+			マッピングはWindowsでは名前付きファイルマッピング、それ以外ではPOSIX共有メモリです。
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace photron {
+
+	enum FrameBusStream {
+		FRAME_BUS_FULL,		// the decoded frame (the decode ROI of the daemon)
+		FRAME_BUS_PROXY,	// the DC proxy
+		FRAME_BUS_STREAMS
+	};
+
+	enum {
+		FRAME_BUS_MAGIC = 0x53554250,	// "PBUS"
+		FRAME_BUS_VERSION = 1,
+		FRAME_BUS_ALIGNMENT = 64
+	};
+
+	// Metadata of one slot, the pixels are at FrameBusStreamHeader::dataOffset + slot * slotBytes
+	struct FrameBusSlot {
+		std::atomic<uint32_t> sequence;		// odd while the writer fills the slot
+		uint32_t width;
+		uint32_t height;
+		uint32_t rowBytes;
+		int64_t frameNo;
+		int64_t timestamp;		// steady clock (ns) of the daemon when the payload arrived
+		uint16_t sequenceNo;
+		uint8_t reserved[FRAME_BUS_ALIGNMENT - 34];
+	};
+	static_assert(sizeof(FrameBusSlot) == FRAME_BUS_ALIGNMENT, "FrameBusSlot must fill one cache line");
+
+	struct FrameBusStreamHeader {
+		uint32_t slotCount;
+		uint32_t reserved;
+		uint64_t slotBytes;
+		uint64_t slotsOffset;	// FrameBusSlot array
+		uint64_t dataOffset;
+		std::atomic<int32_t> latestSlot;
+		std::atomic<int64_t> latestFrameNo;
+		std::atomic<uint64_t> published;
+		std::atomic<uint64_t> oversized;	// frames larger than slotBytes, not published
+	};
+
+	struct FrameBusHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t size;
+		std::atomic<int64_t> heartbeat;	// steady clock (ns) of the last FrameBusWriter::heartbeat
+		FrameBusStreamHeader streams[FRAME_BUS_STREAMS];
+	};
+
+	// A frame referenced in the mapping, see FrameBusReader::isValid
+	struct FrameBusView {
+		const uint8_t* data = NULL;
+		int width = 0;
+		int height = 0;
+		int rowBytes = 0;
+		long long frameNo = -1;
+		long long timestamp = 0;
+		uint16_t sequenceNo = 0;
+		int stream = FRAME_BUS_FULL;
+		int slot = -1;
+		uint32_t sequence = 0;
+
+		bool isValid() const {
+			return data != NULL;
+		}
+	};
+
+	inline long long frameBusClock() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	inline uint64_t frameBusAlign(uint64_t value) {
+		return (value + FRAME_BUS_ALIGNMENT - 1) & ~uint64_t(FRAME_BUS_ALIGNMENT - 1);
+	}
+
+	// A named shared memory mapping
+	class SharedMemory {
+#ifdef _WIN32
+		HANDLE m_handle = NULL;
+#else
+		int m_fd = -1;
+		std::string m_unlinkName;
+#endif
+		void* m_data = NULL;
+		size_t m_size = 0;
+
+		static std::string systemName(const char* name) {
+#ifdef _WIN32
+			return std::string("Local\\photron_") + name;
+#else
+			return std::string("/photron_") + name;
+#endif
+		}
+	public:
+		~SharedMemory() {
+			close();
+		}
+
+		// Creates a new zero filled mapping, false if the name is already in use
+		bool create(const char* name, size_t size) {
+			close();
+			std::string path = systemName(name);
+#ifdef _WIN32
+			m_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), path.c_str());
+			if (m_handle == NULL)
+				return false;
+			if (GetLastError() == ERROR_ALREADY_EXISTS) {
+				// CreateFileMapping hands out the existing mapping, whatever its size
+				close();
+				return false;
+			}
+			m_data = MapViewOfFile(m_handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+			m_fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+			if (m_fd < 0)
+				return false;
+			m_unlinkName = path;
+			if (ftruncate(m_fd, (off_t)size) != 0) {
+				close();
+				return false;
+			}
+			m_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+			if (m_data == MAP_FAILED)
+				m_data = NULL;
+#endif
+			m_size = size;
+			if (m_data == NULL) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		// Replaces the mapping of a process that is gone (the caller checks that it is). POSIX removes the old name and creates a new
+		// object, readers still mapping the old one keep it until they reopen. A Windows mapping lives as long as any process holds a
+		// handle, so it is reused and zero filled, which fails if it is smaller than size.
+		bool takeOver(const char* name, size_t size) {
+			close();
+			std::string path = systemName(name);
+#ifdef _WIN32
+			m_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), path.c_str());
+			if (m_handle == NULL)
+				return false;
+			// Fails if the existing mapping is smaller
+			m_data = MapViewOfFile(m_handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+			if (m_data == NULL) {
+				close();
+				return false;
+			}
+			m_size = size;
+			memset(m_data, 0, size);
+			return true;
+#else
+			shm_unlink(path.c_str());
+			return create(name, size);
+#endif
+		}
+
+		// Maps a mapping created by another process, read only
+		bool open(const char* name) {
+			close();
+			std::string path = systemName(name);
+#ifdef _WIN32
+			m_handle = OpenFileMappingA(FILE_MAP_READ, FALSE, path.c_str());
+			if (m_handle == NULL)
+				return false;
+			m_data = MapViewOfFile(m_handle, FILE_MAP_READ, 0, 0, 0);
+			MEMORY_BASIC_INFORMATION info;
+			if (m_data && VirtualQuery(m_data, &info, sizeof(info)))
+				m_size = info.RegionSize;
+#else
+			m_fd = shm_open(path.c_str(), O_RDONLY, 0);
+			if (m_fd < 0)
+				return false;
+			struct stat st;
+			if (fstat(m_fd, &st) == 0 && st.st_size > 0) {
+				m_size = (size_t)st.st_size;
+				m_data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+				if (m_data == MAP_FAILED)
+					m_data = NULL;
+			}
+#endif
+			if (m_data == NULL) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (m_data)
+				UnmapViewOfFile(m_data);
+			if (m_handle)
+				CloseHandle(m_handle);
+			m_handle = NULL;
+#else
+			if (m_data)
+				munmap(m_data, m_size);
+			if (m_fd >= 0)
+				::close(m_fd);
+			// The creator removes the name, mappings of open readers stay valid until they close
+			if (!m_unlinkName.empty())
+				shm_unlink(m_unlinkName.c_str());
+			m_fd = -1;
+			m_unlinkName.clear();
+#endif
+			m_data = NULL;
+			m_size = 0;
+		}
+
+		void* data() const {
+			return m_data;
+		}
+
+		size_t size() const {
+			return m_size;
+		}
+	};
+
+	/*!
+		@~english
+			@brief Publishing side of the frame bus, used by the process that owns the camera
+			@details Slots are reused round robin, so a reader has slotCount frames of time before the frame it references is overwritten.
+				publish copies the frame once into the mapping, which is the only copy between the decoder and every client.
+		@~japanese
+			@brief フレームバスの公開側（カメラを所有するプロセスが使用します）
+			@details スロットは順番に再利用されるため、読み出し側は参照中のフレームが上書きされるまでslotCountフレーム分の猶予があります。
+				publishはフレームをマッピングへ1度だけコピーし、これがデコーダとすべてのクライアント間の唯一のコピーです。
+	*/
+	class FrameBusWriter {
+		SharedMemory m_memory;
+		FrameBusHeader* m_header = NULL;
+	public:
+		/*!
+			@~english
+				@brief Creates the bus
+				@param[in] name Name clients open, e.g. "photron0"
+				@param[in] slotCount Number of slots of the full and the proxy stream
+				@param[in] slotBytes Largest frame of each stream in bytes (rowBytes * height)
+				@param[in] staleMs A bus of the same name is taken over only when its writer has not sent a heartbeat for staleMs (it died
+					or closed), otherwise create fails. On Windows the old mapping is reused and must be large enough.
+				@return true if successful
+			@~japanese
+				@brief バスを作成します。
+				@param[in] name クライアントが開く名前（例："photron0"）
+				@param[in] slotCount フル画像とプロキシ画像それぞれのスロット数
+				@param[in] slotBytes 各ストリームの最大フレームのバイト数（rowBytes * height）
+				@param[in] staleMs 同名のバスは、その書き込み側がstaleMsの間ハートビートを送っていない場合（終了または異常終了）のみ引き継ぎ、
+					それ以外の場合は失敗します。Windowsでは既存のマッピングを再利用するため、十分な大きさが必要です。
+				@return 成功時はtrue
+		*/
+		bool create(const char* name, const uint32_t slotCount[FRAME_BUS_STREAMS], const uint64_t slotBytes[FRAME_BUS_STREAMS], int staleMs = 1000) {
+			close();
+			uint64_t offset = frameBusAlign(sizeof(FrameBusHeader));
+			uint64_t slotsOffset[FRAME_BUS_STREAMS], dataOffset[FRAME_BUS_STREAMS], alignedBytes[FRAME_BUS_STREAMS];
+			for (int s = 0; s < FRAME_BUS_STREAMS; s++) {
+				alignedBytes[s] = frameBusAlign(slotBytes[s]);
+				slotsOffset[s] = offset;
+				offset = frameBusAlign(offset + sizeof(FrameBusSlot) * slotCount[s]);
+				dataOffset[s] = offset;
+				offset += alignedBytes[s] * slotCount[s];
+			}
+			if (!m_memory.create(name, (size_t)offset) && (isWriterAlive(name, staleMs) || !m_memory.takeOver(name, (size_t)offset)))
+				return false;
+			// The mapping is zero filled. The heartbeat goes first, so a second writer starting now does not take this bus over.
+			uint8_t* base = (uint8_t*)m_memory.data();
+			m_header = (FrameBusHeader*)base;
+			m_header->heartbeat.store(frameBusClock(), std::memory_order_relaxed);
+			m_header->size = offset;
+			for (int s = 0; s < FRAME_BUS_STREAMS; s++) {
+				FrameBusStreamHeader& stream = m_header->streams[s];
+				stream.slotCount = slotCount[s];
+				stream.slotBytes = alignedBytes[s];
+				stream.slotsOffset = slotsOffset[s];
+				stream.dataOffset = dataOffset[s];
+				stream.latestSlot.store(-1, std::memory_order_relaxed);
+				stream.latestFrameNo.store(-1, std::memory_order_relaxed);
+			}
+			m_header->version = FRAME_BUS_VERSION;
+			// Readers check the magic last
+			std::atomic_thread_fence(std::memory_order_release);
+			m_header->magic = FRAME_BUS_MAGIC;
+			return true;
+		}
+
+		void close() {
+			if (m_header) {
+				m_header->magic = 0;
+				// A mapping that outlives the writer (Windows readers keep it) can be taken over at once
+				m_header->heartbeat.store(0, std::memory_order_relaxed);
+			}
+			m_memory.close();
+			m_header = NULL;
+		}
+
+		bool isOpened() const {
+			return m_header != NULL;
+		}
+
+		// True if a bus of that name exists and its writer sent a heartbeat within the last timeoutMs
+		static bool isWriterAlive(const char* name, int timeoutMs) {
+			SharedMemory existing;
+			if (!existing.open(name) || existing.size() < sizeof(FrameBusHeader))
+				return false;
+			const FrameBusHeader* header = (const FrameBusHeader*)existing.data();
+			return frameBusClock() - header->heartbeat.load(std::memory_order_relaxed) < (long long)timeoutMs * 1000000;
+		}
+
+		// Copies a frame into the next slot of stream and makes it the latest, false if it is larger than the slots
+		bool publish(int stream, const uint8_t* data, int width, int height, int rowBytes, long long frameNo, uint16_t sequenceNo, long long timestamp) {
+			FrameBusStreamHeader& header = m_header->streams[stream];
+			uint64_t bytes = uint64_t(rowBytes) * height;
+			if (header.slotCount == 0 || bytes > header.slotBytes) {
+				header.oversized.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			uint64_t count = header.published.load(std::memory_order_relaxed);
+			int slot = int(count % header.slotCount);
+			uint8_t* base = (uint8_t*)m_header;
+			FrameBusSlot& meta = ((FrameBusSlot*)(base + header.slotsOffset))[slot];
+			uint32_t sequence = meta.sequence.load(std::memory_order_relaxed);
+			meta.sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			memcpy(base + header.dataOffset + header.slotBytes * slot, data, (size_t)bytes);
+			meta.width = width;
+			meta.height = height;
+			meta.rowBytes = rowBytes;
+			meta.frameNo = frameNo;
+			meta.timestamp = timestamp;
+			meta.sequenceNo = sequenceNo;
+			meta.sequence.store(sequence + 2, std::memory_order_release);
+			header.latestSlot.store(slot, std::memory_order_release);
+			header.latestFrameNo.store(frameNo, std::memory_order_release);
+			header.published.store(count + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		// Tells readers the daemon is alive even when no frames arrive
+		void heartbeat() {
+			m_header->heartbeat.store(frameBusClock(), std::memory_order_relaxed);
+		}
+
+		uint64_t getPublishedCount(int stream) const {
+			return m_header->streams[stream].published.load(std::memory_order_relaxed);
+		}
+
+		uint64_t getOversizedCount(int stream) const {
+			return m_header->streams[stream].oversized.load(std::memory_order_relaxed);
+		}
+	};
+
+	/*!
+		@~english
+			@brief Reading side of the frame bus
+			@details latest and next reference a slot of the mapping without copying. Use the view, then call isValid: false means the writer
+				reused the slot meanwhile and the data may be torn, like FrameHistory::isValid. copy gives a frame that stays consistent.
+		@~japanese
+			@brief フレームバスの読み出し側
+			@details latestとnextはコピーせずにマッピングのスロットを参照します。ビューを使用した後にisValidを呼んでください。falseの場合、
+				その間に書き込み側がスロットを再利用したためデータが壊れている可能性があります（FrameHistory::isValidと同様）。
+				一貫したフレームが必要な場合はcopyを使用してください。
+	*/
+	class FrameBusReader {
+		SharedMemory m_memory;
+		const FrameBusHeader* m_header = NULL;
+
+		const FrameBusSlot& slotAt(int stream, int slot) const {
+			const uint8_t* base = (const uint8_t*)m_header;
+			return ((const FrameBusSlot*)(base + m_header->streams[stream].slotsOffset))[slot];
+		}
+
+		// Reads the metadata of a slot under its sequence lock
+		bool readSlot(int stream, int slot, FrameBusView& view) const {
+			const FrameBusStreamHeader& header = m_header->streams[stream];
+			const FrameBusSlot& meta = slotAt(stream, slot);
+			for (int attempt = 0; attempt < 64; attempt++) {
+				uint32_t sequence = meta.sequence.load(std::memory_order_acquire);
+				if (sequence & 1) {
+					std::this_thread::yield();
+					continue;
+				}
+				view.width = (int)meta.width;
+				view.height = (int)meta.height;
+				view.rowBytes = (int)meta.rowBytes;
+				view.frameNo = meta.frameNo;
+				view.timestamp = meta.timestamp;
+				view.sequenceNo = meta.sequenceNo;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (meta.sequence.load(std::memory_order_relaxed) != sequence)
+					continue;
+				view.data = (const uint8_t*)m_header + header.dataOffset + header.slotBytes * slot;
+				view.stream = stream;
+				view.slot = slot;
+				view.sequence = sequence;
+				return true;
+			}
+			return false;
+		}
+	public:
+		// Maps the bus a FrameBusWriter created under name, false if there is none (yet)
+		bool open(const char* name) {
+			close();
+			if (!m_memory.open(name))
+				return false;
+			const FrameBusHeader* header = (const FrameBusHeader*)m_memory.data();
+			if (m_memory.size() < sizeof(FrameBusHeader) || header->magic != FRAME_BUS_MAGIC || header->version != FRAME_BUS_VERSION ||
+				m_memory.size() < header->size) {
+				m_memory.close();
+				return false;
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			m_header = header;
+			return true;
+		}
+
+		void close() {
+			m_memory.close();
+			m_header = NULL;
+		}
+
+		bool isOpened() const {
+			return m_header != NULL;
+		}
+
+		// False once the writer closed the bus or has not sent a heartbeat for timeoutMs
+		bool isAlive(int timeoutMs) const {
+			if (m_header == NULL || m_header->magic != FRAME_BUS_MAGIC)
+				return false;
+			return frameBusClock() - m_header->heartbeat.load(std::memory_order_relaxed) < (long long)timeoutMs * 1000000;
+		}
+
+		long long getLatestFrameNo(int stream) const {
+			return m_header->streams[stream].latestFrameNo.load(std::memory_order_acquire);
+		}
+
+		// References the latest frame of stream, false if none was published yet
+		bool latest(int stream, FrameBusView& view) const {
+			for (int attempt = 0; attempt < 4; attempt++) {
+				int slot = m_header->streams[stream].latestSlot.load(std::memory_order_acquire);
+				if (slot < 0)
+					return false;
+				// The slot may be reused between reading its index and its lock, then the next index is newer anyway
+				if (readSlot(stream, slot, view))
+					return true;
+			}
+			return false;
+		}
+
+		/*!
+			@~english
+				@brief References the latest frame newer than afterFrameNo, waiting up to timeoutMs for it
+				@details Polls the latest frame number: it spins with yield for the first 200 us, then sleeps 1 ms at a time, since no wait
+					primitive is shared across processes on every platform. Frames older than the latest are skipped.
+				@param[in] stream FRAME_BUS_FULL or FRAME_BUS_PROXY
+				@param[in] afterFrameNo Frame number already seen, -1 for any
+				@param[out] view The frame
+				@param[in] timeoutMs Timeout, -1 to wait forever
+				@return false on timeout
+			@~japanese
+				@brief afterFrameNoより新しい最新フレームを参照します。最大timeoutMs待機します。
+				@details 最新のフレーム番号をポーリングします。すべてのプラットフォームでプロセス間共有できる待機手段がないため、最初の200usは
+					yieldしながら、その後は1msずつスリープします。最新より古いフレームはスキップされます。
+				@param[in] stream FRAME_BUS_FULLまたはFRAME_BUS_PROXY
+				@param[in] afterFrameNo 取得済みのフレーム番号、-1の場合は任意
+				@param[out] view フレーム
+				@param[in] timeoutMs タイムアウト、-1の場合は無期限
+				@return タイムアウト時はfalse
+		*/
+		bool next(int stream, long long afterFrameNo, FrameBusView& view, int timeoutMs) const {
+			long long start = frameBusClock();
+			for (;;) {
+				if (getLatestFrameNo(stream) > afterFrameNo && latest(stream, view) && view.frameNo > afterFrameNo)
+					return true;
+				long long elapsed = frameBusClock() - start;
+				if (timeoutMs >= 0 && elapsed >= (long long)timeoutMs * 1000000)
+					return false;
+				if (elapsed < 200000)
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		// True if the slot of view was not rewritten since the view was taken
+		bool isValid(const FrameBusView& view) const {
+			if (view.data == NULL)
+				return false;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return slotAt(view.stream, view.slot).sequence.load(std::memory_order_relaxed) == view.sequence;
+		}
+
+		// Copies the frame of view into dst, false if it was overwritten before the copy completed
+		bool copy(const FrameBusView& view, uint8_t* dst, int dstRowBytes) const {
+			if (view.data == NULL)
+				return false;
+			for (int y = 0; y < view.height; y++)
+				memcpy(dst + size_t(y) * dstRowBytes, view.data + size_t(y) * view.rowBytes, view.width);
+			return isValid(view);
+		}
+	};
+
+}
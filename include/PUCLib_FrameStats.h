@@ -0,0 +1,171 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Statistics of a region of a decoded frame, computed by PUCLib_Wrapper while the decoded rows are still in cache
+		@details See PUCLib_Wrapper::setFrameStats. The kernels take whole rows, so the wrapper can run them on each band right after decoding it.
+	@~japanese
+		@brief デコード済みフレームの領域の統計値（デコードした行がキャッシュにある間にPUCLib_Wrapperが計算します）
+		@details PUCLib_Wrapper::setFrameStatsを参照してください。行単位で処理するため、ラッパはデコード直後の帯ごとに実行できます。
+*/
+
+#include "PUCLib_Platform.h"
+#include <string.h>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PHOTRON_FRAME_STATS_SSE2
+#endif
+
+namespace photron {
+
+	struct FrameStats {
+		bool valid = false;
+		int x = 0, y = 0, width = 0, height = 0;	// region in frame coordinates
+		int threshold = 0;
+		UINT32 histogram[256];
+		UINT64 sum = 0;
+		UINT32 count = 0;
+		UINT8 minValue = 0;
+		UINT8 maxValue = 0;
+		int firstAbove = -1;	// leftmost column (frame coordinates) with a pixel above threshold, -1 if none
+		int lastAbove = -1;		// rightmost one
+		std::vector<UINT32> rowSums;		// one per row of the region
+		std::vector<UINT32> columnSums;		// one per column of the region, over all its rows
+
+		double mean() const {
+			return count ? double(sum) / double(count) : 0.0;
+		}
+
+		// Clears the statistics for a new frame. Does not allocate when the region is not larger than the reserved one.
+		void begin(int regionX, int regionY, int regionWidth, int regionHeight, int regionThreshold) {
+			valid = false;
+			x = regionX;
+			y = regionY;
+			width = regionWidth;
+			height = regionHeight;
+			threshold = regionThreshold;
+			memset(histogram, 0, sizeof(histogram));
+			sum = 0;
+			count = 0;
+			minValue = maxValue = 0;
+			firstAbove = lastAbove = -1;
+			rowSums.assign(regionHeight, 0);
+			columnSums.assign(regionWidth, 0);
+		}
+
+		// Derives sum, count, min and max from the histogram once every row went through accumulateFrameStats
+		void finish() {
+			sum = 0;
+			count = 0;
+			int lowest = -1, highest = -1;
+			for (int i = 0; i < 256; i++) {
+				if (histogram[i] == 0)
+					continue;
+				if (lowest < 0)
+					lowest = i;
+				highest = i;
+				sum += UINT64(i) * histogram[i];
+				count += histogram[i];
+			}
+			minValue = lowest < 0 ? 0 : (UINT8)lowest;
+			maxValue = highest < 0 ? 0 : (UINT8)highest;
+			valid = true;
+		}
+	};
+
+	inline int frameStatsLowestBit(unsigned int mask) {
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return (int)index;
+	}
+
+	inline int frameStatsHighestBit(unsigned int mask) {
+		unsigned long index;
+		_BitScanReverse(&index, mask);
+		return (int)index;
+	}
+
+	/*!
+		@~english
+			@brief Adds rows of the region to the statistics
+			@details One pass per row: histogram, row sum, column sums and threshold crossings. Rows may come in any order and in several calls,
+				finish() completes the frame.
+			@param[in,out] stats Statistics prepared with FrameStats::begin
+			@param[in] data First pixel of the first row, at column stats.x
+			@param[in] rowBytes Number of bytes per row of data
+			@param[in] firstRow Index of the first row inside the region
+			@param[in] rows Number of rows
+		@~japanese
+			@brief 領域の行を統計値に加算します。
+			@details 1行につき1回の走査でヒストグラム、行の合計、列の合計、しきい値を超える位置を求めます。行の順序と呼び出し回数は任意で、
+				finish()でフレームの統計値が確定します。
+			@param[in,out] stats FrameStats::beginで準備した統計値
+			@param[in] data 先頭行の先頭画素（stats.x列）
+			@param[in] rowBytes dataの１ラインあたりのバイト数
+			@param[in] firstRow 領域内の先頭行の番号
+			@param[in] rows 行数
+	*/
+	inline void accumulateFrameStats(FrameStats& stats, const UINT8* data, int rowBytes, int firstRow, int rows) {
+		const int width = stats.width;
+		UINT32* histogram = stats.histogram;
+		UINT32* columns = stats.columnSums.data();
+		for (int r = 0; r < rows; r++) {
+			const UINT8* row = data + size_t(r) * rowBytes;
+			UINT32 rowSum = 0;
+			int first = -1, last = -1;
+			int x = 0;
+#ifdef PHOTRON_FRAME_STATS_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i limit = _mm_set1_epi8((char)stats.threshold);
+			__m128i rowAcc = zero;
+			for (; x + 16 <= width; x += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+				rowAcc = _mm_add_epi64(rowAcc, _mm_sad_epu8(v, zero));
+
+				__m128i lo = _mm_unpacklo_epi8(v, zero);
+				__m128i hi = _mm_unpackhi_epi8(v, zero);
+				__m128i* c = (__m128i*)(columns + x);
+				_mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_unpacklo_epi16(lo, zero)));
+				_mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_unpackhi_epi16(lo, zero)));
+				_mm_storeu_si128(c + 2, _mm_add_epi32(_mm_loadu_si128(c + 2), _mm_unpacklo_epi16(hi, zero)));
+				_mm_storeu_si128(c + 3, _mm_add_epi32(_mm_loadu_si128(c + 3), _mm_unpackhi_epi16(hi, zero)));
+
+				unsigned int above = (unsigned int)_mm_movemask_epi8(cmpgtEpu8(v, limit));
+				if (above) {
+					if (first < 0)
+						first = x + frameStatsLowestBit(above);
+					last = x + frameStatsHighestBit(above);
+				}
+
+				const UINT8* p = row + x;
+				histogram[p[0]]++; histogram[p[1]]++; histogram[p[2]]++; histogram[p[3]]++;
+				histogram[p[4]]++; histogram[p[5]]++; histogram[p[6]]++; histogram[p[7]]++;
+				histogram[p[8]]++; histogram[p[9]]++; histogram[p[10]]++; histogram[p[11]]++;
+				histogram[p[12]]++; histogram[p[13]]++; histogram[p[14]]++; histogram[p[15]]++;
+			}
+			rowSum = (UINT32)(_mm_cvtsi128_si32(rowAcc) + _mm_cvtsi128_si32(_mm_srli_si128(rowAcc, 8)));
+#endif
+			for (; x < width; x++) {
+				UINT8 value = row[x];
+				histogram[value]++;
+				rowSum += value;
+				columns[x] += value;
+				if (value > stats.threshold) {
+					if (first < 0)
+						first = x;
+					last = x;
+				}
+			}
+			stats.rowSums[firstRow + r] = rowSum;
+			if (first >= 0) {
+				if (stats.firstAbove < 0 || stats.x + first < stats.firstAbove)
+					stats.firstAbove = stats.x + first;
+				if (stats.x + last > stats.lastAbove)
+					stats.lastAbove = stats.x + last;
+			}
+		}
+	}
+
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+/*!
+	@~english
+		@brief The few Windows types and functions the wrapper headers use, so they also compile on Linux
+		@details On Windows this only includes Windows.h and intrin.h and defines PHOTRON_HAS_PUCLIB, PUCLIB is Windows only.
+			Elsewhere it declares the integer types of PUCLIB.h, VirtualAlloc/VirtualFree on the heap, the bitmap headers of saveBitmap and the
+			intrinsics used by the statistics and DCT kernels. Without PUCLIB the wrapper needs a capture source such as PUCLib_SyntheticSource.h.
+			Define PHOTRON_NO_PUCLIB to build without PUCLIB on Windows as well. On both, the SSE2 helpers those kernels share live here.
+	@~japanese
+		@brief ラッパのヘッダが使用するWindowsの型と関数を定義し、Linuxでもコンパイルできるようにします
+		@details WindowsではWindows.hとintrin.hをインクルードし、PHOTRON_HAS_PUCLIBを定義するだけです。PUCLIBはWindows専用です。
+			それ以外ではPUCLIB.hの整数型、ヒープ上のVirtualAlloc/VirtualFree、saveBitmapのビットマップヘッダ、統計処理とDCT処理が使用する
+			組み込み関数を宣言します。PUCLIBがない場合、ラッパにはPUCLib_SyntheticSource.hなどのキャプチャソースが必要です。
+			WindowsでもPUCLIBなしでビルドする場合はPHOTRON_NO_PUCLIBを定義してください。両方で、それらの処理が共有するSSE2の補助関数もここにあります。
+*/
+
+#ifdef _WIN32
+
+#include <Windows.h>
+#include <intrin.h>
+#ifndef PHOTRON_NO_PUCLIB
+#define PHOTRON_HAS_PUCLIB
+#endif
+
+#else
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define WINAPI
+
+typedef uint8_t UINT8, *PUINT8;
+typedef uint8_t BYTE;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int16_t INT16, *PINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t LONG;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef int BOOL;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef size_t SIZE_T;
+typedef void* LPVOID;
+typedef void* HANDLE;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define MEM_COMMIT		0x00001000
+#define MEM_RESERVE		0x00002000
+#define MEM_RELEASE		0x00008000
+#define MEM_LARGE_PAGES	0x20000000
+#define PAGE_READWRITE	0x04
+
+// Page aligned and zeroed like VirtualAlloc, large pages are not emulated
+inline LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect) {
+	if (address != NULL || (allocationType & MEM_LARGE_PAGES))
+		return NULL;
+	void* memory = NULL;
+	if (posix_memalign(&memory, 4096, size) != 0)
+		return NULL;
+	memset(memory, 0, size);
+	return memory;
+}
+
+inline BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD freeType) {
+	free(address);
+	return TRUE;
+}
+
+inline SIZE_T GetLargePageMinimum() {
+	return 0;
+}
+
+#pragma pack(push, 2)
+typedef struct {
+	WORD bfType;
+	DWORD bfSize;
+	WORD bfReserved1;
+	WORD bfReserved2;
+	DWORD bfOffBits;
+} BITMAPFILEHEADER;
+#pragma pack(pop)
+
+typedef struct {
+	DWORD biSize;
+	LONG biWidth;
+	LONG biHeight;
+	WORD biPlanes;
+	WORD biBitCount;
+	DWORD biCompression;
+	DWORD biSizeImage;
+	LONG biXPelsPerMeter;
+	LONG biYPelsPerMeter;
+	DWORD biClrUsed;
+	DWORD biClrImportant;
+} BITMAPINFOHEADER;
+
+typedef struct {
+	BYTE rgbBlue;
+	BYTE rgbGreen;
+	BYTE rgbRed;
+	BYTE rgbReserved;
+} RGBQUAD;
+
+typedef struct {
+	BITMAPINFOHEADER bmiHeader;
+	RGBQUAD bmiColors[1];
+} BITMAPINFO;
+
+#define BI_RGB 0
+
+inline unsigned char _BitScanForward(unsigned long* index, unsigned long mask) {
+	if (mask == 0)
+		return 0;
+	*index = (unsigned long)__builtin_ctzl(mask);
+	return 1;
+}
+
+inline unsigned char _BitScanReverse(unsigned long* index, unsigned long mask) {
+	if (mask == 0)
+		return 0;
+	*index = (unsigned long)(sizeof(unsigned long) * 8 - 1 - __builtin_clzl(mask));
+	return 1;
+}
+
+// Same signature as the MSVC intrinsic, zeros on CPUs without cpuid
+inline void __cpuid(int info[4], int leaf) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("cpuid" : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3]) : "a"(leaf), "c"(0));
+#else
+	info[0] = info[1] = info[2] = info[3] = 0;
+#endif
+}
+
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+
+namespace photron {
+
+	// Unsigned a > b per byte, all ones where it holds. SSE2 only compares signed bytes; biasing both sides by 0x80 makes that
+	// the unsigned compare. Shared by the statistics and DCT kernels.
+	inline __m128i cmpgtEpu8(__m128i a, __m128i b) {
+		const __m128i bias = _mm_set1_epi8((char)0x80);
+		return _mm_cmpgt_epi8(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+	}
+
+}
+#endif
@@ -0,0 +1,1149 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Plays a recording of PUCLib_Wrapper::startRecording back through the API of PUCLib_Wrapper
+		@details The data file and its index are memory mapped, payloads are decoded straight from the mapping and nothing is read ahead.
+			read, readProxy, readInto and the image listener behave as with the camera, so a pipeline runs unchanged on recorded data.
+			Frames are played in real time (from the recorded timestamps, optionally faster or slower), as fast as possible, or one step at a
+			time. seek finds any frame in constant time through a table from frame numbers to index entries.
+			PlaybackSource replays a recording through the transfer callback instead, as a device backend of the wrapper itself.
+	@~japanese
+		@brief PUCLib_Wrapper::startRecordingの記録をPUCLib_WrapperのAPIで再生します
+		@details データファイルとインデックスをメモリマップし、圧縮データはマッピングから直接デコードされ、先読みは行いません。
+			read、readProxy、readInto、画像リスナーはカメラと同様に動作するため、記録したデータで処理をそのまま実行できます。
+			フレームは実時間（記録されたタイムスタンプに基づき、速度の変更も可能）、最高速度、1ステップずつのいずれかで再生されます。
+			seekはフレーム番号からインデックスへの表により、任意のフレームを一定時間で検索します。
+			PlaybackSourceは、ラッパ自体のデバイスバックエンドとして、記録を転送コールバックで再生します。
+*/
+
+#include "PUCLib_Wrapper.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace photron {
+
+	enum PlaybackPacing {
+		PLAYBACK_REAL_TIME,				// frames are due at their recorded timestamps divided by the speed, late frames are skipped
+		PLAYBACK_AS_FAST_AS_POSSIBLE,	// every frame once: to the listener as soon as it returns, or one per read/readInto without a listener
+		PLAYBACK_STEPPED				// frames only change on step or seek
+	};
+
+	// Read-only mapping of a whole file
+	class MappedFile {
+		const UINT8* m_data = NULL;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = NULL;
+#endif
+	public:
+		~MappedFile() {
+			close();
+		}
+
+		bool open(const char* path) {
+			close();
+#ifdef _WIN32
+			m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+			if (m_file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+				close();
+				return false;
+			}
+			m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m_mapping)
+				m_data = (const UINT8*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+			m_size = (size_t)size.QuadPart;
+#else
+			int file = ::open(path, O_RDONLY);
+			if (file < 0)
+				return false;
+			struct stat st;
+			if (fstat(file, &st) == 0 && st.st_size > 0) {
+				void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, file, 0);
+				if (p != MAP_FAILED) {
+					m_data = (const UINT8*)p;
+					m_size = (size_t)st.st_size;
+				}
+			}
+			::close(file);
+#endif
+			if (m_data == NULL) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (m_data)
+				UnmapViewOfFile(m_data);
+			if (m_mapping)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+			m_mapping = NULL;
+			m_file = INVALID_HANDLE_VALUE;
+#else
+			if (m_data)
+				munmap((void*)m_data, m_size);
+#endif
+			m_data = NULL;
+			m_size = 0;
+		}
+
+		const UINT8* data() const {
+			return m_data;
+		}
+
+		size_t size() const {
+			return m_size;
+		}
+	};
+
+	// Mapped data and index file of a recording, shared by PUCLib_Playback and PlaybackSource
+	class RecordingFile {
+		MappedFile m_dataFile;
+		MappedFile m_indexFile;
+		const RecordingHeader* m_header = NULL;
+		const RecordingIndexEntry* m_entries = NULL;
+		int m_count = 0;
+		std::vector<int> m_lookup;	// frameNo - first frameNo -> entry, -1 for frames that were not recorded
+		long long m_firstFrameNo = -1;
+		UINT32 m_maxPayloadBytes = 0;
+		std::string m_lastErrorName;
+
+	public:
+		/*!
+			@~english
+				@brief Maps a recording and checks its index
+				@details A payload cut short at the end of the data file is dropped. The recording is rejected (PUC_ERROR_XFER_DATA_INVALID_HEADER)
+					if any other index entry points outside the data file or does not follow the frame number of the previous one.
+				@param[in] path Data file given to PUCLib_Wrapper::startRecording, the index is read from path + ".idx"
+				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
+			@~japanese
+				@brief 記録をマップし、インデックスを検査します。
+				@details データファイルの末尾で途切れた圧縮データは除外されます。その他のインデックスの項目がデータファイルの外を指す場合、
+					またはフレーム番号が直前の項目に続かない場合は記録を拒否します（PUC_ERROR_XFER_DATA_INVALID_HEADER）。
+				@param[in] path PUCLib_Wrapper::startRecordingに指定したデータファイル。インデックスはpath + ".idx"から読み込みます
+				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
+		*/
+		PUCRESULT open(const char* path) {
+			close();
+			std::string indexPath = std::string(path) + ".idx";
+			if (!m_dataFile.open(path) || !m_indexFile.open(indexPath.c_str())) {
+				m_lastErrorName = "cannot map the recording";
+				close();
+				return PUC_ERROR_ILLEGAL_ARG;
+			}
+			const RecordingHeader* header = (const RecordingHeader*)m_dataFile.data();
+			const RecordingIndexHeader* indexHeader = (const RecordingIndexHeader*)m_indexFile.data();
+			if (m_dataFile.size() < RECORDING_HEADER_BYTES || header->magic != RECORDING_MAGIC || header->version != RECORDING_VERSION ||
+				header->quantizationCount != PUC_Q_COUNT || m_indexFile.size() < sizeof(RecordingIndexHeader) ||
+				indexHeader->magic != RECORDING_INDEX_MAGIC || indexHeader->entryBytes != sizeof(RecordingIndexEntry)) {
+				m_lastErrorName = "not a recording";
+				close();
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			}
+			m_header = header;
+			m_entries = (const RecordingIndexEntry*)(m_indexFile.data() + sizeof(RecordingIndexHeader));
+			m_count = int((m_indexFile.size() - sizeof(RecordingIndexHeader)) / sizeof(RecordingIndexEntry));
+			// A recording cut short may index a payload the data file does not hold completely
+			while (m_count > 0 && m_entries[m_count - 1].offset + m_entries[m_count - 1].size > m_dataFile.size())
+				m_count--;
+			if (m_count == 0) {
+				m_lastErrorName = "empty recording";
+				close();
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			}
+			// Every entry must lie in the data file and follow the previous one: the lookup below is sized from the first and last
+			// frame numbers, and an unwrapped number never advances more than the 16 bit device counter does
+			for (int i = 0; i < m_count; i++) {
+				const RecordingIndexEntry& entry = m_entries[i];
+				bool inFile = entry.offset >= RECORDING_HEADER_BYTES && entry.size <= m_dataFile.size() && entry.offset <= m_dataFile.size() - entry.size;
+				bool inOrder = i == 0 ? entry.frameNo >= 0 : entry.frameNo > m_entries[i - 1].frameNo && entry.frameNo - m_entries[i - 1].frameNo <= 0xFFFF;
+				if (!inFile || !inOrder) {
+					m_lastErrorName = "corrupt recording index";
+					close();
+					return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+				}
+				if (entry.size > m_maxPayloadBytes)
+					m_maxPayloadBytes = entry.size;
+			}
+
+			m_firstFrameNo = m_entries[0].frameNo;
+			m_lookup.assign(size_t(m_entries[m_count - 1].frameNo - m_firstFrameNo + 1), -1);
+			for (int i = 0; i < m_count; i++)
+				m_lookup[size_t(m_entries[i].frameNo - m_firstFrameNo)] = i;
+			return PUC_SUCCEEDED;
+		}
+
+		void close() {
+			m_dataFile.close();
+			m_indexFile.close();
+			m_header = NULL;
+			m_entries = NULL;
+			m_count = 0;
+			m_lookup.clear();
+			m_firstFrameNo = -1;
+			m_maxPayloadBytes = 0;
+		}
+
+		bool isOpened() const {
+			return m_header != NULL;
+		}
+
+		const char* getLastErrorName() const {
+			return m_lastErrorName.c_str();
+		}
+
+		const RecordingHeader* header() const {
+			return m_header;
+		}
+
+		const RecordingIndexEntry* entries() const {
+			return m_entries;
+		}
+
+		int count() const {
+			return m_count;
+		}
+
+		UINT32 getWidth() const {
+			return m_header ? m_header->width : 0;
+		}
+
+		UINT32 getHeight() const {
+			return m_header ? m_header->height : 0;
+		}
+
+		// Size of the largest payload, what a transfer buffer must hold
+		UINT32 getMaxPayloadBytes() const {
+			return m_maxPayloadBytes;
+		}
+
+		PUINT8 payload(int entry) const {
+			return (PUINT8)(m_dataFile.data() + m_entries[entry].offset);
+		}
+
+		// Index entry of a recorded frame, -1 if it was dropped or is outside the recording
+		int findFrame(long long frameNo) const {
+			if (frameNo < m_firstFrameNo || frameNo - m_firstFrameNo >= (long long)m_lookup.size())
+				return -1;
+			return m_lookup[size_t(frameNo - m_firstFrameNo)];
+		}
+	};
+
+	class PUCLib_Playback {
+		RecordingFile m_recording;
+		const RecordingIndexEntry* m_entries = NULL;	// of m_recording
+		int m_count = 0;
+		UINT32 nWidth = 0, nHeight = 0;
+		UINT32 nBlockCountX = 0, nBlockCountY = 0;
+		USHORT q[PUC_Q_COUNT];
+		int m_numDecodeThreads = 4;
+		CaptureSource* m_source = getDefaultCaptureSource();
+		std::string m_lastErrorName;
+
+		PUCLib_WrapperImageListener* listener = nullptr;
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		bool m_stop = false;
+		PlaybackPacing m_pacing = PLAYBACK_REAL_TIME;
+		double m_speed = 1.0;
+		bool m_loop = false;
+		int m_position = 0;				// next entry to play
+		bool m_deliverPending = false;	// a step or seek waiting to be handed to the listener
+		int m_anchorEntry = 0;			// real time pacing: entry due at m_anchorTime
+		long long m_anchorTime = 0;
+		std::atomic<int> m_current{ -1 };	// entry played last, what read returns
+		std::atomic<UINT64> m_played{ 0 };
+		std::atomic<UINT64> m_skipped{ 0 };
+
+		// Buffers of the consumer thread (read, readProxy) and of the listener
+		std::vector<UINT8> m_readBuffer[2];
+		int m_readEntry[2] = { -1, -1 };
+		std::vector<UINT8> m_listenerBuffer;
+
+		static long long getTimestamp() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		UINT32 rowBytes() const {
+			return (UINT32)BufferArena::alignRow(nWidth);
+		}
+
+		PUINT8 payload(int entry) const {
+			return m_recording.payload(entry);
+		}
+
+		PUCRESULT decodeEntry(int entry, UINT8* dst, UINT32 dstRowBytes) {
+			return m_source->decodeDataMultiThread(dst, 0, 0, nWidth, nHeight, dstRowBytes, payload(entry), q, m_numDecodeThreads);
+		}
+
+		// Called under m_mutex: restarts real time pacing at entry
+		void anchor(int entry) {
+			m_anchorEntry = entry;
+			m_anchorTime = getTimestamp();
+		}
+
+		long long dueTime(int entry) const {
+			return m_anchorTime + (long long)(double(m_entries[entry].timestamp - m_entries[m_anchorEntry].timestamp) / m_speed);
+		}
+
+		// Called with lock held, hands entry to the listener without holding it
+		void deliver(std::unique_lock<std::mutex>& lock, int entry) {
+			PUCLib_WrapperImageListener* target = listener;
+			if (target == nullptr)
+				return;
+			lock.unlock();
+			if (PUC_CHK_SUCCEEDED(decodeEntry(entry, m_listenerBuffer.data(), rowBytes())))
+				target->imageReady(m_listenerBuffer.data(), nWidth, nHeight, rowBytes(), m_entries[entry].sequenceNo);
+			lock.lock();
+		}
+
+		void play() {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stop) {
+				if (m_deliverPending) {
+					// A seek or step made a frame current, the listener sees it before pacing goes on
+					m_deliverPending = false;
+					deliver(lock, m_current.load(std::memory_order_relaxed));
+					continue;
+				}
+				// Stepped playback, and as fast as possible without a listener (paced by read), only move on request
+				bool paced = m_pacing == PLAYBACK_REAL_TIME || (m_pacing == PLAYBACK_AS_FAST_AS_POSSIBLE && listener != nullptr);
+				if (!paced) {
+					m_wake.wait(lock);
+					continue;
+				}
+				if (m_position >= m_count) {
+					if (!m_loop) {
+						m_wake.wait(lock);
+						continue;
+					}
+					m_position = 0;
+					anchor(0);
+				}
+				if (m_pacing == PLAYBACK_REAL_TIME) {
+					long long now = getTimestamp();
+					long long due = dueTime(m_position);
+					if (now < due) {
+						m_wake.wait_for(lock, std::chrono::nanoseconds(due - now));
+						continue;
+					}
+					// Like the camera, a slow consumer gets the latest frame rather than a growing backlog
+					while (m_position + 1 < m_count && dueTime(m_position + 1) <= now) {
+						m_position++;
+						m_skipped.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+				int entry = m_position++;
+				m_current.store(entry, std::memory_order_release);
+				m_played.fetch_add(1, std::memory_order_relaxed);
+				deliver(lock, entry);
+			}
+		}
+
+		// Consumer side: the entry read and readInto return, advancing first when paced by the reads
+		int consumeEntry() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			if (m_pacing == PLAYBACK_AS_FAST_AS_POSSIBLE && listener == nullptr) {
+				if (m_position >= m_count && m_loop)
+					m_position = 0;
+				if (m_position < m_count) {
+					m_current.store(m_position++, std::memory_order_release);
+					m_played.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			return m_current.load(std::memory_order_acquire);
+		}
+
+	public:
+		~PUCLib_Playback() {
+			close();
+		}
+
+		/*!
+			@~english
+				@brief Opens a recording and starts playing it
+				@details A payload cut short at the end of the data file is dropped. The recording is rejected (PUC_ERROR_XFER_DATA_INVALID_HEADER)
+					if any other index entry points outside the data file or does not follow the frame number of the previous one.
+				@param[in] path Data file given to PUCLib_Wrapper::startRecording, the index is read from path + ".idx"
+				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
+			@~japanese
+				@brief 記録を開き、再生を開始します。
+				@details データファイルの末尾で途切れた圧縮データは除外されます。その他のインデックスの項目がデータファイルの外を指す場合、
+					またはフレーム番号が直前の項目に続かない場合は記録を拒否します（PUC_ERROR_XFER_DATA_INVALID_HEADER）。
+				@param[in] path PUCLib_Wrapper::startRecordingに指定したデータファイル。インデックスはpath + ".idx"から読み込みます
+				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
+		*/
+		PUCRESULT open(const char* path) {
+			close();
+			if (m_source == NULL) {
+				m_lastErrorName = "no capture source";
+				return PUC_ERROR_MODULE_LOAD;
+			}
+			PUCRESULT result = m_recording.open(path);
+			if (PUC_CHK_FAILED(result)) {
+				m_lastErrorName = m_recording.getLastErrorName();
+				return result;
+			}
+			const RecordingHeader* header = m_recording.header();
+			m_entries = m_recording.entries();
+			m_count = m_recording.count();
+
+			nWidth = header->width;
+			nHeight = header->height;
+			nBlockCountX = (nWidth + 7) / 8;
+			nBlockCountY = (nHeight + 7) / 8;
+			memcpy(q, header->quantization, sizeof(q));
+
+			m_readBuffer[0].resize(size_t(rowBytes()) * nHeight);
+			m_readBuffer[1].resize(size_t(nBlockCountX) * nBlockCountY);
+			m_readEntry[0] = m_readEntry[1] = -1;
+			m_listenerBuffer.resize(size_t(rowBytes()) * nHeight);
+			m_position = 0;
+			m_current.store(-1, std::memory_order_relaxed);
+			m_played.store(0, std::memory_order_relaxed);
+			m_skipped.store(0, std::memory_order_relaxed);
+			m_deliverPending = false;
+			m_stop = false;
+			anchor(0);
+			m_thread = std::thread(&PUCLib_Playback::play, this);
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT close() {
+			if (m_thread.joinable()) {
+				{
+					std::lock_guard<std::mutex> guard(m_mutex);
+					m_stop = true;
+				}
+				m_wake.notify_all();
+				m_thread.join();
+			}
+			m_recording.close();
+			m_entries = NULL;
+			m_count = 0;
+			return PUC_SUCCEEDED;
+		}
+
+		bool isOpened() const {
+			return m_recording.isOpened();
+		}
+
+		const char* getLastErrorName() const {
+			return m_lastErrorName.c_str();
+		}
+
+		void addListener(PUCLib_WrapperImageListener* listener) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				this->listener = listener;
+			}
+			m_wake.notify_all();
+		}
+
+		/*!
+			@~english
+				@brief Selects how frames advance
+				@param[in] pacing PLAYBACK_REAL_TIME, PLAYBACK_AS_FAST_AS_POSSIBLE or PLAYBACK_STEPPED
+				@param[in] speed Real time pacing only: 2.0 plays twice as fast as recorded
+			@~japanese
+				@brief フレームの進め方を選択します。
+				@param[in] pacing PLAYBACK_REAL_TIME、PLAYBACK_AS_FAST_AS_POSSIBLE、PLAYBACK_STEPPEDのいずれか
+				@param[in] speed 実時間再生のみ。2.0で記録の2倍の速さで再生します
+		*/
+		void setPacing(PlaybackPacing pacing, double speed = 1.0) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_pacing = pacing;
+				m_speed = speed > 0 ? speed : 1.0;
+				if (m_position < m_count)
+					anchor(m_position);
+			}
+			m_wake.notify_all();
+		}
+
+		// Starts again from the first frame after the last one
+		void setLoop(bool loop) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_loop = loop;
+			}
+			m_wake.notify_all();
+		}
+
+		void setNumDecodeThreads(int num) {
+			m_numDecodeThreads = num > 0 ? num : 1;
+		}
+
+		// Decodes the payloads, PUCLIB by default. A recording of a synthetic device needs its SyntheticSource. Call before open.
+		void setCaptureSource(CaptureSource* source) {
+			m_source = source;
+		}
+
+		/*!
+			@~english
+				@brief Moves to a frame in constant time
+				@details The frame becomes the current one (read returns it) and playback continues after it. Real time pacing starts over
+					from it, a stepped playback hands it to the listener.
+				@param[in] frameNo Unwrapped sequence number of a recorded frame
+				@return False if the frame is not in the recording
+			@~japanese
+				@brief 一定時間で指定フレームに移動します。
+				@details 指定フレームが現在のフレームになり（readが返します）、再生はその次から続きます。実時間再生はそのフレームから
+					再開し、ステップ再生ではリスナーに渡されます。
+				@param[in] frameNo 記録されたフレームの拡張シーケンス番号
+				@return 記録にないフレームの場合は偽(false)を返します。
+		*/
+		bool seek(long long frameNo) {
+			int entry = findFrame(frameNo);
+			if (entry < 0)
+				return false;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_current.store(entry, std::memory_order_release);
+				m_position = entry + 1;
+				anchor(entry);
+				m_deliverPending = true;
+			}
+			m_wake.notify_all();
+			return true;
+		}
+
+		// Stepped playback: moves by frames recorded frames (negative steps back), false at either end
+		bool step(int frames = 1) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				int entry = m_current.load(std::memory_order_relaxed) + frames;
+				if (entry < 0 || entry >= m_count)
+					return false;
+				m_current.store(entry, std::memory_order_release);
+				m_position = entry + 1;
+				m_deliverPending = true;
+				m_played.fetch_add(1, std::memory_order_relaxed);
+			}
+			m_wake.notify_all();
+			return true;
+		}
+
+		// Index entry of a recorded frame, -1 if it was dropped or is outside the recording
+		int findFrame(long long frameNo) const {
+			return m_recording.findFrame(frameNo);
+		}
+
+		/*!
+			@~english
+				@brief Reads the current full sized image
+				@details Decoded from the mapping on the calling thread the first time the current frame is read
+				@param[out] width of the image
+				@param[out] height of the image
+				@param[out] rowBytes, number of bytes per row
+				@return A pointer to the image buffer (do not delete it), valid until the next call. NULL before the first frame is played.
+				@note Call from one consumer thread only.
+			@~japanese
+				@brief 現在のフル画像を読み込みます。
+				@details 現在のフレームを最初に読み込んだ時に、呼び出したスレッドでマッピングからデコードされます
+				@param[out] 横解像度
+				@param[out] 縦解像度
+				@param[out] rowBytes １ラインあたりのバイト数
+				@return 画像バッファへのポインタ（デリートしないでください）。次の呼び出しまで有効です。最初のフレームの再生前はNULLを返します。
+				@note 1つのスレッドからのみ呼び出してください。
+		*/
+		unsigned char* read(int& width, int& height, int& rowBytes) {
+			if (!isOpened())
+				return NULL;
+			int entry = consumeEntry();
+			if (entry < 0)
+				return NULL;
+			if (m_readEntry[0] != entry) {
+				if (PUC_CHK_FAILED(decodeEntry(entry, m_readBuffer[0].data(), this->rowBytes())))
+					return NULL;
+				m_readEntry[0] = entry;
+			}
+			width = nWidth;
+			height = nHeight;
+			rowBytes = this->rowBytes();
+			return m_readBuffer[0].data();
+		}
+
+		// DC proxy of the current frame, (width / 8) x (height / 8) rounded up, see read
+		unsigned char* readProxy(int& width, int& height, int& rowBytes) {
+			if (!isOpened())
+				return NULL;
+			int entry = m_current.load(std::memory_order_acquire);
+			if (entry < 0)
+				return NULL;
+			if (m_readEntry[1] != entry) {
+				if (PUC_CHK_FAILED(m_source->decodeDCData(m_readBuffer[1].data(), 0, 0, nBlockCountX, nBlockCountY, payload(entry))))
+					return NULL;
+				m_readEntry[1] = entry;
+			}
+			width = nBlockCountX;
+			height = nBlockCountY;
+			rowBytes = nBlockCountX;
+			return m_readBuffer[1].data();
+		}
+
+		// Decodes the current frame straight into dst, see PUCLib_Wrapper::readInto
+		bool readInto(UINT8* dst, int rowBytes, long long* frameNo = NULL) {
+			if (!isOpened() || dst == NULL || rowBytes < (int)nWidth || rowBytes % 4 != 0)
+				return false;
+			int entry = consumeEntry();
+			if (entry < 0 || PUC_CHK_FAILED(decodeEntry(entry, dst, rowBytes)))
+				return false;
+			if (frameNo)
+				*frameNo = m_entries[entry].frameNo;
+			return true;
+		}
+
+		// Decodes any recorded frame without moving the playback, see PUCLib_Wrapper::decodeFrameAt
+		bool decodeFrameAt(long long frameNo, UINT8* dst, UINT32 rowBytes) {
+			int entry = findFrame(frameNo);
+			return entry >= 0 && PUC_CHK_SUCCEEDED(decodeEntry(entry, dst, rowBytes));
+		}
+
+		bool decodeProxyAt(long long frameNo, UINT8* dst) {
+			int entry = findFrame(frameNo);
+			return entry >= 0 && PUC_CHK_SUCCEEDED(m_source->decodeDCData(dst, 0, 0, nBlockCountX, nBlockCountY, payload(entry)));
+		}
+
+		void getResolution(int& width, int& height) {
+			width = nWidth;
+			height = nHeight;
+		}
+
+		// Frame number of the current frame, -1 before the first one is played
+		long long getFrameNo() const {
+			int entry = m_current.load(std::memory_order_acquire);
+			return entry < 0 ? -1 : m_entries[entry].frameNo;
+		}
+
+		USHORT getSequenceNumber() const {
+			int entry = m_current.load(std::memory_order_acquire);
+			return entry < 0 ? 0 : m_entries[entry].sequenceNo;
+		}
+
+		// Recorded arrival time (ns, steady clock of the recording process) of the current frame
+		long long getTimestamp(long long frameNo) const {
+			int entry = findFrame(frameNo);
+			return entry < 0 ? 0 : m_entries[entry].timestamp;
+		}
+
+		long long getFirstFrameNo() const {
+			return m_count ? m_entries[0].frameNo : -1;
+		}
+
+		long long getLastFrameNo() const {
+			return m_count ? m_entries[m_count - 1].frameNo : -1;
+		}
+
+		int getFrameCount() const {
+			return m_count;
+		}
+
+		// True once the last frame was played and looping is off
+		bool isFinished() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_position >= m_count && !m_loop;
+		}
+
+		// Frames made current so far, and frames real time pacing passed over because the consumer was late
+		UINT64 getPlayedCount() const {
+			return m_played.load(std::memory_order_relaxed);
+		}
+
+		UINT64 getSkippedCount() const {
+			return m_skipped.load(std::memory_order_relaxed);
+		}
+	};
+
+	/*!
+		@~english
+			@brief Device backend that replays a recording through the transfer callback
+			@details Give it to PUCLib_Wrapper::setCaptureSource (or VideoCapture::setCaptureSource) and the wrapper runs on the recording as
+				on the camera: the payloads go through receive, the decode workers, the pools, the listeners and the subscriptions, so every
+				read and subscription path can be tested and benchmarked on recorded data. Each payload is handed to the callback straight from
+				the mapping with its recorded sequence number. The device has the recorded resolution only, set it on the wrapper before open
+				(getRecording().getWidth() and getHeight()). The frame rate and exposure are stored and reported, the pacing decides when frames
+				are sent. endXferData keeps the position, so a paused wrapper resumes where it stopped.
+		@~japanese
+			@brief 記録を転送コールバックで再生するデバイスバックエンド
+			@details PUCLib_Wrapper::setCaptureSource（またはVideoCapture::setCaptureSource）に指定すると、ラッパはカメラと同様に記録上で動作します。
+				圧縮データはreceive、デコードワーカ、プール、リスナー、購読を通るため、読み出しと購読のすべての経路を記録したデータで
+				テストおよびベンチマークできます。各圧縮データは記録されたシーケンス番号とともにマッピングから直接コールバックに渡されます。
+				デバイスの解像度は記録の解像度のみのため、オープン前にラッパに設定してください（getRecording().getWidth()とgetHeight()）。
+				フレームレートと露光は保存して報告するのみで、フレームを送るタイミングは再生方法で決まります。endXferDataは位置を保持するため、
+				一時停止したラッパは停止した位置から再開します。
+	*/
+	class PlaybackSource : public CaptureSource {
+		RecordingFile m_recording;
+		CaptureSource* m_decoder = getDefaultCaptureSource();
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		bool m_open = false;
+		bool m_xferring = false;
+		UINT32 m_frameRate = 1000, m_shutterSpeedFps = 1000;
+		UINT32 m_exposeOnTime = 0, m_exposeOffTime = 0;
+		UINT32 m_singleTimeoutMs = 1000;
+		std::thread m_thread;
+		bool m_stop = false;
+
+		PlaybackPacing m_pacing = PLAYBACK_REAL_TIME;
+		double m_speed = 1.0;
+		bool m_loop = false;
+		int m_position = 0;				// next entry to send
+		int m_steps = 0;				// stepped pacing: entries step released and not sent yet
+		int m_anchorEntry = 0;			// real time pacing: entry due at m_anchorTime
+		long long m_anchorTime = 0;
+		std::atomic<UINT64> m_sent{ 0 };
+		std::atomic<UINT64> m_skipped{ 0 };
+
+		static long long getTimestamp() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		PUCRESULT check(PUC_HANDLE hDevice) const {
+			if (hDevice != (PUC_HANDLE)this)
+				return PUC_ERROR_ILLEGAL_DEVICE_HANDLE;
+			return m_open ? PUC_SUCCEEDED : PUC_ERROR_DEVICE_NOTOPEN;
+		}
+
+		// Called under m_mutex: restarts real time pacing at entry
+		void anchor(int entry) {
+			m_anchorEntry = entry;
+			m_anchorTime = getTimestamp();
+		}
+
+		long long dueTime(int entry) const {
+			const RecordingIndexEntry* entries = m_recording.entries();
+			return m_anchorTime + (long long)(double(entries[entry].timestamp - entries[m_anchorEntry].timestamp) / m_speed);
+		}
+
+		// Called under m_mutex: waits until the pacing releases the next entry, -1 once stopped or at deadline (0 waits indefinitely)
+		int nextEntry(std::unique_lock<std::mutex>& lock, long long deadline) {
+			int count = m_recording.count();
+			while (!m_stop) {
+				long long now = getTimestamp();
+				if (deadline > 0 && now >= deadline)
+					return -1;
+				std::chrono::nanoseconds limit(deadline > 0 ? deadline - now : 0);
+				if (m_position >= count) {
+					if (!m_loop) {
+						if (deadline > 0)
+							m_wake.wait_for(lock, limit);
+						else
+							m_wake.wait(lock);
+						continue;
+					}
+					// The sequence numbers jump back to the first frame, the wrapper counts the jump like a gap
+					m_position = 0;
+					anchor(0);
+				}
+				if (m_pacing == PLAYBACK_STEPPED) {
+					if (m_steps == 0) {
+						if (deadline > 0)
+							m_wake.wait_for(lock, limit);
+						else
+							m_wake.wait(lock);
+						continue;
+					}
+					m_steps--;
+				}
+				else if (m_pacing == PLAYBACK_REAL_TIME) {
+					long long due = dueTime(m_position);
+					if (now < due) {
+						m_wake.wait_for(lock, std::chrono::nanoseconds(deadline > 0 && deadline < due ? deadline - now : due - now));
+						continue;
+					}
+					// Like the camera, a late callback loses frames rather than building a backlog
+					while (m_position + 1 < count && dueTime(m_position + 1) <= now) {
+						m_position++;
+						m_skipped.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+				m_sent.fetch_add(1, std::memory_order_relaxed);
+				return m_position++;
+			}
+			return -1;
+		}
+
+		void transferLoop(RECIEVE_CALLBACK callback, void* arg) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (;;) {
+				int entry = nextEntry(lock, 0);
+				if (entry < 0)
+					return;
+				PUC_XFER_DATA_INFO info;
+				info.pData = m_recording.payload(entry);
+				info.nDataSize = m_recording.entries()[entry].size;
+				info.nSequenceNo = m_recording.entries()[entry].sequenceNo;
+				lock.unlock();
+				callback(&info, arg);
+				lock.lock();
+			}
+		}
+
+	public:
+		~PlaybackSource() {
+			if (m_open)
+				closeDevice((PUC_HANDLE)this);
+		}
+
+		/*!
+			@~english
+				@brief Loads the recording to replay
+				@details Call before the wrapper opens the device. Playback starts at the first frame.
+				@param[in] path Data file given to PUCLib_Wrapper::startRecording, see RecordingFile::open
+				@return If successful, PUC_SUCCEEDED will be returned. PUC_ERROR_DEVICE_OPEN while the device is open.
+			@~japanese
+				@brief 再生する記録を読み込みます。
+				@details ラッパがデバイスをオープンする前に呼び出してください。再生は最初のフレームから始まります。
+				@param[in] path PUCLib_Wrapper::startRecordingに指定したデータファイル。RecordingFile::open参照
+				@return 成功時はPUC_SUCCEEDED、デバイスがオープン中の場合はPUC_ERROR_DEVICE_OPENが返ります。
+		*/
+		PUCRESULT open(const char* path) {
+			if (m_open)
+				return PUC_ERROR_DEVICE_OPEN;
+			PUCRESULT result = m_recording.open(path);
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_position = 0;
+			m_steps = 0;
+			anchor(0);
+			return result;
+		}
+
+		// Unloads the recording, PUC_ERROR_DEVICE_OPEN while the device is open
+		PUCRESULT close() {
+			if (m_open)
+				return PUC_ERROR_DEVICE_OPEN;
+			m_recording.close();
+			return PUC_SUCCEEDED;
+		}
+
+		const RecordingFile& getRecording() const {
+			return m_recording;
+		}
+
+		const char* getLastErrorName() const {
+			return m_recording.getLastErrorName();
+		}
+
+		// Extracts sequence numbers and decodes the payloads, PUCLIB by default. A recording of a synthetic device needs a SyntheticSource.
+		// Call before PUCLib_Wrapper::setCaptureSource, which initializes it.
+		void setDecoder(CaptureSource* decoder) {
+			m_decoder = decoder;
+		}
+
+		/*!
+			@~english
+				@brief Selects when frames are sent, also during a transfer
+				@param[in] pacing PLAYBACK_REAL_TIME (late frames are skipped), PLAYBACK_AS_FAST_AS_POSSIBLE (the next frame as soon as the
+					callback returns) or PLAYBACK_STEPPED (one frame per step)
+				@param[in] speed Real time pacing only: 2.0 plays twice as fast as recorded
+			@~japanese
+				@brief フレームを送るタイミングを選択します。転送中も変更できます。
+				@param[in] pacing PLAYBACK_REAL_TIME（遅れたフレームはスキップ）、PLAYBACK_AS_FAST_AS_POSSIBLE（コールバックが戻るとすぐに次のフレーム）、
+					PLAYBACK_STEPPED（stepごとに1フレーム）のいずれか
+				@param[in] speed 実時間再生のみ。2.0で記録の2倍の速さで再生します
+		*/
+		void setPacing(PlaybackPacing pacing, double speed = 1.0) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_pacing = pacing;
+				m_speed = speed > 0 ? speed : 1.0;
+				if (m_position < m_recording.count())
+					anchor(m_position);
+			}
+			m_wake.notify_all();
+		}
+
+		// Starts again from the first frame after the last one
+		void setLoop(bool loop) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_loop = loop;
+			}
+			m_wake.notify_all();
+		}
+
+		// Stepped pacing: sends the next frames recorded frames, use seek to go back
+		void step(int frames = 1) {
+			if (frames <= 0)
+				return;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_steps += frames;
+			}
+			m_wake.notify_all();
+		}
+
+		// Continues the playback at a recorded frame, false if it is not in the recording
+		bool seek(long long frameNo) {
+			int entry = m_recording.findFrame(frameNo);
+			if (entry < 0)
+				return false;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_position = entry;
+				anchor(entry);
+			}
+			m_wake.notify_all();
+			return true;
+		}
+
+		// True once the last frame was sent and looping is off
+		bool isFinished() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_position >= m_recording.count() && !m_loop;
+		}
+
+		// Frames sent so far, and frames real time pacing passed over because the callback was late
+		UINT64 getSentCount() const {
+			return m_sent.load(std::memory_order_relaxed);
+		}
+
+		UINT64 getSkippedCount() const {
+			return m_skipped.load(std::memory_order_relaxed);
+		}
+
+		PUCRESULT initialize() {
+			if (m_decoder == NULL)
+				return PUC_ERROR_MODULE_LOAD;
+			return m_decoder->initialize();
+		}
+
+		// One device while a recording is loaded
+		PUCRESULT detectDevice(PPUC_DETECT_INFO pDetectInfo) {
+			if (pDetectInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			memset(pDetectInfo, 0, sizeof(*pDetectInfo));
+			pDetectInfo->nDeviceCount = m_recording.isOpened() ? 1 : 0;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT openDevice(UINT32 nDeviceNo, PPUC_HANDLE pDeviceHandle) {
+			if (pDeviceHandle == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (nDeviceNo != 0 || !m_recording.isOpened())
+				return PUC_ERROR_NOT_EXIST_DEVICE_NO;
+			if (m_decoder == NULL)
+				return PUC_ERROR_MODULE_LOAD;
+			if (m_open)
+				closeDevice((PUC_HANDLE)this);
+			m_open = true;
+			*pDeviceHandle = (PUC_HANDLE)this;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT closeDevice(PUC_HANDLE hDevice) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			endXferData(hDevice);
+			m_open = false;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getResolution(PUC_HANDLE hDevice, UINT32* pWidth, UINT32* pHeight) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pWidth == NULL || pHeight == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			*pWidth = m_recording.getWidth();
+			*pHeight = m_recording.getHeight();
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getResolutionLimit(PUC_HANDLE hDevice, PPUC_RESO_LIMIT_INFO pLimitInfo) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pLimitInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			pLimitInfo->nMaxWidth = pLimitInfo->nMinWidth = pLimitInfo->nUnitWidth = m_recording.getWidth();
+			pLimitInfo->nMaxHeight = pLimitInfo->nMinHeight = pLimitInfo->nUnitHeight = m_recording.getHeight();
+			return PUC_SUCCEEDED;
+		}
+
+		// Only the recorded resolution
+		PUCRESULT setResolution(PUC_HANDLE hDevice, UINT32 nWidth, UINT32 nHeight) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (nWidth != m_recording.getWidth() || nHeight != m_recording.getHeight())
+				return PUC_ERROR_ILLEGAL_RESOLUTION;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT* pVal) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pVal == NULL || nPoint >= PUC_Q_COUNT)
+				return PUC_ERROR_ILLEGAL_ARG;
+			*pVal = m_recording.header()->quantization[nPoint];
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getFramerateShutter(PUC_HANDLE hDevice, UINT32* pFramerate, UINT32* pShutterSpeedFps) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pFramerate == NULL || pShutterSpeedFps == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			*pFramerate = m_frameRate;
+			*pShutterSpeedFps = m_shutterSpeedFps;
+			return PUC_SUCCEEDED;
+		}
+
+		// Stored and reported only, the pacing decides when frames are sent
+		PUCRESULT setFramerateShutter(PUC_HANDLE hDevice, UINT32 nFramerate, UINT32 nShutterSpeedFps) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (nFramerate == 0 || nShutterSpeedFps < nFramerate)
+				return PUC_ERROR_ILLEGAL_FRAME_RATE;
+			m_frameRate = nFramerate;
+			m_shutterSpeedFps = nShutterSpeedFps;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getFramerateLimit(PUC_HANDLE hDevice, PPUC_FRAMERATE_LIMIT_INFO pLimitInfo) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pLimitInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			pLimitInfo->nMinFrameRate = 1;
+			pLimitInfo->nMaxFrameRate = 0xFFFFFFFF;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT setExposeTime(PUC_HANDLE hDevice, UINT32 nExpOnTime, UINT32 nExpOffTime) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			m_exposeOnTime = nExpOnTime;
+			m_exposeOffTime = nExpOffTime;
+			return PUC_SUCCEEDED;
+		}
+
+		// The single transfer timeout bounds how long getSingleXferData waits for the pacing
+		PUCRESULT setXferTimeOut(PUC_HANDLE hDevice, UINT32 nSingleXferTimeOut, UINT32 nContinuousXferTimeOut) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			m_singleTimeoutMs = nSingleXferTimeOut > 0 ? nSingleXferTimeOut : 1;
+			return PUC_SUCCEEDED;
+		}
+
+		// The recording holds compressed payloads only
+		PUCRESULT setXferDataMode(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			return nDataMode == PUC_DATA_COMPRESSED ? PUC_SUCCEEDED : PUC_ERROR_NOTSUPPORT;
+		}
+
+		PUCRESULT getXferDataSize(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode, UINT32* pDataSize) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pDataSize == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (nDataMode != PUC_DATA_COMPRESSED)
+				return PUC_ERROR_NOTSUPPORT;
+			*pDataSize = m_recording.getMaxPayloadBytes();
+			return PUC_SUCCEEDED;
+		}
+
+		// Copies the next frame the pacing releases, pXferData->pData must hold getXferDataSize bytes
+		PUCRESULT getSingleXferData(PUC_HANDLE hDevice, PPUC_XFER_DATA_INFO pXferData) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pXferData == NULL || pXferData->pData == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = false;
+			int entry = nextEntry(lock, getTimestamp() + (long long)m_singleTimeoutMs * 1000000);
+			if (entry < 0)
+				return PUC_ERROR_XFER_DATA_WAIT;
+			const RecordingIndexEntry& recorded = m_recording.entries()[entry];
+			memcpy(pXferData->pData, m_recording.payload(entry), recorded.size);
+			pXferData->nDataSize = recorded.size;
+			pXferData->nSequenceNo = recorded.sequenceNo;
+			return PUC_SUCCEEDED;
+		}
+
+		// Starts a thread that calls callback as the pacing releases frames, each payload is only valid during its call
+		PUCRESULT beginXferData(PUC_HANDLE hDevice, RECIEVE_CALLBACK callback, void* arg) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (callback == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_stop = false;
+			if (m_position < m_recording.count())
+				anchor(m_position);
+			m_thread = std::thread(&PlaybackSource::transferLoop, this, callback, arg);
+			m_xferring = true;
+			return PUC_SUCCEEDED;
+		}
+
+		// Keeps the position, the next transfer continues after the last frame sent
+		PUCRESULT endXferData(PUC_HANDLE hDevice) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (!m_xferring)
+				return PUC_SUCCEEDED;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			m_thread.join();
+			m_xferring = false;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT extractSequenceNo(const PUCHAR pData, UINT32 nWidth, UINT32 nHeight, PUSHORT pSeqNo) {
+			return m_decoder->extractSequenceNo(pData, nWidth, nHeight, pSeqNo);
+		}
+
+		PUCRESULT decodeData(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			return m_decoder->decodeData(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals);
+		}
+
+		PUCRESULT decodeDataMultiThread(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals, UINT32 nThreadCount) {
+			return m_decoder->decodeDataMultiThread(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals, nThreadCount);
+		}
+
+		PUCRESULT decodeDCTData(PINT16 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			return m_decoder->decodeDCTData(pDst, nX, nY, nWidth, nHeight, nLineBytes, pSrc, pQVals);
+		}
+
+		PUCRESULT decodeDCData(PUINT8 pDst, UINT32 nBlockX, UINT32 nBlockY, UINT32 nBlockCountX, UINT32 nBlockCountY, const PUINT8 pSrc) {
+			return m_decoder->decodeDCData(pDst, nBlockX, nBlockY, nBlockCountX, nBlockCountY, pSrc);
+		}
+	};
+
+}
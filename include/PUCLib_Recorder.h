@@ -0,0 +1,500 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Records the compressed payloads of the transfer to disk at full camera rate
+		@details See PUCLib_Wrapper::startRecording. The transfer callback only copies each payload into a preallocated write-behind ring,
+			a writer thread flushes the ring in large aligned chunks with unbuffered I/O (FILE_FLAG_NO_BUFFERING with overlapped writes on
+			Windows, O_DIRECT elsewhere), so the page cache is bypassed and the callback never waits for the disk. When the disk cannot keep
+			up and the ring is full, payloads are dropped and counted instead.
+			A recording is two files: the data file holds a RecordingHeader (geometry and quantization tables, everything needed to decode)
+			followed by the payloads, the index file (path + ".idx") holds one RecordingIndexEntry per payload.
+	@~japanese
+		@brief 転送された圧縮データをカメラのフレームレートのままディスクに記録します
+		@details PUCLib_Wrapper::startRecordingを参照してください。転送コールバックは各圧縮データを事前に確保したライトビハインドリングに
+			コピーするだけで、書き込みスレッドがリングを大きな整列済みチャンク単位でバッファなしI/O（WindowsではFILE_FLAG_NO_BUFFERINGと
+			オーバーラップ書き込み、それ以外ではO_DIRECT）により書き出します。ページキャッシュを経由せず、コールバックがディスクを待つことは
+			ありません。ディスクが追いつかずリングが一杯の場合、圧縮データは破棄され、その数が記録されます。
+			記録は2つのファイルからなります。データファイルはRecordingHeader（デコードに必要な解像度と量子化テーブル）と圧縮データ、
+			インデックスファイル（パス + ".idx"）は圧縮データごとに1つのRecordingIndexEntryを保持します。
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace photron {
+
+	enum {
+		RECORDING_MAGIC = 0x43455250,		// "PREC"
+		RECORDING_INDEX_MAGIC = 0x58444950,	// "PIDX"
+		RECORDING_VERSION = 1,
+		RECORDING_HEADER_BYTES = 4096,		// payloads start on a sector boundary
+		RECORDING_ALIGNMENT = 64,			// payload offsets are aligned like the payload ring of the wrapper
+		RECORDING_QUANTIZATION_COUNT = 64	// PUC_Q_COUNT
+	};
+
+	// First RECORDING_HEADER_BYTES of the data file
+	struct RecordingHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t headerBytes;
+		uint32_t width;
+		uint32_t height;
+		uint32_t quantizationCount;
+		uint16_t quantization[RECORDING_QUANTIZATION_COUNT];
+		int64_t startTimestamp;		// steady clock (ns) when the recording started
+	};
+
+	// Index file: a RecordingIndexHeader followed by one entry per payload, in arrival order
+	struct RecordingIndexHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t entryBytes;
+		uint32_t reserved;
+	};
+
+	struct RecordingIndexEntry {
+		int64_t frameNo;		// unwrapped sequence number
+		int64_t timestamp;		// steady clock (ns) when the payload arrived
+		uint64_t offset;		// in the data file
+		uint32_t size;
+		uint16_t sequenceNo;	// as sent by the device
+		uint16_t reserved;
+	};
+	static_assert(sizeof(RecordingIndexEntry) == 32, "RecordingIndexEntry must stay 32 bytes");
+
+	struct RecorderStats {
+		uint64_t frames = 0;			// payloads recorded
+		uint64_t dropped = 0;			// payloads lost to a full write-behind ring
+		uint64_t bytes = 0;				// payload bytes recorded, including alignment
+		uint64_t writtenBytes = 0;		// bytes on disk
+		uint64_t maxBufferedBytes = 0;	// highest fill of the ring
+		uint64_t writeErrors = 0;
+	};
+
+	class PayloadRecorder {
+	public:
+		enum {
+			CHUNK_BYTES = 1 << 20,	// unit of the disk writes, a multiple of every sector size
+			SECTOR_BYTES = 4096,	// the last chunk is padded to this
+			MAX_PENDING_WRITES = 4
+		};
+
+	private:
+		uint8_t* m_buffer = NULL;
+		size_t m_capacity = 0;
+		RecordingIndexEntry* m_entries = NULL;
+		uint32_t m_entryCapacity = 0;
+		RecordingHeader* m_header = NULL;	// sector aligned, written with the same unbuffered handle
+
+		// Producer (transfer callback) side
+		uint64_t m_position = 0;
+		std::atomic<uint64_t> m_committed{ 0 };		// stream bytes the writer may flush
+		std::atomic<uint64_t> m_entryHead{ 0 };
+		// Writer side
+		std::atomic<uint64_t> m_released{ 0 };		// stream bytes on disk, the producer may reuse the ring up to m_released + capacity
+		std::atomic<uint64_t> m_entryTail{ 0 };
+
+		std::atomic<bool> m_accepting{ false };
+		std::atomic<bool> m_appending{ false };
+		std::atomic<bool> m_stopping{ false };
+		std::mutex m_wakeMutex;
+		std::condition_variable m_wake;
+		std::thread m_writer;
+
+		std::atomic<uint64_t> m_frames{ 0 };
+		std::atomic<uint64_t> m_dropped{ 0 };
+		std::atomic<uint64_t> m_writtenBytes{ 0 };
+		std::atomic<uint64_t> m_maxBuffered{ 0 };
+		std::atomic<uint64_t> m_writeErrors{ 0 };
+
+		FILE* m_index = NULL;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		struct PendingWrite {
+			OVERLAPPED overlapped;
+			uint64_t end;
+		};
+		PendingWrite m_pending[MAX_PENDING_WRITES];
+		HANDLE m_events[MAX_PENDING_WRITES] = {};
+#else
+		int m_file = -1;
+#endif
+		int m_pendingHead = 0;
+		int m_pendingCount = 0;
+
+		static void* allocateAligned(size_t bytes) {
+#ifdef _WIN32
+			return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+			void* p = NULL;
+			return posix_memalign(&p, SECTOR_BYTES, bytes) == 0 ? p : NULL;
+#endif
+		}
+
+		static void freeAligned(void* p) {
+			if (p == NULL)
+				return;
+#ifdef _WIN32
+			VirtualFree(p, 0, MEM_RELEASE);
+#else
+			free(p);
+#endif
+		}
+
+		bool openFile(const char* path) {
+#ifdef _WIN32
+			m_file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED, NULL);
+			if (m_file == INVALID_HANDLE_VALUE)
+				return false;
+			for (int i = 0; i < MAX_PENDING_WRITES; i++)
+				m_events[i] = CreateEventA(NULL, TRUE, FALSE, NULL);
+			return true;
+#else
+			m_file = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+			if (m_file < 0 && errno == EINVAL)	// file systems without direct I/O, tmpfs for one
+				m_file = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			return m_file >= 0;
+#endif
+		}
+
+		void closeFile(uint64_t size) {
+#ifdef _WIN32
+			if (m_file != INVALID_HANDLE_VALUE) {
+				// The last write was padded to a sector, cut the file back to its payloads
+				LARGE_INTEGER end;
+				end.QuadPart = (LONGLONG)size;
+				SetFilePointerEx(m_file, end, NULL, FILE_BEGIN);
+				SetEndOfFile(m_file);
+				CloseHandle(m_file);
+			}
+			for (int i = 0; i < MAX_PENDING_WRITES; i++) {
+				if (m_events[i])
+					CloseHandle(m_events[i]);
+				m_events[i] = NULL;
+			}
+			m_file = INVALID_HANDLE_VALUE;
+#else
+			if (m_file >= 0) {
+				if (ftruncate(m_file, (off_t)size) != 0)
+					m_writeErrors++;
+				::close(m_file);
+			}
+			m_file = -1;
+#endif
+		}
+
+		// Starts writing bytes of the ring at file offset, completion is collected in order by completeWrite
+		bool beginWrite(const uint8_t* data, uint32_t bytes, uint64_t offset, uint64_t end) {
+#ifdef _WIN32
+			int index = (m_pendingHead + m_pendingCount) % MAX_PENDING_WRITES;
+			PendingWrite& pending = m_pending[index];
+			memset(&pending.overlapped, 0, sizeof(pending.overlapped));
+			pending.overlapped.Offset = DWORD(offset);
+			pending.overlapped.OffsetHigh = DWORD(offset >> 32);
+			pending.overlapped.hEvent = m_events[index];
+			pending.end = end;
+			if (!WriteFile(m_file, data, bytes, NULL, &pending.overlapped) && GetLastError() != ERROR_IO_PENDING)
+				return false;
+			m_pendingCount++;
+			return true;
+#else
+			// Synchronous on the writer thread, the write-behind ring keeps the callback away from it
+			const uint8_t* p = data;
+			uint32_t left = bytes;
+			while (left > 0) {
+				ssize_t n = pwrite(m_file, p, left, (off_t)offset);
+				if (n <= 0) {
+					if (n < 0 && errno == EINTR)
+						continue;
+					return false;
+				}
+				p += n;
+				offset += n;
+				left -= (uint32_t)n;
+			}
+			m_released.store(end, std::memory_order_release);
+			return true;
+#endif
+		}
+
+		// Collects the oldest outstanding write, false if wait is false and it is still running
+		bool completeWrite(bool wait) {
+#ifdef _WIN32
+			if (m_pendingCount == 0)
+				return false;
+			PendingWrite& pending = m_pending[m_pendingHead];
+			DWORD written = 0;
+			if (!GetOverlappedResult(m_file, &pending.overlapped, &written, wait ? TRUE : FALSE)) {
+				if (GetLastError() == ERROR_IO_INCOMPLETE)
+					return false;
+				m_writeErrors++;
+			}
+			m_released.store(pending.end, std::memory_order_release);
+			m_pendingHead = (m_pendingHead + 1) % MAX_PENDING_WRITES;
+			m_pendingCount--;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// Index entries go out once their payload is on disk, so the index never points past the data
+		void writeIndex() {
+			uint64_t released = m_released.load(std::memory_order_acquire);
+			uint64_t tail = m_entryTail.load(std::memory_order_relaxed);
+			uint64_t head = m_entryHead.load(std::memory_order_acquire);
+			while (tail < head) {
+				const RecordingIndexEntry& entry = m_entries[tail % m_entryCapacity];
+				if (entry.offset - RECORDING_HEADER_BYTES + entry.size > released)
+					break;
+				if (fwrite(&entry, sizeof(entry), 1, m_index) != 1)
+					m_writeErrors++;
+				tail++;
+			}
+			m_entryTail.store(tail, std::memory_order_release);
+		}
+
+		void writerLoop() {
+			uint64_t issued = 0;
+			for (;;) {
+				bool stopping = m_stopping.load(std::memory_order_acquire);
+				uint64_t committed = m_committed.load(std::memory_order_acquire);
+				while (committed - issued >= CHUNK_BYTES && m_pendingCount < MAX_PENDING_WRITES) {
+					if (!beginWrite(m_buffer + issued % m_capacity, CHUNK_BYTES, RECORDING_HEADER_BYTES + issued, issued + CHUNK_BYTES)) {
+						m_writeErrors++;
+						m_released.store(issued + CHUNK_BYTES, std::memory_order_release);
+					}
+					issued += CHUNK_BYTES;
+				}
+				if (stopping && committed > issued && committed - issued < CHUNK_BYTES && m_pendingCount < MAX_PENDING_WRITES) {
+					// The tail never crosses the end of the ring: issued is chunk aligned and the capacity a multiple of chunks
+					uint32_t bytes = uint32_t((committed - issued + SECTOR_BYTES - 1) / SECTOR_BYTES * SECTOR_BYTES);
+					if (!beginWrite(m_buffer + issued % m_capacity, bytes, RECORDING_HEADER_BYTES + issued, committed))
+						m_writeErrors++;
+					issued = committed;
+				}
+				while (completeWrite(false))
+					;
+				writeIndex();
+				if (stopping && issued >= committed) {
+					while (completeWrite(true))
+						;
+					m_released.store(committed, std::memory_order_release);
+					writeIndex();
+					m_writtenBytes.store(committed, std::memory_order_relaxed);
+					return;
+				}
+				m_writtenBytes.store(m_released.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				if (m_pendingCount == MAX_PENDING_WRITES) {
+					completeWrite(true);
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(m_wakeMutex);
+				m_wake.wait_for(lock, std::chrono::milliseconds(2));
+			}
+		}
+
+	public:
+		~PayloadRecorder() {
+			close();
+		}
+
+		/*!
+			@~english
+				@brief Creates the data and index files and starts the writer thread
+				@param[in] path Data file, the index is written to path + ".idx"
+				@param[in] width, height Resolution of the payloads
+				@param[in] quantization Quantization tables the payloads were compressed with
+				@param[in] quantizationCount Number of tables, at most RECORDING_QUANTIZATION_COUNT
+				@param[in] bufferBytes Size of the write-behind ring, rounded up to CHUNK_BYTES
+				@param[in] timestamp Steady clock (ns) stored as the start of the recording
+				@return False if a file or the ring could not be created
+			@~japanese
+				@brief データファイルとインデックスファイルを作成し、書き込みスレッドを開始します。
+				@param[in] path データファイル。インデックスはpath + ".idx"に書き込まれます
+				@param[in] width, height 圧縮データの解像度
+				@param[in] quantization 圧縮に使用された量子化テーブル
+				@param[in] quantizationCount テーブル数。RECORDING_QUANTIZATION_COUNT以下
+				@param[in] bufferBytes ライトビハインドリングのサイズ。CHUNK_BYTESの倍数に切り上げられます
+				@param[in] timestamp 記録開始時刻として保存するsteady clock（ns）
+				@return ファイルまたはリングを作成できなかった場合は偽(false)を返します。
+		*/
+		bool open(const char* path, uint32_t width, uint32_t height, const uint16_t* quantization, int quantizationCount, size_t bufferBytes,
+			long long timestamp) {
+			close();
+			if (quantizationCount > RECORDING_QUANTIZATION_COUNT)
+				return false;
+			m_capacity = (bufferBytes + CHUNK_BYTES - 1) / CHUNK_BYTES * CHUNK_BYTES;
+			if (m_capacity < 4 * CHUNK_BYTES)
+				m_capacity = 4 * CHUNK_BYTES;
+			m_entryCapacity = uint32_t(m_capacity / 512);
+			m_buffer = (uint8_t*)allocateAligned(m_capacity);
+			m_header = (RecordingHeader*)allocateAligned(RECORDING_HEADER_BYTES);
+			m_entries = new RecordingIndexEntry[m_entryCapacity];
+			std::string indexPath = std::string(path) + ".idx";
+			m_index = fopen(indexPath.c_str(), "wb");
+			if (m_buffer == NULL || m_header == NULL || m_index == NULL || !openFile(path)) {
+				release();
+				return false;
+			}
+
+			memset(m_header, 0, RECORDING_HEADER_BYTES);
+			m_header->magic = RECORDING_MAGIC;
+			m_header->version = RECORDING_VERSION;
+			m_header->headerBytes = RECORDING_HEADER_BYTES;
+			m_header->width = width;
+			m_header->height = height;
+			m_header->quantizationCount = (uint32_t)quantizationCount;
+			memcpy(m_header->quantization, quantization, sizeof(uint16_t) * quantizationCount);
+			m_header->startTimestamp = timestamp;
+			RecordingIndexHeader indexHeader = { RECORDING_INDEX_MAGIC, RECORDING_VERSION, sizeof(RecordingIndexEntry), 0 };
+			bool written = fwrite(&indexHeader, sizeof(indexHeader), 1, m_index) == 1;
+			written = written && beginWrite((const uint8_t*)m_header, RECORDING_HEADER_BYTES, 0, 0);
+			while (written && completeWrite(true))
+				;
+			if (!written) {
+				closeFile(0);
+				release();
+				return false;
+			}
+
+			m_position = 0;
+			m_committed.store(0, std::memory_order_relaxed);
+			m_released.store(0, std::memory_order_relaxed);
+			m_entryHead.store(0, std::memory_order_relaxed);
+			m_entryTail.store(0, std::memory_order_relaxed);
+			m_frames.store(0, std::memory_order_relaxed);
+			m_dropped.store(0, std::memory_order_relaxed);
+			m_writtenBytes.store(0, std::memory_order_relaxed);
+			m_maxBuffered.store(0, std::memory_order_relaxed);
+			m_writeErrors.store(0, std::memory_order_relaxed);
+			m_stopping.store(false, std::memory_order_relaxed);
+			m_writer = std::thread(&PayloadRecorder::writerLoop, this);
+			m_accepting.store(true, std::memory_order_seq_cst);
+			return true;
+		}
+
+		// Producer side, called by one thread (the transfer callback): copies the payload into the ring, never waits
+		bool append(long long frameNo, uint16_t sequenceNo, long long timestamp, const uint8_t* payload, uint32_t size) {
+			m_appending.store(true, std::memory_order_seq_cst);
+			if (!m_accepting.load(std::memory_order_seq_cst)) {
+				m_appending.store(false, std::memory_order_release);
+				return false;
+			}
+			uint64_t position = m_position;
+			uint64_t end = position + size;
+			uint64_t head = m_entryHead.load(std::memory_order_relaxed);
+			if (end - m_released.load(std::memory_order_acquire) > m_capacity ||
+				head - m_entryTail.load(std::memory_order_acquire) >= m_entryCapacity) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				m_appending.store(false, std::memory_order_release);
+				return false;
+			}
+
+			size_t offset = size_t(position % m_capacity);
+			size_t first = size < m_capacity - offset ? size : m_capacity - offset;
+			memcpy(m_buffer + offset, payload, first);
+			if (first < size)
+				memcpy(m_buffer, payload + first, size - first);
+
+			RecordingIndexEntry& entry = m_entries[head % m_entryCapacity];
+			entry.frameNo = frameNo;
+			entry.timestamp = timestamp;
+			entry.offset = RECORDING_HEADER_BYTES + position;
+			entry.size = size;
+			entry.sequenceNo = sequenceNo;
+			entry.reserved = 0;
+
+			m_position = (end + RECORDING_ALIGNMENT - 1) / RECORDING_ALIGNMENT * RECORDING_ALIGNMENT;
+			uint64_t previous = m_committed.load(std::memory_order_relaxed);
+			m_committed.store(m_position, std::memory_order_release);
+			m_entryHead.store(head + 1, std::memory_order_release);
+			m_frames.fetch_add(1, std::memory_order_relaxed);
+			uint64_t buffered = m_position - m_released.load(std::memory_order_relaxed);
+			if (buffered > m_maxBuffered.load(std::memory_order_relaxed))
+				m_maxBuffered.store(buffered, std::memory_order_relaxed);
+			m_appending.store(false, std::memory_order_release);
+			// Only a completed chunk is worth waking the writer for, it polls for the rest
+			if (previous / CHUNK_BYTES != m_position / CHUNK_BYTES)
+				m_wake.notify_one();
+			return true;
+		}
+
+		// Stops accepting payloads, flushes the ring and closes both files
+		void close() {
+			if (!m_writer.joinable()) {
+				release();
+				return;
+			}
+			m_accepting.store(false, std::memory_order_seq_cst);
+			while (m_appending.load(std::memory_order_seq_cst))
+				std::this_thread::yield();
+			m_stopping.store(true, std::memory_order_release);
+			m_wake.notify_one();
+			m_writer.join();
+			closeFile(RECORDING_HEADER_BYTES + m_committed.load(std::memory_order_relaxed));
+			release();
+		}
+
+		bool isRecording() const {
+			return m_accepting.load(std::memory_order_relaxed);
+		}
+
+		// Resolution in the header of the open recording, 0 if none
+		uint32_t getWidth() const {
+			return m_header ? m_header->width : 0;
+		}
+
+		uint32_t getHeight() const {
+			return m_header ? m_header->height : 0;
+		}
+
+		RecorderStats getStats() const {
+			RecorderStats stats;
+			stats.frames = m_frames.load(std::memory_order_relaxed);
+			stats.dropped = m_dropped.load(std::memory_order_relaxed);
+			stats.bytes = m_committed.load(std::memory_order_relaxed);
+			stats.writtenBytes = m_writtenBytes.load(std::memory_order_relaxed);
+			stats.maxBufferedBytes = m_maxBuffered.load(std::memory_order_relaxed);
+			stats.writeErrors = m_writeErrors.load(std::memory_order_relaxed);
+			return stats;
+		}
+
+	private:
+		void release() {
+			if (m_index)
+				fclose(m_index);
+			m_index = NULL;
+			freeAligned(m_buffer);
+			freeAligned(m_header);
+			if (m_entries)
+				delete[] m_entries;
+			m_buffer = NULL;
+			m_header = NULL;
+			m_entries = NULL;
+			m_capacity = 0;
+			m_entryCapacity = 0;
+			m_pendingHead = 0;
+			m_pendingCount = 0;
+		}
+	};
+
+}
@@ -0,0 +1,662 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Synthetic camera for PUCLib_Wrapper, needs neither the device nor PUCLIB
+		@details SyntheticSource paces frames like the camera, from 1 up to 31157 fps, and hands them to the wrapper's transfer callback,
+			so buffering, decoding, listeners, subscriptions and sampling run as with the camera (PUCLib_Wrapper::setCaptureSource).
+			A payload is a small header followed by padding that gives it the size of a compressed frame, the decode functions render a moving
+			pattern from the header. Frames can be dropped in transfer (their sequence numbers are skipped) and their arrival delayed at random.
+			A callback that falls further behind than the ring buffer of the driver loses frames too. One source is one device.
+	@~japanese
+		@brief PUCLib_Wrapper用の疑似カメラ。デバイスもPUCLIBも不要です
+		@details SyntheticSourceはカメラと同様に1～31157fpsでフレームを送出し、ラッパの転送コールバックに渡すため、バッファリング、デコード、
+			リスナー、購読、サンプリングはカメラと同じように動作します（PUCLib_Wrapper::setCaptureSource）。
+			圧縮データは小さなヘッダと、圧縮フレームの大きさにするためのパディングからなり、デコード関数はヘッダから動くパターンを描画します。
+			フレームを転送中に欠落させる（シーケンス番号が飛びます）ことや、到着をランダムに遅らせることができます。
+			ドライバのリングバッファを超えて遅れたコールバックもフレームを失います。1つのソースが1台のデバイスに相当します。
+*/
+
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "PUCLib_CaptureSource.h"
+
+namespace photron {
+
+	enum SyntheticPattern {
+		SYNTHETIC_CHECKERBOARD,		// static checkerboard of 32 pixel cells
+		SYNTHETIC_MOVING_SQUARE,	// bright square bouncing over a dark background
+		SYNTHETIC_SCROLLING_BARS	// 32 pixel wide vertical bars scrolling to the left
+	};
+
+	enum {
+		SYNTHETIC_MAGIC = 0x4E595350,	// "PSYN"
+		SYNTHETIC_MAX_WIDTH = 1246,
+		SYNTHETIC_MAX_HEIGHT = 1024,
+		SYNTHETIC_MIN_WIDTH = 64,
+		SYNTHETIC_MIN_HEIGHT = 16,
+		SYNTHETIC_UNIT_WIDTH = 8,
+		SYNTHETIC_UNIT_HEIGHT = 16,
+		SYNTHETIC_MIN_FRAME_RATE = 1,
+		SYNTHETIC_MAX_FRAME_RATE = 31157
+	};
+
+	// Behaviour of the synthetic device, resolution and frame rate are set through the wrapper like for the camera
+	struct SyntheticConfig {
+		SyntheticPattern pattern = SYNTHETIC_MOVING_SQUARE;
+		int speed = 4;					// pixels per frame
+		double dropRate = 0.0;			// probability that a frame starts a drop
+		int dropBurst = 1;				// consecutive frames lost per drop
+		int jitterUs = 0;				// scale of the random delay of arrivals (half normal), 0 for none
+		int compressionRatio = 10;		// pixels per payload byte, sizes what the wrapper copies and records
+		int ringBufferCount = 64;		// frames the callback may fall behind before frames are lost
+		unsigned int seed = 1;
+	};
+
+	struct SyntheticStats {
+		uint64_t sent = 0;
+		uint64_t dropped = 0;	// lost on purpose (dropRate)
+		uint64_t overrun = 0;	// lost because the callback fell more than ringBufferCount frames behind
+		uint64_t late = 0;		// delivered more than one frame period after they were due
+	};
+
+	// Starts every payload, the rest is padding
+	struct SyntheticPayloadHeader {
+		uint32_t magic;
+		uint16_t sequenceNo;
+		uint16_t pattern;
+		uint32_t width;
+		uint32_t height;
+		uint64_t frameIndex;	// frames since the device was opened, positions the pattern
+		int32_t speed;
+		uint32_t reserved;
+	};
+
+	class SyntheticSource : public CaptureSource {
+		std::mutex m_mutex;
+		SyntheticConfig m_config;
+		bool m_open = false;
+		UINT32 m_width = SYNTHETIC_MAX_WIDTH;
+		UINT32 m_height = 1008;
+		std::atomic<UINT32> m_frameRate;
+		UINT32 m_shutterSpeedFps = 2000;
+		UINT32 m_exposeOnTime = 0, m_exposeOffTime = 0;
+		PUC_DATA_MODE m_dataMode = PUC_DATA_COMPRESSED;
+		USHORT m_q[PUC_Q_COUNT];
+
+		USHORT m_sequenceNo = 0;
+		uint64_t m_frameIndex = 0;
+		long long m_nextSingle = 0;
+		std::thread m_thread;
+		std::atomic<bool> m_stop;
+		bool m_xferring = false;
+		std::vector<UINT8> m_buffer;
+
+		std::atomic<uint64_t> m_sent, m_dropped, m_overrun, m_late;
+
+		static long long getTimestamp() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// Sleeps most of the way and yields the last part, sleep alone is too coarse for 30000 fps
+		static void waitUntil(long long due) {
+			for (;;) {
+				long long remaining = due - getTimestamp();
+				if (remaining <= 0)
+					return;
+				if (remaining > 300000)
+					std::this_thread::sleep_for(std::chrono::nanoseconds(remaining - 200000));
+				else
+					std::this_thread::yield();
+			}
+		}
+
+		static UINT32 bounce(uint64_t position, UINT32 range) {
+			if (range == 0)
+				return 0;
+			UINT32 p = UINT32(position % (2 * uint64_t(range)));
+			return p <= range ? p : 2 * range - p;
+		}
+
+		static UINT32 payloadBytes(UINT32 width, UINT32 height, int compressionRatio) {
+			UINT32 bytes = width * height / UINT32(compressionRatio > 0 ? compressionRatio : 1);
+			if (bytes < sizeof(SyntheticPayloadHeader))
+				bytes = sizeof(SyntheticPayloadHeader);
+			return (bytes + 7) & ~7u;
+		}
+
+		struct Square {
+			UINT32 x, y, size;
+		};
+
+		static Square squareAt(const SyntheticPayloadHeader* h) {
+			Square s;
+			s.size = h->height / 4 < 8 ? 8 : h->height / 4;
+			if (s.size > h->width)
+				s.size = h->width;
+			if (s.size > h->height)
+				s.size = h->height;
+			uint64_t travel = h->frameIndex * uint64_t(h->speed < 0 ? 0 : h->speed);
+			s.x = bounce(travel, h->width - s.size);
+			s.y = bounce(travel * 3 / 4, h->height - s.size);
+			return s;
+		}
+
+		static UINT32 overlap(UINT32 begin0, UINT32 end0, UINT32 begin1, UINT32 end1) {
+			UINT32 begin = begin0 > begin1 ? begin0 : begin1;
+			UINT32 end = end0 < end1 ? end0 : end1;
+			return end > begin ? end - begin : 0;
+		}
+
+		static UINT32 barsOffset(const SyntheticPayloadHeader* h) {
+			return UINT32(h->frameIndex * uint64_t(h->speed < 0 ? 0 : h->speed) % 64);
+		}
+
+		// Pixels [x, x + width) of row y
+		static void renderRow(const SyntheticPayloadHeader* h, UINT32 y, UINT32 x, UINT32 width, UINT8* dst) {
+			UINT32 end = x + width;
+			switch (h->pattern) {
+			case SYNTHETIC_CHECKERBOARD:
+				for (UINT32 i = x; i < end;) {
+					UINT32 next = (i | 31) + 1 < end ? (i | 31) + 1 : end;
+					memset(dst + (i - x), ((i >> 5) ^ (y >> 5)) & 1 ? 192 : 64, next - i);
+					i = next;
+				}
+				break;
+			case SYNTHETIC_SCROLLING_BARS: {
+				UINT32 offset = barsOffset(h);
+				for (UINT32 i = x; i < end;) {
+					UINT32 phase = (i + offset) % 64;
+					UINT32 next = i + (phase < 32 ? 32 - phase : 64 - phase);
+					if (next > end)
+						next = end;
+					memset(dst + (i - x), phase < 32 ? 200 : 40, next - i);
+					i = next;
+				}
+				break;
+			}
+			default: {
+				Square s = squareAt(h);
+				memset(dst, 48, width);
+				if (y >= s.y && y < s.y + s.size) {
+					UINT32 covered = overlap(x, end, s.x, s.x + s.size);
+					if (covered)
+						memset(dst + ((s.x > x ? s.x : x) - x), 208, covered);
+				}
+				break;
+			}
+			}
+		}
+
+		// Mean of the pixels of block (bx, by) inside the frame
+		static UINT8 blockMean(const SyntheticPayloadHeader* h, UINT32 bx, UINT32 by) {
+			UINT32 x0 = bx * 8, y0 = by * 8;
+			UINT32 x1 = x0 + 8 < h->width ? x0 + 8 : h->width;
+			UINT32 y1 = y0 + 8 < h->height ? y0 + 8 : h->height;
+			UINT32 count = (x1 - x0) * (y1 - y0);
+			switch (h->pattern) {
+			case SYNTHETIC_CHECKERBOARD:
+				return ((x0 >> 5) ^ (y0 >> 5)) & 1 ? 192 : 64;
+			case SYNTHETIC_SCROLLING_BARS: {
+				UINT32 offset = barsOffset(h);
+				UINT32 sum = 0;
+				for (UINT32 x = x0; x < x1; x++)
+					sum += (x + offset) % 64 < 32 ? 200 : 40;
+				return UINT8((sum + (x1 - x0) / 2) / (x1 - x0));
+			}
+			default: {
+				Square s = squareAt(h);
+				UINT32 covered = overlap(x0, x1, s.x, s.x + s.size) * overlap(y0, y1, s.y, s.y + s.size);
+				return UINT8((48 * (count - covered) + 208 * covered + count / 2) / count);
+			}
+			}
+		}
+
+		static const SyntheticPayloadHeader* header(const PUINT8 pSrc) {
+			const SyntheticPayloadHeader* h = (const SyntheticPayloadHeader*)pSrc;
+			return (h != NULL && h->magic == SYNTHETIC_MAGIC) ? h : NULL;
+		}
+
+		void fillHeader(UINT8* payload, UINT32 width, UINT32 height, SyntheticPattern pattern, int speed) {
+			SyntheticPayloadHeader* h = (SyntheticPayloadHeader*)payload;
+			h->magic = SYNTHETIC_MAGIC;
+			h->sequenceNo = m_sequenceNo;
+			h->pattern = (uint16_t)pattern;
+			h->width = width;
+			h->height = height;
+			h->frameIndex = m_frameIndex;
+			h->speed = speed;
+			h->reserved = 0;
+		}
+
+		// Fills a transfer of the current frame, the decompressed mode renders it right away
+		UINT32 produce(UINT8* dst, UINT32 width, UINT32 height, PUC_DATA_MODE mode, const SyntheticConfig& config) {
+			if (mode == PUC_DATA_DECOMPRESSED_GRAY) {
+				SyntheticPayloadHeader h;
+				fillHeader((UINT8*)&h, width, height, config.pattern, config.speed);
+				for (UINT32 y = 0; y < height; y++)
+					renderRow(&h, y, 0, width, dst + size_t(y) * width);
+				return width * height;
+			}
+			fillHeader(dst, width, height, config.pattern, config.speed);
+			return payloadBytes(width, height, config.compressionRatio);
+		}
+
+		void transferLoop(RECIEVE_CALLBACK callback, void* arg, UINT32 width, UINT32 height, PUC_DATA_MODE mode, SyntheticConfig config) {
+			std::mt19937 random(config.seed);
+			std::uniform_real_distribution<double> uniform(0.0, 1.0);
+			// Unit normal scaled at the draw, a standard deviation of 0 is not a valid distribution
+			std::normal_distribution<double> jitter(0.0, 1.0);
+			double jitterNs = config.jitterUs > 0 ? config.jitterUs * 1000.0 : 0.0;
+			int dropRemaining = 0;
+			long long due = getTimestamp();
+			while (!m_stop.load(std::memory_order_relaxed)) {
+				long long period = 1000000000LL / m_frameRate.load(std::memory_order_relaxed);
+				long long arrival = due + (jitterNs > 0 ? (long long)(fabs(jitter(random)) * jitterNs) : 0);
+				waitUntil(arrival);
+				long long now = getTimestamp();
+				if (config.ringBufferCount > 0 && now - due > period * config.ringBufferCount) {
+					// The driver's ring buffer overflowed while the callback was busy
+					long long lost = (now - due) / period;
+					m_sequenceNo = USHORT(m_sequenceNo + lost);
+					m_frameIndex += lost;
+					due += lost * period;
+					m_overrun.fetch_add(lost, std::memory_order_relaxed);
+					continue;
+				}
+				if (dropRemaining == 0 && config.dropRate > 0.0 && uniform(random) < config.dropRate)
+					dropRemaining = config.dropBurst > 0 ? config.dropBurst : 1;
+				if (dropRemaining > 0) {
+					dropRemaining--;
+					m_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+				else {
+					if (now - due > period)
+						m_late.fetch_add(1, std::memory_order_relaxed);
+					PUC_XFER_DATA_INFO info;
+					info.pData = m_buffer.data();
+					info.nDataSize = produce(m_buffer.data(), width, height, mode, config);
+					info.nSequenceNo = m_sequenceNo;
+					callback(&info, arg);
+					m_sent.fetch_add(1, std::memory_order_relaxed);
+				}
+				m_sequenceNo++;
+				m_frameIndex++;
+				due += period;
+			}
+		}
+
+		PUCRESULT check(PUC_HANDLE hDevice) const {
+			if (hDevice != (PUC_HANDLE)this)
+				return PUC_ERROR_ILLEGAL_DEVICE_HANDLE;
+			return m_open ? PUC_SUCCEEDED : PUC_ERROR_DEVICE_NOTOPEN;
+		}
+
+	public:
+		SyntheticSource() : m_frameRate(1000), m_stop(false), m_sent(0), m_dropped(0), m_overrun(0), m_late(0) {
+			for (int i = 0; i < PUC_Q_COUNT; i++)
+				m_q[i] = 1;
+		}
+
+		explicit SyntheticSource(const SyntheticConfig& config) : SyntheticSource() {
+			m_config = config;
+		}
+
+		~SyntheticSource() {
+			if (m_open)
+				closeDevice((PUC_HANDLE)this);
+		}
+
+		// Takes effect when the next transfer begins
+		void setConfig(const SyntheticConfig& config) {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_config = config;
+		}
+
+		SyntheticConfig getConfig() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_config;
+		}
+
+		SyntheticStats getStats() const {
+			SyntheticStats stats;
+			stats.sent = m_sent.load(std::memory_order_relaxed);
+			stats.dropped = m_dropped.load(std::memory_order_relaxed);
+			stats.overrun = m_overrun.load(std::memory_order_relaxed);
+			stats.late = m_late.load(std::memory_order_relaxed);
+			return stats;
+		}
+
+		void resetStats() {
+			m_sent.store(0, std::memory_order_relaxed);
+			m_dropped.store(0, std::memory_order_relaxed);
+			m_overrun.store(0, std::memory_order_relaxed);
+			m_late.store(0, std::memory_order_relaxed);
+		}
+
+		PUCRESULT initialize() {
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT detectDevice(PPUC_DETECT_INFO pDetectInfo) {
+			if (pDetectInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			memset(pDetectInfo, 0, sizeof(*pDetectInfo));
+			pDetectInfo->nDeviceCount = 1;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT openDevice(UINT32 nDeviceNo, PPUC_HANDLE pDeviceHandle) {
+			if (pDeviceHandle == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (nDeviceNo != 0)
+				return PUC_ERROR_NOT_EXIST_DEVICE_NO;
+			if (m_open)
+				closeDevice((PUC_HANDLE)this);
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_open = true;
+			m_sequenceNo = 0;
+			m_frameIndex = 0;
+			m_nextSingle = 0;
+			m_dataMode = PUC_DATA_COMPRESSED;
+			*pDeviceHandle = (PUC_HANDLE)this;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT closeDevice(PUC_HANDLE hDevice) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			endXferData(hDevice);
+			m_open = false;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getResolution(PUC_HANDLE hDevice, UINT32* pWidth, UINT32* pHeight) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pWidth == NULL || pHeight == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			*pWidth = m_width;
+			*pHeight = m_height;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getResolutionLimit(PUC_HANDLE hDevice, PPUC_RESO_LIMIT_INFO pLimitInfo) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pLimitInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			pLimitInfo->nMaxWidth = SYNTHETIC_MAX_WIDTH;
+			pLimitInfo->nMaxHeight = SYNTHETIC_MAX_HEIGHT;
+			pLimitInfo->nMinWidth = SYNTHETIC_MIN_WIDTH;
+			pLimitInfo->nMinHeight = SYNTHETIC_MIN_HEIGHT;
+			pLimitInfo->nUnitWidth = SYNTHETIC_UNIT_WIDTH;
+			pLimitInfo->nUnitHeight = SYNTHETIC_UNIT_HEIGHT;
+			return PUC_SUCCEEDED;
+		}
+
+		// Applies to the next transfer, the running one keeps its frame size like the camera's until the wrapper restarts it
+		PUCRESULT setResolution(PUC_HANDLE hDevice, UINT32 nWidth, UINT32 nHeight) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			bool widthOk = nWidth >= SYNTHETIC_MIN_WIDTH && nWidth <= SYNTHETIC_MAX_WIDTH && (nWidth == SYNTHETIC_MAX_WIDTH || nWidth % SYNTHETIC_UNIT_WIDTH == 0);
+			bool heightOk = nHeight >= SYNTHETIC_MIN_HEIGHT && nHeight <= SYNTHETIC_MAX_HEIGHT && (nHeight == SYNTHETIC_MAX_HEIGHT || nHeight % SYNTHETIC_UNIT_HEIGHT == 0);
+			if (!widthOk || !heightOk)
+				return PUC_ERROR_ILLEGAL_RESOLUTION;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_width = nWidth;
+			m_height = nHeight;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT* pVal) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pVal == NULL || nPoint >= PUC_Q_COUNT)
+				return PUC_ERROR_ILLEGAL_ARG;
+			*pVal = m_q[nPoint];
+			return PUC_SUCCEEDED;
+		}
+
+		// Stored and reported only, the synthetic payloads are lossless
+		PUCRESULT setQuantization(PUC_HANDLE hDevice, UINT32 nPoint, USHORT nVal) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (nPoint >= PUC_Q_COUNT || nVal == 0)
+				return PUC_ERROR_ILLEGAL_ARG;
+			m_q[nPoint] = nVal;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getFramerateShutter(PUC_HANDLE hDevice, UINT32* pFramerate, UINT32* pShutterSpeedFps) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pFramerate == NULL || pShutterSpeedFps == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			*pFramerate = m_frameRate.load(std::memory_order_relaxed);
+			*pShutterSpeedFps = m_shutterSpeedFps;
+			return PUC_SUCCEEDED;
+		}
+
+		// Takes effect from the next frame, also during a transfer
+		PUCRESULT setFramerateShutter(PUC_HANDLE hDevice, UINT32 nFramerate, UINT32 nShutterSpeedFps) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (nFramerate < SYNTHETIC_MIN_FRAME_RATE || nFramerate > SYNTHETIC_MAX_FRAME_RATE || nShutterSpeedFps < nFramerate)
+				return PUC_ERROR_ILLEGAL_FRAME_RATE;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_frameRate.store(nFramerate, std::memory_order_relaxed);
+			m_shutterSpeedFps = nShutterSpeedFps;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getFramerateLimit(PUC_HANDLE hDevice, PPUC_FRAMERATE_LIMIT_INFO pLimitInfo) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pLimitInfo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			pLimitInfo->nMinFrameRate = SYNTHETIC_MIN_FRAME_RATE;
+			pLimitInfo->nMaxFrameRate = SYNTHETIC_MAX_FRAME_RATE;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT setExposeTime(PUC_HANDLE hDevice, UINT32 nExpOnTime, UINT32 nExpOffTime) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			m_exposeOnTime = nExpOnTime;
+			m_exposeOffTime = nExpOffTime;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT setXferDataMode(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			m_dataMode = nDataMode;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT getXferDataSize(PUC_HANDLE hDevice, PUC_DATA_MODE nDataMode, UINT32* pDataSize) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pDataSize == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			*pDataSize = nDataMode == PUC_DATA_DECOMPRESSED_GRAY ? m_width * m_height : payloadBytes(m_width, m_height, m_config.compressionRatio);
+			return PUC_SUCCEEDED;
+		}
+
+		// Waits for the next frame period, pXferData->pData must hold getXferDataSize bytes
+		PUCRESULT getSingleXferData(PUC_HANDLE hDevice, PPUC_XFER_DATA_INFO pXferData) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (pXferData == NULL || pXferData->pData == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			long long period = 1000000000LL / m_frameRate.load(std::memory_order_relaxed);
+			waitUntil(m_nextSingle);
+			long long now = getTimestamp();
+			m_nextSingle = (m_nextSingle > now ? m_nextSingle : now) + period;
+			pXferData->nDataSize = produce(pXferData->pData, m_width, m_height, m_dataMode, m_config);
+			pXferData->nSequenceNo = m_sequenceNo++;
+			m_frameIndex++;
+			m_sent.fetch_add(1, std::memory_order_relaxed);
+			return PUC_SUCCEEDED;
+		}
+
+		// Starts a thread that calls callback at the frame rate, each payload is only valid during its call
+		PUCRESULT beginXferData(PUC_HANDLE hDevice, RECIEVE_CALLBACK callback, void* arg) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (callback == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (m_xferring)
+				return PUC_ERROR_XFERRING;
+			std::lock_guard<std::mutex> guard(m_mutex);
+			UINT32 bytes = m_dataMode == PUC_DATA_DECOMPRESSED_GRAY ? m_width * m_height : payloadBytes(m_width, m_height, m_config.compressionRatio);
+			m_buffer.assign(bytes, 0);
+			m_stop.store(false, std::memory_order_relaxed);
+			m_thread = std::thread(&SyntheticSource::transferLoop, this, callback, arg, m_width, m_height, m_dataMode, m_config);
+			m_xferring = true;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT endXferData(PUC_HANDLE hDevice) {
+			PUCRESULT result = check(hDevice);
+			if (PUC_CHK_FAILED(result))
+				return result;
+			if (!m_xferring)
+				return PUC_SUCCEEDED;
+			m_stop.store(true, std::memory_order_relaxed);
+			m_thread.join();
+			m_xferring = false;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT extractSequenceNo(const PUCHAR pData, UINT32 nWidth, UINT32 nHeight, PUSHORT pSeqNo) {
+			const SyntheticPayloadHeader* h = header((const PUINT8)pData);
+			if (pSeqNo == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			if (h == NULL)
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			*pSeqNo = h->sequenceNo;
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT decodeData(PUINT8 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			const SyntheticPayloadHeader* h = header(pSrc);
+			if (h == NULL)
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			if (pDst == NULL || nX % 8 || nY % 8 || nX + nWidth > h->width || nY + nHeight > h->height || nLineBytes < nWidth)
+				return PUC_ERROR_ILLEGAL_ARG;
+			for (UINT32 y = 0; y < nHeight; y++)
+				renderRow(h, nY + y, nX, nWidth, pDst + size_t(y) * nLineBytes);
+			return PUC_SUCCEEDED;
+		}
+
+		// Flat blocks only get their DC coefficient (8 * mean), the others go through an 8x8 DCT-II
+		PUCRESULT decodeDCTData(PINT16 pDst, UINT32 nX, UINT32 nY, UINT32 nWidth, UINT32 nHeight, UINT32 nLineBytes, const PUINT8 pSrc, const PUSHORT pQVals) {
+			const SyntheticPayloadHeader* h = header(pSrc);
+			if (h == NULL)
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			if (pDst == NULL || nX % 8 || nY % 8 || nX + nWidth > h->width || nY + nHeight > h->height)
+				return PUC_ERROR_ILLEGAL_ARG;
+			static float basis[8][8];
+			static std::once_flag basisOnce;
+			std::call_once(basisOnce, [] {
+				for (int u = 0; u < 8; u++)
+					for (int x = 0; x < 8; x++)
+						basis[u][x] = float((u == 0 ? sqrt(0.125) : 0.5) * cos((2 * x + 1) * u * 3.14159265358979323846 / 16));
+			});
+			UINT32 blocksX = (nWidth + 7) / 8;
+			UINT32 blocksY = (nHeight + 7) / 8;
+			UINT8 pixels[8][SYNTHETIC_MAX_WIDTH + 8];
+			for (UINT32 by = 0; by < blocksY; by++) {
+				// Rows and columns past the frame repeat its last pixel
+				UINT32 y0 = nY + by * 8;
+				for (UINT32 r = 0; r < 8; r++) {
+					UINT32 y = y0 + r < h->height ? y0 + r : h->height - 1;
+					renderRow(h, y, nX, nWidth, pixels[r]);
+					memset(pixels[r] + nWidth, pixels[r][nWidth - 1], blocksX * 8 - nWidth);
+				}
+				for (UINT32 bx = 0; bx < blocksX; bx++) {
+					INT16* out[8];
+					for (int r = 0; r < 8; r++) {
+						out[r] = (INT16*)((UINT8*)pDst + size_t(by * 8 + r) * nLineBytes) + bx * 8;
+						memset(out[r], 0, 8 * sizeof(INT16));
+					}
+					const UINT8* first = pixels[0] + bx * 8;
+					bool flat = true;
+					for (int r = 0; r < 8 && flat; r++)
+						for (int c = 0; c < 8 && flat; c++)
+							flat = pixels[r][bx * 8 + c] == first[0];
+					if (flat) {
+						out[0][0] = INT16(8 * first[0]);
+						continue;
+					}
+					float rows[8][8];
+					for (int r = 0; r < 8; r++)
+						for (int u = 0; u < 8; u++) {
+							float sum = 0.0f;
+							for (int c = 0; c < 8; c++)
+								sum += basis[u][c] * pixels[r][bx * 8 + c];
+							rows[r][u] = sum;
+						}
+					for (int v = 0; v < 8; v++)
+						for (int u = 0; u < 8; u++) {
+							float sum = 0.0f;
+							for (int r = 0; r < 8; r++)
+								sum += basis[v][r] * rows[r][u];
+							out[v][u] = INT16(lrintf(sum));
+						}
+				}
+			}
+			return PUC_SUCCEEDED;
+		}
+
+		PUCRESULT decodeDCData(PUINT8 pDst, UINT32 nBlockX, UINT32 nBlockY, UINT32 nBlockCountX, UINT32 nBlockCountY, const PUINT8 pSrc) {
+			const SyntheticPayloadHeader* h = header(pSrc);
+			if (h == NULL)
+				return PUC_ERROR_XFER_DATA_INVALID_HEADER;
+			if (pDst == NULL || (nBlockX + nBlockCountX) * 8 > h->width + 7 || (nBlockY + nBlockCountY) * 8 > h->height + 7)
+				return PUC_ERROR_ILLEGAL_ARG;
+			for (UINT32 by = 0; by < nBlockCountY; by++) {
+				UINT8* out = pDst + size_t(by) * nBlockCountX;
+				if (by > 0 && h->pattern == SYNTHETIC_SCROLLING_BARS) {
+					// Bars do not change down the frame
+					memcpy(out, pDst, nBlockCountX);
+					continue;
+				}
+				for (UINT32 bx = 0; bx < nBlockCountX; bx++)
+					out[bx] = blockMean(h, nBlockX + bx, nBlockY + by);
+			}
+			return PUC_SUCCEEDED;
+		}
+	};
+
+}
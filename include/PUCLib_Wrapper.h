@@ -10,21 +10,1257 @@
 	@copyright Copyright (C) 2021 PHOTRON LIMITED
 */
 
+#ifdef _MSC_VER
 #pragma warning (disable : 4996)
+#endif
 #include <stdio.h>
-#include <Windows.h>
 #include <string>
+#include <atomic>
 #include <mutex>
-#include "PUCLIB.h"
+#include <condition_variable>
+#include <vector>
+#include <climits>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include "PUCLib_CaptureSource.h"
+#include "PUCLib_FrameStats.h"
+#include "PUCLib_DCTKernels.h"
+#include "PUCLib_Recorder.h"
 
 // Use Multithread
 #define USE_DECODE_MULITHRREAD
 
 namespace photron {
 
+	class FramePool;
+
+	/*!
+		@~english
+			@brief A decoded frame borrowed from the wrapper's frame pool
+			@details The buffer stays valid and is never overwritten until release() is called. Returning it to the pool does not allocate or free memory.
+				Release every lease before setResolution, pause or close.
+		@~japanese
+			@brief ラッパのフレームプールから借用したデコード済みフレーム
+			@details release()を呼ぶまでバッファは有効で、上書きされません。プールへの返却でメモリの確保・解放は行われません。
+				setResolution、pause、closeの前にすべてのリースを返却してください。
+	*/
+	struct FrameLease {
+		UINT8* data = NULL;
+		int width = 0;
+		int height = 0;
+		int rowBytes = 0;
+		USHORT sequenceNo = 0;
+		long long frameNo = -1; // sequenceNo extended to 64 bits, -1 if unknown
+		long long timestamp = 0; // steady clock (ns) when the payload arrived
+		long long decodedTimestamp = 0; // steady clock (ns) when decoding finished
+		long long deliveredTimestamp = 0; // steady clock (ns) when the frame was published
+		const FrameStats* stats = NULL; // statistics computed while decoding, valid while leased (see PUCLib_Wrapper::setFrameStats)
+		FramePool* pool = NULL;
+		int slot = -1;
+		unsigned int generation = 0;
+
+		bool isValid() const {
+			return data != NULL;
+		}
+
+		inline FrameLease share() const;
+		inline void release();
+	};
+
+	// Page aligned memory that frame buffers are carved from. It only grows: reserve() keeps the allocation when it is large
+	// enough, so setResolution, pause/resume and reopen reuse it. Rows are padded to ROW_ALIGNMENT bytes (alignRow), so every
+	// row of every frame starts on a cache line and SIMD kernels can use aligned loads.
+	class BufferArena {
+		UINT8* m_base = NULL;
+		size_t m_capacity = 0;
+		size_t m_used = 0;
+		bool m_largePages = false;
+		bool m_usesLargePages = false;
+		bool m_largePagesFailed = false;	// the last large page allocation failed, the normal pages are kept while they are large enough
+	public:
+		enum {
+			ROW_ALIGNMENT = 64,
+			PAGE_SIZE = 4096
+		};
+
+		~BufferArena() {
+			release();
+		}
+
+		static int alignRow(int bytes) {
+			return (bytes + ROW_ALIGNMENT - 1) & ~(ROW_ALIGNMENT - 1);
+		}
+
+		static size_t alignPage(size_t bytes) {
+			return (bytes + PAGE_SIZE - 1) & ~size_t(PAGE_SIZE - 1);
+		}
+
+		// Large pages need the "Lock pages in memory" privilege, without it normal pages are used. Applies to the next allocation,
+		// which is tried once more after a failure when large pages are enabled again.
+		void setLargePages(bool enable) {
+			m_largePages = enable;
+			m_largePagesFailed = false;
+		}
+
+		bool usesLargePages() const {
+			return m_usesLargePages;
+		}
+
+		size_t getCapacity() const {
+			return m_capacity;
+		}
+
+		// Makes bytes available and restarts carving from the beginning, every block taken before becomes invalid
+		bool reserve(size_t bytes) {
+			m_used = 0;
+			if (bytes <= m_capacity && (m_usesLargePages || !m_largePages || m_largePagesFailed))
+				return true;
+			release();
+			if (bytes == 0)
+				return true;
+			if (m_largePages) {
+				size_t largePage = GetLargePageMinimum();
+				if (largePage > 0) {
+					size_t size = (bytes + largePage - 1) / largePage * largePage;
+					m_base = (UINT8*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+					if (m_base) {
+						m_capacity = size;
+						m_usesLargePages = true;
+						m_largePagesFailed = false;
+						return true;
+					}
+				}
+				m_largePagesFailed = true;
+			}
+			size_t size = alignPage(bytes);
+			m_base = (UINT8*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (!m_base)
+				return false;
+			m_capacity = size;
+			return true;
+		}
+
+		// Next page aligned block of the reserved memory, NULL if it does not fit
+		UINT8* take(size_t bytes) {
+			size_t size = alignPage(bytes);
+			if (m_base == NULL || m_used + size > m_capacity)
+				return NULL;
+			UINT8* block = m_base + m_used;
+			m_used += size;
+			return block;
+		}
+
+		void release() {
+			if (m_base)
+				VirtualFree(m_base, 0, MEM_RELEASE);
+			m_base = NULL;
+			m_capacity = 0;
+			m_used = 0;
+			m_usesLargePages = false;
+		}
+	};
+
+	// Fixed set of equally sized, reference counted frame buffers shared between the transfer callback and consumers.
+	// The writer only claims slots that are neither leased nor the latest frame, readers take a reference on the latest
+	// frame without ever waiting for the writer. All slots live in one allocation made when the buffers are set up, the slot
+	// states are kept across release() and reused by a pool of the same count or smaller.
+	class FramePool {
+		enum {
+			WRITING = -1
+		};
+		struct Slot {
+			std::atomic<int> refCount{ 0 };
+			USHORT sequenceNo = 0;
+			long long frameNo = -1;
+			long long timestamp = 0;
+			long long decodedTimestamp = 0;
+			long long deliveredTimestamp = 0;
+		};
+		UINT8* m_data = NULL;
+		bool m_ownsData = false;
+		Slot* m_slots = NULL;
+		int m_slotCapacity = 0;
+		const FrameStats* m_stats = NULL;
+		int m_count = 0;
+		size_t m_slotSize = 0;
+		int m_width = 0;
+		int m_height = 0;
+		int m_rowBytes = 0;
+		std::atomic<int> m_next{ 0 };
+		std::atomic<int> m_latest{ -1 };
+		std::atomic<unsigned int> m_generation{ 0 };
+		std::atomic<UINT64> m_exhaustedCount{ 0 };
+	public:
+		~FramePool() {
+			release();
+			if (m_slots)
+				delete[] m_slots;
+		}
+
+		// Takes the slots from arena if given and it has room left, from the heap otherwise. The slot states are sized for reserveCount
+		// slots if there are more than count.
+		void allocate(int count, int width, int height, int rowBytes, BufferArena* arena = NULL, int reserveCount = 0) {
+			release();
+			m_count = count < 3 ? 3 : count;
+			m_width = width;
+			m_height = height;
+			m_rowBytes = rowBytes;
+			m_slotSize = size_t(rowBytes) * size_t(height);
+			m_data = arena ? arena->take(m_slotSize * m_count) : NULL;
+			m_ownsData = m_data == NULL;
+			if (m_ownsData)
+				m_data = new UINT8[m_slotSize * m_count];
+			memset(m_data, 0, m_slotSize * m_count);
+			if (m_count > m_slotCapacity) {
+				if (m_slots)
+					delete[] m_slots;
+				m_slotCapacity = reserveCount > m_count ? reserveCount : m_count;
+				m_slots = new Slot[m_slotCapacity];
+			}
+			for (int i = 0; i < m_count; i++) {
+				m_slots[i].refCount.store(0, std::memory_order_relaxed);
+				m_slots[i].sequenceNo = 0;
+				m_slots[i].frameNo = -1;
+				m_slots[i].timestamp = 0;
+				m_slots[i].decodedTimestamp = 0;
+				m_slots[i].deliveredTimestamp = 0;
+			}
+			m_stats = NULL;
+			m_next.store(0, std::memory_order_relaxed);
+			m_latest.store(-1, std::memory_order_relaxed);
+			m_generation.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+		void release() {
+			if (m_data && m_ownsData)
+				delete[] m_data;
+			m_data = NULL;
+			m_ownsData = false;
+			m_stats = NULL;
+			m_count = 0;
+			m_latest.store(-1, std::memory_order_relaxed);
+			m_generation.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+		bool isAllocated() const {
+			return m_data != NULL;
+		}
+
+		int getCount() const {
+			return m_count;
+		}
+
+		int getRowBytes() const {
+			return m_rowBytes;
+		}
+
+		// Statistics of every slot, stats[slot] is handed out with the leases of the slot
+		void attachStats(const FrameStats* stats) {
+			m_stats = stats;
+		}
+
+		UINT8* slotData(int slot) const {
+			return m_data + m_slotSize * slot;
+		}
+
+		// Number of times the writer found every slot leased and had to drop a frame
+		UINT64 getExhaustedCount() const {
+			return m_exhaustedCount.load(std::memory_order_relaxed);
+		}
+
+		// Writer side: claims a free slot to decode into, returns -1 if every slot is in use
+		int beginWrite() {
+			int latest = m_latest.load(std::memory_order_acquire);
+			for (int i = 0; i < m_count; i++) {
+				int slot = (m_next.load(std::memory_order_relaxed) + i) % m_count;
+				if (slot == latest)
+					continue;
+				int expected = 0;
+				if (m_slots[slot].refCount.compare_exchange_strong(expected, WRITING, std::memory_order_acq_rel)) {
+					if (slot == m_latest.load(std::memory_order_acquire)) {
+						// Another writer published this slot in the meantime
+						m_slots[slot].refCount.store(0, std::memory_order_release);
+						continue;
+					}
+					m_next.store((slot + 1) % m_count, std::memory_order_relaxed);
+					return slot;
+				}
+			}
+			m_exhaustedCount.fetch_add(1, std::memory_order_relaxed);
+			return -1;
+		}
+
+		// Writer side: gives a claimed slot back without publishing it
+		void abortWrite(int slot) {
+			m_slots[slot].refCount.store(0, std::memory_order_release);
+		}
+
+		// Writer side: records the unwrapped frame number and when the claimed slot was decoded and delivered, call before publish
+		void stamp(int slot, long long frameNo, long long decodedTimestamp, long long deliveredTimestamp) {
+			m_slots[slot].frameNo = frameNo;
+			m_slots[slot].decodedTimestamp = decodedTimestamp;
+			m_slots[slot].deliveredTimestamp = deliveredTimestamp;
+		}
+
+		// Writer side: makes the slot the latest frame. If lease is given the writer keeps one reference in it.
+		void publish(int slot, USHORT sequenceNo, long long timestamp, FrameLease* lease = NULL) {
+			m_slots[slot].sequenceNo = sequenceNo;
+			m_slots[slot].timestamp = timestamp;
+			m_latest.exchange(slot, std::memory_order_acq_rel);
+			if (lease) {
+				fillLease(slot, *lease);
+				m_slots[slot].refCount.store(1, std::memory_order_release);
+			}
+			else {
+				m_slots[slot].refCount.store(0, std::memory_order_release);
+			}
+		}
+
+		// Reader side: takes a reference on the latest frame, returns false if nothing has been published yet
+		bool acquire(FrameLease& lease) {
+			for (;;) {
+				int slot = m_latest.load(std::memory_order_acquire);
+				if (slot < 0)
+					return false;
+				int refCount = m_slots[slot].refCount.load(std::memory_order_acquire);
+				if (refCount == WRITING) {
+					// The writer is between publishing this slot and releasing its claim
+					std::this_thread::yield();
+					continue;
+				}
+				if (m_slots[slot].refCount.compare_exchange_weak(refCount, refCount + 1, std::memory_order_acq_rel)) {
+					if (slot != m_latest.load(std::memory_order_acquire)) {
+						// A newer frame was published and the slot may have been claimed, written and aborted in the meantime
+						m_slots[slot].refCount.fetch_sub(1, std::memory_order_acq_rel);
+						continue;
+					}
+					fillLease(slot, lease);
+					return true;
+				}
+			}
+		}
+
+		void addRef(int slot, unsigned int generation) {
+			if (generation != m_generation.load(std::memory_order_acquire))
+				return;
+			m_slots[slot].refCount.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+		void releaseSlot(int slot, unsigned int generation) {
+			// Leases that outlived a reallocation must not touch the new slots
+			if (generation != m_generation.load(std::memory_order_acquire))
+				return;
+			m_slots[slot].refCount.fetch_sub(1, std::memory_order_acq_rel);
+		}
+
+		// Releases the lease whose data points anywhere inside a slot (used by the cv::Mat allocator)
+		void releaseData(const UINT8* data, unsigned int generation) {
+			if (generation != m_generation.load(std::memory_order_acquire) || data < m_data)
+				return;
+			releaseSlot(int(size_t(data - m_data) / m_slotSize), generation);
+		}
+
+	private:
+		void fillLease(int slot, FrameLease& lease) {
+			lease.data = slotData(slot);
+			lease.width = m_width;
+			lease.height = m_height;
+			lease.rowBytes = m_rowBytes;
+			lease.sequenceNo = m_slots[slot].sequenceNo;
+			lease.frameNo = m_slots[slot].frameNo;
+			lease.timestamp = m_slots[slot].timestamp;
+			lease.decodedTimestamp = m_slots[slot].decodedTimestamp;
+			lease.deliveredTimestamp = m_slots[slot].deliveredTimestamp;
+			lease.stats = m_stats && m_stats[slot].valid ? &m_stats[slot] : NULL;
+			lease.pool = this;
+			lease.slot = slot;
+			lease.generation = m_generation.load(std::memory_order_relaxed);
+		}
+	};
+
+	inline FrameLease FrameLease::share() const {
+		if (pool)
+			pool->addRef(slot, generation);
+		return *this;
+	}
+
+	inline void FrameLease::release() {
+		if (pool)
+			pool->releaseSlot(slot, generation);
+		*this = FrameLease();
+	}
+
+	// A run of consecutive history frames stored back to back, frame i starts at data + i * frameBytes
+	struct HistorySpan {
+		const UINT8* data = NULL;
+		long long firstSequenceNo = 0;
+		int count = 0;
+		size_t frameBytes = 0;
+	};
+
+	// The last K decoded frames in one contiguous, preallocated slab indexed by unwrapped sequence number.
+	// Written by the transfer callback only; readers look frames up in O(1) and confirm with isValid()
+	// after using them, since a slot is reused once K newer frames have arrived.
+	class FrameHistory {
+		BufferArena m_arena; // kept across release(), a history of the same size or smaller reuses it
+		UINT8* m_data = NULL;
+		std::atomic<long long>* m_stamps = NULL; // kept across release() like the arena
+		int m_stampCapacity = 0;
+		int m_capacity = 0;
+		size_t m_frameBytes = 0;
+		int m_width = 0;
+		int m_height = 0;
+		int m_rowBytes = 0;
+		std::atomic<long long> m_last{ -1 };
+	public:
+		~FrameHistory() {
+			release();
+			if (m_stamps)
+				delete[] m_stamps;
+		}
+
+		// reserveFrameBytes sizes the arena for larger frames than these, so a later history of that size reuses it
+		void allocate(int capacity, int width, int height, int rowBytes, size_t reserveFrameBytes = 0) {
+			release();
+			m_capacity = capacity;
+			m_width = width;
+			m_height = height;
+			m_rowBytes = rowBytes;
+			m_frameBytes = size_t(rowBytes) * size_t(height);
+			size_t reserveBytes = (reserveFrameBytes > m_frameBytes ? reserveFrameBytes : m_frameBytes) * capacity;
+			if (!m_arena.reserve(reserveBytes) || (m_data = m_arena.take(m_frameBytes * capacity)) == NULL) {
+				m_capacity = 0;
+				return;
+			}
+			if (capacity > m_stampCapacity) {
+				if (m_stamps)
+					delete[] m_stamps;
+				m_stamps = new std::atomic<long long>[capacity];
+				m_stampCapacity = capacity;
+			}
+			for (int i = 0; i < capacity; i++)
+				m_stamps[i].store(-1, std::memory_order_relaxed);
+			m_last.store(-1, std::memory_order_release);
+		}
+
+		void release() {
+			m_data = NULL;
+			m_capacity = 0;
+			m_last.store(-1, std::memory_order_release);
+		}
+
+		bool isAllocated() const {
+			return m_data != NULL;
+		}
+
+		int getCapacity() const {
+			return m_capacity;
+		}
+
+		int getWidth() const {
+			return m_width;
+		}
+
+		int getHeight() const {
+			return m_height;
+		}
+
+		int getRowBytes() const {
+			return m_rowBytes;
+		}
+
+		size_t getFrameBytes() const {
+			return m_frameBytes;
+		}
+
+		// Writer side: slot the frame with this sequence number is stored in
+		UINT8* beginWrite(long long sequenceNo) {
+			int slot = int(sequenceNo % m_capacity);
+			m_stamps[slot].store(-1, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_release);
+			return m_data + m_frameBytes * slot;
+		}
+
+		void endWrite(long long sequenceNo) {
+			m_stamps[sequenceNo % m_capacity].store(sequenceNo, std::memory_order_release);
+			m_last.store(sequenceNo, std::memory_order_release);
+		}
+
+		void write(long long sequenceNo, const UINT8* frame) {
+			memcpy(beginWrite(sequenceNo), frame, m_frameBytes);
+			endWrite(sequenceNo);
+		}
+
+		long long getLastSequenceNo() const {
+			return m_last.load(std::memory_order_acquire);
+		}
+
+		long long getFirstSequenceNo() const {
+			long long last = getLastSequenceNo();
+			if (last < 0)
+				return -1;
+			long long first = last - m_capacity + 1;
+			return first < 0 ? 0 : first;
+		}
+
+		// True while the frame is still held, call after reading a frame to make sure it was not overwritten meanwhile
+		bool isValid(long long sequenceNo) const {
+			if (m_capacity == 0 || sequenceNo < 0)
+				return false;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return m_stamps[sequenceNo % m_capacity].load(std::memory_order_acquire) == sequenceNo;
+		}
+
+		// Frame with the given sequence number or NULL if it was never stored, dropped or already overwritten
+		const UINT8* frameAt(long long sequenceNo) const {
+			if (!isValid(sequenceNo))
+				return NULL;
+			return m_data + m_frameBytes * (sequenceNo % m_capacity);
+		}
+
+		// Frames [from, to] clipped to what is held, as at most two contiguous spans (the slab is a ring). Returns the number of spans.
+		int range(long long from, long long to, HistorySpan spans[2]) const {
+			long long first = getFirstSequenceNo();
+			long long last = getLastSequenceNo();
+			if (first < 0)
+				return 0;
+			if (from < first)
+				from = first;
+			if (to > last)
+				to = last;
+			if (from > to)
+				return 0;
+
+			int numSpans = 0;
+			while (from <= to) {
+				int slot = int(from % m_capacity);
+				long long count = to - from + 1;
+				if (slot + count > m_capacity)
+					count = m_capacity - slot;
+				HistorySpan& span = spans[numSpans++];
+				span.data = m_data + m_frameBytes * slot;
+				span.firstSequenceNo = from;
+				span.count = int(count);
+				span.frameBytes = m_frameBytes;
+				from += count;
+			}
+			return numSpans;
+		}
+	};
+
+	// Compressed payloads of the last frames, appended back to back into one preallocated arena ring.
+	// Only the transfer callback appends; readers look payloads up by unwrapped sequence number and decode
+	// them on demand, checking with isIntact() that the writer has not reused the bytes meanwhile.
+	class PayloadRing {
+		enum {
+			ALIGNMENT = 64
+		};
+		struct Entry {
+			std::atomic<long long> sequenceNo{ -1 }; // -1 while the entry is rewritten
+			long long position = 0;
+			long long timestamp = 0;
+			UINT32 size = 0;
+			USHORT deviceSequenceNo = 0;
+		};
+		UINT8* m_storage = NULL;		// kept across release(), a ring of the same size or smaller reuses it
+		size_t m_storageCapacity = 0;
+		Entry* m_entryStorage = NULL;	// likewise for the index
+		int m_entryCapacity = 0;
+		UINT8* m_data = NULL;
+		size_t m_capacity = 0;
+		Entry* m_entries = NULL;
+		int m_indexCapacity = 0;
+		long long m_writePosition = 0;
+		std::atomic<long long> m_reserved{ 0 };
+		std::atomic<long long> m_last{ -1 };
+	public:
+		struct Record {
+			long long sequenceNo = -1;
+			long long position = 0;
+			long long timestamp = 0;
+			UINT32 size = 0;
+			USHORT deviceSequenceNo = 0;
+		};
+
+		~PayloadRing() {
+			release();
+			if (m_storage)
+				delete[] m_storage;
+			if (m_entryStorage)
+				delete[] m_entryStorage;
+		}
+
+		void allocate(size_t capacity, int indexCapacity) {
+			release();
+			if (capacity > m_storageCapacity) {
+				if (m_storage)
+					delete[] m_storage;
+				m_storage = new UINT8[capacity];
+				m_storageCapacity = capacity;
+			}
+			if (indexCapacity > m_entryCapacity) {
+				if (m_entryStorage)
+					delete[] m_entryStorage;
+				m_entryStorage = new Entry[indexCapacity];
+				m_entryCapacity = indexCapacity;
+			}
+			for (int i = 0; i < indexCapacity; i++)
+				m_entryStorage[i].sequenceNo.store(-1, std::memory_order_relaxed);
+			m_capacity = capacity;
+			m_data = m_storage;
+			m_indexCapacity = indexCapacity;
+			m_entries = m_entryStorage;
+			m_writePosition = 0;
+			m_reserved.store(0, std::memory_order_relaxed);
+			m_last.store(-1, std::memory_order_release);
+		}
+
+		void release() {
+			m_data = NULL;
+			m_entries = NULL;
+			m_capacity = 0;
+			m_indexCapacity = 0;
+			m_last.store(-1, std::memory_order_release);
+		}
+
+		bool isAllocated() const {
+			return m_data != NULL;
+		}
+
+		size_t getCapacity() const {
+			return m_capacity;
+		}
+
+		long long getLastSequenceNo() const {
+			return m_last.load(std::memory_order_acquire);
+		}
+
+		// Writer side: copies the payload into the arena, overwriting the oldest payloads
+		bool append(long long sequenceNo, USHORT deviceSequenceNo, long long timestamp, const UINT8* payload, UINT32 size) {
+			if (size == 0 || size > m_capacity)
+				return false;
+			// A payload never wraps around the end of the arena so it can be decoded in place
+			size_t offset = size_t(m_writePosition % (long long)m_capacity);
+			if (offset + size > m_capacity)
+				m_writePosition += m_capacity - offset;
+			long long position = m_writePosition;
+
+			Entry& entry = m_entries[sequenceNo % m_indexCapacity];
+			entry.sequenceNo.store(-1, std::memory_order_relaxed);
+			m_reserved.store(position + size, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			memcpy(m_data + (position % (long long)m_capacity), payload, size);
+			entry.position = position;
+			entry.timestamp = timestamp;
+			entry.size = size;
+			entry.deviceSequenceNo = deviceSequenceNo;
+			entry.sequenceNo.store(sequenceNo, std::memory_order_release);
+
+			m_writePosition = (position + size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+			m_last.store(sequenceNo, std::memory_order_release);
+			return true;
+		}
+
+		// Reader side: looks the payload up, returns false if it is no longer held
+		bool find(long long sequenceNo, Record& record) const {
+			if (m_indexCapacity == 0 || sequenceNo < 0)
+				return false;
+			const Entry& entry = m_entries[sequenceNo % m_indexCapacity];
+			if (entry.sequenceNo.load(std::memory_order_acquire) != sequenceNo)
+				return false;
+			record.sequenceNo = sequenceNo;
+			record.position = entry.position;
+			record.timestamp = entry.timestamp;
+			record.size = entry.size;
+			record.deviceSequenceNo = entry.deviceSequenceNo;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (entry.sequenceNo.load(std::memory_order_relaxed) != sequenceNo)
+				return false;
+			return isIntact(record);
+		}
+
+		const UINT8* data(const Record& record) const {
+			return m_data + (record.position % (long long)m_capacity);
+		}
+
+		// True while the payload bytes have not been reused, call again after decoding
+		bool isIntact(const Record& record) const {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return m_reserved.load(std::memory_order_relaxed) <= record.position + (long long)m_capacity;
+		}
+	};
+
+	/*!
+		@~english
+			@brief What the transfer callback does when the decode queue is full
+		@~japanese
+			@brief デコードキューが一杯の時の転送コールバックの動作
+	*/
+	enum DecodeQueuePolicy {
+		DECODE_QUEUE_DROP_OLDEST,	// discard the oldest queued payload
+		DECODE_QUEUE_DROP_NEWEST,	// discard the incoming payload
+		DECODE_QUEUE_BLOCK			// wait in the callback until a worker frees a slot
+	};
+
+	/*!
+		@~english
+			@brief How the decode work of the transfer stream is spread over cores
+		@~japanese
+			@brief 転送データのデコード処理をコアに分散する方法
+	*/
+	enum DecodeParallelism {
+		DECODE_PARALLEL_AUTO,			// inter-frame below DECODE_INTER_FRAME_MAX_PIXELS, intra-frame above
+		DECODE_PARALLEL_INTRA_FRAME,	// one frame at a time, split over setNumDecodeThreads threads
+		DECODE_PARALLEL_INTER_FRAME		// consecutive frames on different workers, one thread each, delivered in order
+	};
+
+	// Frames smaller than this are decoded inter-frame in DECODE_PARALLEL_AUTO: the fan-out of PUC_DecodeDataMultiThread
+	// costs more than the decode itself on a few rows
+	const UINT32 DECODE_INTER_FRAME_MAX_PIXELS = 256 * 256;
+
+	// Band a frame decoded with setFrameStats on is split into, small enough that the statistics read it back from L2
+	const UINT32 STATS_BAND_BYTES = 128 * 1024;
+
+	// Counters of setMotionGate: every frame compared on its DC proxy ends up skipped, partially or fully decoded
+	struct MotionGateStats {
+		UINT64 compared = 0;
+		UINT64 skipped = 0;		// full decodes saved, the pool keeps the previous frame
+		UINT64 partial = 0;		// only the changed blocks were decoded over a copy of the previous frame
+		UINT64 full = 0;
+	};
+
+	struct DecodeQueueStats {
+		UINT64 enqueued = 0;
+		UINT64 decoded = 0;
+		UINT64 droppedOldest = 0;
+		UINT64 droppedNewest = 0;
+		UINT64 blocked = 0;
+	};
+
+	/*!
+		@~english
+			@brief Lock-free log-linear latency histogram
+			@details Values (ns) are counted in 32 linear sub-buckets per power of two, so every bucket is within about 3% of the value it holds,
+				up to 2^41 ns. Writers and readers only use relaxed atomics; a reader running during an update may see the counters a frame apart.
+		@~japanese
+			@brief ロックフリーの対数線形レイテンシヒストグラム
+			@details 値（ns）は2のべき乗ごとに32の線形サブバケットで計数され、2^41 nsまで各バケットの誤差は約3%以内です。
+				書き込み、読み込みともにrelaxedアトミック操作のみを使用します。更新中に読み込んだ場合、計数が1フレーム分ずれることがあります。
+	*/
+	class LatencyHistogram {
+	public:
+		enum {
+			SUB_BUCKET_BITS = 5,
+			SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+			MAX_BITS = 41,
+			BUCKET_COUNT = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+		};
+
+		void record(long long value) {
+			UINT64 v = value < 0 ? 0 : (UINT64)value;
+			m_buckets[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_sum.fetch_add(v, std::memory_order_relaxed);
+			UINT64 current = m_max.load(std::memory_order_relaxed);
+			while (v > current && !m_max.compare_exchange_weak(current, v, std::memory_order_relaxed)) {}
+			current = m_min.load(std::memory_order_relaxed);
+			while (v < current && !m_min.compare_exchange_weak(current, v, std::memory_order_relaxed)) {}
+		}
+
+		void reset() {
+			for (int i = 0; i < BUCKET_COUNT; i++)
+				m_buckets[i].store(0, std::memory_order_relaxed);
+			m_count.store(0, std::memory_order_relaxed);
+			m_sum.store(0, std::memory_order_relaxed);
+			m_min.store(ULLONG_MAX, std::memory_order_relaxed);
+			m_max.store(0, std::memory_order_relaxed);
+		}
+
+		UINT64 getCount() const {
+			return m_count.load(std::memory_order_relaxed);
+		}
+
+		long long getMin() const {
+			UINT64 v = m_min.load(std::memory_order_relaxed);
+			return v == ULLONG_MAX ? 0 : (long long)v;
+		}
+
+		long long getMax() const {
+			return (long long)m_max.load(std::memory_order_relaxed);
+		}
+
+		double getMean() const {
+			UINT64 count = getCount();
+			return count ? (double)m_sum.load(std::memory_order_relaxed) / (double)count : 0.0;
+		}
+
+		// Estimated from the bucket midpoints
+		double getStdDev() const {
+			UINT64 count = 0;
+			double sum = 0.0, sumSquares = 0.0;
+			for (int i = 0; i < BUCKET_COUNT; i++) {
+				UINT64 n = m_buckets[i].load(std::memory_order_relaxed);
+				if (n == 0)
+					continue;
+				double mid = 0.5 * (double)(lowerBound(i) + lowerBound(i + 1));
+				count += n;
+				sum += mid * n;
+				sumSquares += mid * mid * n;
+			}
+			if (count < 2)
+				return 0.0;
+			double mean = sum / count;
+			double variance = sumSquares / count - mean * mean;
+			return variance > 0.0 ? sqrt(variance) : 0.0;
+		}
+
+		// Upper bound of the bucket holding the given percentile (0-100)
+		long long getPercentile(double percentile) const {
+			UINT64 count = getCount();
+			if (count == 0)
+				return 0;
+			UINT64 rank = (UINT64)(percentile / 100.0 * (double)count + 0.5);
+			if (rank < 1)
+				rank = 1;
+			UINT64 seen = 0;
+			for (int i = 0; i < BUCKET_COUNT; i++) {
+				seen += m_buckets[i].load(std::memory_order_relaxed);
+				if (seen >= rank)
+					return (long long)lowerBound(i + 1) - 1;
+			}
+			return getMax();
+		}
+
+	private:
+		static int bucketOf(UINT64 v) {
+			if (v < 2 * SUB_BUCKETS)
+				return (int)v;
+			int msb = 0;
+			for (int step = 32; step > 0; step >>= 1) {
+				if (v >> (msb + step))
+					msb += step;
+			}
+			int shift = msb - SUB_BUCKET_BITS;
+			int index = (shift + 1) * SUB_BUCKETS + (int)(v >> shift) - SUB_BUCKETS;
+			return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+		}
+
+		static UINT64 lowerBound(int index) {
+			if (index < 2 * SUB_BUCKETS)
+				return (UINT64)index;
+			int shift = index / SUB_BUCKETS - 1;
+			return (UINT64)(index % SUB_BUCKETS + SUB_BUCKETS) << shift;
+		}
+
+		std::atomic<UINT64> m_buckets[BUCKET_COUNT] = {};
+		std::atomic<UINT64> m_count{ 0 };
+		std::atomic<UINT64> m_sum{ 0 };
+		std::atomic<UINT64> m_min{ ULLONG_MAX };
+		std::atomic<UINT64> m_max{ 0 };
+	};
+
+	// Stages timed for every delivered frame, see PUCLib_Wrapper::getLatencyHistogram
+	enum LatencyStage {
+		LATENCY_QUEUE,			// arrival to decode start
+		LATENCY_DECODE,			// decode start to decoded
+		LATENCY_DELIVER,		// decoded to handed to the pool or listener
+		LATENCY_TOTAL,			// arrival to delivered
+		LATENCY_INTER_ARRIVAL,	// between consecutive payloads
+		LATENCY_STAGE_COUNT
+	};
+
+	struct JitterStats {
+		double meanInterval = 0.0;	// ns
+		double stdDev = 0.0;		// ns
+		long long p50 = 0;
+		long long p99 = 0;
+		long long p999 = 0;
+		long long maxInterval = 0;
+	};
+
+	// Counters of the sequence triage done on every payload before decoding
+	struct SequenceStats {
+		UINT64 received = 0;		// distinct frames
+		UINT64 duplicates = 0;		// payloads repeating the previous sequence number, never decoded
+		UINT64 dropped = 0;			// frames missing between received ones
+		UINT64 gaps = 0;			// runs of missing frames
+		long long lastFrameNo = -1;	// unwrapped 64-bit sequence number of the newest frame
+	};
+
+	// A run of frames the camera numbered but the transfer never delivered
+	struct SequenceGap {
+		long long firstFrameNo = 0;	// unwrapped sequence number of the first missing frame
+		long long count = 0;
+		long long timestamp = 0;	// steady clock ns at which the gap was noticed
+	};
+
+	// A payload copied out of the transfer callback together with what has to be decoded from it
+	struct DecodeJob {
+		const UINT8* payload = NULL;
+		UINT32 size = 0;
+		USHORT sequenceNo = 0;
+		long long frameNo = 0;
+		long long timestamp = 0;
+		bool decodeFull = false;
+		bool decodeProxy = false;
+		bool decodeDCT = false;
+		bool decodeTarget = false;
+		int buffer = -1;
+		UINT64 ticket = 0;	// order in which the job left the queue, delivery follows it
+	};
+
+	// Bounded queue of payloads between the transfer callback and the decode workers. Payload buffers are
+	// preallocated: one per queue entry plus one per worker, so a worker decodes in place while the callback
+	// keeps filling the others.
+	class DecodeQueue {
+		std::mutex m_mutex;
+		std::condition_variable m_notEmpty;
+		std::condition_variable m_notFull;
+		UINT8* m_storage = NULL;	// kept across stop(), reused while the payload buffers fit
+		size_t m_storageBytes = 0;
+		size_t m_payloadCapacity = 0;
+		std::vector<int> m_freeBuffers;
+		std::vector<DecodeJob> m_jobs;
+		int m_head = 0;
+		int m_count = 0;
+		UINT64 m_nextTicket = 0;
+		bool m_stopped = true;
+		DecodeQueuePolicy m_policy = DECODE_QUEUE_DROP_OLDEST;
+		std::atomic<UINT64> m_enqueued{ 0 };
+		std::atomic<UINT64> m_decoded{ 0 };
+		std::atomic<UINT64> m_droppedOldest{ 0 };
+		std::atomic<UINT64> m_droppedNewest{ 0 };
+		std::atomic<UINT64> m_blocked{ 0 };
+	public:
+		~DecodeQueue() {
+			release();
+		}
+
+		// The storage is sized for reserveWorkers workers if there are more than numWorkers, so a later queue with them reuses it
+		void allocate(int capacity, int numWorkers, size_t payloadCapacity, DecodeQueuePolicy policy, int reserveWorkers = 0) {
+			stop();
+			int numBuffers = capacity + numWorkers;
+			m_payloadCapacity = payloadCapacity;
+			if (payloadCapacity * numBuffers > m_storageBytes) {
+				if (m_storage)
+					delete[] m_storage;
+				m_storageBytes = payloadCapacity * (capacity + (reserveWorkers > numWorkers ? reserveWorkers : numWorkers));
+				m_storage = new UINT8[m_storageBytes];
+			}
+			m_freeBuffers.clear();
+			for (int i = numBuffers - 1; i >= 0; i--)
+				m_freeBuffers.push_back(i);
+			m_jobs.assign(capacity, DecodeJob());
+			m_head = 0;
+			m_count = 0;
+			m_nextTicket = 0;
+			m_policy = policy;
+			m_stopped = false;
+		}
+
+		void release() {
+			stop();
+			if (m_storage)
+				delete[] m_storage;
+			m_storage = NULL;
+			m_storageBytes = 0;
+		}
+
+		// Wakes every waiting worker and callback, pending payloads are discarded
+		void stop() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_stopped = true;
+			m_count = 0;
+			m_notEmpty.notify_all();
+			m_notFull.notify_all();
+		}
+
+		// Callback side: copies the payload in, applying the overflow policy. Returns false if the payload was dropped.
+		bool push(DecodeJob job, const UINT8* payload) {
+			if (job.size > m_payloadCapacity)
+				return false;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopped)
+				return false;
+			if (m_count == (int)m_jobs.size() || m_freeBuffers.empty()) {
+				if (m_policy == DECODE_QUEUE_DROP_NEWEST || (m_policy == DECODE_QUEUE_DROP_OLDEST && m_count == 0)) {
+					m_droppedNewest.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				if (m_policy == DECODE_QUEUE_DROP_OLDEST) {
+					m_freeBuffers.push_back(m_jobs[m_head].buffer);
+					m_head = (m_head + 1) % (int)m_jobs.size();
+					m_count--;
+					m_droppedOldest.fetch_add(1, std::memory_order_relaxed);
+				}
+				else {
+					m_blocked.fetch_add(1, std::memory_order_relaxed);
+					m_notFull.wait(lock, [this] { return m_stopped || (m_count < (int)m_jobs.size() && !m_freeBuffers.empty()); });
+					if (m_stopped)
+						return false;
+				}
+			}
+			job.buffer = m_freeBuffers.back();
+			m_freeBuffers.pop_back();
+			UINT8* dst = m_storage + m_payloadCapacity * job.buffer;
+			memcpy(dst, payload, job.size);
+			job.payload = dst;
+			m_jobs[(m_head + m_count) % (int)m_jobs.size()] = job;
+			m_count++;
+			m_enqueued.fetch_add(1, std::memory_order_relaxed);
+			lock.unlock();
+			m_notEmpty.notify_one();
+			return true;
+		}
+
+		// Worker side: waits for the next payload, returns false once the queue is stopped
+		bool pop(DecodeJob& job) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this] { return m_stopped || m_count > 0; });
+			if (m_stopped)
+				return false;
+			job = m_jobs[m_head];
+			job.ticket = m_nextTicket++;
+			m_head = (m_head + 1) % (int)m_jobs.size();
+			m_count--;
+			return true;
+		}
+
+		// Worker side: gives the payload buffer of a decoded job back
+		void done(const DecodeJob& job) {
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_freeBuffers.push_back(job.buffer);
+			}
+			m_decoded.fetch_add(1, std::memory_order_relaxed);
+			m_notFull.notify_one();
+		}
+
+		DecodeQueueStats getStats() const {
+			DecodeQueueStats stats;
+			stats.enqueued = m_enqueued.load(std::memory_order_relaxed);
+			stats.decoded = m_decoded.load(std::memory_order_relaxed);
+			stats.droppedOldest = m_droppedOldest.load(std::memory_order_relaxed);
+			stats.droppedNewest = m_droppedNewest.load(std::memory_order_relaxed);
+			stats.blocked = m_blocked.load(std::memory_order_relaxed);
+			return stats;
+		}
+	};
+
 	class PUCLib_WrapperImageListener {
 	public:
 		virtual void imageReady(unsigned char* image, int width, int height, int rowBytes, USHORT sequenceNum) = 0;
+
+		// Override to keep the frame past the callback without copying it: call lease.share() and release it later
+		virtual void frameReady(FrameLease& lease) {
+			imageReady(lease.data, lease.width, lease.height, lease.rowBytes, lease.sequenceNo);
+		}
+	};
+
+	// Consecutive decoded frames handed to a PUCLib_WrapperBatchListener. The frames are stacked in one buffer, frame i starts at data + i * frameBytes.
+	struct FrameBatch {
+		const UINT8* data = NULL;
+		int count = 0;
+		int width = 0;
+		int height = 0;
+		int rowBytes = 0;
+		size_t frameBytes = 0;
+		const USHORT* sequenceNos = NULL;	// camera sequence numbers
+		const long long* frameNos = NULL;	// unwrapped 64-bit sequence numbers
+		const long long* timestamps = NULL;	// steady clock (ns) at arrival
+	};
+
+	class PUCLib_WrapperBatchListener {
+	public:
+		// The batch is only valid during the call, the wrapper fills the same buffer again afterwards
+		virtual void framesReady(const FrameBatch& batch) = 0;
+	};
+
+	class PUCLib_WrapperTargetListener {
+	public:
+		// buffer (index into the buffers of setTargetBuffers) holds the decoded frame, it is not written again until releaseTarget(index)
+		virtual void targetReady(int index, UINT8* buffer, USHORT sequenceNo, long long frameNo) = 0;
+	};
+
+	// What a FrameSubscription receives
+	enum SubscriptionKind {
+		SUBSCRIBE_FULL,		// the decoded frame (the decode ROI if one is set)
+		SUBSCRIBE_PROXY,	// the DC proxy image
+		SUBSCRIBE_ROI,		// a region of the decoded frame, referenced without copying
+		SUBSCRIBE_DCT		// the DCT coefficients, needs setDCTSampleRate to be set before the transfer starts
+	};
+
+	// What happens when a subscriber's mailbox is full
+	enum SubscriptionDropPolicy {
+		SUBSCRIPTION_DROP_OLDEST,	// the oldest waiting frame is released to make room
+		SUBSCRIPTION_DROP_NEWEST	// the new frame is not delivered to this subscriber
+	};
+
+	/*!
+		@~english
+			@brief One consumer of the wrapper's frames, see PUCLib_Wrapper::subscribe
+			@details Frames are decoded once and shared by reference: the mailbox holds leases on the wrapper pools, next() hands one over.
+				Each subscriber reads at its own pace from its own thread.
+		@~japanese
+			@brief ラッパのフレームの1つの受信者（PUCLib_Wrapper::subscribe参照）
+			@details フレームは1回だけデコードされ、参照で共有されます。メールボックスはラッパのプールのリースを保持し、next()で1つずつ渡します。
+				各受信者は自身のスレッドから自身のペースで読み込みます。
+	*/
+	class FrameSubscription {
+		friend class PUCLib_Wrapper;
+
+		SubscriptionKind m_kind;
+		int m_rate;
+		SubscriptionDropPolicy m_policy;
+		int m_x, m_y, m_width, m_height;
+		std::mutex m_mutex;
+		std::condition_variable m_ready;
+		std::vector<FrameLease> m_mailbox;
+		int m_head = 0;
+		int m_count = 0;
+		bool m_closed = false;
+		std::atomic<UINT64> m_delivered{ 0 };
+		std::atomic<UINT64> m_dropped{ 0 };
+
+		FrameSubscription(SubscriptionKind kind, int rate, SubscriptionDropPolicy policy, int capacity, int x, int y, int width, int height)
+			: m_kind(kind), m_rate(rate < 1 ? 1 : rate), m_policy(policy), m_x(x), m_y(y), m_width(width), m_height(height),
+			m_mailbox(capacity < 1 ? 1 : capacity) {
+		}
+
+		~FrameSubscription() {
+			close();
+		}
+
+		bool wants(long long frameNo) const {
+			return frameNo % m_rate == 0;
+		}
+
+		// Takes over the lease
+		void push(FrameLease& lease) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_closed) {
+				lease.release();
+				return;
+			}
+			if (m_count == (int)m_mailbox.size()) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				if (m_policy == SUBSCRIPTION_DROP_NEWEST) {
+					lease.release();
+					return;
+				}
+				m_mailbox[m_head].release();
+				m_head = (m_head + 1) % (int)m_mailbox.size();
+				m_count--;
+			}
+			m_mailbox[(m_head + m_count) % (int)m_mailbox.size()] = lease;
+			lease = FrameLease();
+			m_count++;
+			m_delivered.fetch_add(1, std::memory_order_relaxed);
+			lock.unlock();
+			m_ready.notify_one();
+		}
+
+		// Releases the waiting frames, e.g. before the pools are set up again
+		void clear() {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			for (; m_count > 0; m_count--) {
+				m_mailbox[m_head].release();
+				m_head = (m_head + 1) % (int)m_mailbox.size();
+			}
+		}
+
+		void close() {
+			clear();
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_closed = true;
+			m_ready.notify_all();
+		}
+
+	public:
+		/*!
+			@~english
+				@brief Takes the oldest waiting frame
+				@param[out] lease The frame, release it when done (the pool buffer stays reserved until then)
+				@param[in] timeoutMs Time to wait for a frame in milliseconds, 0 to poll, negative to wait until one arrives or the subscription ends
+				@return True if a frame was taken
+			@~japanese
+				@brief 最も古い待機中のフレームを取り出します。
+				@param[out] lease フレーム。使用後に解放してください（それまでプールのバッファは確保されたままです）
+				@param[in] timeoutMs フレームを待つ時間（ミリ秒）、0の場合は待たず、負の場合はフレームが届くか購読が終了するまで待ちます
+				@return フレームを取り出せた場合は真(true)を返します。
+		*/
+		bool next(FrameLease& lease, int timeoutMs = -1) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto ready = [this] { return m_count > 0 || m_closed; };
+			if (timeoutMs < 0)
+				m_ready.wait(lock, ready);
+			else if (!m_ready.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready))
+				return false;
+			if (m_count == 0)
+				return false;
+			lease = m_mailbox[m_head];
+			m_mailbox[m_head] = FrameLease();
+			m_head = (m_head + 1) % (int)m_mailbox.size();
+			m_count--;
+			return true;
+		}
+
+		SubscriptionKind getKind() const {
+			return m_kind;
+		}
+
+		int getRate() const {
+			return m_rate;
+		}
+
+		int getCapacity() const {
+			return (int)m_mailbox.size();
+		}
+
+		// Frames put into the mailbox
+		UINT64 getDeliveredCount() const {
+			return m_delivered.load(std::memory_order_relaxed);
+		}
+
+		// Frames lost to a full mailbox
+		UINT64 getDroppedCount() const {
+			return m_dropped.load(std::memory_order_relaxed);
+		}
+	};
+
+	// Request to be told when a frame newer than afterFrameNo is published, completed from the transfer callback instead of
+	// a blocked thread (see PUCLib_Wrapper::addFrameWaiter). wake runs under the wrapper's lock and must only hand the waiter over.
+	struct FrameWaiter {
+		SubscriptionKind kind = SUBSCRIBE_FULL;
+		long long afterFrameNo = -1;
+		void (*wake)(FrameWaiter* waiter) = NULL;
+		void* context = NULL;
+		FrameWaiter* next = NULL;
+		bool linked = false;
+	};
+
+	// One entry of the mode table, see PUCLib_Wrapper::setModeTable
+	struct CaptureMode {
+		UINT32 width = 0;
+		UINT32 height = 0;
+		UINT32 frameRate = 0;
+		UINT32 shutterSpeedFps = 0;
+		UINT32 exposeOnClk = 0;		// 0 keeps the exposure of shutterSpeedFps
+		UINT32 exposeOffClk = 0;
+		UINT32 roiX = 0, roiY = 0, roiWidth = 0, roiHeight = 0;	// decode ROI of the mode, roiWidth 0 keeps the current one
+	};
+
+	// Timing of the last PUCLib_Wrapper::switchMode, in nanoseconds
+	struct ModeSwitchStats {
+		UINT64 count = 0;
+		long long stopNs = 0;		// ending the transfer
+		long long deviceNs = 0;		// setting resolution, frame rate and exposure on the device
+		long long restartNs = 0;	// carving the buffers and starting the transfer
+		long long totalNs = 0;		// the whole call
+		long long maxTotalNs = 0;
+		long long firstFrameNs = 0;	// from the call until the first frame of the new mode arrived, 0 until it did
 	};
 
 	class PUCLib_Wrapper {
@@ -46,9 +1282,9 @@ namespace photron {
 		*/
 		PUCLib_Wrapper() {
 			static bool firstTime = true;
-			if (firstTime) {
+			if (firstTime && m_source) {
 				firstTime = false;
-				result = PUC_Initialize();
+				result = m_source->initialize();
 			}
 		}
 
@@ -66,6 +1302,195 @@ namespace photron {
 			m_isSingleThread = !multiThread;
 		}
 
+		/*!
+			@~english
+				@brief Delivers decoded frames in batches instead of one call per frame
+				@details The frames of a batch are back to back in one buffer. With a frame history of at least batchSize frames (setFrameHistory),
+					consecutive frames are handed out straight from its slab without a copy; otherwise every frame is copied into a buffer allocated
+					when the stream is set up. The listener is called when batchSize frames are collected,
+					or when the oldest collected frame is older than maxLatencyUs at the next arrival. Pending frames are flushed when the transfer stops.
+					Frames are in stream order. Can be combined with addListener and read.
+				@param[in] listener The batch listener, NULL to remove it
+				@param[in] batchSize Maximum number of frames per batch
+				@param[in] maxLatencyUs Maximum time a frame waits in the batch (microseconds), 0 to flush by count only
+			@~japanese
+				@brief デコードしたフレームを1フレームごとではなくまとめて配信します。
+				@details バッチのフレームは1つのバッファに連続して並びます。batchSize枚以上のフレーム履歴（setFrameHistory）がある場合、
+					連続したフレームは履歴の領域からコピーなしで渡されます。それ以外の場合、各フレームはストリームの設定時に確保したバッファに
+					コピーされます。batchSize枚集まった時、または次の受信時に最も古いフレームが
+					maxLatencyUsより古い場合にリスナーが呼ばれます。転送停止時には残りのフレームが配信されます。
+					フレームはストリームの順番で並びます。addListenerやreadと併用できます。
+				@param[in] listener バッチリスナー、NULLで解除
+				@param[in] batchSize 1バッチの最大フレーム数
+				@param[in] maxLatencyUs フレームがバッチ内で待つ最大時間（マイクロ秒）、0の場合は枚数のみで配信
+		*/
+		void setBatchListener(PUCLib_WrapperBatchListener* listener, int batchSize, int maxLatencyUs = 0) {
+			std::lock_guard<std::mutex> guard(m_deliveryMutex);
+			flushBatch();
+			m_batchListener = listener;
+			m_batchSize = batchSize < 1 ? 1 : batchSize;
+			m_batchMaxLatency = (long long)maxLatencyUs * 1000;
+			if (listener && hDevice != NULL)
+				allocateBatch();
+		}
+
+		/*!
+			@~english
+				@brief Decodes every frame straight into buffers owned by the caller
+				@details Mapped GL pixel buffers, CL host pointer buffers or shared memory can be registered, PUC_DecodeData then writes with the
+					caller's stride and no copy is made. The listener gets each filled buffer, it stays out of rotation until releaseTarget.
+					When all buffers are held the frame is not decoded into them (see getTargetDroppedCount). Frames are decoded at the decode ROI size.
+					Call while no transfer runs (before open or while paused), the buffers must stay valid until they are replaced or removed.
+				@param[in] buffers count buffers of rowBytes * height bytes each, NULL to remove them
+				@param[in] count Number of buffers
+				@param[in] rowBytes Number of bytes per row of every buffer, a multiple of 4 not smaller than the decode width
+				@param[in] listener Called with each filled buffer in stream order
+			@~japanese
+				@brief 全フレームを利用者のバッファへ直接デコードします。
+				@details マップしたGLピクセルバッファ、CLのホストポインタバッファ、共有メモリなどを登録でき、PUC_DecodeDataが利用者の
+					ラインバイト数で直接書き込むため、コピーは発生しません。リスナーはデコード済みのバッファを受け取り、releaseTargetまで
+					そのバッファは使用されません。全バッファが使用中の場合、そのフレームはデコードされません（getTargetDroppedCount参照）。
+					フレームはデコードROIのサイズでデコードされます。転送していない時（open前またはpause中）に呼び出してください。
+					バッファは置き換えるか解除するまで有効である必要があります。
+				@param[in] buffers rowBytes * 高さバイトのバッファcount個、NULLで解除
+				@param[in] count バッファ数
+				@param[in] rowBytes 各バッファの１ラインあたりのバイト数。デコード横幅以上の4の倍数
+				@param[in] listener デコード済みのバッファをストリームの順番で受け取ります
+		*/
+		void setTargetBuffers(UINT8* const* buffers, int count, int rowBytes, PUCLib_WrapperTargetListener* listener) {
+			m_targetBuffers.clear();
+			if (m_targetState)
+				delete[] m_targetState;
+			m_targetState = NULL;
+			if (buffers && listener && count > 0) {
+				m_targetBuffers.assign(buffers, buffers + count);
+				m_targetState = new std::atomic<int>[count];
+				for (int i = 0; i < count; i++)
+					m_targetState[i].store(0, std::memory_order_relaxed);
+			}
+			m_targetRowBytes = rowBytes;
+			m_targetListener = listener;
+		}
+
+		// Gives a buffer handed to PUCLib_WrapperTargetListener::targetReady back to the wrapper
+		void releaseTarget(int index) {
+			if (m_targetState && index >= 0 && index < (int)m_targetBuffers.size())
+				m_targetState[index].store(0, std::memory_order_release);
+		}
+
+		// Frames not decoded into the target buffers because the caller held all of them
+		UINT64 getTargetDroppedCount() const {
+			return m_targetDropped.load(std::memory_order_relaxed);
+		}
+
+		/*!
+			@~english
+				@brief Decodes the latest frame straight into a buffer of the caller
+				@details In single thread mode, or when payloads are kept (setPayloadHistory), the newest payload is decoded with the caller's
+					stride and no intermediate buffer. Otherwise the latest decoded frame is copied, which costs the same single copy as read().
+					The frame has the decode ROI size (see getDecodeROI).
+				@param[out] dst Destination buffer, at least rowBytes * height bytes
+				@param[in] rowBytes Number of bytes per row of dst, a multiple of 4 not smaller than the decode width
+				@param[out] frameNo If not NULL, unwrapped sequence number of the frame
+				@return True if a frame was written
+			@~japanese
+				@brief 最新のフレームを利用者のバッファへ直接デコードします。
+				@details シングルスレッドモード、または圧縮データを保持している場合（setPayloadHistory）、最新の圧縮データを利用者の
+					ラインバイト数で中間バッファなしにデコードします。それ以外の場合は最新のデコード済みフレームをコピーし、read()と同じ1回のコピーになります。
+					フレームはデコードROIのサイズです（getDecodeROI参照）。
+				@param[out] dst 展開先バッファ。rowBytes * 高さバイト以上が必要です
+				@param[in] rowBytes dstの１ラインあたりのバイト数。デコード横幅以上の4の倍数
+				@param[out] frameNo NULLでない場合、フレームの拡張シーケンス番号
+				@return フレームを書き込んだ場合は真(true)を返します。
+		*/
+		bool readInto(UINT8* dst, int rowBytes, long long* frameNo = NULL) {
+			if (hDevice == NULL || dst == NULL || rowBytes < (int)m_decodeWidth || rowBytes % 4 != 0)
+				return false;
+			if (m_isSingleThread) {
+				result = m_source->getSingleXferData(hDevice, &xferData);
+				if (PUC_CHK_SUCCEEDED(result))
+					result = decodeFull(dst, xferData.pData, rowBytes);
+				if (PUC_CHK_FAILED(result)) {
+					m_lastErrorName = "PUC_DecodeData error";
+					return false;
+				}
+				long long decoded = unwrapSequenceNo(xferData.nSequenceNo);
+				if (frameNo)
+					*frameNo = decoded;
+				return true;
+			}
+			if (m_payloads.isAllocated()) {
+				PayloadRing::Record record;
+				long long last = m_payloads.getLastSequenceNo();
+				if (last >= 0 && m_payloads.find(last, record) &&
+					PUC_CHK_SUCCEEDED(decodeFull(dst, (PUINT8)m_payloads.data(record), rowBytes)) && m_payloads.isIntact(record)) {
+					if (frameNo)
+						*frameNo = last;
+					return true;
+				}
+			}
+			FrameLease lease;
+			if (!acquireFrame(lease))
+				return false;
+			for (int y = 0; y < lease.height; y++)
+				memcpy(dst + size_t(y) * rowBytes, lease.data + size_t(y) * lease.rowBytes, lease.width);
+			if (frameNo)
+				*frameNo = lease.frameNo;
+			lease.release();
+			return true;
+		}
+
+		/*!
+			@~english
+				@brief Adds a subscriber with its own representation, rate and drop policy
+				@details Each representation is decoded once per frame, whatever the number of subscribers, and every subscriber gets a reference to
+					it in its mailbox (see FrameSubscription::next). Frames whose unwrapped sequence number is a multiple of rate are delivered.
+					Mailboxes hold pool buffers, the pools grow by the mailbox capacities at the next open, setResolution or resume.
+					While a subscription exists, the lazy decoding of setPayloadHistory is off and every frame is decoded in the transfer callback.
+				@param[in] kind SUBSCRIBE_FULL, SUBSCRIBE_PROXY, SUBSCRIBE_ROI or SUBSCRIBE_DCT
+				@param[in] rate Every rate-th frame is delivered
+				@param[in] policy What happens when the mailbox is full
+				@param[in] capacity Number of frames the mailbox holds
+				@param[in] x, y, width, height Region in frame coordinates for SUBSCRIBE_ROI, it must lie inside the decode ROI
+				@return The subscription, owned by the wrapper until unsubscribe
+			@~japanese
+				@brief 表現形式、レート、破棄ポリシーを指定して受信者を追加します。
+				@details 受信者の数によらず各表現形式はフレームごとに1回だけデコードされ、各受信者のメールボックスにはその参照が入ります
+					（FrameSubscription::next参照）。拡張シーケンス番号がrateの倍数のフレームが配信されます。
+					メールボックスはプールのバッファを保持するため、次のopen、setResolution、resumeでプールがメールボックスの容量分拡張されます。
+					購読がある間はsetPayloadHistoryの遅延デコードは無効になり、全フレームが転送コールバックでデコードされます。
+				@param[in] kind SUBSCRIBE_FULL、SUBSCRIBE_PROXY、SUBSCRIBE_ROI、SUBSCRIBE_DCTのいずれか
+				@param[in] rate rateフレームごとに配信します
+				@param[in] policy メールボックスが一杯の時の動作
+				@param[in] capacity メールボックスに保持するフレーム数
+				@param[in] x, y, width, height SUBSCRIBE_ROIの領域（フレーム座標）。デコードROI内である必要があります
+				@return 購読。unsubscribeまでラッパが所有します
+		*/
+		FrameSubscription* subscribe(SubscriptionKind kind, int rate = 1, SubscriptionDropPolicy policy = SUBSCRIPTION_DROP_OLDEST, int capacity = 4,
+			int x = 0, int y = 0, int width = 0, int height = 0) {
+			FrameSubscription* subscription = new FrameSubscription(kind, rate, policy, capacity, x, y, width, height);
+			std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+			m_subscriptions.push_back(subscription);
+			m_subscriptionCount.store((int)m_subscriptions.size(), std::memory_order_release);
+			return subscription;
+		}
+
+		// Removes and deletes the subscription, waiting frames are released. No thread may be inside its next() any more.
+		void unsubscribe(FrameSubscription* subscription) {
+			{
+				std::lock_guard<std::mutex> delivery(m_deliveryMutex);
+				std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+				for (size_t i = 0; i < m_subscriptions.size(); i++) {
+					if (m_subscriptions[i] == subscription) {
+						m_subscriptions.erase(m_subscriptions.begin() + i);
+						break;
+					}
+				}
+				m_subscriptionCount.store((int)m_subscriptions.size(), std::memory_order_release);
+			}
+			delete subscription;
+		}
+
 		void addListener(PUCLib_WrapperImageListener* listener) {
 			this->listener = listener;
 		}
@@ -73,15 +1498,43 @@ namespace photron {
 		/*!
 			@~english
 				@brief Sets the number of threads
-				@details Sets the number of threads for decode operation
+				@details Sets the number of threads for decode operation. Setting it turns the calibration of setDecodeAutoTune off.
 				@note This function is thread-safe.
 			@~japanese
 				@brief スレッド数の設定
-				@details デコード処理時のスレッド数を設定します。
+				@details デコード処理時のスレッド数を設定します。設定するとsetDecodeAutoTuneの計測は無効になります。
 				@note 本関数はスレッドセーフです。
 		*/
 		void setNumDecodeThreads(int num) {
 			m_numDecodeThreads = num;
+			m_decodeAutoTune = false;
+		}
+
+		/*!
+			@~english
+				@brief Calibrates the number of decode threads for every resolution
+				@details When enabled (default), open, setResolution and resume decode one real payload at several thread counts and keep the
+					fastest, then decide whether inter-frame decoding beats it (see setDecodeParallelism). Results are cached in a text file keyed by
+					resolution and CPU model, so a known configuration starts without measuring.
+				@param[in] enable Enables the calibration
+				@param[in] cacheFile Cache file, empty for PUCLib_Wrapper_decode.txt under %LOCALAPPDATA% (or the working directory)
+			@~japanese
+				@brief 解像度ごとにデコードスレッド数を計測します。
+				@details 有効な場合（デフォルト）、open、setResolution、resume時に実際の圧縮データを複数のスレッド数でデコードして最速の設定を採用し、
+					さらにフレーム間並列デコードの方が速いかを判定します（setDecodeParallelism参照）。結果は解像度とCPUモデルをキーにテキストファイルに
+					キャッシュされ、既知の設定では計測せずに開始します。
+				@param[in] enable 計測を有効にします
+				@param[in] cacheFile キャッシュファイル、空の場合は%LOCALAPPDATA%（またはカレントディレクトリ）のPUCLib_Wrapper_decode.txt
+		*/
+		void setDecodeAutoTune(bool enable, const std::string& cacheFile = std::string()) {
+			m_decodeAutoTune = enable;
+			m_decodeTuneCacheFile = cacheFile;
+			m_tunedWidth = m_tunedHeight = 0;
+		}
+
+		// Number of threads each frame is decoded with in the running transfer
+		int getNumDecodeThreads() const {
+			return m_activeDecodeThreads;
 		}
 
 		/*!
@@ -98,6 +1551,13 @@ namespace photron {
 		*/
 		~PUCLib_Wrapper() {
 			close();
+			for (size_t i = 0; i < m_subscriptions.size(); i++)
+				delete m_subscriptions[i];
+			if (m_targetState)
+				delete[] m_targetState;
+			releaseBatch();
+			if (m_xferBuffer)
+				delete[] m_xferBuffer;
 		}
 
 
@@ -138,7 +1598,13 @@ namespace photron {
 			PUCRESULT result = PUC_SUCCEEDED;
 			PUC_DETECT_INFO detectInfo = { 0 };
 
-			result = PUC_DetectDevice(&detectInfo);
+			if (m_source == NULL)
+			{
+				m_lastErrorName = "no capture source";
+				return PUC_ERROR_MODULE_LOAD;
+			}
+
+			result = m_source->detectDevice(&detectInfo);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_DetectDevice error";
@@ -150,17 +1616,17 @@ namespace photron {
 				goto EXIT_LABEL;
 			}
 
-			result = PUC_OpenDevice(detectInfo.nDeviceNoList[deviceID], &hDevice);
+			result = m_source->openDevice(detectInfo.nDeviceNoList[deviceID], &hDevice);
 			if (PUC_CHK_FAILED(result))
 			{
 				// Camera is Detected but cannot open then call reset
-				result = PUC_ResetDevice(detectInfo.nDeviceNoList[deviceID]);
+				result = m_source->resetDevice(detectInfo.nDeviceNoList[deviceID]);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_ResetDevice error";
 					goto EXIT_LABEL;
 				}
-				result = PUC_OpenDevice(detectInfo.nDeviceNoList[deviceID], &hDevice);
+				result = m_source->openDevice(detectInfo.nDeviceNoList[deviceID], &hDevice);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_ResetDevice error";
@@ -173,28 +1639,45 @@ namespace photron {
 				goto EXIT_LABEL;
 			}
 
-			result = PUC_SetFramerateShutter(hDevice, m_frameRate, m_shutterSpeedFps);
+			result = m_source->setFramerateShutter(hDevice, m_frameRate, m_shutterSpeedFps);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_SetFramerateShutter error";
 				goto EXIT_LABEL;
 			}
 
-			result = PUC_SetResolution(hDevice, m_resolutionWidth, m_resolutionHeight);
+			result = m_source->setResolution(hDevice, m_resolutionWidth, m_resolutionHeight);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_SetFramerateShutter error";
 				goto EXIT_LABEL;
 			}
 
-			result = PUC_SetXferDataMode(hDevice, PUC_DATA_COMPRESSED);
+			if (m_exposeOnClk > 0)
+			{
+				result = m_source->setExposeTime(hDevice, m_exposeOnClk, m_exposeOffClk);
+				if (PUC_CHK_FAILED(result))
+				{
+					m_lastErrorName = "PUC_SetExposeTime error";
+					goto EXIT_LABEL;
+				}
+			}
+
+			result = m_source->setXferDataMode(hDevice, PUC_DATA_COMPRESSED);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_SetXferDataMode error";
 				goto EXIT_LABEL;
 			}
 
-			result = PUC_GetXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
+			if (!m_modes.empty())
+			{
+				result = prepareModes();
+				if (PUC_CHK_FAILED(result))
+					goto EXIT_LABEL;
+			}
+
+			result = m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_GetXferDataSize error";
@@ -211,7 +1694,7 @@ namespace photron {
 			{
 				cleanupBuffer();
 
-				result = PUC_CloseDevice(hDevice);
+				result = m_source->closeDevice(hDevice);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_CloseDevice error";
@@ -259,7 +1742,8 @@ namespace photron {
 			if (hDevice)
 			{
 				cleanupBuffer();
-				result = PUC_CloseDevice(hDevice);
+				m_recorder.close();
+				result = m_source->closeDevice(hDevice);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_CloseDevice error";
@@ -315,71 +1799,806 @@ namespace photron {
 				@param[out] width of the image
 				@param[out] height of the image
 				@param[out] rowBytes, number of bytes per row
-				@return If successful, a pointer to the image buffer is returned (do not delete it, just read it)
-				@note This function is thread-safe.
+				@return If successful, a pointer to the image buffer is returned (do not delete it, just read it). The buffer stays valid until the next call.
+				@note Never blocks the transfer callback. Call from one consumer thread only.
 			@~japanese
 				@brief カメラから最新の画像を読み込みます。
 				@details 画像へのバッファと画像解像度を返します。
 				@param[out] 横解像度
 				@param[out] 縦解像度
 				@param[out] rowBytes １ラインあたりのバイト数
-				@return 成功した場合画像バッファへのポインタが返されます。(デリートしないでください。読み込み対応のみです。)
-				@note 本関数はスレッドセーフです。
+				@return 成功した場合画像バッファへのポインタが返されます。(デリートしないでください。読み込み対応のみです。)バッファは次の呼び出しまで有効です。
+				@note 転送コールバックをブロックしません。1つのスレッドからのみ呼び出してください。
 		*/
 		unsigned char* read(int& width, int& height, int& rowBytes)
 		{
 			int index = 0;
+			FrameLease lease;
+			if (!acquireFrame(lease))
+				return NULL;
+
+			// Keep the frame leased until the next read(), so no lock or copy is needed
+			m_readLease[index].release();
+			m_readLease[index] = lease;
+
+			width = lease.width;
+			height = lease.height;
+			rowBytes = lease.rowBytes;
+			return lease.data;
+		}
+
+		/*!
+			@~english
+				@brief Restricts the streaming decode to a region of interest
+				@details The rectangle is grown to the 8x8 blocks it touches and clipped to the resolution, only that part of every payload is
+					decoded. read, acquireFrame, the listener and the frame history then deliver frames of the aligned size (see getDecodeROI).
+					The proxy stream and decodeFrameAt still decode the full frame. An empty rectangle decodes the full frame again.
+					While streaming the buffers are set up again, like setResolution.
+				@param[in] x Left of the region
+				@param[in] y Top of the region
+				@param[in] width Width of the region, 0 for the full frame
+				@param[in] height Height of the region, 0 for the full frame
+				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
+			@~japanese
+				@brief ストリーミング中のデコードを注目領域に限定します。
+				@details 矩形は含まれる8x8ブロック単位に拡張され、解像度内に切り詰められます。各圧縮データのその部分だけがデコードされ、
+					read、acquireFrame、リスナー、フレーム履歴は調整後のサイズのフレームを返します（getDecodeROI参照）。
+					プロキシ画像とdecodeFrameAtは引き続きフル画像をデコードします。空の矩形を指定するとフル画像のデコードに戻ります。
+					ストリーミング中はsetResolutionと同様にバッファを再設定します。
+				@param[in] x 領域の左端
+				@param[in] y 領域の上端
+				@param[in] width 領域の横幅、0の場合はフル画像
+				@param[in] height 領域の高さ、0の場合はフル画像
+				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
+		*/
+		PUCRESULT setDecodeROI(UINT32 x, UINT32 y, UINT32 width, UINT32 height) {
+			m_roiX = x;
+			m_roiY = y;
+			m_roiWidth = width;
+			m_roiHeight = height;
 			if (hDevice == NULL)
+				return PUC_SUCCEEDED;
+			return setupDataBuffer();
+		}
+
+		/*!
+			@~english
+				@brief Computes statistics of a region of every frame decoded into the frame pool
+				@details Histogram, mean, min/max, the sum of every row and column and the outermost columns above threshold (see FrameStats)
+					are computed by the decode worker right after it decoded the rows, while they are still in cache. They come with the frame in
+					FrameLease::stats, so consumers never read the pixels again. A frame decoded on one thread is decoded in bands of block rows
+					and each band goes through the statistics while hot. The region is clipped to the decode ROI and may be moved at any time,
+					it takes effect from the next decoded frame. Enabling it the first time while streaming sets the buffers up again.
+				@param[in] x Left of the region
+				@param[in] y Top of the region
+				@param[in] width Width of the region, 0 to stop computing statistics
+				@param[in] height Height of the region
+				@param[in] threshold Pixels above this value are counted for FrameStats::firstAbove and lastAbove
+				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
+			@~japanese
+				@brief フレームプールにデコードされる各フレームの領域の統計値を計算します。
+				@details ヒストグラム、平均、最小・最大、各行・各列の合計、しきい値を超える両端の列（FrameStats参照）を、デコードワーカーが
+					行をデコードした直後のキャッシュにある間に計算します。統計値はFrameLease::statsでフレームと共に渡されるため、利用側が画素を
+					再度読む必要はありません。1スレッドでデコードするフレームはブロック行の帯ごとにデコードされ、各帯はキャッシュにある間に集計されます。
+					領域はデコードROI内に切り詰められ、いつでも移動でき、次にデコードされるフレームから有効になります。
+					ストリーミング中に初めて有効にした場合はバッファを再設定します。
+				@param[in] x 領域の左端
+				@param[in] y 領域の上端
+				@param[in] width 領域の横幅、0の場合は統計値を計算しません
+				@param[in] height 領域の高さ
+				@param[in] threshold この値を超える画素がFrameStats::firstAbove、lastAboveの対象になります
+				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
+		*/
+		PUCRESULT setFrameStats(UINT32 x, UINT32 y, UINT32 width, UINT32 height, int threshold = 128) {
+			if (width > 0xFFFF || height > 0xFFFF || x > 0xFFFF || y > 0xFFFF)
+				return PUC_ERROR_ILLEGAL_ARG;
+			m_statsThreshold.store(threshold < 0 ? 0 : threshold > 255 ? 255 : threshold, std::memory_order_relaxed);
+			m_statsRegion.store(UINT64(x) | UINT64(y) << 16 | UINT64(width) << 32 | UINT64(height) << 48, std::memory_order_release);
+			if (hDevice == NULL || width == 0 || height == 0 || !m_frameStats.empty())
+				return PUC_SUCCEEDED;
+			return setupDataBuffer();
+		}
+
+		// Block aligned region decoded by the stream, the requested one clipped to the resolution if not streaming yet
+		void getDecodeROI(UINT32& x, UINT32& y, UINT32& width, UINT32& height) const {
+			if (hDevice == NULL) {
+				alignDecodeROI(m_resolutionWidth, m_resolutionHeight, x, y, width, height);
+				return;
+			}
+			x = m_decodeX;
+			y = m_decodeY;
+			width = m_decodeWidth;
+			height = m_decodeHeight;
+		}
+
+		/*!
+			@~english
+				@brief Reads a region of the latest image
+				@details The region must be inside the decode ROI (see setDecodeROI and getDecodeROI), a read never sets the stream up again.
+					A consumer that sets the decode ROI to the region once only pays for decoding its blocks.
+				@param[in] x Left of the region
+				@param[in] y Top of the region
+				@param[in] width Width of the region
+				@param[in] height Height of the region
+				@param[out] rowBytes Number of bytes per row of the returned buffer
+				@return Pointer to the top left pixel of the region, valid until the next call of read or readROI. NULL if no frame is available or the region is not inside the decode ROI.
+				@note Call from one consumer thread only.
+			@~japanese
+				@brief 最新画像の一部の領域を読み込みます。
+				@details 領域はデコードROIに含まれている必要があります（setDecodeROI、getDecodeROI参照）。読み込みでストリームを再設定することはありません。
+					デコードROIを一度その領域に設定すれば、その領域のブロックのデコード負荷のみになります。
+				@param[in] x 領域の左端
+				@param[in] y 領域の上端
+				@param[in] width 領域の横幅
+				@param[in] height 領域の高さ
+				@param[out] rowBytes 返されたバッファの１ラインあたりのバイト数
+				@return 領域の左上の画素へのポインタ。次のreadまたはreadROIの呼び出しまで有効です。フレームが無い場合、または領域がデコードROIに含まれていない場合はNULLを返します。
+				@note 1つのスレッドからのみ呼び出してください。
+		*/
+		unsigned char* readROI(UINT32 x, UINT32 y, UINT32 width, UINT32 height, int& rowBytes) {
+			if (width == 0 || height == 0)
 				return NULL;
-			if (m_frameSampleRate[index] == 0)
+			UINT32 roiX, roiY, roiWidth, roiHeight;
+			getDecodeROI(roiX, roiY, roiWidth, roiHeight);
+			if (x < roiX || y < roiY || x + width > roiX + roiWidth || y + height > roiY + roiHeight) {
+				m_lastErrorName = "readROI region outside the decode ROI";
+				return NULL;
+			}
+			int frameWidth, frameHeight;
+			unsigned char* frame = read(frameWidth, frameHeight, rowBytes);
+			if (!frame || frameWidth != (int)roiWidth || frameHeight != (int)roiHeight)
 				return NULL;
+			return frame + size_t(y - roiY) * rowBytes + (x - roiX);
+		}
+
+		/*!
+			@~english
+				@brief Leases the latest full sized image from the camera
+				@details The image stays valid until lease.release() is called, later frames are decoded into other buffers of the pool.
+				@param[out] lease The leased image, its geometry, sequence number and arrival timestamp
+				@return True if a frame was leased, false if no frame has been decoded yet or decoding failed
+				@note This function is thread-safe and never blocks the transfer callback.
+				@see setFramePoolSize
+			@~japanese
+				@brief カメラから最新の画像をリースします。
+				@details lease.release()を呼ぶまで画像は有効です。以降のフレームはプール内の別のバッファにデコードされます。
+				@param[out] lease リースした画像、その解像度、シーケンス番号、受信時刻
+				@return リースできた場合は真(true)、まだフレームがデコードされていないかデコードに失敗した場合は偽(false)を返します。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+				@see setFramePoolSize
+		*/
+		bool acquireFrame(FrameLease& lease) {
+			int index = 0;
+			if (hDevice == NULL)
+				return false;
+			if (m_frameSampleRate[index].load(std::memory_order_relaxed) == 0)
+				return false;
+			if (m_isSingleThread && !decodeSingle(index))
+				return false;
+			if (isDecodingLazily())
+				decodeLatestPayload(index);
+			if (!m_fullPool.acquire(lease))
+				return false;
+			nReadSequenceNo[index].store(lease.sequenceNo, std::memory_order_relaxed);
+			return true;
+		}
 
-			int readBuffer = m_readBuffer[index];
-			if (m_isSingleThread)
+		/*!
+			@~english
+				@brief Waits until a full sized frame newer than afterFrameNo is available
+				@details Sleeps on a condition variable that the transfer callback signals when it publishes a frame (or, in lazy decode mode,
+					stores a payload), so waiting costs no CPU. Frame numbers are the 64 bit sequence numbers of FrameLease::frameNo.
+				@param[in] afterFrameNo Last frame number seen, -1 to wait for any frame
+				@param[in] timeoutMs Maximum wait in milliseconds, negative waits forever
+				@return The newest available frame number, or -1 on timeout or in single thread mode
+			@~japanese
+				@brief afterFrameNoより新しいフル画像が利用可能になるまで待機します。
+				@details 転送コールバックがフレームを公開した時（遅延デコードモードではペイロードを格納した時）に通知する条件変数で待機するため、
+					待機中にCPUを消費しません。フレーム番号はFrameLease::frameNoの64ビットのシーケンス番号です。
+				@param[in] afterFrameNo 最後に確認したフレーム番号、任意のフレームを待つ場合は-1
+				@param[in] timeoutMs 最大待機時間（ミリ秒）、負の値の場合は無期限に待機します
+				@return 利用可能な最新のフレーム番号、タイムアウトまたはシングルスレッドモードの場合は-1を返します。
+		*/
+		long long waitForFrame(long long afterFrameNo, int timeoutMs) {
+			if (hDevice == NULL || m_isSingleThread)
+				return -1;
+			long long available = m_availableFrameNo[0].load();
+			if (available > afterFrameNo)
+				return available;
+			m_frameWaiters.fetch_add(1);
 			{
-				
-				result = PUC_GetSingleXferData(hDevice, &xferData);
-#ifdef USE_DECODE_MULITHRREAD
-				result = PUC_DecodeDataMultiThread(pDecodeBuf[readBuffer], 0, 0, nWidth, nHeight, nLineBytes, xferData.pData, q, m_numDecodeThreads);
-#else
-				result = PUC_DecodeData(pDecodeBuf[readBuffer], 0, 0, nWidth, nHeight, nLineBytes, xferData.pData, q);
-#endif
-				nSequenceNo[index] = xferData.nSequenceNo;
+				std::unique_lock<std::mutex> lock(m_frameMutex);
+				auto arrived = [&] { return (available = m_availableFrameNo[0].load()) > afterFrameNo; };
+				if (timeoutMs < 0)
+					m_frameArrived.wait(lock, arrived);
+				else
+					m_frameArrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), arrived);
 			}
-			else
-			{
-				int copyBuffer = 2;
-
-#if 0
-				// Block for a while
-				if (nReadSequenceNo[index] == nSequenceNo[index]) {
-					int numTries = 0;
-					while (numTries < 100000000) {
-						if (nReadSequenceNo[index] != nSequenceNo[index])
+			m_frameWaiters.fetch_sub(1);
+			return available > afterFrameNo ? available : -1;
+		}
+
+		/*!
+			@~english
+				@brief Leases the next full sized frame, waiting for it if the latest one was already returned
+				@details Unlike acquireFrame, never returns the same frame twice. Frames published between two calls are skipped,
+					only the newest is leased and skipped reports how many were passed over. Call from one consumer thread only.
+				@param[out] lease The leased image, see acquireFrame
+				@param[in] timeoutMs Maximum wait in milliseconds, negative waits forever
+				@param[out] skipped If not NULL, number of frames between the previous call and this one that were not returned
+				@return True if a new frame was leased, false on timeout or, in lazy decode mode, when every frame slot is leased
+				@see waitForFrame
+			@~japanese
+				@brief 次のフル画像をリースします。最新の画像が返却済みの場合は到着まで待機します。
+				@details acquireFrameと異なり、同じフレームを2回返しません。呼び出しの間に公開されたフレームは読み飛ばされ、
+					最新のものだけをリースし、読み飛ばした数をskippedで返します。1つのスレッドからのみ呼び出してください。
+				@param[out] lease リースした画像（acquireFrame参照）
+				@param[in] timeoutMs 最大待機時間（ミリ秒）、負の値の場合は無期限に待機します
+				@param[out] skipped NULLでない場合、前回の呼び出しから今回までに返されなかったフレーム数
+				@return 新しいフレームをリースできた場合は真(true)、タイムアウトの場合、または遅延デコードモードで全てのフレームスロットがリース中の場合は偽(false)を返します。
+				@see waitForFrame
+		*/
+		bool readNext(FrameLease& lease, int timeoutMs, long long* skipped = NULL) {
+			if (m_isSingleThread) {
+				// Every call fetches a fresh payload from the device
+				if (!acquireFrame(lease))
+					return false;
+			}
+			else {
+				std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+				long long announced = m_readNextFrameNo;
+				for (;;) {
+					int remaining = -1;
+					if (timeoutMs >= 0) {
+						remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+						if (remaining < 0)
+							remaining = 0;
+					}
+					announced = waitForFrame(announced, remaining);
+					if (announced < 0)
+						return false;
+					// Every slot is leased: nothing to decode into until the caller releases one
+					if (isDecodingLazily() && !decodeLatestPayload(0))
+						return false;
+					if (acquireFrame(lease)) {
+						if (lease.frameNo > m_readNextFrameNo)
 							break;
-						numTries++;
+						lease.release();
 					}
+					// Announced but dropped or not decodable, sleep until a newer one is announced
 				}
-#endif
+			}
+			if (skipped)
+				*skipped = m_readNextFrameNo < 0 || lease.frameNo < m_readNextFrameNo ? 0 : lease.frameNo - m_readNextFrameNo - 1;
+			m_readNextFrameNo = lease.frameNo;
+			return true;
+		}
 
-				std::lock_guard<std::mutex> guard(m_mutex);
-				readBuffer = m_readBuffer[index];
-				
-				memcpy(pDecodeBuf[copyBuffer], pDecodeBuf[readBuffer], int(nLineBytes) * int(nHeight));
+		// Newest frame number published on a stream (SUBSCRIBE_ROI counts as full), -1 if none yet
+		long long getAvailableFrameNo(SubscriptionKind kind = SUBSCRIBE_FULL) const {
+			return m_availableFrameNo[streamIndex(kind)].load();
+		}
 
-				readBuffer = copyBuffer;
+		/*!
+			@~english
+				@brief Registers a waiter that is woken from the transfer callback when a newer frame of its stream is published
+				@details The building block of the coroutine interface (PUCLib_Coroutine.h): nothing blocks, waiter->wake is called once
+					under the wrapper's lock, so it should only queue the waiter for later. The waiter must stay valid until it was woken
+					or removeFrameWaiter returned true. Not available in single thread mode.
+				@param[in] waiter kind, afterFrameNo, wake and context must be set
+				@return True if the waiter was registered, false if such a frame is already available (wake is not called)
+			@~japanese
+				@brief ストリームの新しいフレームが公開された時に転送コールバックから起こされる待機者を登録します。
+				@details コルーチンインターフェース（PUCLib_Coroutine.h）の基礎となる機能で、ブロックしません。waiter->wakeはラッパのロック中に
+					1回だけ呼ばれるため、待機者を後で処理するためにキューに入れるだけにしてください。待機者は起こされるか、removeFrameWaiterが
+					真を返すまで有効である必要があります。シングルスレッドモードでは使用できません。
+				@param[in] waiter kind、afterFrameNo、wake、contextを設定してください
+				@return 登録した場合は真(true)、該当するフレームが既に利用可能な場合は偽(false)を返します（wakeは呼ばれません）。
+		*/
+		bool addFrameWaiter(FrameWaiter* waiter) {
+			// Counted before the check, so a frame published in between either is seen here or finds the waiter
+			m_frameWaiters.fetch_add(1);
+			std::lock_guard<std::mutex> guard(m_frameMutex);
+			if (getAvailableFrameNo(waiter->kind) > waiter->afterFrameNo) {
+				m_frameWaiters.fetch_sub(1);
+				return false;
 			}
-			if (PUC_CHK_FAILED(result))
-			{
-				m_lastErrorName = "PUC_DecodeData error";
-				return NULL;
+			waiter->next = m_frameWaiterList;
+			waiter->linked = true;
+			m_frameWaiterList = waiter;
+			return true;
+		}
+
+		// Takes a waiter back, e.g. on timeout. Returns false if it was woken already, its wake call has then completed.
+		bool removeFrameWaiter(FrameWaiter* waiter) {
+			std::lock_guard<std::mutex> guard(m_frameMutex);
+			if (!waiter->linked)
+				return false;
+			for (FrameWaiter** link = &m_frameWaiterList; *link; link = &(*link)->next) {
+				if (*link == waiter) {
+					*link = waiter->next;
+					break;
+				}
+			}
+			waiter->next = NULL;
+			waiter->linked = false;
+			m_frameWaiters.fetch_sub(1);
+			return true;
+		}
+
+		/*!
+			@~english
+				@brief Leases the latest proxy image from the camera
+				@param[out] lease The leased proxy image, its geometry, sequence number and arrival timestamp
+				@return True if a frame was leased, false if no proxy has been decoded yet or decoding failed
+				@note This function is thread-safe and never blocks the transfer callback.
+				@see acquireFrame
+			@~japanese
+				@brief カメラから最新のプロキシ画像をリースします。
+				@param[out] lease リースしたプロキシ画像、その解像度、シーケンス番号、受信時刻
+				@return リースできた場合は真(true)、まだプロキシがデコードされていないかデコードに失敗した場合は偽(false)を返します。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+				@see acquireFrame
+		*/
+		bool acquireProxy(FrameLease& lease) {
+			int index = 1;
+			if (hDevice == NULL)
+				return false;
+			if (m_frameSampleRate[index].load(std::memory_order_relaxed) == 0)
+				return false;
+			if (m_isSingleThread && !decodeSingle(index))
+				return false;
+			if (isDecodingLazily())
+				decodeLatestPayload(index);
+			if (!m_proxyPool.acquire(lease))
+				return false;
+			nReadSequenceNo[index].store(lease.sequenceNo, std::memory_order_relaxed);
+			return true;
+		}
+
+		/*!
+			@~english
+				@brief Leases the DCT coefficients of the latest sampled frame
+				@details The lease holds INT16 coefficients covering the decode ROI in whole 8x8 blocks: block (bx, by) keeps its 64 coefficients
+					in place at rows by * 8 .. by * 8 + 7 and columns bx * 8 .. bx * 8 + 7, the DC coefficient top left. lease.width and lease.height are
+					in coefficients, lease.rowBytes in bytes. See PUCLib_DCTKernels.h for block energy, edge map and block difference.
+				@param[out] lease The leased coefficients, their geometry, sequence number and arrival timestamp
+				@return True if coefficients were leased, false if none have been decoded yet (see setDCTSampleRate)
+				@note This function is thread-safe and never blocks the transfer callback.
+			@~japanese
+				@brief 最新のサンプリングフレームのDCT係数をリースします。
+				@details リースはデコードROIを8x8ブロック単位で覆うINT16の係数を保持します。ブロック(bx, by)の64個の係数は
+					by * 8 .. by * 8 + 7行、bx * 8 .. bx * 8 + 7列にそのまま格納され、DC係数は左上です。lease.width、lease.heightは係数単位、
+					lease.rowBytesはバイト単位です。ブロックエネルギー、エッジマップ、ブロック差分はPUCLib_DCTKernels.hを参照してください。
+				@param[out] lease リースした係数、その解像度、シーケンス番号、受信時刻
+				@return リースできた場合は真(true)、まだ係数がデコードされていない場合は偽(false)を返します（setDCTSampleRate参照）。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+		*/
+		bool acquireDCT(FrameLease& lease) {
+			int index = 2;
+			if (hDevice == NULL || !m_dctPool.isAllocated())
+				return false;
+			if (m_frameSampleRate[index].load(std::memory_order_relaxed) == 0)
+				return false;
+			if (m_isSingleThread && !decodeSingle(index))
+				return false;
+			if (isDecodingLazily())
+				decodeLatestPayload(index);
+			if (!m_dctPool.acquire(lease))
+				return false;
+			nReadSequenceNo[index].store(lease.sequenceNo, std::memory_order_relaxed);
+			return true;
+		}
+
+		/*!
+			@~english
+				@brief Sets the number of buffers in the full and proxy frame pools
+				@details Every lease held by a consumer keeps one buffer out of the pool; when none is free incoming frames are dropped. Takes effect at the next open, setResolution or resume.
+				@param[in] count Number of buffers per pool (minimum 3)
+			@~japanese
+				@brief フル画像とプロキシ画像のフレームプールのバッファ数を設定します。
+				@details 利用者が保持するリース毎にバッファが1つ使用されます。空きがない場合、受信したフレームは破棄されます。次のopen、setResolution、resumeから有効になります。
+				@param[in] count プール毎のバッファ数（最小3）
+		*/
+		void setFramePoolSize(int count) {
+			m_framePoolSize = count;
+		}
+
+		/*!
+			@~english
+				@brief Backs the frame pools with large pages
+				@details The pools live in one page aligned arena sized for the largest resolution of the device, allocated at the first open and
+					reused by setResolution, pause/resume and later opens. Large pages cut TLB misses on full sized frames but need the
+					"Lock pages in memory" privilege; without it normal pages are used (see usesLargePages) and kept, the arena is not allocated
+					again on every restart. Takes effect when the arena is allocated.
+				@param[in] enable True to request large pages
+			@~japanese
+				@brief フレームプールにラージページを使用します。
+				@details プールはデバイスの最大解像度に合わせたページ境界の1つの領域に置かれ、最初のopenで確保され、setResolution、pause/resume、
+					以降のopenで再利用されます。ラージページはフル画像のTLBミスを減らしますが、「メモリ内のページのロック」特権が必要です。
+					特権がない場合は通常のページを使用し（usesLargePages参照）、再開の度に領域を確保し直すことはありません。領域の確保時に有効になります。
+				@param[in] enable ラージページを要求する場合は真(true)
+		*/
+		void setLargePages(bool enable) {
+			m_arena.setLargePages(enable);
+		}
+
+		bool usesLargePages() const {
+			return m_arena.usesLargePages();
+		}
+
+		/*!
+			@~english
+				@brief Moves decoding out of the transfer callback into a pool of worker threads
+				@details The callback then only copies each payload into a bounded queue. What happens when the queue is full is set by policy,
+					every decision is counted (see getDecodeQueueStats). With several workers, frames still reach the listener in the order they left the queue.
+					Takes effect at the next open, setResolution or resume.
+				@param[in] numWorkers Number of decode threads, 0 decodes in the transfer callback (default)
+				@param[in] queueCapacity Number of payloads the queue holds
+				@param[in] policy Overflow behaviour
+			@~japanese
+				@brief デコード処理を転送コールバックからワーカースレッドのプールに移します。
+				@details コールバックは圧縮データを上限付きのキューにコピーするだけになります。キューが一杯の時の動作はpolicyで指定し、
+					すべての判断が計数されます（getDecodeQueueStats参照）。ワーカーが複数の場合も、フレームはキューから取り出した順にリスナーに届きます。
+					次のopen、setResolution、resumeから有効になります。
+				@param[in] numWorkers デコードスレッド数、0の場合は転送コールバック内でデコードします（デフォルト）
+				@param[in] queueCapacity キューに保持する圧縮データ数
+				@param[in] policy キューが一杯の時の動作
+		*/
+		void setDecodeWorkers(int numWorkers, int queueCapacity = 64, DecodeQueuePolicy policy = DECODE_QUEUE_DROP_OLDEST) {
+			m_numDecodeWorkers = numWorkers;
+			m_decodeQueueCapacity = queueCapacity < 1 ? 1 : queueCapacity;
+			m_decodeQueuePolicy = policy;
+		}
+
+		/*!
+			@~english
+				@brief Chooses between intra-frame and inter-frame parallel decoding
+				@details Intra-frame decodes one frame at a time with PUC_DecodeDataMultiThread. Inter-frame decodes consecutive payloads
+					on different decode workers with one thread each and reorders them before delivery, which scales far better on small frames.
+					DECODE_PARALLEL_AUTO (default) picks inter-frame for frames below DECODE_INTER_FRAME_MAX_PIXELS. Inter-frame uses the workers set by
+					setDecodeWorkers, or one per core but one if none are set. Takes effect at the next open, setResolution or resume.
+			@~japanese
+				@brief フレーム内並列デコードとフレーム間並列デコードを切り替えます。
+				@details フレーム内並列は1フレームずつPUC_DecodeDataMultiThreadでデコードします。フレーム間並列は連続する圧縮データを
+					別々のデコードワーカーが1スレッドずつデコードし、並べ替えてから配信します。小さいフレームではこちらの方がよくスケールします。
+					DECODE_PARALLEL_AUTO（デフォルト）ではDECODE_INTER_FRAME_MAX_PIXELS未満のフレームでフレーム間並列を選択します。フレーム間並列では
+					setDecodeWorkersで設定したワーカー数、未設定の場合はコア数-1のワーカーを使用します。次のopen、setResolution、resumeから有効になります。
+		*/
+		void setDecodeParallelism(DecodeParallelism mode) {
+			m_decodeParallelism = mode;
+		}
+
+		// True if the running transfer decodes consecutive frames on separate workers
+		bool isInterFrameDecoding() const {
+			return m_activeDecodeThreads == 1 && m_activeDecodeWorkers > 1;
+		}
+
+		// Counters of the decode queue: enqueued, decoded and every overflow decision
+		DecodeQueueStats getDecodeQueueStats() const {
+			return m_decodeQueue.getStats();
+		}
+
+		/*!
+			@~english
+				@brief Decodes full frames only when the scene changed
+				@details Every payload due for a full decode (listener, subscriptions, readNext, target buffers) is first decoded to the DC proxy,
+					which proxyChanges compares with the proxy of the last fully decoded frame. Below minChangedBlocks changed blocks inside the
+					decode ROI the full decode is skipped: no frame is delivered and readers keep the previous one. With changedRegionsOnly the
+					previous frame is copied and only the bounding box of the changed blocks is decoded over it, when the box is under half the
+					frame and frames are decoded in order (no inter-frame workers). Inter-frame workers compare the proxies in stream order, so
+					they skip the same frames one thread would. Counters are reported by getMotionGateStats.
+				@param[in] blockThreshold Change of a block's DC value that counts as motion, 0 turns the gate off
+				@param[in] minChangedBlocks Number of changed blocks that opens the gate
+				@param[in] changedRegionsOnly Decode only the changed region over the previous frame
+			@~japanese
+				@brief シーンが変化した場合のみフル画像をデコードします。
+				@details フル画像のデコード対象となる圧縮データ（リスナー、購読、readNext、ターゲットバッファ）は、まずDCプロキシにデコードされ、
+					proxyChangesで最後にフルデコードしたフレームのプロキシと比較されます。デコードROI内の変化ブロックがminChangedBlocks未満の場合は
+					フルデコードを省略し、フレームは配信されず、読み出しは直前のフレームのままになります。changedRegionsOnlyの場合、
+					変化ブロックの外接矩形がフレームの半分未満で、フレームが順番にデコードされる場合（フレーム間並列なし）は、直前のフレームを
+					コピーして外接矩形のみをデコードします。フレーム間並列のワーカーもプロキシをストリームの順に比較するため、1スレッドの場合と
+					同じフレームを省略します。カウンタはgetMotionGateStatsで取得できます。
+				@param[in] blockThreshold 動きとみなすブロックのDC値の変化量、0の場合は無効
+				@param[in] minChangedBlocks デコードを行う変化ブロック数
+				@param[in] changedRegionsOnly 変化した領域のみを直前のフレームに上書きデコードします
+		*/
+		void setMotionGate(int blockThreshold, int minChangedBlocks = 1, bool changedRegionsOnly = false) {
+			std::lock_guard<std::mutex> guard(m_gateMutex);
+			m_gateThreshold.store(blockThreshold > 0 ? blockThreshold : 0, std::memory_order_release);
+			m_gateMinBlocks = minChangedBlocks > 0 ? minChangedBlocks : 1;
+			m_gateChangedRegionsOnly = changedRegionsOnly;
+			m_gateReferenceFrameNo = -1;
+		}
+
+		MotionGateStats getMotionGateStats() const {
+			std::lock_guard<std::mutex> guard(m_gateMutex);
+			return m_gateStats;
+		}
+
+		/*!
+			@~english
+				@brief Keeps the last decoded full frames in a history indexed by sequence number
+				@details The history is one contiguous buffer of capacity frames allocated with the other buffers, so no memory is allocated per frame.
+					Sequence numbers are unwrapped to 64 bits. Takes effect at the next open, setResolution or resume.
+				@param[in] capacity Number of frames to keep, 0 disables the history
+				@see frameAt
+				@see range
+			@~japanese
+				@brief デコードした最新のフル画像をシーケンス番号で参照できる履歴に保持します。
+				@details 履歴は他のバッファと同時に確保される連続した1つのバッファで、フレーム毎のメモリ確保は行われません。
+					シーケンス番号は64ビットに拡張されます。次のopen、setResolution、resumeから有効になります。
+				@param[in] capacity 保持するフレーム数、0で履歴を無効にします
+				@see frameAt
+				@see range
+		*/
+		void setFrameHistory(int capacity) {
+			m_historyCapacity = capacity;
+		}
+
+		/*!
+			@~english
+				@brief Returns a frame of the history
+				@details Geometry of history frames is given by getFrameHistory(). Frames are overwritten once capacity newer frames have arrived,
+					call isFrameValid() after using the frame to make sure it was not overwritten meanwhile.
+				@param[in] sequenceNo Unwrapped sequence number of the frame
+				@return A pointer to the frame or NULL if the frame is not held
+				@note This function is thread-safe and never blocks the transfer callback.
+			@~japanese
+				@brief 履歴のフレームを返します。
+				@details 履歴フレームの解像度はgetFrameHistory()で得られます。capacity枚の新しいフレームが届くと上書きされるため、
+					使用後にisFrameValid()で上書きされていないことを確認してください。
+				@param[in] sequenceNo フレームの拡張シーケンス番号
+				@return フレームへのポインタ。保持していない場合はNULLを返します。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+		*/
+		const UINT8* frameAt(long long sequenceNo) const {
+			return m_history.frameAt(sequenceNo);
+		}
+
+		/*!
+			@~english
+				@brief Returns the frames [from, to] of the history
+				@details The frames that are held are returned as at most two spans of consecutive frames stored back to back.
+				@param[in] from First unwrapped sequence number
+				@param[in] to Last unwrapped sequence number
+				@param[out] spans Receives the spans
+				@return Number of spans (0 to 2)
+				@note This function is thread-safe and never blocks the transfer callback.
+			@~japanese
+				@brief 履歴のフレーム[from, to]を返します。
+				@details 保持しているフレームを、連続して格納された最大2つの範囲として返します。
+				@param[in] from 先頭の拡張シーケンス番号
+				@param[in] to 最後の拡張シーケンス番号
+				@param[out] spans 範囲の格納先
+				@return 範囲の数（0～2）
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+		*/
+		int range(long long from, long long to, HistorySpan spans[2]) const {
+			return m_history.range(from, to, spans);
+		}
+
+		/*!
+			@~english
+				@brief Keeps the compressed payloads of the last frames
+				@details Payloads are much smaller than decoded frames, so the same memory holds a far longer history than setFrameHistory.
+					They are appended to one preallocated ring of the given size and decoded only when requested with decodeFrameAt or decodeProxyAt.
+					Takes effect at the next open, setResolution or resume.
+				@param[in] bytes Size of the ring in bytes, 0 disables it
+				@param[in] lazyDecode If true the transfer callback only stores payloads and read(), readProxy() and acquireFrame() decode the latest one on demand.
+					Ignored while a listener, a batch listener, target buffers or a subscription (see subscribe) is set, they need every frame decoded.
+				@see decodeFrameAt
+			@~japanese
+				@brief 最新フレームの圧縮データを保持します。
+				@details 圧縮データはデコード済み画像よりはるかに小さいため、setFrameHistoryと同じメモリでより長い履歴を保持できます。
+					事前に確保した指定サイズのリングに追記され、decodeFrameAtまたはdecodeProxyAtで要求された時のみデコードされます。
+					次のopen、setResolution、resumeから有効になります。
+				@param[in] bytes リングのバイト数、0で無効にします
+				@param[in] lazyDecode 真(true)の場合、転送コールバックは圧縮データの保存のみを行い、read()、readProxy()、acquireFrame()が最新のデータを必要な時にデコードします。
+					リスナー、バッチリスナー、ターゲットバッファ、購読（subscribe参照）が設定されている間は全フレームのデコードが必要なため無視されます。
+				@see decodeFrameAt
+		*/
+		void setPayloadHistory(size_t bytes, bool lazyDecode = false) {
+			m_payloadHistoryBytes = bytes;
+			m_lazyDecode = lazyDecode;
+		}
+
+		/*!
+			@~english
+				@brief Decodes a full frame of the payload history
+				@param[in] sequenceNo Unwrapped sequence number of the frame
+				@param[out] dst Destination buffer, at least rowBytes * height bytes (see getResolution)
+				@param[in] rowBytes Number of bytes per row of dst, a multiple of 4 not smaller than the width
+				@return True if the payload was held and decoded intact
+				@note This function is thread-safe and never blocks the transfer callback.
+			@~japanese
+				@brief 圧縮データ履歴のフル画像をデコードします。
+				@param[in] sequenceNo フレームの拡張シーケンス番号
+				@param[out] dst 展開先バッファ。rowBytes * 高さ以上のサイズが必要です（getResolution参照）
+				@param[in] rowBytes dstの１ラインあたりのバイト数。横幅以上の4の倍数
+				@return 圧縮データが保持されていて正常にデコードできた場合は真(true)を返します。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+		*/
+		bool decodeFrameAt(long long sequenceNo, UINT8* dst, UINT32 rowBytes) {
+			PayloadRing::Record record;
+			if (!m_payloads.find(sequenceNo, record))
+				return false;
+			PUCRESULT res = m_source->decodeDataMultiThread(dst, 0, 0, nWidth, nHeight, rowBytes, (PUINT8)m_payloads.data(record), q, m_numDecodeThreads);
+			return PUC_CHK_SUCCEEDED(res) && m_payloads.isIntact(record);
+		}
+
+		/*!
+			@~english
+				@brief Decodes the proxy (DC) image of a frame of the payload history
+				@param[in] sequenceNo Unwrapped sequence number of the frame
+				@param[out] dst Destination buffer of (width / 8) * (height / 8) bytes, rounded up
+				@return True if the payload was held and decoded intact
+				@note This function is thread-safe and never blocks the transfer callback.
+			@~japanese
+				@brief 圧縮データ履歴のプロキシ（DC）画像をデコードします。
+				@param[in] sequenceNo フレームの拡張シーケンス番号
+				@param[out] dst (横幅 / 8) * (高さ / 8)（切り上げ）バイトの展開先バッファ
+				@return 圧縮データが保持されていて正常にデコードできた場合は真(true)を返します。
+				@note 本関数はスレッドセーフで、転送コールバックをブロックしません。
+		*/
+		bool decodeProxyAt(long long sequenceNo, UINT8* dst) {
+			PayloadRing::Record record;
+			if (!m_payloads.find(sequenceNo, record))
+				return false;
+			PUCRESULT res = m_source->decodeDCData(dst, 0, 0, nBlockCountX, nBlockCountY, (PUINT8)m_payloads.data(record));
+			return PUC_CHK_SUCCEEDED(res) && m_payloads.isIntact(record);
+		}
+
+		const PayloadRing& getPayloadHistory() const {
+			return m_payloads;
+		}
+
+		/*!
+			@~english
+				@brief Records every compressed payload of the transfer to a file
+				@details Payloads are copied from the transfer callback into a write-behind ring of bufferBytes and written by a separate thread
+					with unbuffered I/O, the callback never waits for the disk. If the disk falls behind by more than the ring, payloads are dropped
+					(see getRecordingStats). The data file starts with the resolution and quantization tables, the index file path + ".idx" lists
+					the frame number, timestamp, offset and size of each payload (see PUCLib_Recorder.h).
+					The recording ends with stopRecording, close, or when the transfer restarts at another resolution (setResolution, switchMode,
+					setModeTable), since the header holds one: isRecording() turns false and getLastErrorName tells why. Other restarts (pause and
+					resume, setDecodeROI, setFrameHistory...) keep recording, the frames missed meanwhile are a gap in the frame numbers.
+				@param[in] path Data file
+				@param[in] bufferBytes Size of the write-behind ring
+				@return False if the transfer is not running in multithread mode or the files could not be created
+			@~japanese
+				@brief 転送されたすべての圧縮データをファイルに記録します。
+				@details 圧縮データは転送コールバックからbufferBytesのライトビハインドリングにコピーされ、別スレッドがバッファなしI/Oで書き込むため、
+					コールバックがディスクを待つことはありません。ディスクの遅れがリングを超えると圧縮データは破棄されます（getRecordingStats参照）。
+					データファイルの先頭には解像度と量子化テーブルが、インデックスファイル（path + ".idx"）には各圧縮データのフレーム番号、
+					タイムスタンプ、オフセット、サイズが記録されます（PUCLib_Recorder.h参照）。
+					記録はstopRecording、close、または別の解像度での転送の再開（setResolution、switchMode、setModeTable）で終了します。ヘッダは
+					1つの解像度のみ保持するためです。この場合isRecording()が偽(false)になり、getLastErrorNameで理由を取得できます。その他の再開
+					（pauseとresume、setDecodeROI、setFrameHistory等）では記録を続け、その間に失われたフレームはフレーム番号の欠落になります。
+				@param[in] path データファイル
+				@param[in] bufferBytes ライトビハインドリングのサイズ
+				@return マルチスレッドモードで転送中でない場合、またはファイルを作成できなかった場合は偽(false)を返します。
+		*/
+		bool startRecording(const char* path, size_t bufferBytes = 256 << 20) {
+			if (hDevice == NULL || !m_xferStarted) {
+				m_lastErrorName = "recording needs a running multithread transfer";
+				return false;
 			}
-			width = nWidth;
-			height = nHeight;
-			rowBytes = nLineBytes;
-			nReadSequenceNo[index] = nSequenceNo[index];
+			static_assert(PUC_Q_COUNT <= RECORDING_QUANTIZATION_COUNT, "RecordingHeader holds too few quantization tables");
+			if (!m_recorder.open(path, nWidth, nHeight, q, PUC_Q_COUNT, bufferBytes, getTimestamp())) {
+				m_lastErrorName = "recording file error";
+				return false;
+			}
+			return true;
+		}
+
+		// Flushes the recording and closes its files
+		void stopRecording() {
+			m_recorder.close();
+		}
+
+		bool isRecording() const {
+			return m_recorder.isRecording();
+		}
+
+		RecorderStats getRecordingStats() const {
+			return m_recorder.getStats();
+		}
+
+		bool isFrameValid(long long sequenceNo) const {
+			return m_history.isValid(sequenceNo);
+		}
+
+		const FrameHistory& getFrameHistory() const {
+			return m_history;
+		}
+
+		/*!
+			@~english
+				@brief Counters of the sequence triage
+				@details Every payload's sequence number is extracted from the compressed data (PUC_ExtractSequenceNo) and unwrapped to 64 bits
+					before anything is decoded. Duplicates are skipped, missing frames are counted and logged (see getSequenceGaps), exact across the
+					USHORT wraparound.
+				@note This function is thread-safe.
+			@~japanese
+				@brief シーケンス番号判定の計数
+				@details 各圧縮データのシーケンス番号はデコード前に圧縮データから抽出され（PUC_ExtractSequenceNo）、64ビットに拡張されます。
+					重複フレームはスキップされ、欠落フレームは計数・記録されます（getSequenceGaps参照）。USHORTの桁あふれをまたいでも正確です。
+				@note 本関数はスレッドセーフです。
+		*/
+		SequenceStats getSequenceStats() const {
+			SequenceStats stats;
+			stats.received = m_receivedFrames.load(std::memory_order_relaxed);
+			stats.duplicates = m_duplicateFrames.load(std::memory_order_relaxed);
+			stats.dropped = m_droppedFrames.load(std::memory_order_relaxed);
+			stats.gaps = m_gapCount.load(std::memory_order_relaxed);
+			stats.lastFrameNo = m_frameCounter.load(std::memory_order_relaxed);
+			return stats;
+		}
+
+		// Unwrapped 64-bit sequence number of the newest received frame, -1 before the first one
+		long long getFrameCounter() const {
+			return m_frameCounter.load(std::memory_order_relaxed);
+		}
+
+		// Copies the logged gaps, oldest first. Only the last 256 gaps are kept.
+		int getSequenceGaps(std::vector<SequenceGap>& gaps) {
+			std::lock_guard<std::mutex> guard(m_gapMutex);
+			UINT64 count = m_gapCount.load(std::memory_order_relaxed);
+			UINT64 first = count > SEQUENCE_GAP_LOG_SIZE ? count - SEQUENCE_GAP_LOG_SIZE : 0;
+			gaps.clear();
+			for (UINT64 i = first; i < count; i++)
+				gaps.push_back(m_gapLog[i % SEQUENCE_GAP_LOG_SIZE]);
+			return (int)gaps.size();
+		}
+
+		void resetSequenceStats() {
+			std::lock_guard<std::mutex> guard(m_gapMutex);
+			m_receivedFrames.store(0, std::memory_order_relaxed);
+			m_duplicateFrames.store(0, std::memory_order_relaxed);
+			m_droppedFrames.store(0, std::memory_order_relaxed);
+			m_gapCount.store(0, std::memory_order_relaxed);
+		}
+
+		/*!
+			@~english
+				@brief Latency histogram of one stage of the frame path
+				@details Every payload is stamped with a steady clock at arrival, when decoding starts and ends, and when it is published or handed
+					to the listener; the differences are counted per stage. The stamps of a frame are also in its FrameLease.
+				@param[in] stage LATENCY_QUEUE, LATENCY_DECODE, LATENCY_DELIVER, LATENCY_TOTAL or LATENCY_INTER_ARRIVAL
+				@note This function is thread-safe and lock-free, the histogram can be read while frames are recorded.
+			@~japanese
+				@brief フレーム処理の各段階のレイテンシヒストグラム
+				@details 各圧縮データには受信時、デコード開始時と終了時、プールへの公開またはリスナーへの受け渡し時にsteady clockの時刻が記録され、
+					その差分が段階ごとに計数されます。各フレームの時刻はFrameLeaseにも格納されます。
+				@param[in] stage LATENCY_QUEUE、LATENCY_DECODE、LATENCY_DELIVER、LATENCY_TOTAL、LATENCY_INTER_ARRIVALのいずれか
+				@note 本関数はスレッドセーフかつロックフリーで、記録中にもヒストグラムを読み込めます。
+		*/
+		const LatencyHistogram& getLatencyHistogram(LatencyStage stage) const {
+			return m_latency[stage];
+		}
+
+		// Spread of the payload inter-arrival time, from the LATENCY_INTER_ARRIVAL histogram
+		JitterStats getArrivalJitter() const {
+			const LatencyHistogram& intervals = m_latency[LATENCY_INTER_ARRIVAL];
+			JitterStats jitter;
+			jitter.meanInterval = intervals.getMean();
+			jitter.stdDev = intervals.getStdDev();
+			jitter.p50 = intervals.getPercentile(50.0);
+			jitter.p99 = intervals.getPercentile(99.0);
+			jitter.p999 = intervals.getPercentile(99.9);
+			jitter.maxInterval = intervals.getMax();
+			return jitter;
+		}
 
-			return pDecodeBuf[readBuffer];
+		void resetLatencyHistograms() {
+			for (int i = 0; i < LATENCY_STAGE_COUNT; i++)
+				m_latency[i].reset();
+		}
+
+		// Number of frames dropped because every pool buffer was leased
+		UINT64 getPoolExhaustedCount() const {
+			return m_fullPool.getExhaustedCount() + m_proxyPool.getExhaustedCount() + m_dctPool.getExhaustedCount();
 		}
 
 		/*!
@@ -404,7 +2623,7 @@ namespace photron {
 				m_resolutionHeight = nHeight;
 				return PUC_SUCCEEDED;
 			}
-			PUCRESULT result = PUC_SetResolution(hDevice, nWidth, nHeight);
+			PUCRESULT result = m_source->setResolution(hDevice, nWidth, nHeight);
 			if (result != PUC_SUCCEEDED)
 				return result;
 			result = setupDataBuffer();
@@ -428,12 +2647,13 @@ namespace photron {
 				@note 本関数はスレッドセーフです。
 		*/
 		PUCRESULT setFramerateShutter(UINT32 nFramerate, UINT32 nShutterSpeedFps) {
+			m_exposeOnClk = m_exposeOffClk = 0;
 			if (hDevice == NULL) {
 				m_frameRate = nFramerate;
 				m_shutterSpeedFps = nShutterSpeedFps;
 				return PUC_SUCCEEDED;
 			}
-			return PUC_SetFramerateShutter(hDevice, nFramerate, nShutterSpeedFps);
+			return m_source->setFramerateShutter(hDevice, nFramerate, nShutterSpeedFps);
 		}
 
 		/*!
@@ -462,7 +2682,150 @@ namespace photron {
 				*pShutterSpeedFps = m_shutterSpeedFps;
 				return PUC_SUCCEEDED;
 			}
-			return PUC_GetFramerateShutter(hDevice, pFramerate, pShutterSpeedFps);
+			return m_source->getFramerateShutter(hDevice, pFramerate, pShutterSpeedFps);
+		}
+
+		/*!
+			@~english
+				@brief Sets the modes switchMode can change between
+				@details Every mode is checked against PUC_GetResolutionLimit and PUC_GetFramerateLimit, then set once on the device, which
+					rejects combinations it cannot capture. The decode threads are tuned per mode at the same time, and the buffers are sized
+					for the largest resolution, payload and number of decode workers of the modes, so a switch only restarts the transfer.
+					Done now if the device is open (the transfer restarts), otherwise at open, which fails if the device cannot be put back
+					into its settings afterwards.
+				@param[in] modes The modes, copied
+				@param[in] count Number of modes
+				@return Number of modes the device accepts, count if it is not open yet, -1 if the device could not be put back into its
+					settings (the transfer restarts with whatever it reports, see getLastErrorName)
+				@see switchMode
+			@~japanese
+				@brief switchModeで切り替えるモードを設定します。
+				@details 各モードはPUC_GetResolutionLimit、PUC_GetFramerateLimitで確認した後、デバイスに1度設定され、撮影できない組み合わせは
+					除外されます。同時にモード毎にデコードスレッドを調整し、各バッファをモードの最大の解像度、転送データサイズ、デコードワーカー数で
+					確保するため、切り替えは転送の再開のみになります。デバイスがオープン中の場合は直ちに（転送は再開されます）、それ以外の場合は
+					open時に行い、その後デバイスを元の設定に戻せない場合openは失敗します。
+				@param[in] modes モード（コピーされます）
+				@param[in] count モード数
+				@return デバイスが受け付けたモード数、オープン前の場合はcount、デバイスを元の設定に戻せなかった場合は-1
+					（転送はデバイスの報告する設定で再開されます。getLastErrorNameを参照）
+				@see switchMode
+		*/
+		int setModeTable(const CaptureMode* modes, int count) {
+			m_modes.clear();
+			for (int i = 0; i < count; i++) {
+				PreparedMode prepared;
+				prepared.mode = modes[i];
+				m_modes.push_back(prepared);
+			}
+			m_currentMode = -1;
+			m_modeMaxWidth = m_modeMaxHeight = 0;
+			m_modeMinDataSize = m_modeMaxDataSize = 0;
+			if (hDevice == NULL)
+				return count;
+			cleanupBuffer();
+			PUCRESULT prepared = prepareModes();
+			setupDataBuffer();
+			if (PUC_CHK_FAILED(prepared))
+				return -1;
+			int valid = 0;
+			for (size_t i = 0; i < m_modes.size(); i++)
+				valid += m_modes[i].valid ? 1 : 0;
+			return valid;
+		}
+
+		int getModeCount() const {
+			return (int)m_modes.size();
+		}
+
+		// False if the device rejected the mode, true for every mode before open
+		bool isModeValid(int index) const {
+			return index >= 0 && index < (int)m_modes.size() && (hDevice == NULL || m_modes[index].valid);
+		}
+
+		// Mode last set by switchMode, -1 if none
+		int getCurrentMode() const {
+			return m_currentMode;
+		}
+
+		/*!
+			@~english
+				@brief Switches to a mode of the mode table
+				@details Ends the transfer, sets resolution, frame rate, exposure and decode ROI, and starts the transfer again in the buffers of the
+					previous setup, which setModeTable sized for every mode, so nothing is allocated or tuned; only the decode worker threads are started
+					anew. The time of every step and the dead time until the first frame of the new mode are reported by getModeSwitchStats.
+					Before open the mode is only stored. If the device rejects the mode, it is put back into the previous one, which stays
+					the current mode (getCurrentMode, getResolution), and the transfer restarts in it. All leases must be released, like setResolution.
+				@param[in] index Index into the mode table
+				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
+				@see setModeTable
+			@~japanese
+				@brief モードテーブルのモードに切り替えます。
+				@details 転送を終了し、解像度、撮影速度、露光、デコードROIを設定し、setModeTableが全モード用に確保した前回のバッファで、調整なしに
+					転送を再開します。メモリの確保は行わず、新たに開始するのはデコードワーカースレッドのみです。各段階の時間と新しいモードの
+					最初のフレームまでの無効時間はgetModeSwitchStatsで取得できます。オープン前はモードを記憶するのみです。デバイスがモードを受け付けない場合は
+					前のモードに戻し、それが現在のモードのまま（getCurrentMode、getResolution）転送を再開します。setResolutionと同様にすべてのリースを返却してください。
+				@param[in] index モードテーブルの番号
+				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
+				@see setModeTable
+		*/
+		PUCRESULT switchMode(int index) {
+			if (index < 0 || index >= (int)m_modes.size())
+				return PUC_ERROR_ILLEGAL_ARG;
+			const PreparedMode& prepared = m_modes[index];
+			const CaptureMode& mode = prepared.mode;
+			if (hDevice != NULL && !prepared.valid) {
+				m_lastErrorName = "mode not supported by the device";
+				return PUC_ERROR_ILLEGAL_ARG;
+			}
+			if (hDevice == NULL) {
+				storeMode(index);
+				return PUC_SUCCEEDED;
+			}
+
+			long long begin = getTimestamp();
+			cleanupBuffer();
+			long long stopped = getTimestamp();
+			PUCRESULT result = applyMode(mode);
+			if (PUC_CHK_FAILED(result)) {
+				// The stored settings still describe the previous mode, the transfer restarts in it
+				CaptureMode previous;
+				previous.width = m_resolutionWidth;
+				previous.height = m_resolutionHeight;
+				previous.frameRate = m_frameRate;
+				previous.shutterSpeedFps = m_shutterSpeedFps;
+				previous.exposeOnClk = m_exposeOnClk;
+				previous.exposeOffClk = m_exposeOffClk;
+				m_lastErrorName = PUC_CHK_SUCCEEDED(applyMode(previous)) ? "mode switch error" : "mode switch error, previous mode not restored";
+			}
+			else {
+				storeMode(index);
+				if (prepared.tuned) {
+					m_numDecodeThreads = prepared.threads;
+					m_tunedInterFrame = prepared.interFrame;
+					m_tunedWidth = mode.width;
+					m_tunedHeight = mode.height;
+				}
+			}
+			long long applied = getTimestamp();
+			m_modeSwitchBegin.store(begin, std::memory_order_relaxed);
+			m_modeSwitchFirstFrame.store(0, std::memory_order_relaxed);
+			PUCRESULT restarted = setupDataBuffer();
+			long long end = getTimestamp();
+
+			m_modeSwitch.count++;
+			m_modeSwitch.stopNs = stopped - begin;
+			m_modeSwitch.deviceNs = applied - stopped;
+			m_modeSwitch.restartNs = end - applied;
+			m_modeSwitch.totalNs = end - begin;
+			if (m_modeSwitch.totalNs > m_modeSwitch.maxTotalNs)
+				m_modeSwitch.maxTotalNs = m_modeSwitch.totalNs;
+			return PUC_CHK_FAILED(result) ? result : restarted;
+		}
+
+		ModeSwitchStats getModeSwitchStats() const {
+			ModeSwitchStats stats = m_modeSwitch;
+			stats.firstFrameNs = m_modeSwitchFirstFrame.load(std::memory_order_relaxed);
+			return stats;
 		}
 
 
@@ -488,7 +2851,7 @@ namespace photron {
 		PUCRESULT setQuantization(UINT32 nPoint, USHORT nVal) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetQuantization(hDevice, nPoint, nVal);
+			return m_source->setQuantization(hDevice, nPoint, nVal);
 		}
 
 		/*!
@@ -508,7 +2871,7 @@ namespace photron {
 		PUCRESULT setFanState(PUC_MODE nState) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetFanState(hDevice, nState);
+			return m_source->setFanState(hDevice, nState);
 		}
 
 		/*!
@@ -533,7 +2896,7 @@ namespace photron {
 		PUCRESULT setSyncInMode(PUC_SYNC_MODE nMode, PUC_SIGNAL nSignal) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetSyncInMode(hDevice, nMode, nSignal);
+			return m_source->setSyncInMode(hDevice, nMode, nSignal);
 		}
 
 		/*!
@@ -553,7 +2916,7 @@ namespace photron {
 		PUCRESULT setSyncOutSignal(PUC_SIGNAL nSignal) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetSyncOutSignal(hDevice, nSignal);
+			return m_source->setSyncOutSignal(hDevice, nSignal);
 		}
 
 		/*!
@@ -573,7 +2936,7 @@ namespace photron {
 		PUCRESULT setSyncOutDelay(UINT32 nDelay) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetSyncOutDelay(hDevice, nDelay);
+			return m_source->setSyncOutDelay(hDevice, nDelay);
 		}
 
 		/*!
@@ -593,7 +2956,7 @@ namespace photron {
 		PUCRESULT setSyncOutWidth(UINT32 nWidth) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetSyncOutWidth(hDevice, nWidth);
+			return m_source->setSyncOutWidth(hDevice, nWidth);
 		}
 
 		/*!
@@ -613,7 +2976,7 @@ namespace photron {
 		PUCRESULT setSyncOutMagnification(UINT32 nMagnification) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetSyncOutMagnification(hDevice, nMagnification);
+			return m_source->setSyncOutMagnification(hDevice, nMagnification);
 		}
 
 		/*!
@@ -633,7 +2996,7 @@ namespace photron {
 		PUCRESULT setLEDMode(PUC_MODE nMode) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetLEDMode(hDevice, nMode);
+			return m_source->setLEDMode(hDevice, nMode);
 		}
 
 		/*!
@@ -653,7 +3016,7 @@ namespace photron {
 		PUCRESULT setXferDataMode(PUC_DATA_MODE nDataMode) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetXferDataMode(hDevice, nDataMode);
+			return m_source->setXferDataMode(hDevice, nDataMode);
 		}
 
 		/*!
@@ -679,20 +3042,20 @@ namespace photron {
 		PUCRESULT setXferTimeOut(UINT32 nSingleXferTimeOut, UINT32 nContinuousXferTimeOut) {
 			if (hDevice == NULL)
 				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetXferTimeOut(hDevice, nSingleXferTimeOut, nContinuousXferTimeOut);
+			return m_source->setXferTimeOut(hDevice, nSingleXferTimeOut, nContinuousXferTimeOut);
 		}
 
 		/*!
 			@~english
 				@brief This sets the exposure/non-exposure time of the device.
-				@details Opening the device will reset this setting. @n Note that the return value of PUC_GetFramerateShutter function will be invalid if the exposure/non-exposure time is set directly with this function.
+				@details If the device is not open yet, the setting is applied at open after the frame rate. @n Note that the return value of PUC_GetFramerateShutter function will be invalid if the exposure/non-exposure time is set directly with this function.
 				@param[in] nExpOnClk The exposure period (clock units)
 				@param[in] nExpOffClk The non-exposure period (clock units)
 				@return If successful, PUC_SUCCEEDED will be returned. If failed, other responses will be returned.
 				@note This function is thread-safe.
 			@~japanese
 				@brief デバイスの露光・非露光期間を設定します。
-				@details デバイスのオープン時に設定はリセットされます。@n本関数により露光・非露光期間を直接設定した場合、PUC_GetFramerateShutter関数で返される値は不正な値になります。
+				@details デバイスのオープン前の場合は、オープン時に撮影速度の後に設定されます。@n本関数により露光・非露光期間を直接設定した場合、PUC_GetFramerateShutter関数で返される値は不正な値になります。
 				@param[in] nExpOnClk 露光期間（クロック単位）
 				@param[in] nExpOffClk 非露光期間（クロック単位）
 				@return 成功時はPUC_SUCCEEDED、失敗時はそれ以外が返ります。
@@ -700,9 +3063,11 @@ namespace photron {
 		*/
 		PUCRESULT setExposeTime(UINT32 nExpOnClk, UINT32 nExpOffClk)
 		{
+			m_exposeOnClk = nExpOnClk;
+			m_exposeOffClk = nExpOffClk;
 			if (hDevice == NULL)
-				return PUC_ERROR_DEVICE_NOTOPEN;
-			return PUC_SetExposeTime(hDevice, nExpOnClk, nExpOffClk);
+				return PUC_SUCCEEDED;
+			return m_source->setExposeTime(hDevice, nExpOnClk, nExpOffClk);
 		}
 
 		/*!
@@ -787,15 +3152,45 @@ namespace photron {
 			height = m_resolutionHeight;
 		}
 
-		PUC_HANDLE getPUCHandle() {
-			return hDevice;
+		PUC_HANDLE getPUCHandle() {
+			return hDevice;
+		}
+
+		/*!
+			@~english
+				@brief Replaces the device backend
+				@details PUCLIB (PUCLibSource) by default where it exists, e.g. a SyntheticSource (PUCLib_SyntheticSource.h) to run without a camera.
+					Initializes the source. Call before open, the wrapper does not own the source and it must outlive the wrapper.
+				@param[in] source The backend, see PUCLib_CaptureSource.h
+				@return If successful, PUC_SUCCEEDED will be returned. PUC_ERROR_XFERRING while the device is open.
+			@~japanese
+				@brief デバイスバックエンドを置き換えます。
+				@details PUCLIBがある環境ではPUCLIB（PUCLibSource）がデフォルトです。カメラなしで動かす場合は、例えばSyntheticSource（PUCLib_SyntheticSource.h）を指定します。
+					ソースを初期化します。オープン前に呼び出してください。ラッパはソースを所有しないため、ソースはラッパより長く存在する必要があります。
+				@param[in] source バックエンド。PUCLib_CaptureSource.h参照
+				@return 成功時はPUC_SUCCEEDED、デバイスがオープン中の場合はPUC_ERROR_XFERRINGが返ります。
+		*/
+		PUCRESULT setCaptureSource(CaptureSource* source) {
+			if (hDevice)
+				return PUC_ERROR_XFERRING;
+			if (source == NULL)
+				return PUC_ERROR_ILLEGAL_ARG;
+			PUCRESULT res = source->initialize();
+			if (PUC_CHK_FAILED(res) && res != PUC_ERROR_INITIALIZED)
+				return res;
+			m_source = source;
+			return PUC_SUCCEEDED;
+		}
+
+		CaptureSource* getCaptureSource() const {
+			return m_source;
 		}
 
 		USHORT getFullSequenceNumber() const {
-			return nReadSequenceNo[0];
+			return nReadSequenceNo[0].load(std::memory_order_relaxed);
 		}
 		USHORT getProxySequenceNumber() const {
-			return nReadSequenceNo[1];
+			return nReadSequenceNo[1].load(std::memory_order_relaxed);
 		}
 
 		/*!
@@ -805,71 +3200,46 @@ namespace photron {
 				@param[out] width of the image
 				@param[out] height of the image
 				@param[out] rowBytes, number of bytes per row
-				@return If successful, a pointer to the image buffer is returned (do not delete it, just read it)
-				@note This function is thread-safe.
+				@return If successful, a pointer to the image buffer is returned (do not delete it, just read it). The buffer stays valid until the next call.
+				@note Never blocks the transfer callback. Call from one consumer thread only.
 			@~japanese
 				@brief カメラから最新の画像を読み込みます。
 				@details 画像へのバッファと画像解像度を返します。
 				@param[out] 横解像度
 				@param[out] 縦解像度
 				@param[out] rowBytes １ラインあたりのバイト数
-				@return 成功した場合画像バッファへのポインタが返されます。(デリートしないでください。読み込み対応のみです。)
-				@note 本関数はスレッドセーフです。
+				@return 成功した場合画像バッファへのポインタが返されます。(デリートしないでください。読み込み対応のみです。)バッファは次の呼び出しまで有効です。
+				@note 転送コールバックをブロックしません。1つのスレッドからのみ呼び出してください。
 		*/
 		unsigned char* readProxy(int& width, int& height, int& rowBytes)
 		{
 			int index = 1;
-			if (hDevice == NULL)
-				return NULL;
-			if (m_frameSampleRate[index]==0)
+			FrameLease lease;
+			if (!acquireProxy(lease))
 				return NULL;
 
-			int readBuffer = m_readBuffer[index];
-			if (m_isSingleThread)
-			{
-				result = PUC_GetSingleXferData(hDevice, &xferData);
-				result = PUC_DecodeDCData(pDecodeBufProxy[readBuffer], 0, 0, nBlockCountX, nBlockCountY, xferData.pData);
-				nSequenceNo[index] = xferData.nSequenceNo;
-			}
-			else
-			{
-#if 0
-				// Block for a while
-				if (nReadSequenceNo[index] == nSequenceNo[index]) {
-					int numTries = 0;
-					while (numTries < 100000000) {
-						if (nReadSequenceNo[index] != nSequenceNo[index])
-							break;
-						numTries++;
-					}
-				}
-#endif
-
-				int copyBuffer = 2;
-				std::lock_guard<std::mutex> guard(m_mutex);
-				readBuffer = m_readBuffer[index];
+			m_readLease[index].release();
+			m_readLease[index] = lease;
 
-				memcpy(pDecodeBufProxy[copyBuffer], pDecodeBufProxy[readBuffer], int(nBlockCountX) * int(nBlockCountY));
+			width = lease.width;
+			height = lease.height;
+			rowBytes = lease.rowBytes;
+			return lease.data;
+		}
 
-				readBuffer = copyBuffer;
-			}
-			if (PUC_CHK_FAILED(result))
-			{
-				m_lastErrorName = "PUC_DecodeData error";
-				return NULL;
-			}
-			width = nBlockCountX;
-			height = nBlockCountY;
-			rowBytes = nBlockCountX;
-			nReadSequenceNo[index] = nSequenceNo[index];
+		void setFrameSampleRate(int fullRate, int proxyRate) {
+			m_frameSampleRate[0].store(fullRate, std::memory_order_relaxed);
+			m_frameSampleRate[1].store(proxyRate, std::memory_order_relaxed);
+		}
 
-			return pDecodeBufProxy[readBuffer];
+		// Decodes the DCT coefficients of every rate-th frame for acquireDCT, 0 (default) disables the DCT stream.
+		// Its pool is set up by open, setResolution or resume when the rate is not 0.
+		void setDCTSampleRate(int rate) {
+			m_frameSampleRate[2].store(rate, std::memory_order_relaxed);
 		}
 
-		void setFrameSampleRate(int fullRate, int proxyRate) {
-			std::lock_guard<std::mutex> guard(m_mutexSampleRate);
-			m_frameSampleRate[0] = fullRate;
-			m_frameSampleRate[1] = proxyRate;
+		USHORT getDCTSequenceNumber() const {
+			return nReadSequenceNo[2].load(std::memory_order_relaxed);
 		}
 
 
@@ -881,110 +3251,1176 @@ namespace photron {
 			PUINT8 pData = info->pData;
 			UINT32 nDataSize = info->nDataSize;
 			USHORT nSequenceNo = info->nSequenceNo;
-			if (that->listener) {
-				that->result = PUC_DecodeDataMultiThread(that->pDecodeBuf[0], 0, 0, that->nWidth, that->nHeight, that->nLineBytes, pData, that->q, that->m_numDecodeThreads);
-				that->listener->imageReady(that->pDecodeBuf[0], that->nWidth, that->nHeight, that->nLineBytes, nSequenceNo);
+			// The number embedded in the payload is authoritative, it costs a few bytes of parsing instead of a decode
+			that->m_source->extractSequenceNo(pData, that->nWidth, that->nHeight, &nSequenceNo);
+
+			DecodeJob job;
+			job.size = nDataSize;
+			job.sequenceNo = nSequenceNo;
+			job.timestamp = getTimestamp();
+			if (that->m_lastArrival > 0)
+				that->m_latency[LATENCY_INTER_ARRIVAL].record(job.timestamp - that->m_lastArrival);
+			that->m_lastArrival = job.timestamp;
+			long long switchBegin = that->m_modeSwitchBegin.load(std::memory_order_relaxed);
+			if (switchBegin > 0) {
+				that->m_modeSwitchFirstFrame.store(job.timestamp - switchBegin, std::memory_order_relaxed);
+				that->m_modeSwitchBegin.store(0, std::memory_order_relaxed);
+			}
+			if (!that->triageSequenceNo(nSequenceNo, job.timestamp, job.frameNo))
 				return;
+			if (that->m_recorder.isRecording())
+				that->m_recorder.append(job.frameNo, nSequenceNo, job.timestamp, pData, nDataSize);
+			if (that->m_payloads.isAllocated()) {
+				that->m_payloads.append(job.frameNo, nSequenceNo, job.timestamp, pData, nDataSize);
+				if (that->isDecodingLazily()) {
+					// Decoded on demand by the consumer
+					++that->counter;
+					that->signalFrame(0, job.frameNo);
+					that->signalFrame(1, job.frameNo);
+					that->signalFrame(2, job.frameNo);
+					return;
+				}
 			}
 
+			if (that->m_batchListener && that->m_batchMaxLatency > 0) {
+				// Flush by latency on arrival, unless a worker is delivering right now (it checks itself)
+				std::unique_lock<std::mutex> lock(that->m_deliveryMutex, std::try_to_lock);
+				if (lock.owns_lock() && that->m_batchCount > 0 && job.timestamp - that->m_batchTimestamps[0] >= that->m_batchMaxLatency)
+					that->flushBatch();
+			}
 
-			//if (nSequenceNo == that->nSequenceNo[1])
-			//	return;
-			int drawBuffer[2];
-			std::lock_guard<std::mutex> guard(that->m_mutexSampleRate);
-			int frameSampleRate[2];
-			{
-				std::lock_guard<std::mutex> guard(that->m_mutex);
-				drawBuffer[0] = 1 - that->m_readBuffer[0];
-				drawBuffer[1] = 1 - that->m_readBuffer[1];
-				frameSampleRate[0] = that->m_frameSampleRate[0];
-				frameSampleRate[1] = that->m_frameSampleRate[1];
+			if (that->listener || that->m_batchListener) {
+				job.decodeFull = true;
 			}
+			else {
+				int frameSampleRate[3];
+				frameSampleRate[0] = that->m_frameSampleRate[0].load(std::memory_order_relaxed);
+				frameSampleRate[1] = that->m_frameSampleRate[1].load(std::memory_order_relaxed);
+				frameSampleRate[2] = that->m_frameSampleRate[2].load(std::memory_order_relaxed);
+				job.decodeFull = (frameSampleRate[0] != 0) && that->counter % frameSampleRate[0] == 0;
+				job.decodeProxy = (frameSampleRate[1] != 0) && that->counter % frameSampleRate[1] == 0;
+				job.decodeDCT = (frameSampleRate[2] != 0) && that->counter % frameSampleRate[2] == 0;
+				++that->counter;
+			}
+			if (that->m_subscriptionCount.load(std::memory_order_acquire) > 0)
+				that->addSubscriptionNeeds(job);
+			job.decodeTarget = that->m_targetCount > 0;
+			if (!job.decodeFull && !job.decodeProxy && !job.decodeDCT && !job.decodeTarget)
+				return;
 
-			bool readFull = (frameSampleRate[0]!=0) && that->counter % frameSampleRate[0] == 0;
-			if(readFull)
-			{
+			if (that->m_activeDecodeWorkers > 0) {
+				// Only copy the payload out, the workers decode and deliver it
+				that->m_decodeQueue.push(job, pData);
+				return;
+			}
+			job.payload = pData;
+			that->processFrame(job);
+		}
+
+		// Decodes a payload and delivers it to the listener, the pools and the history
+		void processFrame(const DecodeJob& job) {
+			DecodedFrame frame = decodeFrame(job);
+			if (m_activeDecodeWorkers == 0) {
+				std::lock_guard<std::mutex> guard(m_deliveryMutex);
+				deliverFrame(job, frame);
+				return;
+			}
+			// Workers finish out of order, each waits for its ticket so delivery follows the stream
+			std::unique_lock<std::mutex> lock(m_deliveryMutex);
+			m_deliveryTurn.wait(lock, [&] { return m_nextDeliveryTicket == job.ticket; });
+			deliverFrame(job, frame);
+			m_nextDeliveryTicket++;
+			lock.unlock();
+			m_deliveryTurn.notify_all();
+		}
+
+		struct DecodedFrame {
+			int fullSlot = -1;
+			PUCRESULT fullResult = PUC_SUCCEEDED;
+			int proxySlot = -1;
+			PUCRESULT proxyResult = PUC_SUCCEEDED;
+			int dctSlot = -1;
+			PUCRESULT dctResult = PUC_SUCCEEDED;
+			int targetSlot = -1;
+			PUCRESULT targetResult = PUC_SUCCEEDED;
+			long long decodeStart = 0;
+			long long decoded = 0;
+		};
+
+		DecodedFrame decodeFrame(const DecodeJob& job) {
+			PUINT8 pData = (PUINT8)job.payload;
+			DecodedFrame frame;
+			frame.decodeStart = getTimestamp();
+			bool wantFull = listener || m_batchListener || job.decodeFull;
+			bool gated = (wantFull || job.decodeTarget) && m_gateThreshold.load(std::memory_order_acquire) > 0;
+			// The gate looks at the proxy first, in a proxy slot that is given back unless the proxy stream wants it
+			frame.proxySlot = (job.decodeProxy || gated) ? m_proxyPool.beginWrite() : -1;
+			if (frame.proxySlot >= 0)
+				frame.proxyResult = decodeStream(1, frame.proxySlot, pData);
+			GateDecision gate = GATE_FULL;
+			ProxyChange change;
+			bool compare = gated && frame.proxySlot >= 0 && PUC_CHK_SUCCEEDED(frame.proxyResult);
+			if (m_activeDecodeWorkers > 1) {
+				// Workers get here out of order, but the reference has to follow the stream: every frame passes the gate in the turn
+				// of its ticket, whether it is compared or not, and only the decodes after it run in parallel
+				std::unique_lock<std::mutex> lock(m_gateMutex);
+				m_gateTurn.wait(lock, [&] { return m_nextGateTicket == job.ticket; });
+				if (compare)
+					gate = gateOnProxy(m_proxyPool.slotData(frame.proxySlot), job.frameNo, change);
+				m_nextGateTicket++;
+				lock.unlock();
+				m_gateTurn.notify_all();
+			}
+			else if (compare) {
+				std::lock_guard<std::mutex> guard(m_gateMutex);
+				gate = gateOnProxy(m_proxyPool.slotData(frame.proxySlot), job.frameNo, change);
+			}
+			if (frame.proxySlot >= 0 && !job.decodeProxy) {
+				m_proxyPool.abortWrite(frame.proxySlot);
+				frame.proxySlot = -1;
+			}
+
+			frame.fullSlot = (wantFull && gate != GATE_SKIP) ? m_fullPool.beginWrite() : -1;
+			if (frame.fullSlot >= 0) {
+				if (gate != GATE_PARTIAL || !decodeChangedBlocks(frame.fullSlot, pData, change, frame.fullResult))
+					frame.fullResult = decodeStream(0, frame.fullSlot, pData);
+			}
+			frame.targetSlot = (job.decodeTarget && gate != GATE_SKIP) ? claimTarget() : -1;
+			if (frame.targetSlot >= 0)
+				frame.targetResult = decodeFull(m_targetBuffers[frame.targetSlot], pData, m_targetRowBytes);
+			frame.dctSlot = (job.decodeDCT && m_dctPool.isAllocated()) ? m_dctPool.beginWrite() : -1;
+			if (frame.dctSlot >= 0)
+				frame.dctResult = decodeStream(2, frame.dctSlot, pData);
+			frame.decoded = getTimestamp();
+			return frame;
+		}
+
+		// Called under m_deliveryMutex
+		void deliverFrame(const DecodeJob& job, const DecodedFrame& frame) {
+			long long delivered = getTimestamp();
+			if (frame.fullSlot >= 0)
+				m_fullPool.stamp(frame.fullSlot, job.frameNo, frame.decoded, delivered);
+			if (frame.proxySlot >= 0)
+				m_proxyPool.stamp(frame.proxySlot, job.frameNo, frame.decoded, delivered);
+			if (frame.dctSlot >= 0)
+				m_dctPool.stamp(frame.dctSlot, job.frameNo, frame.decoded, delivered);
+			if (frame.fullSlot >= 0 || frame.proxySlot >= 0 || frame.dctSlot >= 0 || frame.targetSlot >= 0)
+				recordLatency(job.timestamp, frame.decodeStart, frame.decoded, delivered);
+
+			if (frame.fullSlot >= 0) {
+				if (PUC_CHK_SUCCEEDED(frame.fullResult)) {
+					if (m_batchListener)
+						flushBatchBefore(job.frameNo);
+					storeHistory(m_fullPool.slotData(frame.fullSlot), job.frameNo);
+					if (m_batchListener)
+						appendToBatch(m_fullPool.slotData(frame.fullSlot), job);
+				}
+				FrameLease lease;
+				if (publishOrAbort(m_fullPool, frame.fullSlot, frame.fullResult, job, &lease)) {
+					signalFrame(0, job.frameNo);
+					if (listener)
+						listener->frameReady(lease);
+					fanOut(lease, job.frameNo, SUBSCRIBE_FULL);
+					lease.release();
+				}
+			}
+			if (frame.proxySlot >= 0) {
+				FrameLease lease;
+				if (publishOrAbort(m_proxyPool, frame.proxySlot, frame.proxyResult, job, &lease)) {
+					signalFrame(1, job.frameNo);
+					fanOut(lease, job.frameNo, SUBSCRIBE_PROXY);
+					lease.release();
+				}
+			}
+			if (frame.dctSlot >= 0) {
+				FrameLease lease;
+				if (publishOrAbort(m_dctPool, frame.dctSlot, frame.dctResult, job, &lease)) {
+					signalFrame(2, job.frameNo);
+					fanOut(lease, job.frameNo, SUBSCRIBE_DCT);
+					lease.release();
+				}
+			}
+			if (frame.targetSlot >= 0) {
+				if (PUC_CHK_SUCCEEDED(frame.targetResult))
+					m_targetListener->targetReady(frame.targetSlot, m_targetBuffers[frame.targetSlot], job.sequenceNo, job.frameNo);
+				else
+					releaseTarget(frame.targetSlot);
+			}
+		}
+
+		// Pool buffers the mailboxes of one kind can hold at once
+		int mailboxSlots(SubscriptionKind kind) {
+			std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+			int slots = 0;
+			for (size_t i = 0; i < m_subscriptions.size(); i++) {
+				if (m_subscriptions[i]->getKind() == kind)
+					slots += m_subscriptions[i]->getCapacity();
+			}
+			return slots;
+		}
+
+		// Called in the transfer callback: decodes whatever a subscriber due for this frame needs
+		void addSubscriptionNeeds(DecodeJob& job) {
+			std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+			for (size_t i = 0; i < m_subscriptions.size(); i++) {
+				FrameSubscription* subscription = m_subscriptions[i];
+				if (!subscription->wants(job.frameNo))
+					continue;
+				switch (subscription->getKind()) {
+				case SUBSCRIBE_FULL:
+				case SUBSCRIBE_ROI:
+					job.decodeFull = true;
+					break;
+				case SUBSCRIBE_PROXY:
+					job.decodeProxy = true;
+					break;
+				case SUBSCRIBE_DCT:
+					job.decodeDCT = true;
+					break;
+				}
+			}
+		}
+
+		// Called under m_deliveryMutex: hands a reference of the published frame to every subscriber due for it
+		void fanOut(const FrameLease& lease, long long frameNo, SubscriptionKind kind) {
+			if (m_subscriptionCount.load(std::memory_order_acquire) == 0)
+				return;
+			std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+			for (size_t i = 0; i < m_subscriptions.size(); i++) {
+				FrameSubscription* subscription = m_subscriptions[i];
+				bool roi = kind == SUBSCRIBE_FULL && subscription->getKind() == SUBSCRIBE_ROI;
+				if ((subscription->getKind() != kind && !roi) || !subscription->wants(frameNo))
+					continue;
+				FrameLease shared = lease.share();
+				if (roi) {
+					int x = subscription->m_x - (int)m_decodeX;
+					int y = subscription->m_y - (int)m_decodeY;
+					if (x < 0 || y < 0 || x + subscription->m_width > shared.width || y + subscription->m_height > shared.height) {
+						shared.release();
+						continue;
+					}
+					shared.data += size_t(y) * shared.rowBytes + x;
+					shared.width = subscription->m_width;
+					shared.height = subscription->m_height;
+				}
+				subscription->push(shared);
+			}
+		}
+
+		PUCRESULT decodeFull(UINT8* dst, PUINT8 pData, UINT32 lineBytes) {
 #ifdef USE_DECODE_MULITHRREAD
-				that->result = PUC_DecodeDataMultiThread(that->pDecodeBuf[drawBuffer[0]], 0, 0, that->nWidth, that->nHeight, that->nLineBytes, pData, that->q, that->m_numDecodeThreads);
-#else
-				that->result = PUC_DecodeData(that->pDecodeBuf[drawBuffer[0]], 0, 0, that->nWidth, that->nHeight, that->nLineBytes, pData, that->q);
+			if (m_activeDecodeThreads > 1)
+				return m_source->decodeDataMultiThread(dst, m_decodeX, m_decodeY, m_decodeWidth, m_decodeHeight, lineBytes, pData, q, m_activeDecodeThreads);
 #endif
-				that->nSequenceNo[0] = nSequenceNo;
+			return m_source->decodeData(dst, m_decodeX, m_decodeY, m_decodeWidth, m_decodeHeight, lineBytes, pData, q);
+		}
+
+		// Clips the setFrameStats region to the decode ROI and clears stats for it. first and last are the buffer rows of the region.
+		bool beginFrameStats(FrameStats& stats, int& first, int& last) {
+			UINT64 region = m_statsRegion.load(std::memory_order_acquire);
+			int left = int(region & 0xFFFF), top = int(region >> 16 & 0xFFFF);
+			int right = left + int(region >> 32 & 0xFFFF), bottom = top + int(region >> 48 & 0xFFFF);
+			left = left > (int)m_decodeX ? left : (int)m_decodeX;
+			top = top > (int)m_decodeY ? top : (int)m_decodeY;
+			right = right < int(m_decodeX + m_decodeWidth) ? right : int(m_decodeX + m_decodeWidth);
+			bottom = bottom < int(m_decodeY + m_decodeHeight) ? bottom : int(m_decodeY + m_decodeHeight);
+			stats.valid = false;
+			if (right <= left || bottom <= top)
+				return false;
+			stats.begin(left, top, right - left, bottom - top, m_statsThreshold.load(std::memory_order_relaxed));
+			first = top - (int)m_decodeY;
+			last = bottom - (int)m_decodeY;
+			return true;
+		}
+
+		enum GateDecision {
+			GATE_FULL,
+			GATE_PARTIAL,
+			GATE_SKIP
+		};
+
+		// Compares the proxy of a frame with the proxy of the last decoded one and decides how much of it to decode.
+		// Called under m_gateMutex, in stream order.
+		GateDecision gateOnProxy(const UINT8* proxy, long long frameNo, ProxyChange& change) {
+			// Only the blocks of the decode ROI matter
+			int blockX = m_decodeX / 8, blockY = m_decodeY / 8;
+			int blocksX = (m_decodeX + m_decodeWidth + 7) / 8 - blockX;
+			int blocksY = (m_decodeY + m_decodeHeight + 7) / 8 - blockY;
+			size_t proxyBytes = size_t(nBlockCountX) * nBlockCountY;
+			if (m_gateReference.size() != proxyBytes) {
+				m_gateReference.resize(proxyBytes);
+				m_gateReferenceFrameNo = -1;
 			}
+			UINT8* reference = m_gateReference.data();
+			if (m_gateReferenceFrameNo < 0) {
+				memcpy(reference, proxy, proxyBytes);
+				m_gateReferenceFrameNo = frameNo;
+				m_gateStats.full++;
+				return GATE_FULL;
+			}
+			size_t offset = size_t(blockY) * nBlockCountX + blockX;
+			proxyChanges(reference + offset, proxy + offset, nBlockCountX, blocksX, blocksY, m_gateThreshold.load(std::memory_order_relaxed), change);
+			m_gateStats.compared++;
+			if (change.blocks < m_gateMinBlocks) {
+				// The reference stays, so slow drift still adds up to a change
+				m_gateStats.skipped++;
+				return GATE_SKIP;
+			}
+			long long previous = m_gateReferenceFrameNo;
+			memcpy(reference, proxy, proxyBytes);
+			m_gateReferenceFrameNo = frameNo;
+			change.left += blockX;
+			change.right += blockX;
+			change.top += blockY;
+			change.bottom += blockY;
+			bool small = (change.right - change.left) * (change.bottom - change.top) * 2 < blocksX * blocksY;
+			if (m_gateChangedRegionsOnly && small && m_activeDecodeWorkers <= 1) {
+				// Decoded against the frame the reference proxy came from, see decodeChangedBlocks
+				m_gateBaseFrameNo = previous;
+				m_gateStats.partial++;
+				return GATE_PARTIAL;
+			}
+			m_gateStats.full++;
+			return GATE_FULL;
+		}
 
-			bool readProxy = (frameSampleRate[1] != 0) && that->counter % frameSampleRate[1] == 0;
-			if (readProxy)
-			{
-				that->result = PUC_DecodeDCData(that->pDecodeBufProxy[drawBuffer[1]], 0, 0, that->nBlockCountX, that->nBlockCountY, pData);
-				that->nSequenceNo[1] = nSequenceNo;
+		// Copies the previous frame into the slot and decodes the changed blocks over it. False if the previous frame is not the one
+		// the change was measured against, the caller decodes the whole frame then.
+		bool decodeChangedBlocks(int slot, PUINT8 pData, const ProxyChange& change, PUCRESULT& res) {
+			FrameLease base;
+			if (!m_fullPool.acquire(base))
+				return false;
+			if (base.frameNo != m_gateBaseFrameNo) {
+				base.release();
+				std::lock_guard<std::mutex> guard(m_gateMutex);
+				m_gateStats.partial--;
+				m_gateStats.full++;
+				return false;
+			}
+			UINT8* dst = m_fullPool.slotData(slot);
+			memcpy(dst, base.data, size_t(base.rowBytes) * base.height);
+			base.release();
+
+			UINT32 left = UINT32(change.left) * 8, top = UINT32(change.top) * 8;
+			UINT32 right = UINT32(change.right) * 8, bottom = UINT32(change.bottom) * 8;
+			left = left > m_decodeX ? left : m_decodeX;
+			top = top > m_decodeY ? top : m_decodeY;
+			right = right < m_decodeX + m_decodeWidth ? right : m_decodeX + m_decodeWidth;
+			bottom = bottom < m_decodeY + m_decodeHeight ? bottom : m_decodeY + m_decodeHeight;
+			res = m_source->decodeData(dst + size_t(top - m_decodeY) * m_decodeLineBytes + (left - m_decodeX), left, top, right - left, bottom - top,
+				m_decodeLineBytes, pData, q);
+			if (PUC_CHK_SUCCEEDED(res) && slot < (int)m_frameStats.size()) {
+				int first, last;
+				FrameStats& stats = m_frameStats[slot];
+				if (beginFrameStats(stats, first, last)) {
+					accumulateFrameStats(stats, dst + size_t(first) * m_decodeLineBytes + (stats.x - (int)m_decodeX), m_decodeLineBytes, 0, last - first);
+					stats.finish();
+				}
+			}
+			return true;
+		}
+
+		// Decodes into a full pool slot and computes the statistics of setFrameStats on the rows while they are in cache
+		PUCRESULT decodeFullWithStats(UINT8* dst, PUINT8 pData, FrameStats& stats) {
+			int first, last;
+			if (!beginFrameStats(stats, first, last))
+				return decodeFull(dst, pData, m_decodeLineBytes);
+			UINT8* origin = dst + (stats.x - (int)m_decodeX);
+
+			int bandRows = int(STATS_BAND_BYTES / m_decodeLineBytes) & ~7;
+			if (bandRows < 8)
+				bandRows = 8;
+			if (m_activeDecodeThreads > 1 || last - first <= bandRows) {
+				// Multithreaded decodes hand the frame back whole, and a small region is one band anyway
+				PUCRESULT res = decodeFull(dst, pData, m_decodeLineBytes);
+				if (PUC_CHK_FAILED(res))
+					return res;
+				accumulateFrameStats(stats, origin + size_t(first) * m_decodeLineBytes, m_decodeLineBytes, 0, last - first);
+				stats.finish();
+				return res;
+			}
+			for (int band = 0; band < (int)m_decodeHeight; band += bandRows) {
+				int rows = band + bandRows < (int)m_decodeHeight ? bandRows : (int)m_decodeHeight - band;
+				PUCRESULT res = m_source->decodeData(dst + size_t(band) * m_decodeLineBytes, m_decodeX, m_decodeY + band, m_decodeWidth, rows, m_decodeLineBytes, pData, q);
+				if (PUC_CHK_FAILED(res))
+					return res;
+				int from = band > first ? band : first;
+				int to = band + rows < last ? band + rows : last;
+				if (from < to)
+					accumulateFrameStats(stats, origin + size_t(from) * m_decodeLineBytes, m_decodeLineBytes, from - first, to - from);
+			}
+			stats.finish();
+			return PUC_SUCCEEDED;
+		}
+
+		// Claims a free target buffer, -1 if the caller holds all of them
+		int claimTarget() {
+			for (int i = 0; i < m_targetCount; i++) {
+				int index = (m_targetNext.load(std::memory_order_relaxed) + i) % m_targetCount;
+				int expected = 0;
+				if (m_targetState[index].compare_exchange_strong(expected, 1, std::memory_order_acq_rel)) {
+					m_targetNext.store((index + 1) % m_targetCount, std::memory_order_relaxed);
+					return index;
+				}
+			}
+			m_targetDropped.fetch_add(1, std::memory_order_relaxed);
+			return -1;
+		}
+
+		static std::string getCpuName() {
+			int info[4];
+			char brand[49] = { 0 };
+			__cpuid(info, 0x80000000);
+			if ((unsigned)info[0] < 0x80000004)
+				return "unknown";
+			for (int i = 0; i < 3; i++) {
+				__cpuid(info, 0x80000002 + i);
+				memcpy(brand + i * 16, info, 16);
+			}
+			std::string name(brand);
+			size_t begin = name.find_first_not_of(' ');
+			return begin == std::string::npos ? "unknown" : name.substr(begin);
+		}
+
+		std::string getDecodeTuneCacheFile() const {
+			if (!m_decodeTuneCacheFile.empty())
+				return m_decodeTuneCacheFile;
+			const char* dir = getenv("LOCALAPPDATA");
+			return dir ? std::string(dir) + "\\PUCLib_Wrapper_decode.txt" : std::string("PUCLib_Wrapper_decode.txt");
+		}
+
+		// Cache lines are "<width> <height> <threads> <interFrame> <cpu name>"
+		bool loadDecodeTuning(const std::string& cpu, int& threads, bool& interFrame) {
+			FILE* fp = fopen(getDecodeTuneCacheFile().c_str(), "r");
+			if (!fp)
+				return false;
+			bool found = false;
+			char line[256];
+			while (!found && fgets(line, sizeof(line), fp)) {
+				unsigned width, height;
+				int cachedThreads, cachedInterFrame, offset = 0;
+				if (sscanf(line, "%u %u %d %d %n", &width, &height, &cachedThreads, &cachedInterFrame, &offset) < 4 || offset == 0)
+					continue;
+				std::string name(line + offset);
+				name.erase(name.find_last_not_of("\r\n") + 1);
+				if (width == nWidth && height == nHeight && name == cpu && cachedThreads > 0) {
+					threads = cachedThreads;
+					interFrame = cachedInterFrame != 0;
+					found = true;
+				}
+			}
+			fclose(fp);
+			return found;
+		}
+
+		void saveDecodeTuning(const std::string& cpu, int threads, bool interFrame) {
+			FILE* fp = fopen(getDecodeTuneCacheFile().c_str(), "a");
+			if (!fp)
+				return;
+			fprintf(fp, "%u %u %d %d %s\n", nWidth, nHeight, threads, interFrame ? 1 : 0, cpu.c_str());
+			fclose(fp);
+		}
+
+		// Best of a few decodes of the same payload, in nanoseconds
+		long long timeDecode(UINT8* dst, PUINT8 payload, int threads) {
+			const int repeat = 5;
+			long long best = LLONG_MAX;
+			for (int i = 0; i <= repeat; i++) {
+				long long begin = getTimestamp();
+				PUCRESULT res = threads > 1 ?
+					m_source->decodeDataMultiThread(dst, 0, 0, nWidth, nHeight, nLineBytes, payload, q, threads) :
+					m_source->decodeData(dst, 0, 0, nWidth, nHeight, nLineBytes, payload, q);
+				if (PUC_CHK_FAILED(res))
+					return -1;
+				long long elapsed = getTimestamp() - begin;
+				// The first run only warms the caches
+				if (i > 0 && elapsed < best)
+					best = elapsed;
+			}
+			return best;
+		}
+
+		// Called before the transfer starts. Picks m_numDecodeThreads and whether inter-frame decoding is faster for this resolution.
+		void tuneDecodeThreads() {
+			if (!m_decodeAutoTune || (m_tunedWidth == nWidth && m_tunedHeight == nHeight))
+				return;
+			std::string cpu = getCpuName();
+			int threads = 0;
+			bool interFrame = false;
+			if (!loadDecodeTuning(cpu, threads, interFrame)) {
+				UINT32 payloadSize = 0;
+				if (PUC_CHK_FAILED(m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &payloadSize)))
+					return;
+				std::vector<UINT8> payload(payloadSize);
+				std::vector<UINT8> frame(nLineBytes * nHeight);
+				PUC_XFER_DATA_INFO info = { 0 };
+				info.pData = payload.data();
+				if (PUC_CHK_FAILED(m_source->getSingleXferData(hDevice, &info)))
+					return;
+
+				int cores = (int)std::thread::hardware_concurrency();
+				if (cores < 1)
+					cores = 1;
+				long long single = timeDecode(frame.data(), info.pData, 1);
+				if (single < 0)
+					return;
+				long long best = single;
+				threads = 1;
+				for (int n = 2; n <= cores * 2; n *= 2) {
+					long long elapsed = timeDecode(frame.data(), info.pData, n);
+					if (elapsed >= 0 && elapsed < best) {
+						best = elapsed;
+						threads = n;
+					}
+				}
+				// Inter-frame decodes one frame per worker concurrently, so its cost per frame is the single threaded time shared by the workers
+				int workers = m_numDecodeWorkers > 0 ? m_numDecodeWorkers : (cores > 2 ? cores - 1 : 2);
+				interFrame = single / workers < best;
+				saveDecodeTuning(cpu, threads, interFrame);
+			}
+			m_numDecodeThreads = threads;
+			m_tunedInterFrame = interFrame;
+			m_tunedWidth = nWidth;
+			m_tunedHeight = nHeight;
+		}
+
+		FramePool& poolAt(int index) {
+			return index == 0 ? m_fullPool : index == 1 ? m_proxyPool : m_dctPool;
+		}
+
+		// Decodes a payload into a claimed slot of the full (0), proxy (1) or DCT (2) pool
+		PUCRESULT decodeStream(int index, int slot, PUINT8 pData) {
+			UINT8* dst = poolAt(index).slotData(slot);
+			if (index == 0)
+				return slot < (int)m_frameStats.size() ? decodeFullWithStats(dst, pData, m_frameStats[slot]) : decodeFull(dst, pData, m_decodeLineBytes);
+			if (index == 1)
+				return m_source->decodeDCData(dst, 0, 0, nBlockCountX, nBlockCountY, pData);
+			return m_source->decodeDCTData((PINT16)dst, m_decodeX, m_decodeY, m_decodeWidth, m_decodeHeight, m_dctPool.getRowBytes(), pData, q);
+		}
+
+		// Grows the requested ROI to whole 8x8 blocks inside width x height, an empty ROI is the full frame
+		void alignDecodeROI(UINT32 width, UINT32 height, UINT32& x, UINT32& y, UINT32& roiWidth, UINT32& roiHeight) const {
+			if (m_roiWidth == 0 || m_roiHeight == 0 || m_roiX >= width || m_roiY >= height) {
+				x = y = 0;
+				roiWidth = width;
+				roiHeight = height;
+				return;
+			}
+			x = m_roiX & ~7u;
+			y = m_roiY & ~7u;
+			UINT32 right = (m_roiX + m_roiWidth + 7) & ~7u;
+			UINT32 bottom = (m_roiY + m_roiHeight + 7) & ~7u;
+			roiWidth = (right < width ? right : width) - x;
+			roiHeight = (bottom < height ? bottom : height) - y;
+		}
+
+		// Decides the number of decode workers and threads per frame of the coming transfer
+		void resolveDecodeParallelism() {
+			bool smallFrame = m_tunedWidth == nWidth && m_tunedHeight == nHeight ? m_tunedInterFrame : m_decodeWidth * m_decodeHeight < DECODE_INTER_FRAME_MAX_PIXELS;
+			bool interFrame = m_decodeParallelism == DECODE_PARALLEL_INTER_FRAME || (m_decodeParallelism == DECODE_PARALLEL_AUTO && smallFrame);
+			if (m_isSingleThread) {
+				m_activeDecodeWorkers = 0;
+				m_activeDecodeThreads = m_numDecodeThreads;
+			}
+			else if (interFrame) {
+				m_activeDecodeWorkers = interFrameWorkers();
+				m_activeDecodeThreads = 1;
 			}
+			else {
+				m_activeDecodeWorkers = m_numDecodeWorkers;
+				m_activeDecodeThreads = m_numDecodeThreads;
+			}
+		}
 
+		int interFrameWorkers() const {
+			int cores = (int)std::thread::hardware_concurrency();
+			return m_numDecodeWorkers > 0 ? m_numDecodeWorkers : (cores > 2 ? cores - 1 : 2);
+		}
+
+		// Decode workers the buffers are sized for: with a mode table as many as any mode may start, so switchMode reuses the buffers
+		int reservedDecodeWorkers() const {
+			if (m_modes.empty() || m_isSingleThread || m_activeDecodeWorkers >= interFrameWorkers())
+				return m_activeDecodeWorkers;
+			return interFrameWorkers();
+		}
 
-			that->swapBuffer(readFull, readProxy);
+		void decodeWorker() {
+			DecodeJob job;
+			while (m_decodeQueue.pop(job)) {
+				processFrame(job);
+				m_decodeQueue.done(job);
+			}
+		}
 
-			++that->counter;
+		void startDecodeWorkers() {
+			m_nextDeliveryTicket = 0;
+			m_nextGateTicket = 0;
+			// Payload buffers for the largest mode, so a mode switch reuses them
+			m_decodeQueue.allocate(m_decodeQueueCapacity, m_activeDecodeWorkers, nDataSize > m_modeMaxDataSize ? nDataSize : m_modeMaxDataSize, m_decodeQueuePolicy,
+				reservedDecodeWorkers());
+			for (int i = 0; i < m_activeDecodeWorkers; i++)
+				m_decodeWorkers.push_back(std::thread(&PUCLib_Wrapper::decodeWorker, this));
+		}
 
+		void stopDecodeWorkers() {
+			m_decodeQueue.stop();
+			for (size_t i = 0; i < m_decodeWorkers.size(); i++)
+				m_decodeWorkers[i].join();
+			m_decodeWorkers.clear();
 		}
 
-		USHORT nSequenceNo[2] = { 0, 0 };
+		CaptureSource* m_source = getDefaultCaptureSource();
 		PUC_HANDLE hDevice = NULL;
 		UINT32 nDataSize = 0;
 		PUC_XFER_DATA_INFO xferData = { 0 };
+		UINT8* m_xferBuffer = NULL;	// xferData.pData of the single thread mode, kept across setups while it fits
+		UINT32 m_xferBufferSize = 0;
 		UINT32 nWidth, nHeight, nLineBytes;
+		UINT32 m_roiX = 0, m_roiY = 0, m_roiWidth = 0, m_roiHeight = 0;
+		UINT32 m_decodeX = 0, m_decodeY = 0, m_decodeWidth = 0, m_decodeHeight = 0, m_decodeLineBytes = 0;
 		USHORT q[PUC_Q_COUNT];
-		UINT8* pDecodeBuf[3] = { NULL,NULL,NULL };
+		BufferArena m_arena;
+		FramePool m_fullPool;
+		std::vector<FrameStats> m_frameStats;	// one per full pool slot, empty until setFrameStats
+		std::atomic<UINT64> m_statsRegion{ 0 };	// x, y, width, height of setFrameStats, 16 bits each
+		std::atomic<int> m_statsThreshold{ 128 };
+		mutable std::mutex m_gateMutex;		// guards the gate state below but m_gateThreshold
+		std::condition_variable m_gateTurn;
+		UINT64 m_nextGateTicket = 0;		// ticket of the job whose proxy is compared next, with decode workers
+		std::atomic<int> m_gateThreshold{ 0 };
+		int m_gateMinBlocks = 1;
+		bool m_gateChangedRegionsOnly = false;
+		std::vector<UINT8> m_gateReference;	// DC proxy of the last frame the gate let through
+		long long m_gateReferenceFrameNo = -1;
+		long long m_gateBaseFrameNo = -1;
+		MotionGateStats m_gateStats;
 		PUCRESULT result = PUC_SUCCEEDED;
 		std::string m_lastErrorName = "";
 		int m_resolutionWidth = 1246;
 		int m_resolutionHeight = 800;
 		int m_frameRate = 1000;
 		int m_shutterSpeedFps = 2000;
-		USHORT nReadSequenceNo[2] = { 0,0 };
-		int m_readBuffer[2] = { 0, 0 };
-		std::mutex m_mutex;
-		std::mutex m_mutexSampleRate;
-		UINT8* pDecodeBufProxy[3] = { NULL,NULL,NULL };
+		UINT32 m_exposeOnClk = 0;
+		UINT32 m_exposeOffClk = 0;
+		struct PreparedMode {
+			CaptureMode mode;
+			bool valid = false;
+			bool tuned = false;
+			int threads = 0;
+			bool interFrame = false;
+		};
+		std::vector<PreparedMode> m_modes;
+		int m_currentMode = -1;
+		// Largest frame and range of payload sizes of the valid modes, the buffers are sized for them so switchMode reuses them
+		UINT32 m_modeMaxWidth = 0, m_modeMaxHeight = 0;
+		UINT32 m_modeMinDataSize = 0, m_modeMaxDataSize = 0;
+		ModeSwitchStats m_modeSwitch;
+		std::atomic<long long> m_modeSwitchBegin{ 0 };
+		std::atomic<long long> m_modeSwitchFirstFrame{ 0 };
+		bool m_xferStarted = false;
+		std::atomic<USHORT> nReadSequenceNo[3] = { {0}, {0}, {0} };
+		FrameLease m_readLease[2];
+		int m_framePoolSize = 8;
+		FramePool m_proxyPool;
 		UINT32 nBlockCountX, nBlockCountY;
-		int m_frameSampleRate[2] = { 1, 0 };
+		std::atomic<int> m_frameSampleRate[3] = { {1}, {0}, {0} };
+		FramePool m_dctPool;
 		int counter = 0;
 		PUCLib_WrapperImageListener* listener = nullptr;
+		int m_historyCapacity = 0;
+		FrameHistory m_history;
+		bool m_hasLastSequenceNo = false;
+		bool m_sequenceRestart = false;	// set by cleanupBuffer, the next frame is neither a gap nor a duplicate
+		USHORT m_lastSequenceNo = 0;
+		long long m_unwrappedSequenceNo = -1;
+		static const int SEQUENCE_GAP_LOG_SIZE = 256;
+		std::atomic<UINT64> m_receivedFrames{ 0 };
+		std::atomic<UINT64> m_duplicateFrames{ 0 };
+		std::atomic<UINT64> m_droppedFrames{ 0 };
+		std::atomic<UINT64> m_gapCount{ 0 };
+		std::atomic<long long> m_frameCounter{ -1 };
+		std::mutex m_gapMutex;
+		SequenceGap m_gapLog[SEQUENCE_GAP_LOG_SIZE];
+		LatencyHistogram m_latency[LATENCY_STAGE_COUNT];
+		PUCLib_WrapperBatchListener* m_batchListener = nullptr;
+		std::vector<FrameSubscription*> m_subscriptions;
+		std::atomic<int> m_subscriptionCount{ 0 };
+		std::mutex m_subscriptionMutex;
+		int m_batchSize = 1;
+		long long m_batchMaxLatency = 0;
+		UINT8* m_batchData = NULL;
+		size_t m_batchDataBytes = 0;
+		int m_batchCapacity = 0;
+		size_t m_batchFrameBytes = 0;
+		int m_batchCount = 0;
+		bool m_batchInHistory = false; // the frames of the pending batch are read from the history at flush
+
+		std::vector<USHORT> m_batchSequenceNos;
+		std::vector<long long> m_batchFrameNos;
+		std::vector<long long> m_batchTimestamps;
+		long long m_lastArrival = 0;
+		std::vector<UINT8*> m_targetBuffers;
+		int m_targetRowBytes = 0;
+		PUCLib_WrapperTargetListener* m_targetListener = nullptr;
+		std::atomic<int>* m_targetState = NULL;
+		int m_targetCount = 0; // buffers in use for this transfer, 0 when none are registered or they do not fit
+		std::atomic<int> m_targetNext{ 0 };
+		std::atomic<UINT64> m_targetDropped{ 0 };
+		size_t m_payloadHistoryBytes = 0;
+		bool m_lazyDecode = false;
+		PayloadRing m_payloads;
+		PayloadRecorder m_recorder;
+		std::mutex m_lazyMutex;
+		long long m_lazySequenceNo[3] = { -1, -1, -1 };
+		int m_numDecodeWorkers = 0;
+		DecodeParallelism m_decodeParallelism = DECODE_PARALLEL_AUTO;
+		int m_activeDecodeWorkers = 0;
+		int m_activeDecodeThreads = 16;
+		bool m_decodeAutoTune = true;
+		std::string m_decodeTuneCacheFile;
+		UINT32 m_tunedWidth = 0;
+		UINT32 m_tunedHeight = 0;
+		bool m_tunedInterFrame = false;
+		int m_decodeQueueCapacity = 64;
+		DecodeQueuePolicy m_decodeQueuePolicy = DECODE_QUEUE_DROP_OLDEST;
+		DecodeQueue m_decodeQueue;
+		std::vector<std::thread> m_decodeWorkers;
+		std::mutex m_deliveryMutex;
+		std::condition_variable m_deliveryTurn;
+		UINT64 m_nextDeliveryTicket = 0;
+		long long m_publishedFrameNo[3] = { -1, -1, -1 };
+		std::atomic<long long> m_availableFrameNo[3] = { {-1}, {-1}, {-1} };
+		std::atomic<int> m_frameWaiters{ 0 };
+		FrameWaiter* m_frameWaiterList = NULL;
+		std::mutex m_frameMutex;
+		std::condition_variable m_frameArrived;
+		long long m_readNextFrameNo = -1;	// readNext only, frame numbers keep increasing across restarts so it is never reset
+
+		static long long getTimestamp() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// Sizes the batch buffer for the batch size and the decode ROI, by setupDataBuffer and setBatchListener so delivery never allocates.
+		// Kept while it is large enough, and sized for the largest mode of the mode table. Called under m_deliveryMutex.
+		void allocateBatch() {
+			size_t frameBytes = size_t(m_decodeLineBytes) * m_decodeHeight;
+			if (m_batchData && m_batchCapacity == m_batchSize && m_batchFrameBytes == frameBytes)
+				return;
+			flushBatch();
+			size_t modeFrameBytes = size_t(BufferArena::alignRow(m_modeMaxWidth)) * m_modeMaxHeight;
+			size_t bytes = (frameBytes > modeFrameBytes ? frameBytes : modeFrameBytes) * m_batchSize;
+			if (bytes > m_batchDataBytes) {
+				releaseBatch();
+				m_batchData = new UINT8[bytes];
+				m_batchDataBytes = bytes;
+			}
+			m_batchSequenceNos.assign(m_batchSize, 0);
+			m_batchFrameNos.assign(m_batchSize, 0);
+			m_batchTimestamps.assign(m_batchSize, 0);
+			m_batchCapacity = m_batchSize;
+			m_batchFrameBytes = frameBytes;
+		}
+
+		// Flushes a batch read from the history before storing frameNo would overwrite its first frame, a gap in the stream can do that
+		// before the batch is full. Called under m_deliveryMutex.
+		void flushBatchBefore(long long frameNo) {
+			if (m_batchCount > 0 && m_batchInHistory && frameNo - m_batchFrameNos[0] >= m_history.getCapacity())
+				flushBatch();
+		}
+
+		// Frames the history holds are not copied, flushBatch hands them out from its slab. Called under m_deliveryMutex.
+		void appendToBatch(const UINT8* frame, const DecodeJob& job) {
+			if (m_batchCapacity == 0 || m_batchFrameBytes != size_t(m_decodeLineBytes) * m_decodeHeight)
+				return;
+			bool inHistory = m_history.isAllocated() && m_history.getCapacity() >= m_batchCapacity && m_history.getLastSequenceNo() == job.frameNo;
+			if (m_batchCount > 0 && inHistory != m_batchInHistory)
+				flushBatch();
+			if (m_batchCount == 0)
+				m_batchInHistory = inHistory;
+			if (!inHistory)
+				memcpy(m_batchData + m_batchFrameBytes * m_batchCount, frame, m_batchFrameBytes);
+			m_batchSequenceNos[m_batchCount] = job.sequenceNo;
+			m_batchFrameNos[m_batchCount] = job.frameNo;
+			m_batchTimestamps[m_batchCount] = job.timestamp;
+			m_batchCount++;
+			if (m_batchCount == m_batchCapacity || (m_batchMaxLatency > 0 && getTimestamp() - m_batchTimestamps[0] >= m_batchMaxLatency))
+				flushBatch();
+		}
+
+		// Called under m_deliveryMutex
+		void flushBatch() {
+			if (m_batchCount == 0 || !m_batchListener) {
+				m_batchCount = 0;
+				return;
+			}
+			FrameBatch batch;
+			batch.data = m_batchData;
+			if (m_batchInHistory) {
+				// Consecutive frames stored back to back in the slab go out as they are, the others (a gap or the end of the ring) are gathered
+				long long first = m_batchFrameNos[0];
+				long long last = m_batchFrameNos[m_batchCount - 1];
+				HistorySpan spans[2];
+				if (last - first + 1 == m_batchCount && m_history.range(first, last, spans) == 1 && spans[0].count == m_batchCount) {
+					batch.data = spans[0].data;
+				}
+				else {
+					for (int i = 0; i < m_batchCount; i++)
+						memcpy(m_batchData + m_batchFrameBytes * i, m_history.frameAt(m_batchFrameNos[i]), m_batchFrameBytes);
+				}
+			}
+			batch.count = m_batchCount;
+			batch.width = m_decodeWidth;
+			batch.height = m_decodeHeight;
+			batch.rowBytes = m_decodeLineBytes;
+			batch.frameBytes = m_batchFrameBytes;
+			batch.sequenceNos = m_batchSequenceNos.data();
+			batch.frameNos = m_batchFrameNos.data();
+			batch.timestamps = m_batchTimestamps.data();
+			m_batchCount = 0;
+			m_batchListener->framesReady(batch);
+		}
+
+		void releaseBatch() {
+			if (m_batchData)
+				delete[] m_batchData;
+			m_batchData = NULL;
+			m_batchDataBytes = 0;
+			m_batchCapacity = 0;
+			m_batchFrameBytes = 0;
+			m_batchCount = 0;
+		}
+
+		void recordLatency(long long arrival, long long decodeStart, long long decoded, long long delivered) {
+			m_latency[LATENCY_QUEUE].record(decodeStart - arrival);
+			m_latency[LATENCY_DECODE].record(decoded - decodeStart);
+			m_latency[LATENCY_DELIVER].record(delivered - decoded);
+			m_latency[LATENCY_TOTAL].record(delivered - arrival);
+		}
+
+		// Unwraps the sequence number, counts drops and duplicates. Returns false for a duplicate, which is not decoded.
+		bool triageSequenceNo(USHORT sequenceNo, long long timestamp, long long& frameNo) {
+			bool first = !m_hasLastSequenceNo;
+			long long previous = m_unwrappedSequenceNo;
+			frameNo = unwrapSequenceNo(sequenceNo);
+			if (m_sequenceRestart) {
+				// First frame after a restart: the frames the device sent while the transfer was stopped are no drops,
+				// and the number only has to move on
+				m_sequenceRestart = false;
+				if (frameNo == previous)
+					frameNo = m_unwrappedSequenceNo = previous + 1;
+				first = true;
+			}
+			if (!first && frameNo == previous) {
+				m_duplicateFrames.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			if (!first && frameNo > previous + 1) {
+				SequenceGap gap;
+				gap.firstFrameNo = previous + 1;
+				gap.count = frameNo - previous - 1;
+				gap.timestamp = timestamp;
+				std::lock_guard<std::mutex> guard(m_gapMutex);
+				UINT64 index = m_gapCount.load(std::memory_order_relaxed);
+				m_gapLog[index % SEQUENCE_GAP_LOG_SIZE] = gap;
+				m_gapCount.store(index + 1, std::memory_order_relaxed);
+				m_droppedFrames.fetch_add(gap.count, std::memory_order_relaxed);
+			}
+			m_receivedFrames.fetch_add(1, std::memory_order_relaxed);
+			m_frameCounter.store(frameNo, std::memory_order_relaxed);
+			return true;
+		}
+
+		// Extends the 16 bit device sequence number to 64 bits, it wraps every 65536 frames (about 2 s at 31157 fps)
+		long long unwrapSequenceNo(USHORT sequenceNo) {
+			if (!m_hasLastSequenceNo) {
+				m_hasLastSequenceNo = true;
+				m_unwrappedSequenceNo = sequenceNo;
+			}
+			else {
+				m_unwrappedSequenceNo += USHORT(sequenceNo - m_lastSequenceNo);
+			}
+			m_lastSequenceNo = sequenceNo;
+			return m_unwrappedSequenceNo;
+		}
+
+		void storeHistory(const UINT8* frame, long long frameNo) {
+			if (!m_history.isAllocated())
+				return;
+			if (frameNo == m_history.getLastSequenceNo())
+				return; // duplicate
+			m_history.write(frameNo, frame);
+		}
+
+		static int streamIndex(SubscriptionKind kind) {
+			return kind == SUBSCRIBE_PROXY ? 1 : kind == SUBSCRIBE_DCT ? 2 : 0;
+		}
+
+		// Wakes waitForFrame, readNext and the frame waiters of the stream. The mutex is only taken when somebody waits,
+		// so the callback pays one atomic load otherwise.
+		void signalFrame(int index, long long frameNo) {
+			m_availableFrameNo[index].store(frameNo);
+			if (m_frameWaiters.load() == 0)
+				return;
+			{
+				std::lock_guard<std::mutex> guard(m_frameMutex);
+				FrameWaiter** link = &m_frameWaiterList;
+				while (*link) {
+					FrameWaiter* waiter = *link;
+					if (streamIndex(waiter->kind) != index || frameNo <= waiter->afterFrameNo) {
+						link = &waiter->next;
+						continue;
+					}
+					*link = waiter->next;
+					waiter->next = NULL;
+					waiter->linked = false;
+					m_frameWaiters.fetch_sub(1);
+					waiter->wake(waiter);
+				}
+			}
+			if (index == 0)
+				m_frameArrived.notify_all();
+		}
+
+		// Lazy decoding needs a payload history and nobody who has to be handed every frame: listeners, target buffers and subscriptions
+		// turn it off while they are set
+		bool isDecodingLazily() const {
+			return m_lazyDecode && m_payloads.isAllocated() && !listener && !m_batchListener && m_targetCount == 0 &&
+				m_subscriptionCount.load(std::memory_order_acquire) == 0;
+		}
+
+		// Lazy decode mode: decodes the newest stored payload into the pool unless it is already there.
+		// False only when the pool has no free slot.
+		bool decodeLatestPayload(int index) {
+			std::lock_guard<std::mutex> guard(m_lazyMutex);
+			long long last = m_payloads.getLastSequenceNo();
+			if (last < 0 || last == m_lazySequenceNo[index])
+				return true;
+			FramePool& pool = poolAt(index);
+			int slot = pool.beginWrite();
+			if (slot < 0)
+				return false;
+			long long decodeStart = getTimestamp();
+			PayloadRing::Record record;
+			bool decoded = m_payloads.find(last, record) &&
+				PUC_CHK_SUCCEEDED(decodeStream(index, slot, (PUINT8)m_payloads.data(record))) && m_payloads.isIntact(record);
+			if (!decoded) {
+				pool.abortWrite(slot);
+				return true;
+			}
+			long long decodedTimestamp = getTimestamp();
+			pool.stamp(slot, last, decodedTimestamp, decodedTimestamp);
+			recordLatency(record.timestamp, decodeStart, decodedTimestamp, decodedTimestamp);
+			pool.publish(slot, record.deviceSequenceNo, record.timestamp);
+			m_lazySequenceNo[index] = last;
+			return true;
+		}
+
+		// Called under m_deliveryMutex. A frame decoded after a newer one was published is dropped, so read() never goes back in time.
+		bool publishOrAbort(FramePool& pool, int slot, PUCRESULT res, const DecodeJob& job, FrameLease* lease = NULL) {
+			long long& published = m_publishedFrameNo[&pool == &m_fullPool ? 0 : &pool == &m_proxyPool ? 1 : 2];
+			if (PUC_CHK_FAILED(res) || job.frameNo < published) {
+				pool.abortWrite(slot);
+				return false;
+			}
+			published = job.frameNo;
+			pool.publish(slot, job.sequenceNo, job.timestamp, lease);
+			return true;
+		}
+
+		// Single thread mode: fetches one payload and decodes it into the pool of the requested stream
+		bool decodeSingle(int index) {
+			FramePool& pool = poolAt(index);
+			int slot = pool.beginWrite();
+			if (slot < 0)
+				return false;
+			result = m_source->getSingleXferData(hDevice, &xferData);
+			long long arrival = getTimestamp();
+			if (PUC_CHK_SUCCEEDED(result))
+			{
+				result = decodeStream(index, slot, xferData.pData);
+			}
+			if (PUC_CHK_FAILED(result))
+			{
+				pool.abortWrite(slot);
+				m_lastErrorName = "PUC_DecodeData error";
+				return false;
+			}
+			long long decoded = getTimestamp();
+			// No transfer callback in this mode, so the consumer thread owns the unwrap state
+			pool.stamp(slot, unwrapSequenceNo(xferData.nSequenceNo), decoded, decoded);
+			pool.publish(slot, xferData.nSequenceNo, arrival);
+			recordLatency(arrival, arrival, decoded, decoded);
+			return true;
+		}
 
 		void cleanupBuffer() {
-			if (!m_isSingleThread) {
-				result = PUC_EndXferData(hDevice);
-			}
-
-			if (xferData.pData)
-				delete[] xferData.pData;
-			if (pDecodeBuf[0])
-				delete[] pDecodeBuf[0];
-			if (pDecodeBuf[1])
-				delete[] pDecodeBuf[1];
-			if (pDecodeBuf[2])
-				delete[] pDecodeBuf[2];
-			if (pDecodeBufProxy[0])
-				delete[] pDecodeBufProxy[0];
-			if (pDecodeBufProxy[1])
-				delete[] pDecodeBufProxy[1];
-			if (pDecodeBufProxy[2])
-				delete[] pDecodeBufProxy[2];
+			if (m_xferStarted) {
+				result = m_source->endXferData(hDevice);
+				m_xferStarted = false;
+			}
+			stopDecodeWorkers();
+			{
+				// The batch buffer is kept, setupDataBuffer only reallocates it when it grows
+				std::lock_guard<std::mutex> guard(m_deliveryMutex);
+				flushBatch();
+			}
+
+			m_readLease[0].release();
+			m_readLease[1].release();
+			{
+				std::lock_guard<std::mutex> guard(m_subscriptionMutex);
+				for (size_t i = 0; i < m_subscriptions.size(); i++)
+					m_subscriptions[i]->clear();
+			}
+			m_fullPool.release();
+			m_proxyPool.release();
+			m_dctPool.release();
+			m_history.release();
+			m_payloads.release();
+			m_targetCount = 0;
+			// Frame numbers keep increasing across the restart: awaiters (readNext, FrameStream, MatAwaiter) and recordings hold on to them
+			m_sequenceRestart = m_hasLastSequenceNo;
+			m_lastArrival = 0;
+			m_lazySequenceNo[0] = -1;
+			m_lazySequenceNo[1] = -1;
+			m_lazySequenceNo[2] = -1;
+			m_publishedFrameNo[0] = -1;
+			m_publishedFrameNo[1] = -1;
+			m_publishedFrameNo[2] = -1;
+			m_availableFrameNo[0].store(-1, std::memory_order_relaxed);
+			m_availableFrameNo[1].store(-1, std::memory_order_relaxed);
+			m_availableFrameNo[2].store(-1, std::memory_order_relaxed);
 
 			xferData.pData = NULL;
-			pDecodeBuf[0] = NULL;
-			pDecodeBuf[1] = NULL;
-			pDecodeBuf[2] = NULL;
-			pDecodeBufProxy[0] = NULL;
-			pDecodeBufProxy[1] = NULL;
-			pDecodeBufProxy[2] = NULL;
 		}
 
-		void swapBuffer(bool updateFull, bool updateProxy) {
-			// Swap Buffers
-			std::lock_guard<std::mutex> guard(m_mutex);
-			if(updateFull)
-				m_readBuffer[0] = 1 - m_readBuffer[0];
-			if (updateProxy)
-				m_readBuffer[1] = 1 - m_readBuffer[1];
+		// Checks a mode against the limits of the device
+		bool validateMode(const CaptureMode& mode) {
+			PUC_RESO_LIMIT_INFO reso;
+			PUC_FRAMERATE_LIMIT_INFO rate;
+			if (PUC_CHK_FAILED(m_source->getResolutionLimit(hDevice, &reso)) || PUC_CHK_FAILED(m_source->getFramerateLimit(hDevice, &rate))) {
+				m_lastErrorName = "PUC_GetResolutionLimit error";
+				return false;
+			}
+			bool widthOk = mode.width >= reso.nMinWidth && mode.width <= reso.nMaxWidth &&
+				(mode.width == reso.nMaxWidth || reso.nUnitWidth == 0 || mode.width % reso.nUnitWidth == 0);
+			bool heightOk = mode.height >= reso.nMinHeight && mode.height <= reso.nMaxHeight &&
+				(mode.height == reso.nMaxHeight || reso.nUnitHeight == 0 || mode.height % reso.nUnitHeight == 0);
+			if (!widthOk || !heightOk) {
+				m_lastErrorName = "mode resolution out of range";
+				return false;
+			}
+			if (mode.frameRate < rate.nMinFrameRate || mode.frameRate > rate.nMaxFrameRate || mode.shutterSpeedFps < mode.frameRate) {
+				m_lastErrorName = "mode frame rate out of range";
+				return false;
+			}
+			return true;
+		}
+
+		// Sets a mode on the device, the transfer must be stopped
+		// Settings of the mode the device is in, read by setResolution, the decode ROI and reopen
+		void storeMode(int index) {
+			const CaptureMode& mode = m_modes[index].mode;
+			m_resolutionWidth = mode.width;
+			m_resolutionHeight = mode.height;
+			m_frameRate = mode.frameRate;
+			m_shutterSpeedFps = mode.shutterSpeedFps;
+			m_exposeOnClk = mode.exposeOnClk;
+			m_exposeOffClk = mode.exposeOffClk;
+			if (mode.roiWidth > 0) {
+				m_roiX = mode.roiX;
+				m_roiY = mode.roiY;
+				m_roiWidth = mode.roiWidth;
+				m_roiHeight = mode.roiHeight;
+			}
+			m_currentMode = index;
+		}
+
+		PUCRESULT applyMode(const CaptureMode& mode) {
+			UINT32 currentRate = 0, currentShutter = 0;
+			m_source->getFramerateShutter(hDevice, &currentRate, &currentShutter);
+			PUCRESULT result;
+			// The largest resolution shrinks as the frame rate grows: shrink the frame before speeding up, slow down before growing it
+			if (mode.frameRate > currentRate) {
+				result = m_source->setResolution(hDevice, mode.width, mode.height);
+				if (PUC_CHK_SUCCEEDED(result))
+					result = m_source->setFramerateShutter(hDevice, mode.frameRate, mode.shutterSpeedFps);
+			}
+			else {
+				result = m_source->setFramerateShutter(hDevice, mode.frameRate, mode.shutterSpeedFps);
+				if (PUC_CHK_SUCCEEDED(result))
+					result = m_source->setResolution(hDevice, mode.width, mode.height);
+			}
+			if (PUC_CHK_SUCCEEDED(result) && mode.exposeOnClk > 0)
+				result = m_source->setExposeTime(hDevice, mode.exposeOnClk, mode.exposeOffClk);
+			return result;
+		}
+
+		// Validates every mode on the device, tunes the decode threads and measures the payload size for it, then puts the device back
+		// into the current settings. The transfer must be stopped and in PUC_DATA_COMPRESSED. Fails if the settings cannot be restored.
+		PUCRESULT prepareModes() {
+			m_modeMaxWidth = m_modeMaxHeight = 0;
+			m_modeMinDataSize = m_modeMaxDataSize = 0;
+			CaptureMode current;
+			m_source->getResolution(hDevice, &current.width, &current.height);
+			m_source->getFramerateShutter(hDevice, &current.frameRate, &current.shutterSpeedFps);
+			current.exposeOnClk = m_exposeOnClk;
+			current.exposeOffClk = m_exposeOffClk;
+			for (size_t i = 0; i < m_modes.size(); i++) {
+				PreparedMode& prepared = m_modes[i];
+				prepared.valid = validateMode(prepared.mode) && PUC_CHK_SUCCEEDED(applyMode(prepared.mode));
+				prepared.tuned = false;
+				if (!prepared.valid)
+					continue;
+				UINT32 dataSize = 0;
+				if (PUC_CHK_SUCCEEDED(m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &dataSize)) && dataSize > 0) {
+					m_modeMinDataSize = m_modeMinDataSize == 0 || dataSize < m_modeMinDataSize ? dataSize : m_modeMinDataSize;
+					m_modeMaxDataSize = dataSize > m_modeMaxDataSize ? dataSize : m_modeMaxDataSize;
+				}
+				m_modeMaxWidth = prepared.mode.width > m_modeMaxWidth ? prepared.mode.width : m_modeMaxWidth;
+				m_modeMaxHeight = prepared.mode.height > m_modeMaxHeight ? prepared.mode.height : m_modeMaxHeight;
+				if (!m_decodeAutoTune)
+					continue;
+				nWidth = prepared.mode.width;
+				nHeight = prepared.mode.height;
+				nLineBytes = BufferArena::alignRow(nWidth);
+				for (UINT32 j = 0; j < PUC_Q_COUNT; j++)
+					m_source->getQuantization(hDevice, j, &q[j]);
+				tuneDecodeThreads();
+				prepared.tuned = m_tunedWidth == nWidth && m_tunedHeight == nHeight;
+				prepared.threads = m_numDecodeThreads;
+				prepared.interFrame = m_tunedInterFrame;
+			}
+			PUCRESULT result = applyMode(current);
+			if (PUC_CHK_FAILED(result))
+				m_lastErrorName = "mode restore error";
+			// setupDataBuffer tunes the current settings again unless they are one of the modes
+			m_tunedWidth = m_tunedHeight = 0;
+			if (m_currentMode >= 0 && m_modes[m_currentMode].tuned) {
+				m_numDecodeThreads = m_modes[m_currentMode].threads;
+				m_tunedInterFrame = m_modes[m_currentMode].interFrame;
+				m_tunedWidth = m_modes[m_currentMode].mode.width;
+				m_tunedHeight = m_modes[m_currentMode].mode.height;
+			}
+			return result;
+		}
+
+		// Sizes the arena for the largest resolution of the device, so setups at any resolution fit without allocating again
+		void reserveArena(int fullSlots, int proxySlots, int dctSlots) {
+			UINT32 maxWidth = nWidth;
+			UINT32 maxHeight = nHeight;
+			PUC_RESO_LIMIT_INFO limit;
+			if (PUC_CHK_SUCCEEDED(m_source->getResolutionLimit(hDevice, &limit))) {
+				maxWidth = limit.nMaxWidth > maxWidth ? limit.nMaxWidth : maxWidth;
+				maxHeight = limit.nMaxHeight > maxHeight ? limit.nMaxHeight : maxHeight;
+			}
+			UINT32 blocksX = (maxWidth + 7) / 8;
+			UINT32 blocksY = (maxHeight + 7) / 8;
+			size_t bytes = BufferArena::alignPage(size_t(BufferArena::alignRow(maxWidth)) * maxHeight * fullSlots)
+				+ BufferArena::alignPage(size_t(blocksX) * blocksY * proxySlots)
+				+ BufferArena::alignPage(size_t(BufferArena::alignRow(blocksX * 8 * sizeof(INT16))) * blocksY * 8 * dctSlots);
+			if (!m_arena.reserve(bytes))
+				m_lastErrorName = "VirtualAlloc error"; // the pools fall back to the heap
 		}
 
 		PUCRESULT setupDataBuffer() {
@@ -993,9 +4429,15 @@ namespace photron {
 			PUCRESULT result = PUC_SUCCEEDED;
 			
 			if (m_isSingleThread) {
-				result = PUC_GetXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
-				xferData.pData = new UINT8[nDataSize];
-				result = PUC_GetSingleXferData(hDevice, &xferData);
+				result = m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
+				if (nDataSize > m_xferBufferSize) {
+					if (m_xferBuffer)
+						delete[] m_xferBuffer;
+					m_xferBufferSize = nDataSize > m_modeMaxDataSize ? nDataSize : m_modeMaxDataSize;
+					m_xferBuffer = new UINT8[m_xferBufferSize];
+				}
+				xferData.pData = m_xferBuffer;
+				result = m_source->getSingleXferData(hDevice, &xferData);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_GetSingleXferData error";
@@ -1003,16 +4445,21 @@ namespace photron {
 				}
 			}
 			
-			result = PUC_GetResolution(hDevice, &nWidth, &nHeight);
+			result = m_source->getResolution(hDevice, &nWidth, &nHeight);
 			if (PUC_CHK_FAILED(result))
 			{
 				m_lastErrorName = "PUC_GetResolution error";
 				goto EXIT_LABEL;
 			}
+			if (m_recorder.isRecording() && (m_recorder.getWidth() != nWidth || m_recorder.getHeight() != nHeight)) {
+				// The recording header holds one resolution, the transfer is stopped so the callback no longer appends
+				m_recorder.close();
+				m_lastErrorName = "recording ended by a resolution change";
+			}
 
 			for (UINT32 i = 0; i < PUC_Q_COUNT; i++)
 			{
-				result = PUC_GetQuantization(hDevice, i, &q[i]);
+				result = m_source->getQuantization(hDevice, i, &q[i]);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_GetQuantization error";
@@ -1020,21 +4467,95 @@ namespace photron {
 				}
 			}
 
-			nLineBytes = nWidth % 4 == 0 ? nWidth : nWidth + (4 - nWidth % 4);
-			pDecodeBuf[0] = new UINT8[nLineBytes * nHeight];
-			pDecodeBuf[1] = new UINT8[nLineBytes * nHeight];
-			pDecodeBuf[2] = new UINT8[nLineBytes * nHeight];
-
-			
+			nLineBytes = BufferArena::alignRow(nWidth);
+			alignDecodeROI(nWidth, nHeight, m_decodeX, m_decodeY, m_decodeWidth, m_decodeHeight);
+			m_decodeLineBytes = BufferArena::alignRow(m_decodeWidth);
+			tuneDecodeThreads();
+			resolveDecodeParallelism();
 			nBlockCountX = nWidth % 8 == 0 ? nWidth / 8 : (nWidth + (8 - nWidth % 8)) / 8;
 			nBlockCountY = nHeight % 8 == 0 ? nHeight / 8 : (nHeight + (8 - nHeight % 8)) / 8;
-			pDecodeBufProxy[0] = new UINT8[nBlockCountX * nBlockCountY];
-			pDecodeBufProxy[1] = new UINT8[nBlockCountX * nBlockCountY];
-			pDecodeBufProxy[2] = new UINT8[nBlockCountX * nBlockCountY];
+			{
+				// Every worker may hold a slot while it waits for its turn to deliver. The arena and the slot states are sized for the
+				// workers of any mode, so switchMode reuses them.
+				int fullSlots = m_framePoolSize + m_activeDecodeWorkers + mailboxSlots(SUBSCRIBE_FULL) + mailboxSlots(SUBSCRIBE_ROI);
+				int proxySlots = m_framePoolSize + m_activeDecodeWorkers + mailboxSlots(SUBSCRIBE_PROXY);
+				int dctSlots = m_frameSampleRate[2].load(std::memory_order_relaxed) != 0 ? m_framePoolSize + m_activeDecodeWorkers + mailboxSlots(SUBSCRIBE_DCT) : 0;
+				int extraWorkers = reservedDecodeWorkers() - m_activeDecodeWorkers;
+				reserveArena(fullSlots + extraWorkers, proxySlots + extraWorkers, dctSlots > 0 ? dctSlots + extraWorkers : 0);
+				m_fullPool.allocate(fullSlots, m_decodeWidth, m_decodeHeight, m_decodeLineBytes, &m_arena, fullSlots + extraWorkers);
+				{
+					// The first frame of the new geometry always goes through the gate
+					std::lock_guard<std::mutex> guard(m_gateMutex);
+					m_gateReferenceFrameNo = -1;
+					UINT32 maxWidth = nWidth > m_modeMaxWidth ? nWidth : m_modeMaxWidth;
+					UINT32 maxHeight = nHeight > m_modeMaxHeight ? nHeight : m_modeMaxHeight;
+					m_gateReference.reserve(size_t((maxWidth + 7) / 8) * ((maxHeight + 7) / 8));
+				}
+				if ((m_statsRegion.load(std::memory_order_relaxed) >> 32) != 0 || !m_frameStats.empty()) {
+					// Reserved for the whole decode ROI, so moving the region never allocates while streaming, and for the largest mode.
+					// Never shrunk, the statistics of the slots a mode does not use stay allocated for the next one.
+					if (m_frameStats.size() < size_t(fullSlots + extraWorkers))
+						m_frameStats.resize(fullSlots + extraWorkers);
+					for (size_t i = 0; i < m_frameStats.size(); i++) {
+						m_frameStats[i].valid = false;
+						m_frameStats[i].rowSums.reserve(m_decodeHeight > m_modeMaxHeight ? m_decodeHeight : m_modeMaxHeight);
+						m_frameStats[i].columnSums.reserve(m_decodeWidth > m_modeMaxWidth ? m_decodeWidth : m_modeMaxWidth);
+					}
+					m_fullPool.attachStats(m_frameStats.data());
+				}
+				// PUC_DecodeDCData writes the proxy without padding
+				m_proxyPool.allocate(proxySlots, nBlockCountX, nBlockCountY, nBlockCountX, &m_arena, proxySlots + extraWorkers);
+				if (dctSlots > 0) {
+					// Whole blocks of INT16 coefficients over the decode ROI
+					UINT32 dctWidth = (m_decodeWidth + 7) & ~7u;
+					UINT32 dctHeight = (m_decodeHeight + 7) & ~7u;
+					m_dctPool.allocate(dctSlots, dctWidth, dctHeight, BufferArena::alignRow(dctWidth * sizeof(INT16)), &m_arena, dctSlots + extraWorkers);
+				}
+			}
+			if (m_historyCapacity > 0)
+				m_history.allocate(m_historyCapacity, m_decodeWidth, m_decodeHeight, m_decodeLineBytes, size_t(BufferArena::alignRow(m_modeMaxWidth)) * m_modeMaxHeight);
+			if (m_batchListener) {
+				std::lock_guard<std::mutex> guard(m_deliveryMutex);
+				allocateBatch();
+			}
+			if (m_payloadHistoryBytes > 0) {
+				result = m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
+				if (PUC_CHK_FAILED(result))
+				{
+					m_lastErrorName = "PUC_GetXferDataSize error";
+					goto EXIT_LABEL;
+				}
+				// Index twice as many entries as full sized payloads fit, actual payloads are usually smaller. The smallest mode needs the most.
+				UINT32 indexDataSize = m_modeMinDataSize > 0 && m_modeMinDataSize < nDataSize ? m_modeMinDataSize : nDataSize;
+				m_payloads.allocate(m_payloadHistoryBytes, int(m_payloadHistoryBytes / (indexDataSize ? indexDataSize : 1)) * 2 + 64);
+			}
+
+
+			if (!m_targetBuffers.empty()) {
+				if (m_targetRowBytes >= (int)m_decodeWidth && m_targetRowBytes % 4 == 0) {
+					// Buffers still held by the caller stay claimed across the restart
+					m_targetCount = (int)m_targetBuffers.size();
+					m_targetNext.store(0, std::memory_order_relaxed);
+				}
+				else {
+					// Not fatal, frames still reach the pools and the listener
+					m_lastErrorName = "target buffer rowBytes too small";
+				}
+			}
 
 
 			if (!m_isSingleThread) {
-				result = PUC_BeginXferData(hDevice, PUCLib_Wrapper::receive, this);
+				if (m_activeDecodeWorkers > 0) {
+					result = m_source->getXferDataSize(hDevice, PUC_DATA_COMPRESSED, &nDataSize);
+					if (PUC_CHK_FAILED(result))
+					{
+						m_lastErrorName = "PUC_GetXferDataSize error";
+						goto EXIT_LABEL;
+					}
+					startDecodeWorkers();
+				}
+				result = m_source->beginXferData(hDevice, PUCLib_Wrapper::receive, this);
+				m_xferStarted = PUC_CHK_SUCCEEDED(result);
 			}
 
 			return result;
@@ -1043,8 +4564,9 @@ namespace photron {
 			if (hDevice)
 			{
 				cleanupBuffer();
+				m_recorder.close();
 
-				result = PUC_CloseDevice(hDevice);
+				result = m_source->closeDevice(hDevice);
 				if (PUC_CHK_FAILED(result))
 				{
 					m_lastErrorName = "PUC_CloseDevice error";
@@ -0,0 +1,245 @@
+#pragma once
+
+/*!
+	@~english
+		@brief photron::VideoCapture-like client of the frame bus published by the capture daemon
+		@details Several processes can read the camera through one daemon (src/captureDaemon). read, readProxy, readNext and readROI return
+			cv::Mat headers on the shared memory without copying. The mapping is read only: the Mats must not be written to (it is an access
+			violation), clone them or use readCopy to get a frame to modify. A slot is rewritten after the daemon published slotCount newer
+			frames, so check isFrameValid/isProxyValid after processing, or use readCopy for a frame that stays consistent.
+			The listener interface is the one of VideoCapture (PhotronCaptureListener.h). The daemon owns the camera, so set changes nothing
+			and returns false. Does not need PUCLIB.
+	@~japanese
+		@brief キャプチャデーモンが公開するフレームバスの、photron::VideoCaptureと同様のクライアント
+		@details 1つのデーモン（src/captureDaemon）を通じて複数のプロセスがカメラを読み出せます。read、readProxy、readNext、readROIは共有メモリを
+			コピーせずに参照するcv::Matを返します。マッピングは読み出し専用のため、Matに書き込まないでください（アクセス違反になります）。
+			変更する場合はcloneするか、readCopyを使用してください。デーモンがslotCount個の新しいフレームを公開するとスロットは上書きされるため、
+			処理後にisFrameValid/isProxyValidを確認するか、一貫したフレームが必要な場合はreadCopyを使用してください。
+			リスナーはVideoCaptureと共通です（PhotronCaptureListener.h）。カメラはデーモンが所有するため、setは何も変更せずfalseを返します。
+			PUCLIBは不要です。
+*/
+
+#include <atomic>
+#include <thread>
+#include <opencv2/core.hpp>
+#include "PUCLib_FrameBus.h"
+#include "PhotronCaptureListener.h"
+
+namespace photron {
+
+	class BusCapture {
+		FrameBusReader m_reader;
+		FrameBusView m_lastView[FRAME_BUS_STREAMS];
+		long long m_readNextFrameNo = -1;
+		std::string m_lastErrorName;
+		VideoCaptureImageListener* m_listener = nullptr;
+		std::thread m_listenerThread;
+		std::atomic<bool> m_listening{ false };
+
+		bool wrap(const FrameBusView& view, cv::Mat& img) {
+			m_lastView[view.stream] = view;
+			img = cv::Mat(view.height, view.width, CV_8UC1, (void*)view.data, view.rowBytes);
+			return true;
+		}
+
+		// Hands every frame to the listener, polling the bus like readNext
+		void listen() {
+			long long last = m_reader.getLatestFrameNo(FRAME_BUS_FULL);
+			while (m_listening.load()) {
+				FrameBusView view;
+				if (!m_reader.next(FRAME_BUS_FULL, last, view, 100))
+					continue;
+				last = view.frameNo;
+				cv::Mat mat(view.height, view.width, CV_8UC1, (void*)view.data, view.rowBytes);
+				m_listener->imageReady(mat, view.sequenceNo);
+			}
+		}
+
+		void startListening() {
+			if (m_listener == nullptr || !m_reader.isOpened() || m_listenerThread.joinable())
+				return;
+			m_listening = true;
+			m_listenerThread = std::thread(&BusCapture::listen, this);
+		}
+
+		void stopListening() {
+			m_listening = false;
+			if (m_listenerThread.joinable())
+				m_listenerThread.join();
+		}
+	public:
+		~BusCapture() {
+			stopListening();
+		}
+
+		// Name of the bus of the daemon running deviceID, see captureDaemon
+		static std::string busName(int deviceID) {
+			return "photron" + std::to_string(deviceID);
+		}
+
+		bool open(const std::string& name) {
+			stopListening();
+			if (!m_reader.open(name.c_str())) {
+				m_lastErrorName = "no capture daemon publishing " + name;
+				return false;
+			}
+			m_readNextFrameNo = -1;
+			m_lastErrorName.clear();
+			startListening();
+			return true;
+		}
+
+		// Same signature as photron::VideoCapture::open, connects to the daemon of deviceID
+		bool open(int deviceID, int apiID) {
+			return open(busName(deviceID));
+		}
+
+		bool isOpened() const {
+			return m_reader.isOpened();
+		}
+
+		// False once the daemon stopped or has not sent a heartbeat for timeoutMs
+		bool isAlive(int timeoutMs = 1000) const {
+			return m_reader.isAlive(timeoutMs);
+		}
+
+		void release() {
+			stopListening();
+			m_reader.close();
+			m_lastView[FRAME_BUS_FULL] = FrameBusView();
+			m_lastView[FRAME_BUS_PROXY] = FrameBusView();
+		}
+
+		const char* getLastErrorName() const {
+			return m_lastErrorName.c_str();
+		}
+
+		// Same as VideoCapture::addListener: imageReady gets every new frame (read only, valid until the slot is rewritten) on a thread
+		// of BusCapture, nullptr removes the listener
+		void addListener(VideoCaptureImageListener* listener) {
+			stopListening();
+			m_listener = listener;
+			startListening();
+		}
+
+		// Latest frame, img references the shared memory
+		bool read(cv::Mat& img) {
+			FrameBusView view;
+			if (!m_reader.isOpened() || !m_reader.latest(FRAME_BUS_FULL, view))
+				return false;
+			return wrap(view, img);
+		}
+
+		bool readProxy(cv::Mat& img) {
+			FrameBusView view;
+			if (!m_reader.isOpened() || !m_reader.latest(FRAME_BUS_PROXY, view))
+				return false;
+			return wrap(view, img);
+		}
+
+		// Next frame not returned before, waits up to timeoutMs for it. skipped receives the number of frames published in between.
+		bool readNext(cv::Mat& img, int timeoutMs, long long* skipped = NULL) {
+			FrameBusView view;
+			if (!m_reader.isOpened() || !m_reader.next(FRAME_BUS_FULL, m_readNextFrameNo, view, timeoutMs))
+				return false;
+			if (skipped)
+				*skipped = m_readNextFrameNo < 0 ? 0 : view.frameNo - m_readNextFrameNo - 1;
+			m_readNextFrameNo = view.frameNo;
+			return wrap(view, img);
+		}
+
+		// Frame number of the latest frame once it is newer than afterFrameNo, -1 on timeout
+		long long waitForFrame(long long afterFrameNo, int timeoutMs) {
+			FrameBusView view;
+			if (!m_reader.isOpened() || !m_reader.next(FRAME_BUS_FULL, afterFrameNo, view, timeoutMs))
+				return -1;
+			return view.frameNo;
+		}
+
+		// Copy of the latest frame that cannot be torn, retried while the daemon overwrites the slot
+		bool readCopy(cv::Mat& img) {
+			for (int attempt = 0; attempt < 8; attempt++) {
+				FrameBusView view;
+				if (!m_reader.isOpened() || !m_reader.latest(FRAME_BUS_FULL, view))
+					return false;
+				img.create(view.height, view.width, CV_8UC1);
+				if (m_reader.copy(view, img.data, (int)img.step))
+					return true;
+			}
+			return false;
+		}
+
+		// Area of the published frames in sensor coordinates. The daemon decodes the full frame, so this is the latest frame's size.
+		cv::Rect getDecodeROI() {
+			FrameBusView view;
+			if (!m_reader.isOpened() || !m_reader.latest(FRAME_BUS_FULL, view))
+				return cv::Rect();
+			return cv::Rect(0, 0, view.width, view.height);
+		}
+
+		// Same as VideoCapture::readROI: rect of the latest frame without copying, false if the frame does not cover it
+		bool readROI(const cv::Rect& rect, cv::Mat& img) {
+			if (rect.width <= 0 || rect.height <= 0 || rect.x < 0 || rect.y < 0)
+				return false;
+			cv::Mat frame;
+			if (!read(frame) || rect.x + rect.width > frame.cols || rect.y + rect.height > frame.rows)
+				return false;
+			img = frame(rect);
+			return true;
+		}
+
+		BusCapture& operator>> (cv::Mat& image) {
+			read(image);
+			return *this;
+		}
+
+		// Property ids of VideoCapture
+		enum {
+			CAP_PROP_FRAME_WIDTH_HEIGHT = 100000,
+			CAP_PROP_FRAMERATE_SHUTTER_SPEED,
+			CAP_PROP_FAN_STATE,
+			CAP_PROP_EXPOSURE_TIME_ON_OFF_CLK,
+			CAP_PROP_DECODE_ROI
+		};
+
+		// The camera settings belong to the daemon (its command line), a client cannot change them
+		bool set(int propId, unsigned int value, unsigned int value2 = 0) {
+			m_lastErrorName = "the capture daemon owns the camera settings";
+			return false;
+		}
+
+		bool set(int propId, const cv::Rect& rect) {
+			m_lastErrorName = "the capture daemon owns the camera settings";
+			return false;
+		}
+
+		// CAP_PROP_FRAME_WIDTH_HEIGHT: size of the latest frame, false for the other properties or before the first frame
+		bool get(int propId, unsigned int& value, unsigned int& value2) {
+			FrameBusView view;
+			if (propId != CAP_PROP_FRAME_WIDTH_HEIGHT || !m_reader.isOpened() || !m_reader.latest(FRAME_BUS_FULL, view))
+				return false;
+			value = (unsigned int)view.width;
+			value2 = (unsigned int)view.height;
+			return true;
+		}
+
+		// True if the frame of the last read/readNext was not overwritten since
+		bool isFrameValid() const {
+			return m_reader.isValid(m_lastView[FRAME_BUS_FULL]);
+		}
+
+		bool isProxyValid() const {
+			return m_reader.isValid(m_lastView[FRAME_BUS_PROXY]);
+		}
+
+		// Frame number and device sequence number of the last read frame
+		long long getFrameNo() const {
+			return m_lastView[FRAME_BUS_FULL].frameNo;
+		}
+
+		uint16_t getSequenceNo() const {
+			return m_lastView[FRAME_BUS_FULL].sequenceNo;
+		}
+	};
+
+}
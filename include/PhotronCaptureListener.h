@@ -0,0 +1,24 @@
+#pragma once
+
+/*!
+	@~english
+		@brief Frame listener shared by photron::VideoCapture and photron::BusCapture
+		@details A listener written for one capture class can be added to the other. Kept apart from PhotronVideoCapture.h, so that
+			BusCapture clients build without PUCLIB.
+	@~japanese
+		@brief photron::VideoCaptureとphotron::BusCaptureで共通のフレームリスナー
+		@details 一方のキャプチャクラス用に作成したリスナーを、もう一方にも追加できます。BusCaptureのクライアントがPUCLIBなしでビルドできるよう、
+			PhotronVideoCapture.hとは別のヘッダにしています。
+*/
+
+#include <opencv2/core.hpp>
+
+namespace photron {
+
+	class VideoCaptureImageListener {
+	public:
+		// Called for every new frame from a thread of the capture class, sequenceNum is the 16 bit sequence number of the device (USHORT)
+		virtual void imageReady(cv::Mat& mat, unsigned short sequenceNum) = 0;
+	};
+
+}
@@ -11,22 +11,113 @@
 */
 
 #include "PUCLib_Wrapper.h"
+#ifdef PHOTRON_ENABLE_COROUTINES
+#include "PUCLib_Coroutine.h"
+#endif
 
 #include <opencv2/core.hpp>
+#include "PhotronCaptureListener.h"
 using namespace cv;
 
 namespace photron {
 
-	class VideoCaptureImageListener {
+	class VideoCaptureBatchListener {
 	public:
-		virtual void imageReady(Mat &mat, USHORT sequenceNum) = 0;
+		// frames stacks count frames vertically (frame i is frames.rowRange(i * height, (i + 1) * height)), it is only valid during the call
+		virtual void framesReady(Mat& frames, int height, const USHORT* sequenceNums, int count) = 0;
 	};
 
+	class VideoCaptureTargetListener {
+	public:
+		// target is the index-th Mat of VideoCapture::setTargetBuffers holding the new frame, hand it back with releaseTarget(index)
+		virtual void targetReady(int index, Mat& target, USHORT sequenceNum) = 0;
+	};
+
+
+	// Lets a cv::Mat own a FrameLease: the pool buffer is released when the last Mat referencing it is destroyed
+	class FrameLeaseAllocator : public cv::MatAllocator {
+	public:
+		UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, AccessFlag flags, UMatUsageFlags usageFlags) const override {
+			return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		}
+
+		bool allocate(UMatData* data, AccessFlag accessFlags, UMatUsageFlags usageFlags) const override {
+			return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+		}
+
+		void deallocate(UMatData* u) const override {
+			if (!u)
+				return;
+			FramePool* pool = (FramePool*)u->userdata;
+			pool->releaseData(u->origdata, (unsigned int)u->allocatorFlags_);
+			delete u;
+		}
+
+		static FrameLeaseAllocator* getInstance() {
+			static FrameLeaseAllocator allocator;
+			return &allocator;
+		}
+
+		// Wraps the lease in a Mat without copying, the Mat takes over the lease
+		static Mat wrap(FrameLease& lease, int type = CV_8UC1) {
+			Mat mat(lease.height, lease.width, type, lease.data, lease.rowBytes);
+			UMatData* u = new UMatData(getInstance());
+			u->data = u->origdata = lease.data;
+			u->size = size_t(lease.rowBytes) * size_t(lease.height);
+			u->userdata = lease.pool;
+			u->allocatorFlags_ = (int)lease.generation;
+			u->refcount = 1;
+			mat.u = u;
+			lease = FrameLease();
+			return mat;
+		}
+	};
+
+#ifdef PHOTRON_ENABLE_COROUTINES
+	// co_await of VideoCapture::nextFrame and nextProxy: a frame not returned before as a Mat referencing the pool buffer, empty on timeout
+	class MatAwaiter {
+		FrameAwaiter m_frame;
+		long long& m_lastFrameNo;
+	public:
+		MatAwaiter(PUCLib_Wrapper& wrapper, FrameExecutor& executor, SubscriptionKind kind, long long& lastFrameNo, int timeoutMs)
+			: m_frame(wrapper, executor, kind, lastFrameNo, timeoutMs), m_lastFrameNo(lastFrameNo) {
+		}
+		bool await_ready() const { return m_frame.await_ready(); }
+		bool await_suspend(std::coroutine_handle<> handle) { return m_frame.await_suspend(handle); }
+		Mat await_resume() {
+			FrameLease lease = m_frame.await_resume();
+			if (!lease.isValid() || lease.frameNo <= m_lastFrameNo) {
+				lease.release();
+				return Mat();
+			}
+			m_lastFrameNo = lease.frameNo;
+			return FrameLeaseAllocator::wrap(lease);
+		}
+	};
+#endif
 
-	class VideoCapture : public PUCLib_WrapperImageListener
+	class VideoCapture : public PUCLib_WrapperImageListener, public PUCLib_WrapperBatchListener, public PUCLib_WrapperTargetListener
 	{
 		photron::PUCLib_Wrapper* m_wrapper;
 		VideoCaptureImageListener *m_listener = nullptr;
+		VideoCaptureBatchListener* m_batchListener = nullptr;
+		VideoCaptureTargetListener* m_targetListener = nullptr;
+		std::vector<Mat> m_targets;
+		long long m_awaitedFrameNo[2] = { -1, -1 };
+
+		virtual void framesReady(const FrameBatch& batch) {
+			if (m_batchListener == nullptr)
+				return;
+			// Frames are padded to rowBytes and stacked without gaps, so one Mat covers the whole batch
+			Mat frames(batch.count * batch.height, batch.width, CV_8UC1, (void*)batch.data, batch.rowBytes);
+			m_batchListener->framesReady(frames, batch.height, batch.sequenceNos, batch.count);
+		}
+
+		virtual void targetReady(int index, UINT8* buffer, USHORT sequenceNo, long long frameNo) {
+			if (m_targetListener == nullptr)
+				return;
+			m_targetListener->targetReady(index, m_targets[index], sequenceNo);
+		}
 
 		virtual void imageReady(unsigned char* image, int width, int height, int rowBytes, USHORT sequenceNum) {
 			if (m_listener == nullptr)
@@ -34,6 +125,15 @@ namespace photron {
 			Mat mat = cv::Mat(height, width, CV_8UC1, image, rowBytes);
 			m_listener->imageReady(mat, sequenceNum);
 		}
+
+		virtual void frameReady(FrameLease& lease) {
+			if (m_listener == nullptr)
+				return;
+			// The listener may keep the Mat (no clone needed), the buffer goes back to the pool when it is released
+			FrameLease shared = lease.share();
+			Mat mat = FrameLeaseAllocator::wrap(shared);
+			m_listener->imageReady(mat, lease.sequenceNo);
+		}
 	public:
 		VideoCapture() {
 			m_wrapper = new PUCLib_Wrapper();
@@ -51,6 +151,76 @@ namespace photron {
 				m_wrapper->addListener(this);
 		}
 
+		// Decodes every frame straight into one of targets, see PUCLib_Wrapper::setTargetBuffers. The Mats must be CV_8UC1 of the
+		// decode ROI size with the same step, a multiple of 4. Call before open or while paused.
+		bool setTargetBuffers(const std::vector<Mat>& targets, VideoCaptureTargetListener* listener) {
+			std::vector<UINT8*> buffers;
+			for (size_t i = 0; i < targets.size(); i++) {
+				if (targets[i].type() != CV_8UC1 || targets[i].step != targets[0].step || targets[i].cols != targets[0].cols || targets[i].rows != targets[0].rows)
+					return false;
+				buffers.push_back(targets[i].data);
+			}
+			if (listener == nullptr || buffers.empty()) {
+				m_wrapper->setTargetBuffers(NULL, 0, 0, nullptr);
+				m_targets.clear();
+				m_targetListener = nullptr;
+				return true;
+			}
+			m_targets = targets;
+			m_targetListener = listener;
+			m_wrapper->setTargetBuffers(buffers.data(), (int)buffers.size(), (int)targets[0].step, this);
+			return true;
+		}
+
+		void releaseTarget(int index) {
+			m_wrapper->releaseTarget(index);
+		}
+
+		// Decodes the latest frame into dst, reusing its buffer when it has the decode ROI size (see PUCLib_Wrapper::readInto)
+		bool readInto(cv::Mat& dst, long long* frameNo = NULL)
+		{
+			cv::Rect roi = getDecodeROI();
+			if (dst.type() != CV_8UC1 || dst.cols != roi.width || dst.rows != roi.height || dst.step % 4 != 0) {
+				// PUC_DecodeData needs rows padded to 4 bytes
+				Mat buffer(roi.height, (roi.width + 3) & ~3, CV_8UC1);
+				dst = buffer(cv::Rect(0, 0, roi.width, roi.height));
+			}
+			return m_wrapper->readInto(dst.ptr(), (int)dst.step, frameNo);
+		}
+
+		// Adds a subscriber with its own representation, rate and drop policy, see PUCLib_Wrapper::subscribe. roi is used by SUBSCRIBE_ROI.
+		FrameSubscription* subscribe(SubscriptionKind kind, int rate = 1, SubscriptionDropPolicy policy = SUBSCRIPTION_DROP_OLDEST, int capacity = 4,
+			const cv::Rect& roi = cv::Rect())
+		{
+			return m_wrapper->subscribe(kind, rate, policy, capacity, roi.x, roi.y, roi.width, roi.height);
+		}
+
+		void unsubscribe(FrameSubscription* subscription) {
+			m_wrapper->unsubscribe(subscription);
+		}
+
+		// Next frame of a subscription, img references the pool buffer until it is released
+		bool next(FrameSubscription* subscription, cv::Mat& img, int timeoutMs = -1)
+		{
+			FrameLease lease;
+			if (!subscription->next(lease, timeoutMs))
+				return false;
+			img = FrameLeaseAllocator::wrap(lease, subscription->getKind() == SUBSCRIBE_DCT ? CV_16SC1 : CV_8UC1);
+			return true;
+		}
+
+		// Delivers frames in batches of up to batchSize, see PUCLib_Wrapper::setBatchListener
+		void addBatchListener(VideoCaptureBatchListener* listener, int batchSize, int maxLatencyUs = 0) {
+			m_batchListener = listener;
+			m_wrapper->setBatchListener(listener == nullptr ? nullptr : this, batchSize, maxLatencyUs);
+		}
+
+		// Runs on another device backend, e.g. a PlaybackSource (PUCLib_Playback.h) replaying a recording. Call before open, the source must
+		// outlive the capture (see PUCLib_Wrapper::setCaptureSource).
+		bool setCaptureSource(CaptureSource* source) {
+			return m_wrapper->setCaptureSource(source) == PUC_SUCCEEDED;
+		}
+
 		const char* getLastErrorName() const {
 			return m_wrapper->getLastErrorName();
 		}
@@ -69,26 +239,110 @@ namespace photron {
 
 		bool read(cv::Mat &img)
 		{
-			int width, height, rowBytes;
-			unsigned char* pDecodeBuf = m_wrapper->read(width, height, rowBytes);
-			if (!pDecodeBuf)
+			FrameLease lease;
+			if (!m_wrapper->acquireFrame(lease))
 				return false;
 
-			img = cv::Mat(height, width, CV_8UC1, pDecodeBuf, rowBytes);
+			img = FrameLeaseAllocator::wrap(lease);
+			return true;
+		}
+
+		// Next frame not returned before, waits up to timeoutMs for it (see PUCLib_Wrapper::readNext).
+		// stats receives the statistics decoded with the frame, valid is false if there are none (see setFrameStats).
+		bool readNext(cv::Mat& img, int timeoutMs, long long* skipped = NULL, FrameStats* stats = NULL)
+		{
+			FrameLease lease;
+			if (!m_wrapper->readNext(lease, timeoutMs, skipped))
+				return false;
+			if (stats) {
+				if (lease.stats)
+					*stats = *lease.stats;
+				else
+					stats->valid = false;
+			}
+			img = FrameLeaseAllocator::wrap(lease);
 			return true;
 		}
 
+		// Statistics of region computed while decoding, an empty region stops them (see PUCLib_Wrapper::setFrameStats)
+		bool setFrameStats(const cv::Rect& region, int threshold = 128) {
+			return m_wrapper->setFrameStats(region.x, region.y, region.width, region.height, threshold) == PUC_SUCCEEDED;
+		}
+
+		long long waitForFrame(long long afterFrameNo, int timeoutMs) {
+			return m_wrapper->waitForFrame(afterFrameNo, timeoutMs);
+		}
+
+#ifdef PHOTRON_ENABLE_COROUTINES
+		// co_await cap.nextFrame(executor, timeoutMs) from a coroutine on the executor, see PUCLib_Coroutine.h
+		MatAwaiter nextFrame(FrameExecutor& executor, int timeoutMs = -1) {
+			return MatAwaiter(*m_wrapper, executor, SUBSCRIBE_FULL, m_awaitedFrameNo[0], timeoutMs);
+		}
+
+		MatAwaiter nextProxy(FrameExecutor& executor, int timeoutMs = -1) {
+			return MatAwaiter(*m_wrapper, executor, SUBSCRIBE_PROXY, m_awaitedFrameNo[1], timeoutMs);
+		}
+#endif
+
 		void setFrameSampleRate(int dctRate, int dcRate) {
 			m_wrapper->setFrameSampleRate(dctRate, dcRate);
 		}
 
 		bool readProxy(cv::Mat& img)
 		{
-			int width, height, rowBytes;
-			unsigned char* pDecodeBuf = m_wrapper->readProxy(width, height, rowBytes);
-			if (!pDecodeBuf)
+			FrameLease lease;
+			if (!m_wrapper->acquireProxy(lease))
+				return false;
+			img = FrameLeaseAllocator::wrap(lease);
+			return true;
+		}
+
+		// DCT coefficients of the latest sampled frame as CV_16SC1, one 8x8 block per 8x8 area (see PUCLib_Wrapper::acquireDCT)
+		bool readDCT(cv::Mat& coeffs)
+		{
+			FrameLease lease;
+			if (!m_wrapper->acquireDCT(lease))
+				return false;
+			coeffs = FrameLeaseAllocator::wrap(lease, CV_16SC1);
+			return true;
+		}
+
+		void setDCTSampleRate(int rate) {
+			m_wrapper->setDCTSampleRate(rate);
+		}
+
+		// Frame of the wrapper history (see PUCLib_Wrapper::setFrameHistory), img references the history without copying
+		bool frameAt(long long sequenceNo, cv::Mat& img)
+		{
+			const UINT8* frame = m_wrapper->frameAt(sequenceNo);
+			if (!frame)
+				return false;
+			const FrameHistory& history = m_wrapper->getFrameHistory();
+			img = cv::Mat(history.getHeight(), history.getWidth(), CV_8UC1, (void*)frame, history.getRowBytes());
+			return true;
+		}
+
+		// Decodes a frame of the payload history (see PUCLib_Wrapper::setPayloadHistory)
+		bool readAt(long long sequenceNo, cv::Mat& img)
+		{
+			int width, height;
+			m_wrapper->getResolution(width, height);
+			int rowBytes = (width + 3) & ~3;
+			Mat decoded(height, rowBytes, CV_8UC1);
+			if (!m_wrapper->decodeFrameAt(sequenceNo, decoded.ptr(), rowBytes))
+				return false;
+			img = decoded(cv::Rect(0, 0, width, height));
+			return true;
+		}
+
+		bool readProxyAt(long long sequenceNo, cv::Mat& img)
+		{
+			int width, height;
+			m_wrapper->getResolution(width, height);
+			Mat decoded((height + 7) / 8, (width + 7) / 8, CV_8UC1);
+			if (!m_wrapper->decodeProxyAt(sequenceNo, decoded.ptr()))
 				return false;
-			img = cv::Mat(height, width, CV_8UC1, pDecodeBuf, rowBytes);
+			img = decoded;
 			return true;
 		}
 
@@ -101,7 +355,8 @@ namespace photron {
 			CAP_PROP_FRAME_WIDTH_HEIGHT = 100000,
 			CAP_PROP_FRAMERATE_SHUTTER_SPEED,
 			CAP_PROP_FAN_STATE,
-			CAP_PROP_EXPOSURE_TIME_ON_OFF_CLK
+			CAP_PROP_EXPOSURE_TIME_ON_OFF_CLK,
+			CAP_PROP_DECODE_ROI
 		};
 
 		bool set(int propId, unsigned int value, unsigned int value2 = 0) {
@@ -121,6 +376,41 @@ namespace photron {
 			return false;
 		}
 
+		// CAP_PROP_DECODE_ROI: decodes only the 8x8 blocks covering rect, an empty rect decodes the full frame (see PUCLib_Wrapper::setDecodeROI)
+		bool set(int propId, const cv::Rect& rect) {
+			switch (propId) {
+			case CAP_PROP_DECODE_ROI:
+				return m_wrapper->setDecodeROI(rect.x, rect.y, rect.width, rect.height) == PUC_SUCCEEDED;
+			}
+			return false;
+		}
+
+		static bool covers(const cv::Rect& roi, const cv::Rect& rect) {
+			return rect.x >= roi.x && rect.y >= roi.y && rect.x + rect.width <= roi.x + roi.width && rect.y + rect.height <= roi.y + roi.height;
+		}
+
+		// Block aligned region the frames of read are decoded from
+		cv::Rect getDecodeROI() {
+			UINT32 x, y, width, height;
+			m_wrapper->getDecodeROI(x, y, width, height);
+			return cv::Rect(x, y, width, height);
+		}
+
+		// Reads rect of the latest frame, false if the decode ROI (set with CAP_PROP_DECODE_ROI) does not cover it. img references the leased frame.
+		bool readROI(const cv::Rect& rect, cv::Mat& img)
+		{
+			if (rect.width <= 0 || rect.height <= 0 || rect.x < 0 || rect.y < 0)
+				return false;
+			cv::Rect roi = getDecodeROI();
+			if (!covers(roi, rect))
+				return false;
+			Mat frame;
+			if (!read(frame) || frame.cols != roi.width || frame.rows != roi.height)
+				return false;
+			img = frame(cv::Rect(rect.x - roi.x, rect.y - roi.y, rect.width, rect.height));
+			return true;
+		}
+
 		bool set(int propId, double value) {
 			cerr << "Not supported" << endl;
 			return false;
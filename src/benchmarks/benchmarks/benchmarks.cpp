@@ -0,0 +1,828 @@
+// benchmarks.cpp : Microbenchmarks of the capture hot paths, streamed from the synthetic device
+//
+// Every streaming benchmark runs once per mode of the cvtiles mode table, so a regression shows up at the frame rate it affects.
+// Results are written to photron_benchmarks.json unless --benchmark_out is given, see README.md.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "PUCLib_SyntheticSource.h"
+#include "PUCLib_Wrapper.h"
+#include "PUCLib_FrameStats.h"
+#include "PUCLib_DCTKernels.h"
+#include "PUCLib_Coroutine.h"
+#include "PUCLib_Playback.h"
+
+#ifdef PHOTRON_BENCHMARK_OPENCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <iostream>
+// PhotronVideoCapture.h is included after using namespace std, as in the samples
+using namespace std;
+#include "PhotronVideoCapture.h"
+#endif
+
+using namespace photron;
+
+namespace {
+
+// Same table as main() of cvtiles
+const int modeWidth = 1246;
+const int modeFps[] = { 50, 250, 500, 950, 1000, 2000, 5000, 10000, 20000, 31157 };
+const int modeHeight[] = { 1024, 1024, 1024, 1024, 1008, 496, 176, 80, 32, 16 };
+const int modeCount = sizeof(modeFps) / sizeof(modeFps[0]);
+
+std::string modeName(int mode) {
+    return std::to_string(modeWidth) + "x" + std::to_string(modeHeight[mode]) + "@" + std::to_string(modeFps[mode]);
+}
+
+// Enough iterations for about a fifth of a second of frames, the streaming benchmarks wait for every frame they measure
+int modeIterations(int mode) {
+    return std::min(2000, std::max(20, modeFps[mode] / 5));
+}
+
+// Benchmarks that also check a behaviour count their failures here, main() then exits with an error for ctest
+int failedChecks = 0;
+
+long long nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The wrapper streaming one mode from its own synthetic device
+struct SyntheticStream {
+    SyntheticSource source;
+    PUCLib_Wrapper camera;
+
+    explicit SyntheticStream(SyntheticPattern pattern = SYNTHETIC_MOVING_SQUARE) {
+        SyntheticConfig config;
+        config.pattern = pattern;
+        source.setConfig(config);
+        camera.setCaptureSource(&source);
+        // Keep the decode path fixed between runs
+        camera.setDecodeAutoTune(false);
+    }
+
+    ~SyntheticStream() {
+        camera.close();
+    }
+
+    // Opens the device at the mode and waits for the first decoded frame
+    bool open(int mode) {
+        camera.setResolution(modeWidth, modeHeight[mode]);
+        camera.setFramerateShutter(modeFps[mode], modeFps[mode]);
+        if (PUC_CHK_FAILED(camera.open(0)))
+            return false;
+        FrameLease lease;
+        if (!camera.readNext(lease, 2000))
+            return false;
+        lease.release();
+        return true;
+    }
+};
+
+// Hands the arrival to listener latency of the frames to the benchmark thread
+class LatencyListener : public PUCLib_WrapperImageListener {
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    long long m_delivered = 0;
+    long long m_latency = 0;
+
+public:
+    void imageReady(unsigned char* image, int width, int height, int rowBytes, USHORT sequenceNum) {}
+
+    void frameReady(FrameLease& lease) {
+        long long now = nowNs();
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_latency = now - lease.timestamp;
+        m_delivered++;
+        m_arrived.notify_one();
+    }
+
+    long long getDelivered() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_delivered;
+    }
+
+    // Latency (ns) of the next frame delivered after seen, -1 on timeout
+    long long waitNext(long long& seen, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return m_delivered > seen; }))
+            return -1;
+        seen = m_delivered;
+        return m_latency;
+    }
+};
+
+// Compressed payload of frame frameIndex, the synthetic decoders render the frame from this header alone
+std::vector<UINT8> syntheticPayload(int width, int height, UINT64 frameIndex, SyntheticPattern pattern) {
+    std::vector<UINT8> payload(sizeof(SyntheticPayloadHeader), 0);
+    SyntheticPayloadHeader* header = (SyntheticPayloadHeader*)payload.data();
+    header->magic = SYNTHETIC_MAGIC;
+    header->sequenceNo = USHORT(frameIndex);
+    header->pattern = uint16_t(pattern);
+    header->width = width;
+    header->height = height;
+    header->frameIndex = frameIndex;
+    header->speed = SyntheticConfig().speed;
+    return payload;
+}
+
+// Two consecutive frames of one mode in every representation the kernels work on
+struct FramePair {
+    int width = 0, height = 0;
+    int rowBytes = 0;
+    int blocksX = 0, blocksY = 0;
+    int dctRowBytes = 0;
+    std::vector<UINT8> payload[2];
+    std::vector<UINT8> frame[2];
+    std::vector<UINT8> dct[2];
+    std::vector<UINT8> proxy[2];
+
+    FramePair(int mode, SyntheticPattern pattern) {
+        SyntheticSource source;
+        width = modeWidth;
+        height = modeHeight[mode];
+        rowBytes = BufferArena::alignRow(width);
+        blocksX = (width + 7) / 8;
+        blocksY = (height + 7) / 8;
+        dctRowBytes = BufferArena::alignRow(blocksX * 8 * sizeof(INT16));
+        for (int i = 0; i < 2; i++) {
+            payload[i] = syntheticPayload(width, height, 100 + i, pattern);
+            frame[i].resize(size_t(rowBytes) * height);
+            dct[i].resize(size_t(dctRowBytes) * blocksY * 8);
+            proxy[i].resize(size_t(blocksX) * blocksY);
+            source.decodeData(frame[i].data(), 0, 0, width, height, rowBytes, payload[i].data(), NULL);
+            source.decodeDCTData((INT16*)dct[i].data(), 0, 0, width, height, dctRowBytes, payload[i].data(), NULL);
+            source.decodeDCData(proxy[i].data(), 0, 0, blocksX, blocksY, payload[i].data());
+        }
+    }
+};
+
+// Time from the arrival of the payload to the listener callback, per frame (manual time)
+void BM_ReceiveToListener(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    LatencyListener listener;
+    stream.camera.addListener(&listener);
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    stream.camera.resetLatencyHistograms();
+    stream.camera.resetSequenceStats();
+    long long seen = listener.getDelivered();
+    for (auto _ : state) {
+        long long latency = listener.waitNext(seen, 1000);
+        if (latency < 0) {
+            state.SkipWithError("no frame delivered");
+            break;
+        }
+        state.SetIterationTime(latency * 1e-9);
+    }
+    const LatencyHistogram& total = stream.camera.getLatencyHistogram(LATENCY_TOTAL);
+    state.counters["p50_us"] = total.getPercentile(50.0) / 1000.0;
+    state.counters["p99_us"] = total.getPercentile(99.0) / 1000.0;
+    state.counters["dropped"] = (double)stream.camera.getSequenceStats().dropped;
+    stream.camera.close();
+}
+
+// The original frame hand-off of read(), kept as the baseline of CallbackToRead: the callback decodes into the back
+// buffer and swaps it in under two mutexes, read() copies the front buffer into a third one under the same mutex.
+class MutexCopyHandoff {
+    SyntheticSource& m_source;
+    PUC_HANDLE m_device = NULL;
+    UINT32 m_width = 0, m_height = 0, m_lineBytes = 0;
+    std::mutex m_mutex;
+    std::mutex m_mutexSampleRate;
+    std::vector<UINT8> m_buffer[3];
+    int m_readBuffer = 0;
+    long long m_timestamp[2] = { 0, 0 };
+
+    static void receive(PPUC_XFER_DATA_INFO info, void* userData) {
+        MutexCopyHandoff* that = (MutexCopyHandoff*)userData;
+        long long arrival = nowNs();
+        std::lock_guard<std::mutex> sampleGuard(that->m_mutexSampleRate);
+        int drawBuffer;
+        {
+            std::lock_guard<std::mutex> guard(that->m_mutex);
+            drawBuffer = 1 - that->m_readBuffer;
+        }
+        that->m_source.decodeData(that->m_buffer[drawBuffer].data(), 0, 0, that->m_width, that->m_height, that->m_lineBytes, info->pData, NULL);
+        std::lock_guard<std::mutex> guard(that->m_mutex);
+        that->m_timestamp[drawBuffer] = arrival;
+        that->m_readBuffer = drawBuffer;
+    }
+
+public:
+    explicit MutexCopyHandoff(SyntheticSource& source) : m_source(source) {}
+
+    ~MutexCopyHandoff() {
+        close();
+    }
+
+    bool open(int mode) {
+        if (PUC_CHK_FAILED(m_source.openDevice(0, &m_device)))
+            return false;
+        m_width = modeWidth;
+        m_height = modeHeight[mode];
+        m_lineBytes = BufferArena::alignRow(m_width);
+        m_source.setResolution(m_device, m_width, m_height);
+        m_source.setFramerateShutter(m_device, modeFps[mode], modeFps[mode]);
+        m_source.setXferDataMode(m_device, PUC_DATA_COMPRESSED);
+        for (int i = 0; i < 3; i++)
+            m_buffer[i].assign(size_t(m_lineBytes) * m_height, 0);
+        return PUC_CHK_SUCCEEDED(m_source.beginXferData(m_device, MutexCopyHandoff::receive, this));
+    }
+
+    void close() {
+        if (m_device == NULL)
+            return;
+        m_source.endXferData(m_device);
+        m_source.closeDevice(m_device);
+        m_device = NULL;
+    }
+
+    // Copies the newest frame like read() did and returns its arrival stamp, 0 before the first frame
+    long long read() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        memcpy(m_buffer[2].data(), m_buffer[m_readBuffer].data(), size_t(m_lineBytes) * m_height);
+        return m_timestamp[m_readBuffer];
+    }
+};
+
+// Time from the arrival of a payload until a polling reader holds the frame, the mutex + memcpy baseline against the frame pool
+void BM_CallbackToReadMutexCopy(benchmark::State& state, int mode) {
+    SyntheticSource source;
+    MutexCopyHandoff handoff(source);
+    if (!handoff.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    long long last = 0;
+    while ((last = handoff.read()) == 0)
+        std::this_thread::yield();
+    for (auto _ : state) {
+        long long timestamp;
+        while ((timestamp = handoff.read()) == last)
+            std::this_thread::yield();
+        state.SetIterationTime((nowNs() - timestamp) * 1e-9);
+        last = timestamp;
+    }
+    handoff.close();
+}
+
+// The same through the FramePool lease of acquireFrame, which read() uses
+void BM_CallbackToReadFramePool(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    long long last = -1;
+    FrameLease lease;
+    for (auto _ : state) {
+        // acquireFrame is read() without keeping the lease for the next call
+        while (!stream.camera.acquireFrame(lease) || lease.frameNo <= last) {
+            lease.release();
+            std::this_thread::yield();
+        }
+        state.SetIterationTime((nowNs() - lease.timestamp) * 1e-9);
+        last = lease.frameNo;
+        lease.release();
+    }
+    stream.camera.close();
+}
+
+// read() leases the newest frame without copying it
+void BM_Read(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    int width = 0, height = 0, rowBytes = 0;
+    for (auto _ : state) {
+        unsigned char* image = stream.camera.read(width, height, rowBytes);
+        benchmark::DoNotOptimize(image);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_ReadProxy(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    stream.camera.setFrameSampleRate(1, 1);
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    int width = 0, height = 0, rowBytes = 0;
+    for (auto _ : state) {
+        unsigned char* image = stream.camera.readProxy(width, height, rowBytes);
+        benchmark::DoNotOptimize(image);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// readInto() copies the newest frame, the one copy a caller owning its buffers pays
+void BM_ReadInto(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    int rowBytes = BufferArena::alignRow(modeWidth);
+    std::vector<UINT8> dst(size_t(rowBytes) * modeHeight[mode]);
+    for (auto _ : state) {
+        if (!stream.camera.readInto(dst.data(), rowBytes)) {
+            state.SkipWithError("readInto failed");
+            break;
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(modeWidth) * modeHeight[mode]);
+}
+
+FrameTask awaitNextFrame(FrameStream& frames, FrameExecutor& executor, FrameLease& lease, int timeoutMs) {
+    lease = co_await frames.next(timeoutMs);
+    executor.stop();
+}
+
+// Time from resume() until a FrameStream that awaited frames before pause() gets the next one. The stream runs past the
+// 16 bit sequence number wrap first: a frame numbering that starts over at the restart stalls the awaiter, which fails the run.
+void BM_StreamResume(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(0x10000 * 1000LL / modeFps[mode] + 100));
+    FrameExecutor executor;
+    FrameStream frames(stream.camera, executor);
+    FrameLease lease;
+    awaitNextFrame(frames, executor, lease, 1000).spawn(executor);
+    executor.run();
+    for (auto _ : state) {
+        if (!lease.isValid()) {
+            state.SkipWithError("no frame awaited after resume()");
+            failedChecks++;
+            break;
+        }
+        lease.release();
+        stream.camera.pause();
+        long long start = nowNs();
+        stream.camera.resume();
+        awaitNextFrame(frames, executor, lease, 1000).spawn(executor);
+        executor.run();
+        state.SetIterationTime((nowNs() - start) * 1e-9);
+    }
+    lease.release();
+    stream.camera.close();
+}
+
+// Time from a step of a PlaybackSource until readNext returns the frame, on a recording of the synthetic device. Each frame
+// must come out of the wrapper with the sequence number it was recorded with, a mismatch fails the run.
+void BM_PlaybackReplay(benchmark::State& state, int mode) {
+    const char* path = "playback_replay.rec";
+    {
+        SyntheticStream stream;
+        if (!stream.open(mode) || !stream.camera.startRecording(path, 16 << 20)) {
+            state.SkipWithError("unable to record the synthetic device");
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        stream.camera.close();
+    }
+    SyntheticSource decoder;
+    PlaybackSource playback;
+    playback.setDecoder(&decoder);
+    playback.setPacing(PLAYBACK_STEPPED);
+    playback.setLoop(true);
+    PUCLib_Wrapper camera;
+    camera.setDecodeAutoTune(false);
+    if (PUC_CHK_FAILED(playback.open(path)) || PUC_CHK_FAILED(camera.setCaptureSource(&playback))) {
+        state.SkipWithError(playback.getLastErrorName());
+        return;
+    }
+    const RecordingFile& recording = playback.getRecording();
+    camera.setResolution(recording.getWidth(), recording.getHeight());
+    if (PUC_CHK_FAILED(camera.open(0))) {
+        state.SkipWithError(camera.getLastErrorName());
+        return;
+    }
+    int entry = 0;
+    for (auto _ : state) {
+        FrameLease lease;
+        long long start = nowNs();
+        playback.step();
+        if (!camera.readNext(lease, 1000)) {
+            state.SkipWithError("no frame after step()");
+            failedChecks++;
+            break;
+        }
+        state.SetIterationTime((nowNs() - start) * 1e-9);
+        bool recorded = lease.sequenceNo == recording.entries()[entry].sequenceNo;
+        lease.release();
+        if (!recorded) {
+            state.SkipWithError("replayed frame has another sequence number than the recorded one");
+            failedChecks++;
+            break;
+        }
+        entry = (entry + 1) % recording.count();
+    }
+    state.counters["recorded_frames"] = recording.count();
+    camera.close();
+    playback.close();
+    std::remove(path);
+    std::remove((std::string(path) + ".idx").c_str());
+}
+
+// Process CPU time of streaming 50 ms with only every rate-th frame decoded. No listener, it would get every frame decoded.
+void BM_FrameSampleRate(benchmark::State& state, int mode, int rate) {
+    SyntheticStream stream;
+    stream.camera.setFrameSampleRate(rate, 0);
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    stream.camera.resetSequenceStats();
+    stream.camera.resetLatencyHistograms();
+    for (auto _ : state)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    state.counters["received_per_s"] = benchmark::Counter((double)stream.camera.getSequenceStats().received, benchmark::Counter::kIsRate);
+    state.counters["decoded_per_s"] = benchmark::Counter((double)stream.camera.getLatencyHistogram(LATENCY_DECODE).getCount(), benchmark::Counter::kIsRate);
+    stream.camera.close();
+}
+
+// The scan line statistics cvtiles gathers on every frame
+void BM_CvtilesScanLineStats(benchmark::State& state) {
+    FramePair frames(4, SYNTHETIC_SCROLLING_BARS);
+    int y = frames.height / 2;
+    const UINT8* row = frames.frame[0].data() + size_t(y) * frames.rowBytes;
+    FrameStats stats;
+    for (auto _ : state) {
+        stats.begin(0, y, frames.width, 1, 128);
+        accumulateFrameStats(stats, row, frames.rowBytes, 0, 1);
+        stats.finish();
+        benchmark::DoNotOptimize(stats);
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(frames.width));
+}
+
+// save() of cvtiles: the scan line of every frame of the history into one tile image, while the stream keeps writing the history
+void BM_CvtilesHistorySave(benchmark::State& state, int mode) {
+    SyntheticStream stream;
+    int numTiles = std::min(30000, std::max(16, modeFps[mode] / 2));
+    int height = modeHeight[mode];
+    stream.camera.setFrameHistory(numTiles);
+    stream.camera.setDecodeROI(0, (height / 2) & ~7, modeWidth, 1);
+    if (!stream.open(mode)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    // Fill the history once
+    std::this_thread::sleep_for(std::chrono::milliseconds(200 + numTiles * 1000LL / modeFps[mode]));
+    UINT32 roiX, roiY, roiWidth, roiHeight;
+    stream.camera.getDecodeROI(roiX, roiY, roiWidth, roiHeight);
+    int y = (height >> 1) - (int)roiY;
+    std::vector<UINT8> tiles(size_t(numTiles) * roiWidth);
+    for (auto _ : state) {
+        long long last = stream.camera.getFrameHistory().getLastSequenceNo();
+        long long first = last - numTiles + 1;
+        HistorySpan spans[2];
+        int count = stream.camera.range(first, last, spans);
+        int tile = 0;
+        for (int s = 0; s < count; s++)
+            for (int i = 0; i < spans[s].count; i++, tile++)
+                memcpy(&tiles[size_t(tile) * roiWidth], spans[s].data + spans[s].frameBytes * i + size_t(y) * stream.camera.getFrameHistory().getRowBytes(), roiWidth);
+        // Frames overwritten during the copy are blanked like cvtiles does
+        for (int i = 0; i < tile; i++)
+            if (!stream.camera.isFrameValid(first + i))
+                memset(&tiles[size_t(i) * roiWidth], 0, roiWidth);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * numTiles);
+    stream.camera.close();
+}
+
+// Decodes of the synthetic device. Their cost is that of the synthetic renderer, not of PUCLIB; they are here so the
+// edge and motion comparisons below can be read net of the decode.
+void BM_DecodeFull(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    SyntheticSource source;
+    for (auto _ : state) {
+        source.decodeData(frames.frame[1].data(), 0, 0, frames.width, frames.height, frames.rowBytes, frames.payload[1].data(), NULL);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(frames.width) * frames.height);
+}
+
+void BM_DecodeDCT(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    SyntheticSource source;
+    for (auto _ : state) {
+        source.decodeDCTData((INT16*)frames.dct[1].data(), 0, 0, frames.width, frames.height, frames.dctRowBytes, frames.payload[1].data(), NULL);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(frames.width) * frames.height);
+}
+
+void BM_DecodeDC(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    SyntheticSource source;
+    for (auto _ : state) {
+        source.decodeDCData(frames.proxy[1].data(), 0, 0, frames.blocksX, frames.blocksY, frames.payload[1].data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(frames.width) * frames.height);
+}
+
+// Edges of a frame from its DCT coefficients, the decoded half of the comparison with BM_EdgesFullDecodeCanny
+void BM_EdgesDCTEdgeMap(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    std::vector<UINT8> map(size_t(frames.blocksX) * frames.blocksY);
+    for (auto _ : state) {
+        dctEdgeMap((const INT16*)frames.dct[1].data(), frames.dctRowBytes, frames.blocksX, frames.blocksY, 64.0f, map.data(), frames.blocksX);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(frames.blocksX) * frames.blocksY);
+}
+
+// Coefficient decode plus edge map, what temporalEdges would spend per frame on the DCT path
+void BM_EdgesDCTDecodeEdgeMap(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    SyntheticSource source;
+    std::vector<UINT8> map(size_t(frames.blocksX) * frames.blocksY);
+    for (auto _ : state) {
+        source.decodeDCTData((INT16*)frames.dct[1].data(), 0, 0, frames.width, frames.height, frames.dctRowBytes, frames.payload[1].data(), NULL);
+        dctEdgeMap((const INT16*)frames.dct[1].data(), frames.dctRowBytes, frames.blocksX, frames.blocksY, 64.0f, map.data(), frames.blocksX);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(frames.blocksX) * frames.blocksY);
+}
+
+// Motion between two frames: per block coefficient difference against the DC proxy comparison of the motion gate
+void BM_MotionDCTBlockDiff(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    std::vector<float> diff(size_t(frames.blocksX) * frames.blocksY);
+    for (auto _ : state) {
+        dctBlockDiff((const INT16*)frames.dct[0].data(), (const INT16*)frames.dct[1].data(), frames.dctRowBytes, frames.blocksX, frames.blocksY, diff.data());
+        benchmark::DoNotOptimize(dctCountAbove(diff.data(), (int)diff.size(), 64.0f));
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(frames.blocksX) * frames.blocksY);
+}
+
+void BM_MotionProxyChanges(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    ProxyChange change;
+    for (auto _ : state) {
+        proxyChanges(frames.proxy[0].data(), frames.proxy[1].data(), frames.blocksX, frames.blocksX, frames.blocksY, 4, change);
+        benchmark::DoNotOptimize(change);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(frames.blocksX) * frames.blocksY);
+}
+
+#ifdef PHOTRON_BENCHMARK_OPENCV
+
+// photron::VideoCapture::read wraps the leased frame in a cv::Mat header
+void BM_VideoCaptureRead(benchmark::State& state, int mode) {
+    SyntheticSource source;
+    VideoCapture cap;
+    PUCLib_Wrapper* camera = cap.getPUCLibWrapper();
+    camera->setCaptureSource(&source);
+    camera->setDecodeAutoTune(false);
+    camera->setResolution(modeWidth, modeHeight[mode]);
+    camera->setFramerateShutter(modeFps[mode], modeFps[mode]);
+    cv::Mat frame;
+    if (!cap.open(0, cv::CAP_ANY) || !cap.readNext(frame, 2000)) {
+        state.SkipWithError("unable to open the synthetic device");
+        return;
+    }
+    for (auto _ : state) {
+        cap.read(frame);
+        benchmark::DoNotOptimize(frame.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+    frame.release();
+    cap.release();
+}
+
+// The per-frame kernel of temporalEdges
+void BM_TemporalEdges(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    cv::Mat prev(frames.height, frames.width, CV_8UC1, frames.frame[0].data(), frames.rowBytes);
+    cv::Mat cur(frames.height, frames.width, CV_8UC1, frames.frame[1].data(), frames.rowBytes);
+    cv::Mat processed;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Vec4i> hierarchy;
+    for (auto _ : state) {
+        cv::absdiff(prev, cur, processed);
+        processed.convertTo(processed, -1, 1.0);
+        cv::Canny(processed, processed, 100, 200);
+        cv::findContours(processed, contours, hierarchy, cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE);
+        benchmark::DoNotOptimize(contours.data());
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(frames.width) * frames.height);
+}
+
+// Full decode plus Canny, the pixel half of the comparison with BM_EdgesDCTDecodeEdgeMap
+void BM_EdgesFullDecodeCanny(benchmark::State& state, int mode) {
+    FramePair frames(mode, SYNTHETIC_MOVING_SQUARE);
+    SyntheticSource source;
+    cv::Mat frame(frames.height, frames.width, CV_8UC1, frames.frame[1].data(), frames.rowBytes);
+    cv::Mat edges;
+    for (auto _ : state) {
+        source.decodeData(frames.frame[1].data(), 0, 0, frames.width, frames.height, frames.rowBytes, frames.payload[1].data(), NULL);
+        cv::Canny(frame, edges, 100, 200);
+        benchmark::DoNotOptimize(edges.data);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(frames.blocksX) * frames.blocksY);
+}
+
+#endif
+
+#ifdef PHOTRON_HAS_PUCLIB
+
+// One compressed frame of the camera at a mode. The synthetic decoders render from a header, only PUCLIB measures what decoding the
+// coefficients instead of the pixels saves.
+struct CameraPayload {
+    PUCLibSource source;
+    int width = 0, height = 0;
+    int rowBytes = 0;
+    int blocksX = 0, blocksY = 0;
+    int dctRowBytes = 0;
+    std::vector<UINT8> payload;
+    USHORT q[PUC_Q_COUNT];
+
+    bool capture(int mode) {
+        PUC_HANDLE device = NULL;
+        if (PUC_CHK_FAILED(source.initialize()) || PUC_CHK_FAILED(source.openDevice(0, &device)))
+            return false;
+        width = modeWidth;
+        height = modeHeight[mode];
+        rowBytes = BufferArena::alignRow(width);
+        blocksX = (width + 7) / 8;
+        blocksY = (height + 7) / 8;
+        dctRowBytes = BufferArena::alignRow(blocksX * 8 * sizeof(INT16));
+        UINT32 size = 0;
+        PUCRESULT result = source.setResolution(device, width, height);
+        if (PUC_CHK_SUCCEEDED(result))
+            result = source.setFramerateShutter(device, modeFps[mode], modeFps[mode]);
+        if (PUC_CHK_SUCCEEDED(result))
+            result = source.setXferDataMode(device, PUC_DATA_COMPRESSED);
+        if (PUC_CHK_SUCCEEDED(result))
+            result = source.getXferDataSize(device, PUC_DATA_COMPRESSED, &size);
+        for (UINT32 i = 0; PUC_CHK_SUCCEEDED(result) && i < PUC_Q_COUNT; i++)
+            result = source.getQuantization(device, i, &q[i]);
+        if (PUC_CHK_SUCCEEDED(result)) {
+            payload.assign(size, 0);
+            PUC_XFER_DATA_INFO info = { 0 };
+            info.pData = payload.data();
+            result = source.getSingleXferData(device, &info);
+        }
+        source.closeDevice(device);
+        return PUC_CHK_SUCCEEDED(result);
+    }
+};
+
+// PUCLIB full decode of a camera frame, the pixel path of temporalEdges before Canny
+void BM_PUCLibDecodeFull(benchmark::State& state, int mode) {
+    CameraPayload camera;
+    if (!camera.capture(mode)) {
+        state.SkipWithError("unable to capture a frame from the camera");
+        return;
+    }
+    std::vector<UINT8> frame(size_t(camera.rowBytes) * camera.height);
+    for (auto _ : state) {
+        camera.source.decodeData(frame.data(), 0, 0, camera.width, camera.height, camera.rowBytes, camera.payload.data(), camera.q);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(camera.blocksX) * camera.blocksY);
+}
+
+// PUCLIB coefficient decode plus edge map, the DCT path compared with BM_PUCLibDecodeCanny
+void BM_PUCLibDecodeDCTEdgeMap(benchmark::State& state, int mode) {
+    CameraPayload camera;
+    if (!camera.capture(mode)) {
+        state.SkipWithError("unable to capture a frame from the camera");
+        return;
+    }
+    std::vector<UINT8> dct(size_t(camera.dctRowBytes) * camera.blocksY * 8);
+    std::vector<UINT8> map(size_t(camera.blocksX) * camera.blocksY);
+    for (auto _ : state) {
+        camera.source.decodeDCTData((INT16*)dct.data(), 0, 0, camera.width, camera.height, camera.dctRowBytes, camera.payload.data(), camera.q);
+        dctEdgeMap((const INT16*)dct.data(), camera.dctRowBytes, camera.blocksX, camera.blocksY, 64.0f, map.data(), camera.blocksX);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(camera.blocksX) * camera.blocksY);
+}
+
+#ifdef PHOTRON_BENCHMARK_OPENCV
+
+void BM_PUCLibDecodeCanny(benchmark::State& state, int mode) {
+    CameraPayload camera;
+    if (!camera.capture(mode)) {
+        state.SkipWithError("unable to capture a frame from the camera");
+        return;
+    }
+    std::vector<UINT8> data(size_t(camera.rowBytes) * camera.height);
+    cv::Mat frame(camera.height, camera.width, CV_8UC1, data.data(), camera.rowBytes);
+    cv::Mat edges;
+    for (auto _ : state) {
+        camera.source.decodeData(data.data(), 0, 0, camera.width, camera.height, camera.rowBytes, camera.payload.data(), camera.q);
+        cv::Canny(frame, edges, 100, 200);
+        benchmark::DoNotOptimize(edges.data);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(camera.blocksX) * camera.blocksY);
+}
+
+#endif
+
+#endif
+
+void registerBenchmarks() {
+    for (int mode = 0; mode < modeCount; mode++) {
+        std::string name = modeName(mode);
+        benchmark::RegisterBenchmark(("ReceiveToListener/" + name).c_str(), BM_ReceiveToListener, mode)
+            ->UseManualTime()->Iterations(modeIterations(mode))->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("CallbackToRead/" + name + "/mutex_copy").c_str(), BM_CallbackToReadMutexCopy, mode)
+            ->UseManualTime()->Iterations(modeIterations(mode))->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("CallbackToRead/" + name + "/frame_pool").c_str(), BM_CallbackToReadFramePool, mode)
+            ->UseManualTime()->Iterations(modeIterations(mode))->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("Read/" + name).c_str(), BM_Read, mode);
+        benchmark::RegisterBenchmark(("ReadProxy/" + name).c_str(), BM_ReadProxy, mode);
+        benchmark::RegisterBenchmark(("ReadInto/" + name).c_str(), BM_ReadInto, mode)->Unit(benchmark::kMicrosecond);
+        for (int rate : { 1, 40 })
+            benchmark::RegisterBenchmark(("FrameSampleRate/" + name + "/rate:" + std::to_string(rate)).c_str(), BM_FrameSampleRate, mode, rate)
+                ->MeasureProcessCPUTime()->UseRealTime()->Iterations(10)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("CvtilesHistorySave/" + name).c_str(), BM_CvtilesHistorySave, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("DecodeFull/" + name).c_str(), BM_DecodeFull, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("DecodeDCT/" + name).c_str(), BM_DecodeDCT, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("DecodeDC/" + name).c_str(), BM_DecodeDC, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("EdgesDCTEdgeMap/" + name).c_str(), BM_EdgesDCTEdgeMap, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("EdgesDCTDecodeEdgeMap/" + name).c_str(), BM_EdgesDCTDecodeEdgeMap, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("MotionDCTBlockDiff/" + name).c_str(), BM_MotionDCTBlockDiff, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("MotionProxyChanges/" + name).c_str(), BM_MotionProxyChanges, mode)->Unit(benchmark::kMicrosecond);
+#ifdef PHOTRON_BENCHMARK_OPENCV
+        benchmark::RegisterBenchmark(("VideoCaptureRead/" + name).c_str(), BM_VideoCaptureRead, mode);
+        benchmark::RegisterBenchmark(("TemporalEdges/" + name).c_str(), BM_TemporalEdges, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("EdgesFullDecodeCanny/" + name).c_str(), BM_EdgesFullDecodeCanny, mode)->Unit(benchmark::kMicrosecond);
+#endif
+#ifdef PHOTRON_HAS_PUCLIB
+        benchmark::RegisterBenchmark(("PUCLibDecodeFull/" + name).c_str(), BM_PUCLibDecodeFull, mode)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("PUCLibDecodeDCTEdgeMap/" + name).c_str(), BM_PUCLibDecodeDCTEdgeMap, mode)->Unit(benchmark::kMicrosecond);
+#ifdef PHOTRON_BENCHMARK_OPENCV
+        benchmark::RegisterBenchmark(("PUCLibDecodeCanny/" + name).c_str(), BM_PUCLibDecodeCanny, mode)->Unit(benchmark::kMicrosecond);
+#endif
+#endif
+    }
+    benchmark::RegisterBenchmark("CvtilesScanLineStats", BM_CvtilesScanLineStats);
+    // The fastest mode wraps the sequence number soonest
+    benchmark::RegisterBenchmark(("StreamResume/" + modeName(modeCount - 1)).c_str(), BM_StreamResume, modeCount - 1)
+        ->UseManualTime()->Iterations(20)->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(("PlaybackReplay/" + modeName(5)).c_str(), BM_PlaybackReplay, 5)
+        ->UseManualTime()->Iterations(500)->Unit(benchmark::kMicrosecond);
+}
+
+}
+
+int main(int argc, char** argv) {
+    // JSON for trend tracking unless the output is chosen on the command line
+    std::vector<char*> args(argv, argv + argc);
+    bool hasOut = false;
+    for (int i = 1; i < argc; i++)
+        if (std::string(argv[i]).rfind("--benchmark_out=", 0) == 0)
+            hasOut = true;
+    std::string out = "--benchmark_out=photron_benchmarks.json";
+    std::string format = "--benchmark_out_format=json";
+    if (!hasOut) {
+        args.push_back(&out[0]);
+        args.push_back(&format[0]);
+    }
+    int count = (int)args.size();
+
+    benchmark::AddCustomContext("capture_source", "synthetic");
+#ifdef PHOTRON_BENCHMARK_OPENCV
+    benchmark::AddCustomContext("opencv", CV_VERSION);
+#else
+    benchmark::AddCustomContext("opencv", "off");
+#endif
+#ifdef PHOTRON_HAS_PUCLIB
+    benchmark::AddCustomContext("puclib", "on");
+#else
+    benchmark::AddCustomContext("puclib", "off");
+#endif
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+        return 1;
+    registerBenchmarks();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return failedChecks ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+// captureDaemon.cpp : Owns the camera and publishes its frames on a shared memory frame bus for other processes.
+//
+
+#include <Windows.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "PUCLib_Wrapper.h"
+#include "PUCLib_FrameBus.h"
+
+using namespace std;
+
+std::atomic<bool> running(true);
+
+BOOL WINAPI onConsoleCtrl(DWORD ctrlType) {
+    running = false;
+    return TRUE;
+}
+
+void usage() {
+    cout << "usage: captureDaemon [-device N] [-name NAME] [-slots N] [-width W] [-height H] [-fps F]" << endl;
+    cout << "  publishes the decoded frames and the DC proxy of device N on the frame bus NAME (default photron<N>)" << endl;
+}
+
+// Copies the frames of one subscription into the bus until the daemon stops
+void publishLoop(photron::FrameSubscription* subscription, photron::FrameBusWriter* bus, int stream) {
+    while (running) {
+        photron::FrameLease lease;
+        if (!subscription->next(lease, 100))
+            continue;
+        bus->publish(stream, lease.data, lease.width, lease.height, lease.rowBytes, lease.frameNo, lease.sequenceNo, lease.timestamp);
+        lease.release();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int deviceID = 0;
+    std::string name;
+    int slots = 8;
+    int width = 1246;
+    int height = 1008;
+    int fps = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        if (arg == "-device")
+            deviceID = atoi(argv[++i]);
+        else if (arg == "-name")
+            name = argv[++i];
+        else if (arg == "-slots")
+            slots = atoi(argv[++i]);
+        else if (arg == "-width")
+            width = atoi(argv[++i]);
+        else if (arg == "-height")
+            height = atoi(argv[++i]);
+        else if (arg == "-fps")
+            fps = atoi(argv[++i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (name.empty())
+        name = "photron" + std::to_string(deviceID);    // photron::BusCapture::open(deviceID, apiID) connects here
+    if (slots < 2)
+        slots = 2;
+
+    photron::PUCLib_Wrapper camera;
+    camera.setResolution(width, height);
+    camera.setFramerateShutter(fps, fps);
+    photron::FrameSubscription* full = camera.subscribe(photron::SUBSCRIBE_FULL, 1, photron::SUBSCRIPTION_DROP_OLDEST, 2);
+    photron::FrameSubscription* proxy = camera.subscribe(photron::SUBSCRIBE_PROXY, 1, photron::SUBSCRIPTION_DROP_OLDEST, 2);
+    if (PUC_CHK_FAILED(camera.open(deviceID))) {
+        cerr << "ERROR: cannot open device " << deviceID << ": " << camera.getLastErrorName() << endl;
+        return 1;
+    }
+
+    // Slots hold the largest frame of the chosen resolution, rows padded like the wrapper's pools
+    const uint32_t slotCount[photron::FRAME_BUS_STREAMS] = { (uint32_t)slots, (uint32_t)slots };
+    const uint64_t slotBytes[photron::FRAME_BUS_STREAMS] = {
+        uint64_t(photron::BufferArena::alignRow(width)) * height,
+        uint64_t(photron::BufferArena::alignRow((width + 7) / 8)) * ((height + 7) / 8)
+    };
+    photron::FrameBusWriter bus;
+    if (!bus.create(name.c_str(), slotCount, slotBytes)) {
+        cerr << "ERROR: cannot create the frame bus " << name << ", another captureDaemon may be publishing it" << endl;
+        camera.close();
+        return 1;
+    }
+    cout << "publishing device " << deviceID << " (" << width << "x" << height << " @ " << fps << " fps) on " << name
+        << ", " << slots << " slots per stream, Ctrl+C to stop" << endl;
+
+    SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+    std::thread fullThread(publishLoop, full, &bus, (int)photron::FRAME_BUS_FULL);
+    std::thread proxyThread(publishLoop, proxy, &bus, (int)photron::FRAME_BUS_PROXY);
+
+    // Heartbeats come well within the 1 s clients wait by default (BusCapture::isAlive), statistics once per second
+    uint64_t lastFull = 0, lastProxy = 0;
+    for (int tick = 1; running; tick++) {
+        bus.heartbeat();
+        Sleep(200);
+        if (tick % 5)
+            continue;
+        uint64_t fullCount = bus.getPublishedCount(photron::FRAME_BUS_FULL);
+        uint64_t proxyCount = bus.getPublishedCount(photron::FRAME_BUS_PROXY);
+        printf("full %llu fps, proxy %llu fps, dropped %llu, oversized %llu\n",
+            (unsigned long long)(fullCount - lastFull), (unsigned long long)(proxyCount - lastProxy),
+            (unsigned long long)(full->getDroppedCount() + proxy->getDroppedCount()),
+            (unsigned long long)(bus.getOversizedCount(photron::FRAME_BUS_FULL) + bus.getOversizedCount(photron::FRAME_BUS_PROXY)));
+        lastFull = fullCount;
+        lastProxy = proxyCount;
+    }
+
+    fullThread.join();
+    proxyThread.join();
+    camera.close();
+    camera.unsubscribe(full);
+    camera.unsubscribe(proxy);
+    bus.close();
+    return 0;
+}
@@ -63,60 +63,33 @@ void setUpPreview() {
 class CVTilesListener : public photron::VideoCaptureImageListener {
 public:
     CVTilesListener(int numTiles, int tileHeight, int width) {
-        prior = new Mat[numTiles];
-       
         this->tileHeight = tileHeight;
         this->numTiles = numTiles;
         fullImage = Mat::zeros(numTiles * 1, width, CV_8UC1);
         this->width = width;
-        isSaving = false;
     }
 
-    ~CVTilesListener()
-    {
-        delete[]prior;
-    }
     virtual void imageReady(Mat& currentFrame, USHORT sequenceNum) {
 
-        if (isSaving)
-            return;
-
-        if (priorSequenceNum == sequenceNum) {
-            //cout << "Duplicate frame" << endl;
-            return;
-        }
-
-        int dropFrames = sequenceNum - priorSequenceNum - 1;
-        
-        if(dropFrames>0)
-            totalDropFrames += dropFrames;
-        measuredDropFrames++;
-
+        // Duplicates and drops are sorted out by the wrapper before decoding (see getDropFrames)
         priorSequenceNum = sequenceNum;
 
-        // Copy this into the prior
-        prior[writeIndex] = currentFrame.clone();
-
-       
-        writeIndex = (writeIndex + 1) % numTiles;
-        // Update circular buffer
-        if (readIndex == writeIndex) {
-            readIndex = (readIndex + 1) % numTiles;
-        }
-
+        // The frames themselves are kept by the wrapper history (see setFrameHistory in main)
     }
 
-    void read(Mat& mat) {
-        int lastWrittenIndex = writeIndex - 1;
-        if (lastWrittenIndex < 0)
-            lastWrittenIndex += numTiles;
-        lastWrittenIndex %= numTiles;
-        mat = prior[lastWrittenIndex];
+    // Only frames not shown yet, the loop sleeps instead of redrawing the same frame
+    void read(Mat& mat, photron::FrameStats& stats) {
+        cap.readNext(mat, 50, NULL, &stats);
     }
 
     int getPriorSequenceNum() {
         return priorSequenceNum;
     }
+
+    // The history restarts with the new mode, see switchMode in main
+    void setTileHeight(int tileHeight) {
+        this->tileHeight = tileHeight;
+    }
     void start() {
         cap.addListener(this);
     }
@@ -127,25 +100,28 @@ public:
 
     void save() {
 
-        isSaving = true;
-        int k = 0;
-        for (int r = readIndex; r < readIndex + numTiles; r++, k++) {
-
-            int i = r % numTiles;
-
-            // check if prior[i] is invalid continue
-            if (prior[i].empty())
-                continue;
-
-            int y = tileHeight >> 1;
-            uchar* src = prior[i].ptr(y, 0);
-            uchar* dst = fullImage.ptr(k, 0);
-            // call src to dst using mempcy (figure out number opf bytes)
-            std::memcpy(dst, src, width);
+        photron::PUCLib_Wrapper* wrapper = cap.getPUCLibWrapper();
+        const photron::FrameHistory& history = wrapper->getFrameHistory();
+        long long last = history.getLastSequenceNo();
+        long long first = last - numTiles + 1;
+        // Only the block row holding the scan line is decoded (see CAP_PROP_DECODE_ROI in main)
+        int y = (tileHeight >> 1) - cap.getDecodeROI().y;
+
+        fullImage.setTo(0);
+        photron::HistorySpan spans[2];
+        int numSpans = wrapper->range(first, last, spans);
+        for (int s = 0; s < numSpans; s++) {
+            const uchar* src = spans[s].data + size_t(y) * history.getRowBytes();
+            for (int i = 0; i < spans[s].count; i++, src += spans[s].frameBytes) {
+                long long sequenceNo = spans[s].firstSequenceNo + i;
+                uchar* dst = fullImage.ptr(int(sequenceNo - first), 0);
+                std::memcpy(dst, src, width);
+                // The oldest frames may be overwritten by new ones while copying
+                if (!wrapper->isFrameValid(sequenceNo))
+                    std::memset(dst, 0, width);
+            }
         }
-        totalDropFrames = 0;
-        measuredDropFrames = 0;
-        isSaving = false;
+        measureFrom = wrapper->getSequenceStats();
         
         fileName = "test" + std::to_string(fileNumber) + ".jpg";
         ++fileNumber;
@@ -155,26 +131,21 @@ public:
 
 
     float getDropFrames() {
-        if (measuredDropFrames == 0) {
+        photron::SequenceStats stats = cap.getPUCLibWrapper()->getSequenceStats();
+        UINT64 measuredFrames = stats.received - measureFrom.received;
+        if (measuredFrames == 0) {
             return 0.0f;
         }
-        return (float) totalDropFrames / (float) measuredDropFrames;
+        return (float) (stats.dropped - measureFrom.dropped) / (float) measuredFrames;
     }
 
 private:
     int tileHeight;
-    Mat* prior;
-    int readIndex = 0;
-    int writeIndex = 0;
-    int readIndexPreview = 0;
-    int writeIndexPreview = 0;
     int numTiles;
     Mat fullImage;
     USHORT priorSequenceNum = 0;
     int width;
-    bool isSaving;
-    int totalDropFrames = 0;
-    int measuredDropFrames = 0;
+    photron::SequenceStats measureFrom;
 };
 
 CVTilesListener* pListener = nullptr;
@@ -446,18 +417,36 @@ int main(int argc, char** argv)
     int fps[] = {50, 250, 500, 950, 1000, 2000, 5000, 10000, 20000, 31157};
     int width = 1246;
     int height[] = {1024, 1024, 1024, 1024, 1008, 496, 176, 80, 32, 16};
-    int nExpOnClk[] = { 19988700, 3988700, 1988700, 1041300, 988700, 488700, 188700, 88700, 88700, 38700, 22000 };
+    int nExpOnClk[] = { 19988700, 3988700, 1988700, 1041300, 988700, 488700, 188700, 88700, 88700, 38700 };
     int nExpOffClk = 11200;
-
+    const int numModes = sizeof(fps) / sizeof(fps[0]);
+
+    // Every consumer below looks at the middle line only, so each mode decodes just the 8 rows holding it
+    photron::CaptureMode modes[numModes];
+    for (int i = 0; i < numModes; i++) {
+        modes[i].width = width;
+        modes[i].height = height[i];
+        modes[i].frameRate = fps[i];
+        modes[i].shutterSpeedFps = fps[i];
+        modes[i].exposeOnClk = nExpOnClk[i];
+        modes[i].exposeOffClk = nExpOffClk;
+        modes[i].roiY = height[i] >> 1;
+        modes[i].roiWidth = width;
+        modes[i].roiHeight = 1;
+    }
 
     cap.getPUCLibWrapper()->setMultiThread(true);
     int mode = 9;
     int tileHeight = height[mode];
     int numTiles = 30000;
 
-    cap.getPUCLibWrapper()->setResolution(width, tileHeight);
-    cap.getPUCLibWrapper()->setFramerateShutter(fps[mode], fps[mode]);
-    cap.getPUCLibWrapper()->setExposeTime(nExpOnClk[mode], nExpOffClk);
+    // All modes are checked and prepared at open, so switching with '+' and '-' only restarts the transfer
+    cap.getPUCLibWrapper()->setModeTable(modes, numModes);
+    cap.getPUCLibWrapper()->switchMode(mode);
+    cap.getPUCLibWrapper()->setFrameHistory(numTiles);
+    // Enabled before open so the statistics buffers are set up with the stream, the main loop only moves the region
+    Rect lastStatsRegion(0, tileHeight >> 1, width, 1);
+    cap.setFrameStats(lastStatsRegion);
 
     cout << "Resolution " << width << " x " << tileHeight << "\n";
     cout << "fps " << fps[mode] << "\n";
@@ -481,6 +470,10 @@ int main(int argc, char** argv)
 
     cout << "numTiles=" << numTiles << endl;
 
+    int scanLine = (tileHeight >> 1) - cap.getDecodeROI().y;
+    bool switchPending = false;
+    photron::FrameStats frameStats;
+
     int prevmsec = 0;
     SYSTEMTIME st;
     bool showDc = true;
@@ -557,53 +550,42 @@ int main(int argc, char** argv)
         prevmsec = st.wMilliseconds;
 
         
+        // The wrapper computes histogram, mean and threshold crossings of the scan line range while decoding it
+        int xMin = 0;
+        int xMax = width - 1;
+        int threshold = 128;
+
+        if (!lumaFromFullFrame) {
+            xMin = previewWindowRect.x - imageRect.x;
+            if (xMin < 0) 
+                xMin = 0;
+
+            xMax = xMin + previewWindowRect.width;
+            if (xMax >= width)
+                xMax = width - 1;
+        }
+        Rect statsRegion(xMin, tileHeight >> 1, xMax - xMin + 1, 1);
+        if (statsRegion != lastStatsRegion) {
+            cap.setFrameStats(statsRegion, threshold);
+            lastStatsRegion = statsRegion;
+        }
+
         Mat currentFrame;
-        listener.read(currentFrame);
+        listener.read(currentFrame, frameStats);
         int currentSequenceNumber = listener.getPriorSequenceNum();
         float numDropFrames = listener.getDropFrames();
 
-        if (!currentFrame.empty()) {
+        if (!currentFrame.empty() && frameStats.valid) {
 
             
             // Display Current Frame
-            int histogram[256];
-            memset(histogram, 0, 1024);
-            double sum = 0.0;
+            const UINT32* histogram = frameStats.histogram;
             double average;
             double latestAverage;
 
-            const unsigned char* line;
-            line = currentFrame.ptr(8, 0);
-
-            int xMin = 0;
-            int xMax = width - 1;
-            int threshold = 128;
-
-            if (!lumaFromFullFrame) {
-                xMin = previewWindowRect.x - imageRect.x;
-                if (xMin < 0) 
-                    xMin = 0;
-
-                xMax = xMin + previewWindowRect.width;
-                if (xMax >= width)
-                    xMax = width - 1;
-            }
-
-            int xMinAboveThresh = -1;
-            int xMaxAboveThresh = -1;
-            for (int x = xMin; x <= xMax; x++) {
-                int val = line[x];
-                histogram[val]++;
-                sum += val;
-
-                if (xMinAboveThresh ==-1 && val > threshold) {
-                    xMinAboveThresh = x;
-                }
-                if (xMaxAboveThresh == -1 && line[width - x - 1] > threshold) {
-                    xMaxAboveThresh = width - x - 1;
-                }
-            }
-            average = sum / ((double) xMax - (double) xMin + 1.0);
+            int xMinAboveThresh = frameStats.firstAbove;
+            int xMaxAboveThresh = frameStats.lastAbove;
+            average = frameStats.mean();
             latestAverage = average;
             priorLumas[priorLumaCounter] = latestAverage;
             priorLumaCounter = (priorLumaCounter + 1) % NUM_PRIOR_LUMAS;
@@ -658,7 +640,9 @@ int main(int argc, char** argv)
             
             cvtColor(currentFrame, currentFrame, COLOR_GRAY2BGR);
 
-            currentFrame.copyTo(canvas(imageRect));
+            // Stretch the decoded band over the tile strip
+            Mat imageCanvas = canvas(imageRect);
+            cv::resize(currentFrame, imageCanvas, imageCanvas.size(), 0, 0, cv::INTER_NEAREST);
 
             // Display threshold bar
             float thresholdMix = (float)thresholdVal / 255.0f;
@@ -772,7 +756,7 @@ int main(int argc, char** argv)
             // Copy one line into the previewImage
             unsigned char* previewSrc;
             unsigned char* previewDest;
-            previewSrc = currentFrame.ptr(8, previewWindowRect.x);
+            previewSrc = currentFrame.ptr(scanLine, previewWindowRect.x);
             previewDest = previewCircularImage.ptr(previewLineIndex, 0);
             int numBytesPerLine = previewCircularImage.cols * 3;
             memcpy(previewDest, previewSrc, numBytesPerLine);
@@ -895,6 +879,47 @@ int main(int argc, char** argv)
             listener.save();
         }
 
+        if (key == '+' || key == '-') {
+            photron::PUCLib_Wrapper* wrapper = cap.getPUCLibWrapper();
+            int next = mode + (key == '+' ? 1 : -1);
+            while (next >= 0 && next < numModes && !wrapper->isModeValid(next))
+                next += key == '+' ? 1 : -1;
+            if (next >= 0 && next < numModes && wrapper->switchMode(next) == PUC_SUCCEEDED) {
+                mode = next;
+                tileHeight = height[mode];
+                listener.setTileHeight(tileHeight);
+                scanLine = (tileHeight >> 1) - cap.getDecodeROI().y;
+                photron::ModeSwitchStats stats = wrapper->getModeSwitchStats();
+                cout << "Mode " << mode << ": " << width << " x " << tileHeight << " @ " << fps[mode] << " fps, switched in "
+                    << stats.totalNs / 1000 << " us (stop " << stats.stopNs / 1000 << ", device " << stats.deviceNs / 1000
+                    << ", restart " << stats.restartNs / 1000 << ")" << endl;
+                switchPending = true;
+            }
+        }
+
+        if (key == 'r') {
+            photron::PUCLib_Wrapper* wrapper = cap.getPUCLibWrapper();
+            if (wrapper->isRecording()) {
+                wrapper->stopRecording();
+                photron::RecorderStats stats = wrapper->getRecordingStats();
+                cout << "Recorded " << stats.frames << " frames (" << stats.writtenBytes / (1 << 20) << " MB), dropped " << stats.dropped << endl;
+            }
+            else if (wrapper->startRecording("cvtiles.rec")) {
+                cout << "Recording to cvtiles.rec, press 'r' again to stop" << endl;
+            }
+            else {
+                cout << "Cannot record: " << wrapper->getLastErrorName() << endl;
+            }
+        }
+
+        if (switchPending) {
+            long long firstFrameNs = cap.getPUCLibWrapper()->getModeSwitchStats().firstFrameNs;
+            if (firstFrameNs > 0) {
+                cout << "First frame of mode " << mode << " after " << firstFrameNs / 1000 << " us" << endl;
+                switchPending = false;
+            }
+        }
+
 
 
         ++counter;
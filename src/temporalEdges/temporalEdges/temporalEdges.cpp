@@ -97,6 +97,8 @@ int main(int argc, char** argv)
 
 #ifndef USE_WEBCAMERA
     cap.setFrameSampleRate(40,1);
+    // A static scene has no temporal edges, so only decode frames whose DC proxy moved
+    cap.getPUCLibWrapper()->setMotionGate(4, 4, true);
 #endif
 
     int brighntessValue = 100;
@@ -136,9 +138,12 @@ int main(int argc, char** argv)
             imshow("FastCam DC", frame);
         
         Mat fullFrame;
-        cap.read(fullFrame);
 #ifdef USE_WEBCAMERA
+        cap.read(fullFrame);
         cvtColor(fullFrame, fullFrame, COLOR_BGR2GRAY);
+#else
+        // Wait for a frame not seen yet, the temporal difference against the same frame would be empty
+        cap.readNext(fullFrame, 100);
 #endif
 
         Mat processedFrame;
@@ -146,7 +151,7 @@ int main(int argc, char** argv)
 
 
 
-        if (!prevFullFrame.empty()) {
+        if (!prevFullFrame.empty() && !fullFrame.empty()) {
 
             if (mode == MODE_CAMERA) {
                 imshow("Temporal", fullFrame);
@@ -259,9 +264,15 @@ int main(int argc, char** argv)
             exportSvg = true;
 
         ++counter;
-        // copy current to previous
-        prevFullFrame = fullFrame.clone();
+        // keep the current frame as previous (the leased buffer is not overwritten while referenced)
+        if (!fullFrame.empty())
+            prevFullFrame = fullFrame;
     }
+#ifndef USE_WEBCAMERA
+    photron::MotionGateStats gateStats = cap.getPUCLibWrapper()->getMotionGateStats();
+    cout << "Full decodes saved: " << gateStats.skipped << " skipped, " << gateStats.partial << " partial of "
+        << gateStats.skipped + gateStats.partial + gateStats.full << " frames" << endl;
+#endif
     // the camera will be deinitialized automatically in VideoCapture destructor
     return 0;
 }
\ No newline at end of file